@@ -0,0 +1,175 @@
+// Measures the cost of building and serializing an exec command, as it is done on every symbolic step.
+// 'legacy' reproduces the former scheme (operands, command arrays and the message are allocated on every step),
+// 'pooled' is the current one (per-thread scratch command and send buffer, see probes.h and protocol.h),
+// 'compact' is the same with compact wire encoding (see wireEncoding.h). Average sizes of messages are reported too.
+// Usage: execCommandBenchmark [iterations]
+
+#include "communication/execCommand.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+using namespace vsharp;
+
+// Shape of a typical step: binary operation with two operands, one new call stack frame, sometimes a new object
+static const unsigned framesCount = 1;
+static const unsigned opsCount = 2;
+static const unsigned typeLength = 48;
+
+struct LegacyExecCommand {
+    unsigned offset;
+    unsigned isBranch;
+    unsigned newCallStackFramesCount;
+    unsigned callStackFramesPops;
+    unsigned evaluationStackPushesCount;
+    unsigned evaluationStackPops;
+    unsigned newAddressesCount;
+    unsigned *newCallStackFrames;
+    EvalStackOperand *evaluationStackPushes;
+    OBJID *newAddresses;
+    unsigned long *newAddressesTypeLengths;
+    char *newAddressesTypes;
+
+    void serialize(char *&bytes, unsigned &count) const {
+        count = 7 * sizeof(unsigned) + sizeof(unsigned) * newCallStackFramesCount;
+        for (unsigned i = 0; i < evaluationStackPushesCount; ++i)
+            count += evaluationStackPushes[i].size();
+        count += sizeof(UINT_PTR) * newAddressesCount;
+        count += newAddressesCount * sizeof(unsigned long);
+        unsigned long fullTypesSize = 0;
+        for (unsigned i = 0; i < newAddressesCount; ++i)
+            fullTypesSize += newAddressesTypeLengths[i];
+        count += fullTypesSize;
+        bytes = new char[count];
+        char *buffer = bytes;
+        unsigned size = sizeof(unsigned);
+        *(unsigned *)buffer = offset; buffer += size;
+        *(unsigned *)buffer = isBranch; buffer += size;
+        *(unsigned *)buffer = newCallStackFramesCount; buffer += size;
+        *(unsigned *)buffer = callStackFramesPops; buffer += size;
+        *(unsigned *)buffer = evaluationStackPushesCount; buffer += size;
+        *(unsigned *)buffer = evaluationStackPops; buffer += size;
+        *(unsigned *)buffer = newAddressesCount; buffer += size;
+        size = newCallStackFramesCount * sizeof(unsigned);
+        memcpy(buffer, (char*)newCallStackFrames, size); buffer += size;
+        for (unsigned i = 0; i < evaluationStackPushesCount; ++i)
+            evaluationStackPushes[i].serialize(buffer);
+        size = newAddressesCount * sizeof(UINT_PTR);
+        memcpy(buffer, (char*)newAddresses, size); buffer += size;
+        size = newAddressesCount * sizeof(unsigned long);
+        memcpy(buffer, (char*)newAddressesTypeLengths, size); buffer += size;
+        memcpy(buffer, newAddressesTypes, fullTypesSize);
+    }
+};
+
+static unsigned long long checksum = 0;
+static unsigned long long totalBytes = 0;
+
+static void consume(const char *bytes, unsigned count) {
+    checksum += count + (unsigned char) bytes[count - 1];
+    totalBytes += count;
+}
+
+static void legacyStep(unsigned i, bool withObject, const char *type) {
+    EvalStackOperand *ops = new EvalStackOperand[opsCount] { {OpI4, (long long) i}, {OpI4, (long long) i + 1} };
+    LegacyExecCommand command;
+    command.offset = i;
+    command.isBranch = 0;
+    command.newCallStackFramesCount = framesCount;
+    command.newCallStackFrames = new unsigned[framesCount];
+    command.newCallStackFrames[0] = 0x06000001;
+    command.callStackFramesPops = 0;
+    command.evaluationStackPushesCount = opsCount;
+    command.evaluationStackPushes = ops;
+    command.evaluationStackPops = opsCount;
+    unsigned addressesCount = withObject ? 1 : 0;
+    command.newAddressesCount = addressesCount;
+    command.newAddresses = new UINT_PTR[addressesCount];
+    command.newAddressesTypeLengths = new unsigned long[addressesCount];
+    command.newAddressesTypes = new char[withObject ? typeLength : 0];
+    if (withObject) {
+        command.newAddresses[0] = (UINT_PTR) i;
+        command.newAddressesTypeLengths[0] = typeLength;
+        memcpy(command.newAddressesTypes, type, typeLength);
+    }
+    char *bytes;
+    unsigned count;
+    command.serialize(bytes, count);
+    consume(bytes, count);
+    delete[] bytes;
+    delete[] command.newCallStackFrames;
+    delete[] command.evaluationStackPushes;
+    delete[] command.newAddresses;
+    delete[] command.newAddressesTypeLengths;
+    delete[] command.newAddressesTypes;
+}
+
+static void fillCommand(unsigned i, bool withObject, const char *type, ExecCommand &command) {
+    command.evaluationStackPushes.assign({ EvalStackOperand{OpI4, (long long) i}, EvalStackOperand{OpI4, (long long) i + 1} });
+    command.offset = i;
+    command.isBranch = 0;
+    command.newCallStackFrames.clear();
+    command.newCallStackFrames.push_back(0x06000001);
+    command.callStackFramesPops = 0;
+    command.evaluationStackPops = opsCount;
+    command.newAddresses.clear();
+    command.newAddressesTypeLengths.clear();
+    command.newAddressesTypes.clear();
+    if (withObject) {
+        command.newAddresses.push_back((UINT_PTR) i);
+        command.newAddressesTypeLengths.push_back(typeLength);
+        command.newAddressesTypes.insert(command.newAddressesTypes.end(), type, type + typeLength);
+    }
+}
+
+static void pooledStep(unsigned i, bool withObject, const char *type, ExecCommand &command, std::vector<char> &sendBuffer) {
+    fillCommand(i, withObject, type, command);
+    sendBuffer.resize(command.size());
+    command.serialize(sendBuffer.data());
+    consume(sendBuffer.data(), (unsigned) sendBuffer.size());
+}
+
+static void compactStep(unsigned i, bool withObject, const char *type, ExecCommand &command, std::vector<char> &sendBuffer) {
+    fillCommand(i, withObject, type, command);
+    CompactExecCommand compact{command};
+    sendBuffer.resize(compact.size());
+    compact.serialize(sendBuffer.data());
+    consume(sendBuffer.data(), (unsigned) sendBuffer.size());
+}
+
+template<typename Step>
+static double measure(unsigned iterations, Step step) {
+    auto start = std::chrono::steady_clock::now();
+    for (unsigned i = 0; i < iterations; ++i)
+        step(i, i % 8 == 0);
+    auto finish = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::nano>(finish - start).count() / iterations;
+}
+
+int main(int argc, char *argv[]) {
+    unsigned iterations = argc > 1 ? (unsigned) strtoul(argv[1], nullptr, 10) : 10000000;
+    char type[typeLength];
+    memset(type, 0x2a, typeLength);
+
+    double legacy = measure(iterations, [&](unsigned i, bool withObject) { legacyStep(i, withObject, type); });
+    double legacyBytes = (double) totalBytes / iterations;
+
+    ExecCommand command;
+    std::vector<char> sendBuffer;
+    totalBytes = 0;
+    double pooled = measure(iterations, [&](unsigned i, bool withObject) { pooledStep(i, withObject, type, command, sendBuffer); });
+    double pooledBytes = (double) totalBytes / iterations;
+
+    totalBytes = 0;
+    double compact = measure(iterations, [&](unsigned i, bool withObject) { compactStep(i, withObject, type, command, sendBuffer); });
+    double compactBytes = (double) totalBytes / iterations;
+
+    printf("iterations: %u\n", iterations);
+    printf("legacy: %.1f ns/command, %.1f bytes/command\n", legacy, legacyBytes);
+    printf("pooled: %.1f ns/command, %.1f bytes/command\n", pooled, pooledBytes);
+    printf("compact: %.1f ns/command, %.1f bytes/command\n", compact, compactBytes);
+    printf("(checksum %llu)\n", checksum);
+    return 0;
+}
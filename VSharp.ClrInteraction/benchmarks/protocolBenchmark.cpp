@@ -0,0 +1,200 @@
+// Measures round trips of exec commands through 'Protocol', as they are done on every blocking symbolic step: the command
+// byte and the command are sent, the response is awaited. The server side is a stand-in on another thread of the same
+// process, which listens on a temporary unix domain socket (CONCOLIC_PIPE) and answers every command with the canned
+// "nothing concretized" response, so the numbers are the cost of the protocol and the transport alone.
+// Each configuration gets its own connection and handshake:
+//   v1 is the confirmation protocol, v2 and v5 write frames without confirmations, fixed and compact are the encodings
+//   (see wireEncoding.h), stream, seqpacket and shm are the transports (see socketCommunicator.h and protocol.h).
+// Latencies are reported as percentiles of single round trips, throughput is round trips per second.
+// Usage: protocolBenchmark [iterations]
+
+#include "communication/protocol.h"
+#include "communication/execCommand.h"
+#include "mockServer/serverConnection.h"
+
+#include <sys/socket.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace vsharp;
+
+enum Transport {
+    StreamTransport,
+    SeqpacketTransport,
+    SharedMemoryTransport
+};
+
+struct Configuration {
+    const char *name;
+    ProtocolVersion version;
+    WireEncoding encoding;
+    Transport transport;
+};
+
+static const Configuration configurations[] = {
+    { "v1 fixed stream", ProtocolV1, FixedEncoding, StreamTransport },
+    { "v2 fixed stream", ProtocolV2, FixedEncoding, StreamTransport },
+    { "v2 compact stream", ProtocolV2, CompactEncoding, StreamTransport },
+    { "v5 compact stream", ProtocolV5, CompactEncoding, StreamTransport },
+    { "v5 compact seqpacket", ProtocolV5, CompactEncoding, SeqpacketTransport },
+    { "v5 compact shm", ProtocolV5, CompactEncoding, SharedMemoryTransport },
+};
+
+// Shapes of steps: unary operation, binary operation with a new call stack frame, call with arguments and new objects
+struct CommandShape {
+    const char *name;
+    unsigned opsCount;
+    unsigned framesCount;
+    unsigned objectsCount;
+};
+
+static const CommandShape shapes[] = {
+    { "unary", 1, 0, 0 },
+    { "binary", 2, 1, 0 },
+    { "call", 6, 3, 4 },
+};
+
+static const unsigned typeLength = 48;
+static const unsigned sharedMemoryCapacity = 1 << 16;
+
+// Server side of the protocol for one configuration: handshake, optional switch to shared memory, then canned responses
+static void serve(const Configuration &configuration, int fd) {
+    ServerConnection connection(fd, configuration.transport == SeqpacketTransport);
+    ServerOffer offer = { configuration.version, 1 << FixedEncoding, { 0, MaxBatchEvents, sharedMemoryCapacity } };
+    if (configuration.encoding == CompactEncoding)
+        offer.encodings |= 1 << CompactEncoding;
+    if (configuration.transport == SharedMemoryTransport)
+        offer.capabilities.mask |= SharedMemoryCapability;
+    if (!connection.handshake(offer) || !connection.setupTransport()) {
+        fprintf(stderr, "%s: stand-in server could not set up the session\n", configuration.name);
+        return;
+    }
+    // NOTE: responses tell that the instruction pushed a symbolic value and nothing was concretized
+    const char fixedResponse[] = { 0, 0, 0, 0, 1, -1, -1, -1, -1, 0 };
+    const char compactResponse[] = { 1, 0 };
+    bool compact = connection.encoding() == CompactEncoding;
+    const char *response = compact ? compactResponse : fixedResponse;
+    int responseLength = compact ? (int) sizeof(compactResponse) : (int) sizeof(fixedResponse);
+    std::vector<char> message;
+    unsigned channel;
+    while (connection.readMessage(message, channel)) {
+        // NOTE: the command byte comes as a separate message, the command itself is answered
+        if (message.size() == 1 && message[0] == ExecuteCommand) continue;
+        if (!connection.writeMessage(response, responseLength, channel)) break;
+    }
+}
+
+static void fillCommand(const CommandShape &shape, unsigned i, const char *type, ExecCommand &command) {
+    command.offset = i;
+    command.isBranch = 0;
+    command.evaluationStackPushes.clear();
+    for (unsigned k = 0; k < shape.opsCount; ++k)
+        command.evaluationStackPushes.push_back(EvalStackOperand{OpI4, (long long) (i + k)});
+    command.evaluationStackPops = shape.opsCount;
+    command.newCallStackFrames.assign(shape.framesCount, 0x06000001);
+    command.callStackFramesPops = 0;
+    command.newAddresses.clear();
+    command.newAddressesTypeLengths.clear();
+    command.newAddressesTypes.clear();
+    for (unsigned k = 0; k < shape.objectsCount; ++k) {
+        command.newAddresses.push_back((UINT_PTR) (i + k));
+        command.newAddressesTypeLengths.push_back(typeLength);
+        command.newAddressesTypes.insert(command.newAddressesTypes.end(), type, type + typeLength);
+    }
+}
+
+static double percentile(const std::vector<double> &sorted, double p) {
+    size_t index = (size_t) (p * (sorted.size() - 1));
+    return sorted[index];
+}
+
+static bool run(const Configuration &configuration, const std::string &path, unsigned iterations) {
+    int listener = ServerConnection::listen(path.c_str(), configuration.transport == SeqpacketTransport);
+    if (listener < 0) {
+        fprintf(stderr, "%s: could not listen on %s\n", configuration.name, path.c_str());
+        return false;
+    }
+    std::thread server([&configuration, listener]() {
+        int fd = accept(listener, nullptr, nullptr);
+        if (fd < 0) return;
+        serve(configuration, fd);
+    });
+    setenv("CONCOLIC_TRANSPORT", configuration.transport == SharedMemoryTransport ? "shm" : "socket", 1);
+
+    bool connected;
+    {
+        Protocol protocol;
+        connected = protocol.connect();
+        if (connected) {
+            char type[typeLength];
+            memset(type, 0x2a, typeLength);
+            ExecCommand command;
+            std::vector<double> latencies(iterations);
+            for (const CommandShape &shape : shapes) {
+                unsigned long long bytes = 0;
+                auto start = std::chrono::steady_clock::now();
+                for (unsigned i = 0; i < iterations; ++i) {
+                    fillCommand(shape, i, type, command);
+                    auto sent = std::chrono::steady_clock::now();
+                    if (protocol.encoding() == CompactEncoding) {
+                        CompactExecCommand compact{command};
+                        bytes += compact.size();
+                        protocol.sendSerializable(ExecuteCommand, compact);
+                    } else {
+                        bytes += command.size();
+                        protocol.sendSerializable(ExecuteCommand, command);
+                    }
+                    char *response;
+                    int responseLength;
+                    protocol.acceptExecResult(response, responseLength);
+                    latencies[i] = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - sent).count();
+                }
+                double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+                std::sort(latencies.begin(), latencies.end());
+                printf("%-22s %-7s %7.1f bytes/command  p50 %7.2f us  p99 %7.2f us  %10.0f round trips/s\n",
+                       configuration.name, shape.name, (double) bytes / iterations,
+                       percentile(latencies, 0.5), percentile(latencies, 0.99), iterations / seconds);
+            }
+        }
+        protocol.shutdown();
+    }
+    // NOTE: wakes up the server, if the client could not even connect
+    ::shutdown(listener, SHUT_RDWR);
+    server.join();
+    close(listener);
+    unlink(path.c_str());
+    if (!connected)
+        fprintf(stderr, "%s: handshake failed\n", configuration.name);
+    return connected;
+}
+
+int main(int argc, char *argv[]) {
+    unsigned iterations = argc > 1 ? (unsigned) strtoul(argv[1], nullptr, 10) : 100000;
+    if (!iterations) iterations = 1;
+    char directory[] = "/tmp/vsharpProtocolBenchmarkXXXXXX";
+    if (!mkdtemp(directory)) {
+        perror("mkdtemp");
+        return 1;
+    }
+    std::string path = std::string(directory) + "/pipe";
+    setenv("CONCOLIC_PIPE", path.c_str(), 1);
+    unsetenv("CONCOLIC_REPLAY");
+    unsetenv("CONCOLIC_RECORD");
+
+    printf("iterations: %u\n", iterations);
+    int failures = 0;
+    for (const Configuration &configuration : configurations) {
+        if (configuration.transport == SharedMemoryTransport && !(SupportedCapabilities & SharedMemoryCapability))
+            continue;
+        failures += run(configuration, path, iterations) ? 0 : 1;
+    }
+    rmdir(directory);
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,171 @@
+#include "instrumentationCache.h"
+#include "../ilOpcodes.h"
+#include "../logging.h"
+#include "../probeRegistry.h"
+
+using namespace vsharp;
+
+struct CacheFileHeader {
+    char magic[4];
+    unsigned layoutVersion;
+};
+
+struct CacheRecordHeader {
+    unsigned size;
+    unsigned maxStackSize;
+    InstrumentationCacheKey key;
+    unsigned long long bodyHash;
+    unsigned codeLength;
+    unsigned ehsLength;
+};
+
+static const CacheFileHeader cacheFileHeader = { { 'V', 'S', 'I', 'C' }, 1 };
+// NOTE: records are aligned, so that their headers could be read in place
+static const unsigned recordAlignment = 8;
+
+static unsigned long long fnv1a(const char *bytes, size_t count, unsigned long long hash = 14695981039346656037ull) {
+    for (size_t i = 0; i < count; ++i) {
+        hash ^= (unsigned char) bytes[i];
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+static std::vector<unsigned> tokensOf(const char *signatureTokens, unsigned signatureTokensLength) {
+    std::vector<unsigned> tokens(signatureTokensLength / sizeof(unsigned));
+    if (!tokens.empty()) memcpy(tokens.data(), signatureTokens, tokens.size() * sizeof(unsigned));
+    return tokens;
+}
+
+InstrumentationCache::InstrumentationCache()
+    : m_enabled(false)
+    , m_probesVersion(0)
+    , m_hits(0)
+    , m_misses(0)
+    , m_stores(0)
+{
+    // NOTE: cached code refers to probes by their slots, so it is valid only for the same probes in the same order:
+    //       probes with equal signatures differ by names, so the slot, the name and the signature of each probe are hashed
+    const std::vector<ProbeInfo> &probes = probesTable();
+    unsigned count = (unsigned) probes.size();
+    m_probesVersion = fnv1a((const char *) &count, sizeof(count));
+    for (unsigned i = 0; i < count; ++i) {
+        const ProbeInfo &probe = probes[i];
+        m_probesVersion = fnv1a((const char *) &i, sizeof(i), m_probesVersion);
+        // NOTE: terminating zero is hashed too, so that names and signatures of adjacent probes are not mixed up
+        const char *name = probe.name ? probe.name : "";
+        m_probesVersion = fnv1a(name, strlen(name) + 1, m_probesVersion);
+        m_probesVersion = fnv1a((const char *) probe.signature, probe.signatureLength, m_probesVersion);
+        m_probeAddresses.push_back(probe.address);
+        m_probeSlots.push_back(i);
+        m_tokenSlots.push_back(i);
+    }
+}
+
+InstrumentationCache::~InstrumentationCache() {
+    if (m_enabled)
+        LOG(tout << "Instrumentation cache: " << m_hits << " hits, " << m_misses << " misses, " << m_stores << " stored bodies");
+}
+
+bool InstrumentationCache::open(const char *path) {
+    if (!m_file.open(path, (const char *) &cacheFileHeader, sizeof(cacheFileHeader)))
+        return false;
+    if (m_file.size() < sizeof(cacheFileHeader) || memcmp(m_file.data(), &cacheFileHeader, sizeof(cacheFileHeader))) {
+        LOG_ERROR(tout << "Instrumentation cache " << path << " has unknown format, it is not used");
+        m_file.close();
+        return false;
+    }
+    size_t validSize = indexRecords();
+    if (validSize < m_file.size()) {
+        // NOTE: records, which are appended after the torn one, could not be found, so it is discarded
+        m_bodies.clear();
+        if (!m_file.discardTail(validSize)) {
+            LOG_ERROR(tout << "Instrumentation cache " << path << " is corrupted, it is not used");
+            m_file.close();
+            return false;
+        }
+        indexRecords();
+    }
+    m_enabled = true;
+    LOG(tout << "Instrumentation cache " << path << " has " << m_bodies.size() << " bodies");
+    return true;
+}
+
+size_t InstrumentationCache::indexRecords() {
+    const char *data = m_file.data();
+    size_t size = m_file.size();
+    size_t offset = sizeof(cacheFileHeader);
+    while (offset + sizeof(CacheRecordHeader) <= size) {
+        const auto *header = (const CacheRecordHeader *) (data + offset);
+        // NOTE: the last record may be torn by the crash of the writer, the rest of the file is ignored then
+        unsigned long long payload = (unsigned long long) header->codeLength + header->ehsLength;
+        if (header->size % recordAlignment || header->size < sizeof(CacheRecordHeader) + payload || offset + header->size > size)
+            break;
+        const char *code = data + offset + sizeof(CacheRecordHeader);
+        if (fnv1a(code, payload) == header->bodyHash) {
+            CachedBody body = { header->maxStackSize, header->codeLength, header->ehsLength, code, code + header->codeLength };
+            m_bodies[header->key] = body;
+        }
+        offset += header->size;
+    }
+    return offset;
+}
+
+bool InstrumentationCache::enabled() const {
+    return m_enabled;
+}
+
+InstrumentationCacheKey InstrumentationCache::key(const void *moduleVersionId, unsigned token, const char *code, unsigned codeLength,
+                                                  const char *ehs, unsigned ehsLength, unsigned maxStackSize, unsigned flags,
+                                                  unsigned localsSignature) const {
+    InstrumentationCacheKey key;
+    memset(&key, 0, sizeof(key));
+    memcpy(key.moduleVersionId, moduleVersionId, sizeof(key.moduleVersionId));
+    key.token = token;
+    unsigned header[] = { codeLength, ehsLength, maxStackSize, flags, localsSignature };
+    unsigned long long hash = fnv1a((const char *) header, sizeof(header));
+    hash = fnv1a(code, codeLength, hash);
+    key.originalBodyHash = fnv1a(ehs, ehsLength, hash);
+    key.probesVersion = m_probesVersion;
+    return key;
+}
+
+bool InstrumentationCache::find(const InstrumentationCacheKey &key, CachedBody &body) {
+    auto found = m_bodies.find(key);
+    if (found == m_bodies.end()) {
+        ++m_misses;
+        return false;
+    }
+    ++m_hits;
+    body = found->second;
+    return true;
+}
+
+bool InstrumentationCache::restore(const CachedBody &body, char *bytecode, char *ehs, const char *signatureTokens,
+                                   unsigned signatureTokensLength) const {
+    memcpy(bytecode, body.code, body.codeLength);
+    if (body.ehsLength) memcpy(ehs, body.ehs, body.ehsLength);
+    return relocateProbes(bytecode, body.codeLength, m_probeSlots, m_probeAddresses,
+                          m_tokenSlots, tokensOf(signatureTokens, signatureTokensLength));
+}
+
+bool InstrumentationCache::store(const InstrumentationCacheKey &key, const char *bytecode, unsigned codeLength, unsigned maxStackSize,
+                                 const char *ehs, unsigned ehsLength, const char *signatureTokens, unsigned signatureTokensLength) {
+    unsigned payload = codeLength + ehsLength;
+    unsigned size = (unsigned) (sizeof(CacheRecordHeader) + payload + recordAlignment - 1) & ~(recordAlignment - 1);
+    std::vector<char> record(size, 0);
+    char *code = record.data() + sizeof(CacheRecordHeader);
+    memcpy(code, bytecode, codeLength);
+    if (ehsLength) memcpy(code + codeLength, ehs, ehsLength);
+    if (!relocateProbes(code, codeLength, m_probeAddresses, m_probeSlots,
+                        tokensOf(signatureTokens, signatureTokensLength), m_tokenSlots)) {
+        LOG_ERROR(tout << "Instrumentation cache: instrumented code of " << HEX(key.token) << " is malformed, it is not stored");
+        return false;
+    }
+    CacheRecordHeader header = { size, maxStackSize, key, fnv1a(code, payload), codeLength, ehsLength };
+    memcpy(record.data(), &header, sizeof(header));
+    if (!m_file.append(record.data(), record.size()))
+        return false;
+    ++m_stores;
+    return true;
+}
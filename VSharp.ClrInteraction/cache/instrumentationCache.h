@@ -0,0 +1,72 @@
+#ifndef INSTRUMENTATIONCACHE_H_
+#define INSTRUMENTATIONCACHE_H_
+
+#include "mappedFile.h"
+#include <cstring>
+#include <map>
+#include <vector>
+
+namespace vsharp {
+
+// Identity of instrumented body: module version, method, its original body and the layout of the probes table
+struct InstrumentationCacheKey {
+    unsigned char moduleVersionId[16];
+    unsigned token;
+    unsigned reserved;
+    unsigned long long originalBodyHash;
+    unsigned long long probesVersion;
+
+    bool operator<(const InstrumentationCacheKey &other) const {
+        return memcmp(this, &other, sizeof(InstrumentationCacheKey)) < 0;
+    }
+};
+
+// Instrumented body in the cache, 'code' and 'ehs' point into the mapped file
+struct CachedBody {
+    unsigned maxStackSize;
+    unsigned codeLength;
+    unsigned ehsLength;
+    const char *code;
+    const char *ehs;
+};
+
+// Instrumented method bodies, which are kept between runs in the file from CONCOLIC_CACHE. Every run of the target is a new
+// process, so without the cache each of them asks the server to instrument the same methods again.
+// Probe addresses and signature tokens differ between runs and modules, so the cached code refers to the slots of probes
+// instead (see 'relocateProbes'): it is relocated on store and on restore.
+// File is a header followed by records: [size of record][key][body hash][max stack size][code length][ehs length][code][ehs]
+class InstrumentationCache {
+private:
+    MappedFile m_file;
+    bool m_enabled;
+    std::map<InstrumentationCacheKey, CachedBody> m_bodies;
+    std::vector<unsigned long long> m_probeAddresses;
+    std::vector<unsigned long long> m_probeSlots;
+    std::vector<unsigned> m_tokenSlots;
+    unsigned long long m_probesVersion;
+    unsigned m_hits;
+    unsigned m_misses;
+    unsigned m_stores;
+
+    // Returns the end of the last valid record
+    size_t indexRecords();
+
+public:
+    InstrumentationCache();
+    ~InstrumentationCache();
+
+    bool open(const char *path);
+    bool enabled() const;
+
+    InstrumentationCacheKey key(const void *moduleVersionId, unsigned token, const char *code, unsigned codeLength,
+                                const char *ehs, unsigned ehsLength, unsigned maxStackSize, unsigned flags, unsigned localsSignature) const;
+    bool find(const InstrumentationCacheKey &key, CachedBody &body);
+    // Copies the cached body into its locations, probes are relocated to the current addresses and signature tokens of the module
+    bool restore(const CachedBody &body, char *bytecode, char *ehs, const char *signatureTokens, unsigned signatureTokensLength) const;
+    bool store(const InstrumentationCacheKey &key, const char *bytecode, unsigned codeLength, unsigned maxStackSize,
+               const char *ehs, unsigned ehsLength, const char *signatureTokens, unsigned signatureTokensLength);
+};
+
+}
+
+#endif // INSTRUMENTATIONCACHE_H_
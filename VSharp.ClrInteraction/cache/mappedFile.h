@@ -0,0 +1,36 @@
+#ifndef MAPPEDFILE_H_
+#define MAPPEDFILE_H_
+
+#include <cstddef>
+
+namespace vsharp {
+
+// File, which is shared by concurrent processes: its contents at the moment of opening are mapped for reading, new records
+// are appended under an exclusive lock. Implemented by unixMappedFile.cpp and windowsMappedFile.cpp
+class MappedFile {
+private:
+    // NOTE: handles are platform-specific, they are defined by the implementation
+    struct Handle;
+    Handle *m_handle;
+    const char *m_data;
+    size_t m_size;
+
+public:
+    MappedFile();
+    ~MappedFile();
+
+    // Opens or creates the file. If it is empty, 'header' is written first
+    bool open(const char *path, const char *header, size_t headerSize);
+    const char *data() const;
+    size_t size() const;
+    // Writes 'bytes' to the end of the file at once, so that records of concurrent writers do not interleave
+    bool append(const char *bytes, size_t count);
+    // Cuts the file to 'validSize', if nothing was appended since it was mapped: the tail was left by the writer, which
+    // crashed in the middle of a record. The mapping is shrunk too
+    bool discardTail(size_t validSize);
+    void close();
+};
+
+}
+
+#endif // MAPPEDFILE_H_
@@ -0,0 +1,102 @@
+#include "mappedFile.h"
+#include "../logging.h"
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+
+using namespace vsharp;
+
+struct MappedFile::Handle {
+    int fd = -1;
+    size_t mappedSize = 0;
+};
+
+static bool reportError(const char *operation) {
+    LOG_ERROR(tout << "Mapped file: " << operation << " failed: " << strerror(errno));
+    return false;
+}
+
+static bool writeAll(int fd, const char *bytes, size_t count) {
+    while (count > 0) {
+        ssize_t written = ::write(fd, bytes, count);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        bytes += written;
+        count -= written;
+    }
+    return true;
+}
+
+MappedFile::MappedFile() : m_handle(new Handle()), m_data(nullptr), m_size(0) {}
+
+MappedFile::~MappedFile() {
+    close();
+    delete m_handle;
+}
+
+bool MappedFile::open(const char *path, const char *header, size_t headerSize) {
+    int fd = ::open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd < 0) return reportError("open");
+    m_handle->fd = fd;
+    struct stat info;
+    // NOTE: concurrent process may be creating the same file, so the header is written under the lock
+    if (flock(fd, LOCK_EX) < 0) return reportError("lock");
+    bool created = fstat(fd, &info) == 0 && info.st_size == 0 && writeAll(fd, header, headerSize);
+    flock(fd, LOCK_UN);
+    if (fstat(fd, &info) < 0) return reportError("stat");
+    if (info.st_size == 0 && !created) return reportError("write of header");
+    m_size = (size_t) info.st_size;
+    void *data = mmap(nullptr, m_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (data == MAP_FAILED) {
+        m_size = 0;
+        return reportError("mmap");
+    }
+    m_data = (const char *) data;
+    m_handle->mappedSize = m_size;
+    return true;
+}
+
+const char *MappedFile::data() const {
+    return m_data;
+}
+
+size_t MappedFile::size() const {
+    return m_size;
+}
+
+bool MappedFile::append(const char *bytes, size_t count) {
+    if (m_handle->fd < 0) return false;
+    if (flock(m_handle->fd, LOCK_EX) < 0) return reportError("lock");
+    bool written = writeAll(m_handle->fd, bytes, count);
+    flock(m_handle->fd, LOCK_UN);
+    return written || reportError("append");
+}
+
+bool MappedFile::discardTail(size_t validSize) {
+    if (m_handle->fd < 0 || validSize > m_size) return false;
+    if (flock(m_handle->fd, LOCK_EX) < 0) return reportError("lock");
+    struct stat info;
+    // NOTE: pages beyond the new end are not accessed, so the mapping stays as it is
+    bool discarded = fstat(m_handle->fd, &info) == 0 && (size_t) info.st_size == m_size && ftruncate(m_handle->fd, (off_t) validSize) == 0;
+    flock(m_handle->fd, LOCK_UN);
+    if (discarded) m_size = validSize;
+    return discarded;
+}
+
+void MappedFile::close() {
+    if (m_data) {
+        munmap((void *) m_data, m_handle->mappedSize);
+        m_data = nullptr;
+        m_size = 0;
+    }
+    if (m_handle->fd >= 0) {
+        ::close(m_handle->fd);
+        m_handle->fd = -1;
+    }
+}
@@ -0,0 +1,116 @@
+#include "mappedFile.h"
+#include "../logging.h"
+#include <windows.h>
+
+using namespace vsharp;
+
+struct MappedFile::Handle {
+    HANDLE file = INVALID_HANDLE_VALUE;
+    HANDLE mapping = nullptr;
+};
+
+static bool reportError(const char *operation) {
+    LOG_ERROR(tout << "Mapped file: " << operation << " failed, WinAPI error code = " << GetLastError());
+    return false;
+}
+
+// NOTE: the lock covers the whole range of possible offsets, so appends of concurrent processes are serialized
+static bool lockFile(HANDLE file) {
+    OVERLAPPED overlapped = {};
+    return LockFileEx(file, LOCKFILE_EXCLUSIVE_LOCK, 0, MAXDWORD, MAXDWORD, &overlapped) != 0;
+}
+
+static void unlockFile(HANDLE file) {
+    OVERLAPPED overlapped = {};
+    UnlockFileEx(file, 0, MAXDWORD, MAXDWORD, &overlapped);
+}
+
+static bool appendLocked(HANDLE file, const char *bytes, size_t count) {
+    LARGE_INTEGER end = {};
+    if (!SetFilePointerEx(file, end, nullptr, FILE_END)) return false;
+    DWORD written;
+    return WriteFile(file, bytes, (DWORD) count, &written, nullptr) && written == count;
+}
+
+MappedFile::MappedFile() : m_handle(new Handle()), m_data(nullptr), m_size(0) {}
+
+MappedFile::~MappedFile() {
+    close();
+    delete m_handle;
+}
+
+bool MappedFile::open(const char *path, const char *header, size_t headerSize) {
+    HANDLE file = CreateFileA(path, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr, OPEN_ALWAYS,
+                              FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file == INVALID_HANDLE_VALUE) return reportError("open");
+    m_handle->file = file;
+    // NOTE: concurrent process may be creating the same file, so the header is written under the lock
+    if (!lockFile(file)) return reportError("lock");
+    LARGE_INTEGER size;
+    bool created = GetFileSizeEx(file, &size) && size.QuadPart == 0 && appendLocked(file, header, headerSize);
+    unlockFile(file);
+    if (!GetFileSizeEx(file, &size)) return reportError("stat");
+    if (size.QuadPart == 0 && !created) return reportError("write of header");
+    m_handle->mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (!m_handle->mapping) return reportError("mapping");
+    m_data = (const char *) MapViewOfFile(m_handle->mapping, FILE_MAP_READ, 0, 0, (SIZE_T) size.QuadPart);
+    if (!m_data) return reportError("map view");
+    m_size = (size_t) size.QuadPart;
+    return true;
+}
+
+const char *MappedFile::data() const {
+    return m_data;
+}
+
+size_t MappedFile::size() const {
+    return m_size;
+}
+
+bool MappedFile::append(const char *bytes, size_t count) {
+    if (m_handle->file == INVALID_HANDLE_VALUE) return false;
+    if (!lockFile(m_handle->file)) return reportError("lock");
+    bool written = appendLocked(m_handle->file, bytes, count);
+    unlockFile(m_handle->file);
+    return written || reportError("append");
+}
+
+bool MappedFile::discardTail(size_t validSize) {
+    if (m_handle->file == INVALID_HANDLE_VALUE || validSize > m_size) return false;
+    if (!lockFile(m_handle->file)) return reportError("lock");
+    LARGE_INTEGER size;
+    bool discarded = false;
+    // NOTE: mapped file cannot be truncated, so it is unmapped and mapped again
+    if (GetFileSizeEx(m_handle->file, &size) && (size_t) size.QuadPart == m_size) {
+        UnmapViewOfFile(m_data);
+        CloseHandle(m_handle->mapping);
+        LARGE_INTEGER end;
+        end.QuadPart = (LONGLONG) validSize;
+        discarded = SetFilePointerEx(m_handle->file, end, nullptr, FILE_BEGIN) && SetEndOfFile(m_handle->file);
+        if (discarded) m_size = validSize;
+        m_handle->mapping = CreateFileMappingA(m_handle->file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        m_data = m_handle->mapping ? (const char *) MapViewOfFile(m_handle->mapping, FILE_MAP_READ, 0, 0, (SIZE_T) m_size) : nullptr;
+        if (!m_data) {
+            m_size = 0;
+            discarded = false;
+        }
+    }
+    unlockFile(m_handle->file);
+    return discarded || reportError("truncation");
+}
+
+void MappedFile::close() {
+    if (m_data) {
+        UnmapViewOfFile(m_data);
+        m_data = nullptr;
+        m_size = 0;
+    }
+    if (m_handle->mapping) {
+        CloseHandle(m_handle->mapping);
+        m_handle->mapping = nullptr;
+    }
+    if (m_handle->file != INVALID_HANDLE_VALUE) {
+        CloseHandle(m_handle->file);
+        m_handle->file = INVALID_HANDLE_VALUE;
+    }
+}
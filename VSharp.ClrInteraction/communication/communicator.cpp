@@ -0,0 +1,41 @@
+#include "communicator.h"
+#include "fileCommunicator.h"
+#include "socketCommunicator.h"
+#include "../logging.h"
+#include <cstdlib>
+#include <cstring>
+
+using namespace vsharp;
+
+int Communicator::writeVector(char **buffers, const int *counts, int buffersCount) {
+    int written = 0;
+    for (int i = 0; i < buffersCount; ++i) {
+        int bytes = write(buffers[i], counts[i]);
+        if (bytes > 0) written += bytes;
+        if (bytes != counts[i]) break;
+    }
+    return written;
+}
+
+bool Communicator::createSharedMemory(unsigned capacity, unsigned &pid, unsigned &memoryFd) {
+    LOG_ERROR(tout << "Shared memory transport is not supported by this communicator");
+    return false;
+}
+
+void Communicator::switchToSharedMemory() {}
+
+static const char *fileFromEnvironment(const char *variable) {
+    const char *file = getenv(variable);
+    return file && strlen(file) > 0 ? file : nullptr;
+}
+
+Communicator *vsharp::createCommunicator() {
+    // NOTE: replayed bodies call the probes of the recording run, so the profiler never replays, see 'ReplayingCommunicator'
+    if (const char *replayFile = fileFromEnvironment("CONCOLIC_REPLAY"))
+        LOG_ERROR(tout << "Replaying of " << replayFile << " is not supported by the profiler, CONCOLIC_REPLAY is ignored");
+    if (const char *recordFile = fileFromEnvironment("CONCOLIC_RECORD")) {
+        LOG(tout << "Recording communication into " << recordFile);
+        return new RecordingCommunicator(new SocketCommunicator(), recordFile);
+    }
+    return new SocketCommunicator();
+}
@@ -3,14 +3,30 @@
 
 namespace vsharp {
 
+// Byte stream between the profiler and the server. Backends own their state, so several communicators may coexist
 class Communicator {
 public:
-    bool open();
-    int read(char *buffer, int count);
-    int write(char *message, int count);
-    bool close();
+    virtual ~Communicator() {}
+
+    virtual bool open() = 0;
+    virtual int read(char *buffer, int count) = 0;
+    virtual int write(char *message, int count) = 0;
+    // Writes all the buffers with a single system call where possible. Returns the total amount of written bytes
+    virtual int writeVector(char **buffers, const int *counts, int buffersCount);
+    virtual bool close() = 0;
+
+    // Creates the shared region for the shared memory transport, which the server maps via '/proc/<pid>/fd/<memoryFd>'.
+    // NOTE: only socket backend on Linux supports it
+    virtual bool createSharedMemory(unsigned capacity, unsigned &pid, unsigned &memoryFd);
+    // After this call all the reads and writes go through the rings of the shared region instead of the socket
+    virtual void switchToSharedMemory();
 };
 
+// Creates the backend of the profiler, chosen by the environment:
+//   CONCOLIC_RECORD=<file>: socket backend, whose traffic is recorded into the file
+//   otherwise: socket backend (CONCOLIC_PIPE)
+Communicator *createCommunicator();
+
 }
 
 #endif // COMMUNICATOR_H_
@@ -0,0 +1,278 @@
+#ifndef EXECCOMMAND_H_
+#define EXECCOMMAND_H_
+
+#include "wireEncoding.h"
+#include "../memory/heap.h"
+#include <cstring>
+#include <vector>
+
+namespace vsharp {
+
+enum EvalStackArgType {
+    OpSymbolic = 1,
+    OpI4 = 2,
+    OpI8 = 3,
+    OpR4 = 4,
+    OpR8 = 5,
+    OpRef = 6
+};
+
+union OperandContent {
+    long long number;
+    VirtualAddress address;
+};
+
+struct EvalStackOperand {
+    EvalStackArgType typ;
+    OperandContent content;
+
+    size_t size() const {
+        if (typ == OpRef)
+            return sizeof(EvalStackArgType) + sizeof(unsigned long) + sizeof(unsigned long);
+        return sizeof(EvalStackArgType) + sizeof(long long);
+    }
+
+    void serialize(char *&buffer) const {
+        *(EvalStackArgType *)buffer = typ;
+        buffer += sizeof(EvalStackArgType);
+        if (typ == OpRef) {
+            *(unsigned long *)buffer = content.address.obj; buffer += sizeof(unsigned long);
+            *(unsigned long *)buffer = content.address.offset; buffer += sizeof(unsigned long);
+        } else {
+            *(long long *)buffer = content.number;
+            buffer += sizeof(long long);
+        }
+    }
+
+    void deserialize(char *&buffer) {
+        typ = *(EvalStackArgType *)buffer;
+        buffer += sizeof(EvalStackArgType);
+        if (typ == OpRef) {
+            content.address.obj = (OBJID) *(unsigned long *)buffer; buffer += sizeof(unsigned long);
+            content.address.offset = (SIZE) *(unsigned long *)buffer; buffer += sizeof(unsigned long);
+        } else {
+            content.number = *(long long *)buffer;
+            buffer += sizeof(long long);
+        }
+    }
+
+    // NOTE: in compact encoding floating point values keep their 8 bytes, the other contents are varints
+    size_t compactSize() const {
+        switch (typ) {
+            case OpRef:
+                return 1 + varintSize(content.address.obj) + varintSize(content.address.offset);
+            case OpR4:
+            case OpR8:
+                return 1 + sizeof(long long);
+            default:
+                return 1 + varintSize(zigZag(content.number));
+        }
+    }
+
+    void serializeCompact(char *&buffer) const {
+        *buffer++ = (char) typ;
+        switch (typ) {
+            case OpRef:
+                writeVarint(buffer, content.address.obj);
+                writeVarint(buffer, content.address.offset);
+                break;
+            case OpR4:
+            case OpR8:
+                *(long long *)buffer = content.number;
+                buffer += sizeof(long long);
+                break;
+            default:
+                writeVarint(buffer, zigZag(content.number));
+        }
+    }
+
+    void deserializeCompact(char *&buffer) {
+        typ = (EvalStackArgType) *buffer++;
+        switch (typ) {
+            case OpRef:
+                content.address.obj = (OBJID) readVarint(buffer);
+                content.address.offset = (SIZE) readVarint(buffer);
+                break;
+            case OpR4:
+            case OpR8:
+                content.number = *(long long *)buffer;
+                buffer += sizeof(long long);
+                break;
+            default:
+                content.number = unZigZag(readVarint(buffer));
+        }
+    }
+};
+
+// Sections of compact exec command, which are present. Absent sections are not written at all
+enum ExecCommandSections {
+    SectionBranch = 1,
+    SectionNewCallStackFrames = 2,
+    SectionCallStackFramesPops = 4,
+    SectionEvaluationStackPushes = 8,
+    SectionEvaluationStackPops = 16,
+    SectionNewAddresses = 32
+};
+
+// NOTE: commands are reused between steps (see 'scratchCommand' in probes.h): vectors are cleared, but keep their capacity,
+//       so after warming up building a command does not allocate
+struct ExecCommand {
+    unsigned offset;
+    unsigned isBranch;
+    unsigned callStackFramesPops;
+    unsigned evaluationStackPops;
+    std::vector<unsigned> newCallStackFrames;
+    std::vector<EvalStackOperand> evaluationStackPushes;
+    // TODO: add deleted addresses
+    std::vector<OBJID> newAddresses;
+    std::vector<unsigned long> newAddressesTypeLengths;
+    std::vector<char> newAddressesTypes;
+
+    unsigned size() const {
+        unsigned count = 7 * sizeof(unsigned) + sizeof(unsigned) * newCallStackFrames.size();
+        for (const EvalStackOperand &op : evaluationStackPushes)
+            count += op.size();
+        count += sizeof(UINT_PTR) * newAddresses.size();
+        count += sizeof(unsigned long) * newAddressesTypeLengths.size();
+        count += newAddressesTypes.size();
+        return count;
+    }
+
+    // Writes exactly 'size()' bytes into 'buffer'
+    void serialize(char *buffer) const {
+        unsigned size = sizeof(unsigned);
+        *(unsigned *)buffer = offset; buffer += size;
+        *(unsigned *)buffer = isBranch; buffer += size;
+        *(unsigned *)buffer = (unsigned) newCallStackFrames.size(); buffer += size;
+        *(unsigned *)buffer = callStackFramesPops; buffer += size;
+        *(unsigned *)buffer = (unsigned) evaluationStackPushes.size(); buffer += size;
+        *(unsigned *)buffer = evaluationStackPops; buffer += size;
+        *(unsigned *)buffer = (unsigned) newAddresses.size(); buffer += size;
+        size = newCallStackFrames.size() * sizeof(unsigned);
+        if (size) memcpy(buffer, (char*)newCallStackFrames.data(), size);
+        buffer += size;
+        for (const EvalStackOperand &op : evaluationStackPushes)
+            op.serialize(buffer);
+        size = newAddresses.size() * sizeof(UINT_PTR);
+        if (size) memcpy(buffer, (char*)newAddresses.data(), size);
+        buffer += size;
+        size = newAddressesTypeLengths.size() * sizeof(unsigned long);
+        if (size) memcpy(buffer, (char*)newAddressesTypeLengths.data(), size);
+        buffer += size;
+        size = newAddressesTypes.size();
+        if (size) memcpy(buffer, newAddressesTypes.data(), size);
+    }
+
+    // Compact encoding: [offset][sections], then the present sections in the order of 'ExecCommandSections'.
+    // NOTE: lengths of types are not written, types are parsed by the server anyway
+    unsigned char sections() const {
+        unsigned char result = 0;
+        if (isBranch) result |= SectionBranch;
+        if (!newCallStackFrames.empty()) result |= SectionNewCallStackFrames;
+        if (callStackFramesPops) result |= SectionCallStackFramesPops;
+        if (!evaluationStackPushes.empty()) result |= SectionEvaluationStackPushes;
+        if (evaluationStackPops) result |= SectionEvaluationStackPops;
+        if (!newAddresses.empty()) result |= SectionNewAddresses;
+        return result;
+    }
+
+    unsigned compactSize() const {
+        unsigned count = varintSize(offset) + 1;
+        if (!newCallStackFrames.empty()) {
+            count += varintSize(newCallStackFrames.size());
+            for (unsigned token : newCallStackFrames)
+                count += varintSize(token);
+        }
+        if (callStackFramesPops) count += varintSize(callStackFramesPops);
+        if (!evaluationStackPushes.empty()) {
+            count += varintSize(evaluationStackPushes.size());
+            for (const EvalStackOperand &op : evaluationStackPushes)
+                count += op.compactSize();
+        }
+        if (evaluationStackPops) count += varintSize(evaluationStackPops);
+        if (!newAddresses.empty()) {
+            count += varintSize(newAddresses.size());
+            for (OBJID address : newAddresses)
+                count += varintSize(address);
+            count += newAddressesTypes.size();
+        }
+        return count;
+    }
+
+    // Writes exactly 'compactSize()' bytes into 'buffer'
+    void serializeCompact(char *buffer) const {
+        writeVarint(buffer, offset);
+        *buffer++ = (char) sections();
+        if (!newCallStackFrames.empty()) {
+            writeVarint(buffer, newCallStackFrames.size());
+            for (unsigned token : newCallStackFrames)
+                writeVarint(buffer, token);
+        }
+        if (callStackFramesPops) writeVarint(buffer, callStackFramesPops);
+        if (!evaluationStackPushes.empty()) {
+            writeVarint(buffer, evaluationStackPushes.size());
+            for (const EvalStackOperand &op : evaluationStackPushes)
+                op.serializeCompact(buffer);
+        }
+        if (evaluationStackPops) writeVarint(buffer, evaluationStackPops);
+        if (!newAddresses.empty()) {
+            writeVarint(buffer, newAddresses.size());
+            for (OBJID address : newAddresses)
+                writeVarint(buffer, address);
+            if (!newAddressesTypes.empty()) memcpy(buffer, newAddressesTypes.data(), newAddressesTypes.size());
+        }
+    }
+};
+
+// Serializes the command in compact encoding, see 'Protocol::sendSerializable'
+struct CompactExecCommand {
+    const ExecCommand &command;
+
+    unsigned size() const { return command.compactSize(); }
+    void serialize(char *buffer) const { command.serializeCompact(buffer); }
+};
+
+// Serialized exec commands, whose responses are predicted by the client (see 'postEvent' in probes.h). They are sent
+// together with the next command, which needs a response
+struct ExecEventBatch {
+    std::vector<char> events;
+    unsigned count = 0;
+
+    // NOTE: 'T' is 'ExecCommand' or 'CompactExecCommand'
+    template<typename T>
+    void append(const T &command) {
+        unsigned length = command.size();
+        size_t start = events.size();
+        events.resize(start + sizeof(unsigned) + length);
+        *(unsigned *)(events.data() + start) = length;
+        command.serialize(events.data() + start + sizeof(unsigned));
+        ++count;
+    }
+
+    bool empty() const { return count == 0; }
+
+    void clear() {
+        events.clear();
+        count = 0;
+    }
+};
+
+// Message of 'ExecuteBatchCommand': [events count]([event length][event])*[command, which needs a response]
+template<typename T>
+struct BatchedExecCommand {
+    const ExecEventBatch &batch;
+    const T &command;
+
+    unsigned size() const { return sizeof(unsigned) + (unsigned) batch.events.size() + command.size(); }
+
+    void serialize(char *buffer) const {
+        *(unsigned *)buffer = batch.count;
+        buffer += sizeof(unsigned);
+        if (!batch.events.empty()) memcpy(buffer, batch.events.data(), batch.events.size());
+        command.serialize(buffer + batch.events.size());
+    }
+};
+
+}
+
+#endif // EXECCOMMAND_H_
@@ -0,0 +1,149 @@
+#include "fileCommunicator.h"
+#include "../logging.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+using namespace vsharp;
+
+RecordingCommunicator::RecordingCommunicator(Communicator *inner, const char *path)
+    : m_inner(inner)
+    , m_path(path)
+    , m_file(nullptr)
+{
+}
+
+RecordingCommunicator::~RecordingCommunicator() {
+    if (m_file)
+        fclose(m_file);
+    delete m_inner;
+}
+
+void RecordingCommunicator::record(char direction, const char *bytes, int count) {
+    if (!m_file || count <= 0) return;
+    fputc(direction, m_file);
+    fwrite(&count, sizeof(int), 1, m_file);
+    fwrite(bytes, 1, count, m_file);
+}
+
+bool RecordingCommunicator::open() {
+    m_file = fopen(m_path, "wb");
+    if (!m_file) {
+        LOG_ERROR(tout << "Could not open " << m_path << " for recording: " << strerror(errno));
+        return false;
+    }
+    fwrite(RecordMagic, 1, sizeof(RecordMagic), m_file);
+    return m_inner->open();
+}
+
+int RecordingCommunicator::read(char *buffer, int count) {
+    int bytes = m_inner->read(buffer, count);
+    record(RecordRead, buffer, bytes);
+    return bytes;
+}
+
+int RecordingCommunicator::write(char *message, int count) {
+    int bytes = m_inner->write(message, count);
+    record(RecordWrite, message, bytes);
+    return bytes;
+}
+
+int RecordingCommunicator::writeVector(char **buffers, const int *counts, int buffersCount) {
+    int bytes = m_inner->writeVector(buffers, counts, buffersCount);
+    int left = bytes;
+    for (int i = 0; i < buffersCount && left > 0; ++i) {
+        int count = std::min(counts[i], left);
+        record(RecordWrite, buffers[i], count);
+        left -= count;
+    }
+    return bytes;
+}
+
+bool RecordingCommunicator::close() {
+    if (m_file) {
+        fclose(m_file);
+        m_file = nullptr;
+    }
+    return m_inner->close();
+}
+
+bool RecordingCommunicator::createSharedMemory(unsigned capacity, unsigned &pid, unsigned &memoryFd) {
+    return m_inner->createSharedMemory(capacity, pid, memoryFd);
+}
+
+void RecordingCommunicator::switchToSharedMemory() {
+    m_inner->switchToSharedMemory();
+}
+
+ReplayingCommunicator::ReplayingCommunicator(const char *path)
+    : m_path(path)
+    , m_incomingOffset(0)
+    , m_outgoingOffset(0)
+    , m_diverged(false)
+{
+}
+
+bool ReplayingCommunicator::open() {
+    FILE *file = fopen(m_path, "rb");
+    if (!file) {
+        LOG_ERROR(tout << "Could not open recording " << m_path << ": " << strerror(errno));
+        return false;
+    }
+    char magic[sizeof(RecordMagic)];
+    bool valid = fread(magic, 1, sizeof(magic), file) == sizeof(magic) && !memcmp(magic, RecordMagic, sizeof(magic));
+    int direction;
+    while (valid && (direction = fgetc(file)) != EOF) {
+        int count;
+        if (fread(&count, sizeof(int), 1, file) != 1 || count < 0 || (direction != RecordRead && direction != RecordWrite)) {
+            valid = false;
+            break;
+        }
+        std::vector<char> &stream = direction == RecordRead ? m_incoming : m_outgoing;
+        size_t start = stream.size();
+        stream.resize(start + count);
+        if (fread(stream.data() + start, 1, count, file) != (size_t) count)
+            valid = false;
+    }
+    fclose(file);
+    if (!valid) {
+        LOG_ERROR(tout << "Recording " << m_path << " is corrupted");
+        return false;
+    }
+    LOG(tout << "Loaded recording: " << m_incoming.size() << " bytes from server, " << m_outgoing.size() << " bytes to server");
+    return true;
+}
+
+int ReplayingCommunicator::read(char *buffer, int count) {
+    // NOTE: the end of recording looks like the closed connection
+    size_t bytes = std::min((size_t) count, m_incoming.size() - m_incomingOffset);
+    memcpy(buffer, m_incoming.data() + m_incomingOffset, bytes);
+    m_incomingOffset += bytes;
+    return (int) bytes;
+}
+
+int ReplayingCommunicator::write(char *message, int count) {
+    if (!m_diverged) {
+        size_t expected = std::min((size_t) count, m_outgoing.size() - m_outgoingOffset);
+        const char *recorded = m_outgoing.data() + m_outgoingOffset;
+        if (expected != (size_t) count || memcmp(message, recorded, count)) {
+            size_t position = 0;
+            while (position < expected && message[position] == recorded[position]) ++position;
+            LOG(tout << "Replay: written bytes diverge from the recording at offset " << m_outgoingOffset + position);
+            m_diverged = true;
+        }
+    }
+    m_outgoingOffset += count;
+    return count;
+}
+
+bool ReplayingCommunicator::close() {
+    return true;
+}
+
+bool ReplayingCommunicator::createSharedMemory(unsigned capacity, unsigned &pid, unsigned &memoryFd) {
+    pid = 0;
+    memoryFd = 0;
+    return true;
+}
+
+void ReplayingCommunicator::switchToSharedMemory() {}
@@ -0,0 +1,69 @@
+#ifndef FILECOMMUNICATOR_H_
+#define FILECOMMUNICATOR_H_
+
+#include "communicator.h"
+#include <cstdio>
+#include <vector>
+
+namespace vsharp {
+
+// Recording is a sequence of chunks: [direction][int32 length][bytes], where direction is 'R' for the bytes read from the
+// server and 'W' for the bytes written to it. Chunks follow the calls of the recorded backend, so their boundaries do not
+// matter for replaying
+const char RecordMagic[] = { 'V', 'S', 'R', 'C' };
+const char RecordRead = 'R';
+const char RecordWrite = 'W';
+
+// Passes everything to 'inner' and writes the traffic into the file
+class RecordingCommunicator : public Communicator {
+private:
+    Communicator *m_inner;
+    const char *m_path;
+    FILE *m_file;
+
+    void record(char direction, const char *bytes, int count);
+
+public:
+    // NOTE: takes ownership of 'inner'
+    RecordingCommunicator(Communicator *inner, const char *path);
+    ~RecordingCommunicator() override;
+
+    bool open() override;
+    int read(char *buffer, int count) override;
+    int write(char *message, int count) override;
+    int writeVector(char **buffers, const int *counts, int buffersCount) override;
+    bool close() override;
+
+    bool createSharedMemory(unsigned capacity, unsigned &pid, unsigned &memoryFd) override;
+    void switchToSharedMemory() override;
+};
+
+// Serves the recorded bytes of the server and checks, that the profiler writes the recorded bytes.
+// NOTE: probe addresses and signature tokens differ between runs and nothing relocates them here, so replayed instrumented
+//       code must not be executed: the backend is for drivers of 'Protocol', which do not JIT the bodies (see
+//       'Protocol::connect(Communicator *)'), and the profiler never chooses it. Divergence of the written bytes is only reported
+class ReplayingCommunicator : public Communicator {
+private:
+    const char *m_path;
+    std::vector<char> m_incoming;
+    std::vector<char> m_outgoing;
+    size_t m_incomingOffset;
+    size_t m_outgoingOffset;
+    bool m_diverged;
+
+public:
+    explicit ReplayingCommunicator(const char *path);
+
+    bool open() override;
+    int read(char *buffer, int count) override;
+    int write(char *message, int count) override;
+    bool close() override;
+
+    // NOTE: server side of the shared memory setup is in the recording, so the transport stays the same
+    bool createSharedMemory(unsigned capacity, unsigned &pid, unsigned &memoryFd) override;
+    void switchToSharedMemory() override;
+};
+
+}
+
+#endif // FILECOMMUNICATOR_H_
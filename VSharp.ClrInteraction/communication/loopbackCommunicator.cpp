@@ -0,0 +1,77 @@
+#include "loopbackCommunicator.h"
+#include <algorithm>
+#include <cstring>
+
+using namespace vsharp;
+
+LoopbackQueue::LoopbackQueue() : m_offset(0), m_closed(false) {}
+
+void LoopbackQueue::write(char **buffers, const int *counts, int buffersCount) {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        for (int i = 0; i < buffersCount; ++i)
+            m_bytes.insert(m_bytes.end(), buffers[i], buffers[i] + counts[i]);
+    }
+    m_available.notify_one();
+}
+
+int LoopbackQueue::read(char *buffer, int count) {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_available.wait(lock, [this]() { return m_offset < m_bytes.size() || m_closed; });
+    size_t bytes = std::min((size_t) count, m_bytes.size() - m_offset);
+    memcpy(buffer, m_bytes.data() + m_offset, bytes);
+    m_offset += bytes;
+    // NOTE: storage is reused, once everything is read
+    if (m_offset == m_bytes.size()) {
+        m_bytes.clear();
+        m_offset = 0;
+    }
+    return (int) bytes;
+}
+
+void LoopbackQueue::close() {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_closed = true;
+    }
+    m_available.notify_all();
+}
+
+LoopbackCommunicator::LoopbackCommunicator(const std::shared_ptr<LoopbackQueue> &incoming, const std::shared_ptr<LoopbackQueue> &outgoing)
+    : m_incoming(incoming)
+    , m_outgoing(outgoing)
+{
+}
+
+void LoopbackCommunicator::createPair(LoopbackCommunicator *&client, LoopbackCommunicator *&server) {
+    auto toServer = std::make_shared<LoopbackQueue>();
+    auto toClient = std::make_shared<LoopbackQueue>();
+    client = new LoopbackCommunicator(toClient, toServer);
+    server = new LoopbackCommunicator(toServer, toClient);
+}
+
+bool LoopbackCommunicator::open() {
+    return true;
+}
+
+int LoopbackCommunicator::read(char *buffer, int count) {
+    return m_incoming->read(buffer, count);
+}
+
+int LoopbackCommunicator::write(char *message, int count) {
+    m_outgoing->write(&message, &count, 1);
+    return count;
+}
+
+int LoopbackCommunicator::writeVector(char **buffers, const int *counts, int buffersCount) {
+    m_outgoing->write(buffers, counts, buffersCount);
+    int written = 0;
+    for (int i = 0; i < buffersCount; ++i)
+        written += counts[i];
+    return written;
+}
+
+bool LoopbackCommunicator::close() {
+    m_outgoing->close();
+    return true;
+}
@@ -0,0 +1,54 @@
+#ifndef LOOPBACKCOMMUNICATOR_H_
+#define LOOPBACKCOMMUNICATOR_H_
+
+#include "communicator.h"
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace vsharp {
+
+// In-memory byte queue of one direction. Reads block until some bytes are written or the queue is closed
+class LoopbackQueue {
+private:
+    std::mutex m_mutex;
+    std::condition_variable m_available;
+    std::vector<char> m_bytes;
+    size_t m_offset;
+    bool m_closed;
+
+public:
+    LoopbackQueue();
+
+    // NOTE: all the buffers are appended at once, so writes of different threads do not interleave
+    void write(char **buffers, const int *counts, int buffersCount);
+    // Returns 0, when the queue is closed and empty
+    int read(char *buffer, int count);
+    void close();
+};
+
+// In-process endpoint of a loopback connection: benchmarks and tests run the server side on another thread,
+// without spawning SILI
+class LoopbackCommunicator : public Communicator {
+private:
+    std::shared_ptr<LoopbackQueue> m_incoming;
+    std::shared_ptr<LoopbackQueue> m_outgoing;
+
+    LoopbackCommunicator(const std::shared_ptr<LoopbackQueue> &incoming, const std::shared_ptr<LoopbackQueue> &outgoing);
+
+public:
+    // Creates two connected endpoints: whatever one of them writes, the other one reads
+    static void createPair(LoopbackCommunicator *&client, LoopbackCommunicator *&server);
+
+    bool open() override;
+    int read(char *buffer, int count) override;
+    int write(char *message, int count) override;
+    int writeVector(char **buffers, const int *counts, int buffersCount) override;
+    // NOTE: closes the outgoing direction, so the peer reads the end of stream
+    bool close() override;
+};
+
+}
+
+#endif // LOOPBACKCOMMUNICATOR_H_
@@ -1,29 +1,69 @@
 #include "protocol.h"
 #include "../logging.h"
 #include "../probes.h"
+#include "../probeRegistry.h"
 
+#include <atomic>
+#include <cassert>
+#include <condition_variable>
+#include <cstdlib>
 #include <cstring>
+#include <deque>
 #include <iostream>
+#include <map>
+#include <mutex>
+#include <vector>
 
 using namespace vsharp;
 
+struct Protocol::Channels {
+    // NOTE: frame is written by a single call under the lock, so frames of different threads do not interleave
+    std::mutex writeLock;
+    std::mutex readLock;
+    // NOTE: before v5 responses are not routed to their threads, so the request and its response are not interleaved with others
+    std::mutex exchangeLock;
+    std::condition_variable frameArrived;
+    // Whether some thread is reading the connection now. Only one thread reads it at a time
+    bool reading = false;
+    std::map<unsigned, std::deque<std::vector<char>>> mailboxes;
+};
+
+Protocol::Protocol()
+    : m_communicator(nullptr)
+    , m_version(ProtocolV1)
+    , m_encoding(FixedEncoding)
+    , m_capabilities{0, 0, 0}
+    , m_channels(new Channels())
+    , m_aborted(false)
+{}
+
+Protocol::~Protocol() {
+    delete m_communicator;
+    delete m_channels;
+}
+
+unsigned Protocol::currentChannel() {
+    static std::atomic<unsigned> channelsCount(0);
+    static thread_local unsigned channel = channelsCount++;
+    return channel;
+}
+
 bool Protocol::readConfirmation() {
-    char *buffer = new char[1];
-    int bytesRead = m_communicator.read(buffer, 1);
+    char buffer[1];
+    int bytesRead = m_communicator->read(buffer, 1);
     if (bytesRead != 1 || buffer[0] != Confirmation) {
         LOG_ERROR(tout << "Communication with server: could not get the confirmation message. Instead read "
                        << bytesRead << " bytes with message [";
               for (int i = 0; i < bytesRead; ++i) tout << buffer[i] << " ";
               tout << "].");
-        delete[] buffer;
         return false;
     }
-    delete[] buffer;
     return true;
 }
 
 bool Protocol::writeConfirmation() {
-    int bytesWritten = m_communicator.write(new char[1] {Confirmation}, 1);
+    char confirmation = Confirmation;
+    int bytesWritten = m_communicator->write(&confirmation, 1);
     if (bytesWritten != 1) {
         LOG_ERROR(tout << "Communication with server: could not send the confirmation message. Instead sent"
                        << bytesWritten << " bytes.");
@@ -33,7 +73,7 @@ bool Protocol::writeConfirmation() {
 }
 
 bool Protocol::readCount(int &count) {
-    int countCount = m_communicator.read((char*)(&count), 4);
+    int countCount = m_communicator->read((char*)(&count), 4);
     if (countCount != 4) {
         LOG_ERROR(tout << "Communication with server: could not get the amount of bytes of the next message. Instead read " << countCount << " bytes");
         return false;
@@ -43,7 +83,7 @@ bool Protocol::readCount(int &count) {
 }
 
 bool Protocol::writeCount(int count) {
-    int bytesWritten = m_communicator.write((char*)(&count), 4);
+    int bytesWritten = m_communicator->write((char*)(&count), 4);
     if (bytesWritten != 4) {
         LOG_ERROR(tout << "Communication with server: could not sent the amount of bytes of the next message. Instead sent " << bytesWritten << " bytes");
         return false;
@@ -51,7 +91,12 @@ bool Protocol::writeCount(int count) {
     return true;
 }
 
-bool Protocol::readBuffer(char *&buffer, int &count) {
+bool Protocol::startReadingMessage(int &count) {
+    if (m_aborted) return false;
+    if (m_version >= ProtocolV5) {
+        receiveOffset() = 0;
+        return receiveFrame(receiveBuffer(), count);
+    }
     if (!readCount(count)) {
         return false;
     }
@@ -59,37 +104,129 @@ bool Protocol::readBuffer(char *&buffer, int &count) {
         LOG_ERROR(tout << "Communication with server: the amount of bytes is unexpectedly non-positive (count = " << count << ") ");
         return false;
     }
-    if (!writeConfirmation()) return false;
-    buffer = new char[count];
-    char *bufferBeginning = buffer;
+    ++m_stats.messagesReceived;
+    m_stats.bytesReceived += sizeof(int) + count;
+    return m_version >= ProtocolV2 || writeConfirmation();
+}
+
+bool Protocol::readExactly(char *buffer, int count) {
     int bytesRead = 0;
     while (bytesRead < count) {
-        int newBytesCount = m_communicator.read(buffer, count - bytesRead);
-        if (newBytesCount == 0) break;
+        int newBytesCount = m_communicator->read(buffer + bytesRead, count - bytesRead);
+        if (newBytesCount <= 0) break;
         bytesRead += newBytesCount;
-        buffer += newBytesCount;
     }
-    buffer = bufferBeginning;
     if (bytesRead != count) {
         LOG_ERROR(tout << "Communication with server: expected " << count << " bytes, but read " << bytesRead << " bytes");
-        delete[] buffer;
-        buffer = nullptr;
         return false;
     }
+    return true;
+}
+
+bool Protocol::readMessagePart(char *buffer, int count) {
+    if (m_version < ProtocolV5)
+        return readExactly(buffer, count);
+    std::vector<char> &received = receiveBuffer();
+    int &offset = receiveOffset();
+    if (offset + count > (int) received.size()) {
+        LOG_ERROR(tout << "Communication with server: expected " << count << " more bytes, but message has only " << received.size() - offset);
+        return false;
+    }
+    if (count) memcpy(buffer, received.data() + offset, count);
+    offset += count;
+    return true;
+}
+
+bool Protocol::receiveFrame(std::vector<char> &frame, int &count) {
+    unsigned channel = currentChannel();
+    std::unique_lock<std::mutex> lock(m_channels->readLock);
+    while (true) {
+        auto mailbox = m_channels->mailboxes.find(channel);
+        if (mailbox != m_channels->mailboxes.end() && !mailbox->second.empty()) {
+            frame.swap(mailbox->second.front());
+            mailbox->second.pop_front();
+            count = (int) frame.size();
+            return true;
+        }
+        if (!m_channels->reading) break;
+        m_channels->frameArrived.wait(lock);
+    }
+    m_channels->reading = true;
+    lock.unlock();
+    bool received = false;
+    while (true) {
+        int header[2];
+        if (!readExactly((char *) header, sizeof(header))) break;
+        count = header[0];
+        unsigned frameChannel = (unsigned) header[1];
+        if (count <= 0) {
+            LOG_ERROR(tout << "Communication with server: the amount of bytes is unexpectedly non-positive (count = " << count << ") ");
+            break;
+        }
+        ++m_stats.messagesReceived;
+        m_stats.bytesReceived += sizeof(header) + count;
+        if (frameChannel == channel) {
+            frame.resize(count);
+            received = readExactly(frame.data(), count);
+            break;
+        }
+        std::vector<char> other(count);
+        if (!readExactly(other.data(), count)) break;
+        lock.lock();
+        m_channels->mailboxes[frameChannel].push_back(std::move(other));
+        m_channels->frameArrived.notify_all();
+        lock.unlock();
+    }
+    // NOTE: one of the waiting threads becomes the reader
+    lock.lock();
+    m_channels->reading = false;
+    m_channels->frameArrived.notify_all();
+    return received;
+}
+
+bool Protocol::finishReadingMessage() {
+    if (m_version >= ProtocolV2) return true;
     if (!writeConfirmation()) {
         LOG_ERROR(tout << "Communication with server: I've got the message, but could not confirm it.");
-        delete[] buffer;
-        buffer = nullptr;
         return false;
     }
     return true;
 }
 
+std::vector<char> &Protocol::receiveBuffer() {
+    static thread_local std::vector<char> buffer;
+    return buffer;
+}
+
+int &Protocol::receiveOffset() {
+    static thread_local int offset = 0;
+    return offset;
+}
+
+bool Protocol::readBuffer(char *&buffer, int &count) {
+    if (m_aborted) return false;
+    if (m_version >= ProtocolV5) {
+        if (!receiveFrame(receiveBuffer(), count)) return false;
+        buffer = receiveBuffer().data();
+        return true;
+    }
+    if (!startReadingMessage(count)) return false;
+    std::vector<char> &received = receiveBuffer();
+    if (received.size() < (size_t) count)
+        received.resize(count);
+    buffer = received.data();
+    return readExactly(buffer, count) && finishReadingMessage();
+}
+
 bool Protocol::writeBuffer(char *buffer, int count) {
+    if (m_aborted) return false;
+    if (m_version >= ProtocolV2) {
+        return writeBuffers(&buffer, &count, 1);
+    }
     if (!writeCount(count) || !readConfirmation()) {
         return false;
     }
-    int bytesWritten = m_communicator.write(buffer, count);
+    int bytesWritten = m_communicator->write(buffer, count);
     if (bytesWritten != count) {
         LOG_ERROR(tout << "Communication with server: could not sent the message. Instead sent " << bytesWritten << " bytes");
         return false;
@@ -98,35 +235,164 @@ bool Protocol::writeBuffer(char *buffer, int count) {
         LOG_ERROR(tout << "Communication with server: message sent, but no confirmation.");
         return false;
     }
+    ++m_stats.messagesSent;
+    m_stats.bytesSent += sizeof(int) + count;
     return true;
 }
 
+std::vector<char> &Protocol::sendBuffer() {
+    static thread_local std::vector<char> buffer;
+    return buffer;
+}
+
+bool Protocol::writeBuffers(char **payloads, const int *counts, int payloadsCount) {
+    if (m_aborted) return false;
+    if (m_version < ProtocolV2) {
+        for (int i = 0; i < payloadsCount; ++i)
+            if (!writeBuffer(payloads[i], counts[i])) return false;
+        return true;
+    }
+    const int maxPayloadsCount = 2;
+    assert(payloadsCount <= maxPayloadsCount);
+    // NOTE: since v5 header of frame is count and channel, before it is just count
+    int headerLength = m_version >= ProtocolV5 ? 2 : 1;
+    int headers[2 * maxPayloadsCount];
+    char *buffers[2 * maxPayloadsCount];
+    int bufferCounts[2 * maxPayloadsCount];
+    int total = 0;
+    for (int i = 0; i < payloadsCount; ++i) {
+        int *header = headers + 2 * i;
+        header[0] = counts[i];
+        header[1] = (int) currentChannel();
+        buffers[2 * i] = (char *) header;
+        bufferCounts[2 * i] = headerLength * sizeof(int);
+        buffers[2 * i + 1] = payloads[i];
+        bufferCounts[2 * i + 1] = counts[i];
+        total += bufferCounts[2 * i] + counts[i];
+    }
+    std::lock_guard<std::mutex> lock(m_channels->writeLock);
+    int bytesWritten = m_communicator->writeVector(buffers, bufferCounts, 2 * payloadsCount);
+    if (bytesWritten != total) {
+        LOG_ERROR(tout << "Communication with server: could not sent the message. Instead of " << total << " sent " << bytesWritten << " bytes");
+        return false;
+    }
+    m_stats.messagesSent += payloadsCount;
+    m_stats.bytesSent += total;
+    return true;
+}
+
+void Protocol::chooseCapabilities(ProtocolVersion version, const char *offer, int offerLength) {
+    const char *transport = getenv("CONCOLIC_TRANSPORT");
+    bool wantsSharedMemory = transport && !strcmp(transport, "shm");
+    if (wantsSharedMemory && !(SupportedCapabilities & SharedMemoryCapability)) {
+        LOG(tout << "Communication with server: shared memory is not supported on this platform, staying on the socket");
+        wantsSharedMemory = false;
+    }
+    if (offerLength < (int) sizeof(Capabilities)) {
+        m_capabilities.mask = (version >= ProtocolV3 ? EventBatchesCapability : 0)
+                            | (version >= ProtocolV4 ? PipelinedCommandsCapability : 0)
+                            | (wantsSharedMemory ? SharedMemoryCapability : 0);
+        m_capabilities.maxBatchEvents = MaxBatchEvents;
+        m_capabilities.ringCapacity = SharedMemoryRingCapacity;
+        return;
+    }
+    Capabilities offered;
+    memcpy(&offered, offer, sizeof(Capabilities));
+    m_capabilities.mask = offered.mask & SupportedCapabilities;
+    if (!wantsSharedMemory)
+        m_capabilities.mask &= ~SharedMemoryCapability;
+    else if (!(m_capabilities.mask & SharedMemoryCapability))
+        LOG(tout << "Communication with server: server does not offer shared memory, staying on the socket");
+    const char *batchInstrumentation = getenv("CONCOLIC_BATCH_INSTRUMENTATION");
+    if (!batchInstrumentation || strcmp(batchInstrumentation, "1"))
+        m_capabilities.mask &= ~BatchInstrumentationCapability;
+    m_capabilities.maxBatchEvents = offered.maxBatchEvents < MaxBatchEvents ? offered.maxBatchEvents : MaxBatchEvents;
+    m_capabilities.ringCapacity = offered.ringCapacity < SharedMemoryRingCapacity ? offered.ringCapacity : SharedMemoryRingCapacity;
+    if (!m_capabilities.maxBatchEvents)
+        m_capabilities.mask &= ~EventBatchesCapability;
+    if (m_capabilities.ringCapacity & (m_capabilities.ringCapacity - 1) || m_capabilities.ringCapacity < 4096)
+        m_capabilities.mask &= ~SharedMemoryCapability;
+}
+
 bool Protocol::handshake() {
+    // NOTE: server greets with "Hi!"; servers, which support framing v2, put their latest version after the null terminator,
+    //       servers, which support compact encoding, put the mask of supported encodings after the version, servers, which
+    //       negotiate capabilities, put the offered 'Capabilities' after the encodings.
+    //       Client answers with "Hi!", the chosen version, the chosen encoding and the chosen capabilities, but only with
+    //       the parts, which server sent
     const char *expectedMessage = "Hi!";
+    int greetingLength = (int) strlen(expectedMessage) + 1;
     char *message;
     int count;
-    if (readBuffer(message, count) && !strcmp(message, expectedMessage)) {
-        strcpy(message, "Hi!");
-        count = strlen(message);
-        if (writeBuffer(message, count)) {
-            delete[] message;
-            LOG(tout << "Communication with server: handshake success!");
+    if (readBuffer(message, count) && count >= greetingLength && !strcmp(message, expectedMessage)) {
+        bool versioned = count > greetingLength;
+        bool withEncodings = count > greetingLength + 1;
+        bool withCapabilities = count >= greetingLength + 2 + (int) sizeof(Capabilities);
+        ProtocolVersion version = ProtocolV1;
+        WireEncoding encoding = FixedEncoding;
+        if (versioned) {
+            char serverVersion = message[greetingLength];
+            version = serverVersion >= LatestProtocolVersion ? LatestProtocolVersion
+                    : serverVersion >= ProtocolV1 ? (ProtocolVersion) serverVersion : ProtocolV1;
+        }
+        if (withEncodings) {
+            unsigned char serverEncodings = (unsigned char) message[greetingLength + 1];
+            if (serverEncodings & (1 << CompactEncoding))
+                encoding = CompactEncoding;
+        }
+        chooseCapabilities(version, message + greetingLength + 2, withCapabilities ? (int) sizeof(Capabilities) : 0);
+        char answer[6 + sizeof(Capabilities)] = { 'H', 'i', '!', '\0', (char) version, (char) encoding };
+        memcpy(answer + 6, &m_capabilities, sizeof(Capabilities));
+        int answerLength = withCapabilities ? (int) sizeof(answer) : withEncodings ? 6 : versioned ? 5 : greetingLength - 1;
+        if (writeBuffer(answer, answerLength)) {
+            m_version = version;
+            m_encoding = encoding;
+            LOG(tout << "Communication with server: handshake success! "; describeFeatures(tout));
             return true;
         }
-        delete[] message;
     }
     LOG_ERROR(tout << "Communication with server: handshake failed!");
     return false;
 }
 
+bool Protocol::setupTransport() {
+    const char *transport = getenv("CONCOLIC_TRANSPORT");
+    if (transport && strlen(transport) && strcmp(transport, "socket") && strcmp(transport, "shm")) {
+        LOG_ERROR(tout << "Communication with server: unknown transport " << transport);
+        return false;
+    }
+    if (!(m_capabilities.mask & SharedMemoryCapability))
+        return true;
+    unsigned setup[3];
+    setup[2] = m_capabilities.ringCapacity;
+    if (!m_communicator->createSharedMemory(setup[2], setup[0], setup[1]) || !writeBuffer((char *) setup, sizeof(setup)))
+        return false;
+    char *answer;
+    int count;
+    if (!readBuffer(answer, count) || count != 1 || answer[0] != 1) {
+        LOG_ERROR(tout << "Communication with server: server could not map shared memory");
+        return false;
+    }
+    m_communicator->switchToSharedMemory();
+    LOG(tout << "Communication with server: switched to shared memory transport");
+    return true;
+}
+
 bool Protocol::startSession() {
     return connect() && sendProbes();
 }
 
 bool Protocol::sendProbes() {
-    unsigned bytesCount = ProbesAddresses.size() * sizeof(unsigned long long);
-    LOG(tout << "Sending probes..." << std::endl);
-    return writeBuffer((char*)ProbesAddresses.data(), bytesCount);
+    // NOTE: every probe is sent as its address followed by the length and bytes of its metadata signature
+    std::vector<char> message;
+    for (const ProbeInfo &probe : probesTable()) {
+        const char *address = (const char *) &probe.address;
+        message.insert(message.end(), address, address + sizeof(unsigned long long));
+        message.push_back((char) probe.signatureLength);
+        message.insert(message.end(), probe.signature, probe.signature + probe.signatureLength);
+    }
+    LOG(tout << "Sending " << probesTable().size() << " probes..." << std::endl);
+    return writeBuffer(message.data(), (int) message.size());
 }
 
 void Protocol::acceptEntryPoint(char *&entryPointBytes, int &length) {
@@ -148,7 +414,6 @@ bool Protocol::acceptCommand(CommandType &command)
     command = (CommandType) *message;
 //    CLOG(command == ReadMethodBody, tout << "Accepted ReadMethodBody command");
 //    CLOG(command == ReadString, tout << "Accepted ReadString command");
-    delete[] message;
     return true;
 }
 
@@ -159,10 +424,10 @@ bool Protocol::acceptString(char *&string) {
         LOG_ERROR(tout << "Reading instrumented method body failed!");
         return false;
     }
+    // NOTE: string is stored in strings pool, so it is copied out of the receive buffer
     string = new char[messageLength];
     memcpy(string, message, messageLength);
 //    LOG(tout << "Successfully accepted string: " << string);
-    delete[] message;
     return true;
 }
 
@@ -175,41 +440,127 @@ bool Protocol::sendStringsPoolIndex(const unsigned index) {
     return result;
 }
 
-bool Protocol::acceptMethodBody(char *&bytecode, int &codeLength, unsigned &maxStackSize, char *&ehs, unsigned &ehsLength) {
-    char *message;
+bool Protocol::acceptMethodBodyHeader(unsigned &codeLength, unsigned &maxStackSize, unsigned &ehsLength) {
     int messageLength;
-    if (!readBuffer(message, messageLength)) {
+    if (!startReadingMessage(messageLength)) {
         LOG_ERROR(tout << "Reading instrumented method body failed!");
         return false;
     }
-    char *origMessage = message;
-    LOG(tout << "Successfully accepted " << messageLength << " bytes of message, parsing it...");
-    codeLength = *(int*)message;
-    message += sizeof(int);
-    maxStackSize = *(unsigned*)message;
-    message += sizeof(unsigned);
-    bytecode = new char[codeLength];
-    memcpy(bytecode, message, codeLength);
-    ehsLength = messageLength - sizeof(int) - sizeof(unsigned) - codeLength;
-    ehs = new char[ehsLength];
-    memcpy(ehs, message + codeLength, ehsLength);
-    delete[] origMessage;
+    char header[sizeof(int) + sizeof(unsigned)];
+    if (messageLength < (int) sizeof(header) || !readMessagePart(header, sizeof(header))) {
+        LOG_ERROR(tout << "Reading header of instrumented method body failed!");
+        return false;
+    }
+    int length = *(int*)header;
+    maxStackSize = *(unsigned*)(header + sizeof(int));
+    int rest = messageLength - (int) sizeof(header) - length;
+    if (length < 0 || rest < 0) {
+        LOG_ERROR(tout << "Communication with server: inconsistent lengths of method body (message length = " << messageLength << ", code length = " << length << ")");
+        return false;
+    }
+    codeLength = (unsigned) length;
+    ehsLength = (unsigned) rest;
+    LOG(tout << "Accepting " << messageLength << " bytes of method body...");
     return true;
 }
 
+bool Protocol::acceptMethodBodyContents(char *bytecode, unsigned codeLength, char *ehs, unsigned ehsLength) {
+    if (!readMessagePart(bytecode, (int) codeLength) || !readMessagePart(ehs, (int) ehsLength)) {
+        LOG_ERROR(tout << "Reading instrumented method body failed!");
+        return false;
+    }
+    return finishReadingMessage();
+}
+
 void Protocol::acceptExecResult(char *&bytes, int &messageLength) {
     if (!readBuffer(bytes, messageLength)) {
         FAIL_LOUD("Exec response validation failed!");
     }
-    assert(messageLength >= 5);
+    assert(messageLength >= (m_encoding == CompactEncoding ? 2 : 5));
 }
 
 bool Protocol::connect() {
+    return connect(createCommunicator());
+}
+
+bool Protocol::connect(Communicator *communicator) {
     LOG(tout << "Connecting to server...");
-    return m_communicator.open() && handshake();
+    delete m_communicator;
+    m_communicator = communicator;
+    return m_communicator->open() && handshake() && setupTransport();
+}
+
+WireEncoding Protocol::encoding() const {
+    return m_encoding;
+}
+
+bool Protocol::batchesEvents() const {
+    return (m_capabilities.mask & EventBatchesCapability) != 0;
+}
+
+unsigned Protocol::maxBatchEvents() const {
+    return m_capabilities.maxBatchEvents;
+}
+
+bool Protocol::pipelinesCommands() const {
+    return (m_capabilities.mask & PipelinedCommandsCapability) != 0;
+}
+
+bool Protocol::multiplexesChannels() const {
+    return m_version >= ProtocolV5;
+}
+
+std::unique_lock<std::mutex> Protocol::lockExchange() {
+    // NOTE: responses come in the order of requests, so responses of the commands, pipelined by this thread, are read first
+    joinPipelinedCommands();
+    if (multiplexesChannels())
+        return std::unique_lock<std::mutex>();
+    return std::unique_lock<std::mutex>(m_channels->exchangeLock);
+}
+
+bool Protocol::batchesInstrumentation() const {
+    return (m_capabilities.mask & BatchInstrumentationCapability) != 0;
+}
+
+void Protocol::describeFeatures(std::ostream &out) const {
+    out << "protocol v" << m_version << ", " << (m_encoding == CompactEncoding ? "compact" : "fixed") << " encoding";
+    if (batchesEvents())
+        out << ", event batches (up to " << m_capabilities.maxBatchEvents << " events)";
+    if (pipelinesCommands())
+        out << ", pipelined commands";
+    if (batchesInstrumentation())
+        out << ", batched instrumentation";
+    if (m_capabilities.mask & SharedMemoryCapability)
+        out << ", shared memory (" << m_capabilities.ringCapacity << " bytes per ring)";
+}
+
+void Protocol::writeStats(std::ostream &out) const {
+    out << "Communication with server: ";
+    describeFeatures(out);
+    out << "; sent " << m_stats.messagesSent << " messages (" << m_stats.bytesSent << " bytes), received "
+        << m_stats.messagesReceived << " messages (" << m_stats.bytesReceived << " bytes)";
+}
+
+void Protocol::abort() {
+    if (!m_aborted.exchange(true))
+        LOG_ERROR(tout << "Communication with server is aborted, the further messages are neither sent nor read");
 }
 
 bool Protocol::shutdown()
 {
-    return writeCount(-1);
+    LOG(writeStats(tout));
+    if (getenv("CONCOLIC_STATS")) {
+        writeStats(std::cerr);
+        std::cerr << std::endl;
+    }
+    // NOTE: closing lets recording backend flush its file
+    bool terminated;
+    if (m_version >= ProtocolV5) {
+        int header[] = { -1, (int) currentChannel() };
+        std::lock_guard<std::mutex> lock(m_channels->writeLock);
+        terminated = m_communicator->write((char *) header, sizeof(header)) == sizeof(header);
+    } else {
+        terminated = writeCount(-1);
+    }
+    return terminated && m_communicator->close();
 }
@@ -2,6 +2,11 @@
 #define PROTOCOL_H_
 
 #include "communicator.h"
+#include "wireEncoding.h"
+#include <atomic>
+#include <mutex>
+#include <ostream>
+#include <vector>
 
 namespace vsharp {
 
@@ -10,12 +15,88 @@ enum CommandType {
     InstrumentCommand = 0x56,
     ExecuteCommand = 0x57,
     ReadMethodBody = 0x58,
-    ReadString = 0x59
+    ReadString = 0x59,
+    ExecuteBatchCommand = 0x5A,
+    ExecutePipelinedCommand = 0x5B,
+    InstrumentBatchCommand = 0x5C
+};
+
+// Framing of messages, which is negotiated during the handshake:
+//   v1: count, confirmation from the receiver, payload, confirmation from the receiver
+//   v2: count and payload, written together, without confirmations
+//   v3: framing of v2; exec commands, whose responses client predicts, may be batched (see 'ExecEventBatch')
+//   v4: framing of v2; exec commands may be pipelined, i.e. their responses are read later (see 'CommandPipeline')
+//   NOTE: servers, which negotiate capabilities, enable batches and pipelining by 'Capability' instead of v3 and v4
+//   v5: count, channel of the sending thread and payload: each thread of the target talks to the server through its own
+//       channel, frames of different channels share the connection
+enum ProtocolVersion {
+    ProtocolV1 = 1,
+    ProtocolV2 = 2,
+    ProtocolV3 = 3,
+    ProtocolV4 = 4,
+    ProtocolV5 = 5
+};
+
+const ProtocolVersion LatestProtocolVersion = ProtocolV5;
+
+// Transport of messages is chosen by CONCOLIC_TRANSPORT environment variable (SILI passes the same value to both sides):
+//   "socket" (default): everything goes through the socket from CONCOLIC_PIPE
+//   "shm": after the handshake the client creates shared region with two rings and sends [pid][fd][capacity of ring]
+//          through the socket; server maps the region and confirms, then both sides switch to the rings.
+//          If server negotiates capabilities, but does not offer 'SharedMemoryCapability', the socket is used
+const unsigned SharedMemoryRingCapacity = 1 << 20;
+
+// Optional features of the session. Server offers the ones it supports, client chooses the ones both sides use
+enum Capability {
+    EventBatchesCapability = 1,
+    PipelinedCommandsCapability = 2,
+    SharedMemoryCapability = 4,
+    // Client sends the methods of a loaded module with one 'InstrumentBatchCommand', server answers with their bodies.
+    // Chosen only if CONCOLIC_BATCH_INSTRUMENTATION is "1"
+    BatchInstrumentationCapability = 8
+};
+
+// NOTE: shared memory transport is built on Linux only (see CMakeLists.txt)
+#ifdef VSHARP_SHARED_MEMORY
+const unsigned SupportedCapabilities =
+    EventBatchesCapability | PipelinedCommandsCapability | SharedMemoryCapability | BatchInstrumentationCapability;
+#else
+const unsigned SupportedCapabilities = EventBatchesCapability | PipelinedCommandsCapability | BatchInstrumentationCapability;
+#endif
+const unsigned MaxBatchEvents = 256;
+
+// Features of the session, which both sides agreed on: server offers its limits, client chooses the lesser ones
+struct Capabilities {
+    unsigned mask;
+    // Maximal amount of events, which are sent with one command
+    unsigned maxBatchEvents;
+    // Capacity of each shared memory ring, power of two
+    unsigned ringCapacity;
+};
+
+// Amounts of messages and bytes (with headers of frames), which went through the connection
+struct ProtocolStats {
+    std::atomic<unsigned long long> messagesSent;
+    std::atomic<unsigned long long> bytesSent;
+    std::atomic<unsigned long long> messagesReceived;
+    std::atomic<unsigned long long> bytesReceived;
+
+    ProtocolStats() : messagesSent(0), bytesSent(0), messagesReceived(0), bytesReceived(0) {}
 };
 
 class Protocol {
 private:
-    Communicator m_communicator;
+    // Locks and queues, which demultiplex frames of different channels
+    struct Channels;
+
+    Communicator *m_communicator;
+    ProtocolVersion m_version;
+    WireEncoding m_encoding;
+    Capabilities m_capabilities;
+    Channels *m_channels;
+    ProtocolStats m_stats;
+    // NOTE: set by 'abort', after it nothing is read or written
+    std::atomic<bool> m_aborted;
 
     bool readConfirmation();
     bool writeConfirmation();
@@ -23,32 +104,90 @@ private:
     bool readCount(int &count);
     bool writeCount(int count);
 
+    // NOTE: message is read in three stages, so that its parts could be read right into their destinations
+    bool startReadingMessage(int &count);
+    bool readExactly(char *buffer, int count);
+    // Reads the next part of the message, which reading was started by 'startReadingMessage'
+    bool readMessagePart(char *buffer, int count);
+    bool finishReadingMessage();
+
+    // NOTE: since v5 the thread waits for the frame of its channel, frames of the other channels, read meanwhile,
+    //       are put into their mailboxes
+    bool receiveFrame(std::vector<char> &frame, int &count);
+
+    // Reads the whole message into the per-thread receive buffer: 'buffer' is valid until the next read of the thread
     bool readBuffer(char *&buffer, int &count);
     bool writeBuffer(char *buffer, int count);
+    // Writes each of 'payloads' as a separate message; in v2 all of them are sent by a single write
+    bool writeBuffers(char **payloads, const int *counts, int payloadsCount);
 
     bool handshake();
+    // Chooses capabilities from the ones, which server offers. Older servers do not offer them, so they follow from 'version'
+    void chooseCapabilities(ProtocolVersion version, const char *offer, int offerLength);
+    bool setupTransport();
+
+    // Per-thread buffer, into which messages are serialized before sending
+    static std::vector<char> &sendBuffer();
+    // Per-thread buffer, into which messages are received
+    static std::vector<char> &receiveBuffer();
+    // Per-thread position of the next unread byte of the received message, see 'readMessagePart'
+    static int &receiveOffset();
+    // Channel of the current thread: channels are numbered in the order of the first message of the thread
+    static unsigned currentChannel();
 
 public:
+    Protocol();
+    ~Protocol();
+
+    // Connects via the backend, chosen by 'createCommunicator'
     bool connect();
+    // Connects via the given backend (e.g. an end of loopback connection), takes ownership of it
+    bool connect(Communicator *communicator);
+    // Encoding of exec commands and responses, chosen during the handshake
+    WireEncoding encoding() const;
+    // Whether the server accepts batches of exec events
+    bool batchesEvents() const;
+    unsigned maxBatchEvents() const;
+    // Whether the server accepts exec commands, whose responses are not awaited
+    bool pipelinesCommands() const;
+    // Whether each thread talks to the server through its own channel, so that threads do not wait for each other's responses
+    bool multiplexesChannels() const;
+    // Reads responses of the commands, pipelined by the thread, and locks the connection until the response of the thread is read,
+    // if threads share the only channel. Since v5 nothing is locked. Must precede any request of the instrumenter and,
+    // before v5, any exec command (see 'sendCommand')
+    std::unique_lock<std::mutex> lockExchange();
+    // Whether methods of the loaded modules are sent to the server in batches
+    bool batchesInstrumentation() const;
+    // Writes the version, the encoding and the capabilities of the session
+    void describeFeatures(std::ostream &out) const;
+    // Writes the features and the amounts of messages; shutdown writes them into log and, if CONCOLIC_STATS is set, to stderr
+    void writeStats(std::ostream &out) const;
     bool sendProbes();
     bool startSession();
     void acceptEntryPoint(char *&entryPointBytes, int &length);
     bool acceptCommand(CommandType &command);
     bool acceptString(char *&string);
     bool sendStringsPoolIndex(unsigned index);
-    bool acceptMethodBody(char *&bytecode, int &codeLength, unsigned &maxStackSize, char *&ehs, unsigned &ehsLength);
+    // NOTE: instrumented method body is accepted in two steps: after the header is read, the caller allocates the locations,
+    //       into which the code and the exception handling clauses are read then
+    bool acceptMethodBodyHeader(unsigned &codeLength, unsigned &maxStackSize, unsigned &ehsLength);
+    bool acceptMethodBodyContents(char *bytecode, unsigned codeLength, char *ehs, unsigned ehsLength);
+    // NOTE: 'T' must provide 'unsigned size() const' and 'void serialize(char *buffer) const', which writes exactly 'size()' bytes
     template<typename T>
     bool sendSerializable(char commandByte, const T &object) {
-        if (!writeBuffer(new char[1] {commandByte}, 1)) return false;
-        char *bytes;
-        unsigned count;
-        object.serialize(bytes, count);
-        bool result = writeBuffer(bytes, count);
-        delete[] bytes;
-        return result;
+        std::vector<char> &buffer = sendBuffer();
+        buffer.resize(object.size());
+        object.serialize(buffer.data());
+        char *payloads[] = { &commandByte, buffer.data() };
+        int counts[] = { 1, (int) buffer.size() };
+        return writeBuffers(payloads, counts, 2);
     }
+    // NOTE: 'bytes' points into the receive buffer, see 'readBuffer'
     void acceptExecResult(char *&bytes, int &messageLength);
     bool shutdown();
+    // Breaks the connection, when the messages can not be told apart anymore (e.g. a message is read partially), so that
+    // the further exchanges fail instead of taking the rest of a message for a response
+    void abort();
 };
 
 }
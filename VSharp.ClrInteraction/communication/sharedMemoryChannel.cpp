@@ -0,0 +1,185 @@
+#include "sharedMemoryChannel.h"
+#include "../logging.h"
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC 0x0001U
+#endif
+
+using namespace vsharp;
+
+// NOTE: waiter spins for a while before going to sleep, because the peer usually answers within a few microseconds
+static const int spinIterations = 2000;
+// NOTE: sleeping waiter wakes up periodically to check whether the channel was closed
+static const long sleepTimeoutNanoseconds = 100 * 1000 * 1000;
+
+static void cpuRelax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield");
+#endif
+}
+
+static void futexWait(std::atomic<uint32_t> &word, uint32_t value) {
+    struct timespec timeout = {0, sleepTimeoutNanoseconds};
+    syscall(SYS_futex, (uint32_t *) &word, FUTEX_WAIT, value, &timeout, nullptr, 0);
+}
+
+static void futexWake(std::atomic<uint32_t> &word) {
+    syscall(SYS_futex, (uint32_t *) &word, FUTEX_WAKE, 1, nullptr, nullptr, 0);
+}
+
+Ring::Ring() : m_control(nullptr), m_data(nullptr), m_capacity(0), m_closed(nullptr) {}
+
+void Ring::attach(RingControl *control, char *data, uint32_t capacity, const std::atomic<uint32_t> *closed) {
+    m_control = control;
+    m_data = data;
+    m_capacity = capacity;
+    m_closed = closed;
+}
+
+// Waits until 'word' differs from 'value'. Returns false if the channel was closed
+bool Ring::wait(std::atomic<uint32_t> &word, std::atomic<uint32_t> &waits, uint32_t value) {
+    for (int i = 0; i < spinIterations; ++i) {
+        if (word.load(std::memory_order_acquire) != value) return true;
+        cpuRelax();
+    }
+    while (word.load(std::memory_order_acquire) == value) {
+        if (m_closed->load(std::memory_order_acquire)) return false;
+        // NOTE: the flag is raised before the last check, so the peer either sees it after publishing, or we see the new value
+        waits.store(1, std::memory_order_seq_cst);
+        if (word.load(std::memory_order_seq_cst) == value)
+            futexWait(word, value);
+        waits.store(0, std::memory_order_relaxed);
+    }
+    return true;
+}
+
+void Ring::wake(std::atomic<uint32_t> &word, std::atomic<uint32_t> &waits) {
+    if (waits.load(std::memory_order_seq_cst))
+        futexWake(word);
+}
+
+int Ring::write(char **buffers, const int *counts, int buffersCount) {
+    uint32_t head = m_control->head.load(std::memory_order_relaxed);
+    int written = 0;
+    for (int i = 0; i < buffersCount; ++i) {
+        const char *buffer = buffers[i];
+        uint32_t left = (uint32_t) counts[i];
+        while (left > 0) {
+            uint32_t tail = m_control->tail.load(std::memory_order_acquire);
+            uint32_t free = m_capacity - (head - tail);
+            if (free == 0) {
+                // NOTE: publishing what is written so far, so that the reader could free the space
+                m_control->head.store(head, std::memory_order_seq_cst);
+                wake(m_control->head, m_control->readerWaits);
+                if (!wait(m_control->tail, m_control->writerWaits, tail)) return written;
+                continue;
+            }
+            uint32_t chunk = std::min(left, free);
+            uint32_t position = head & (m_capacity - 1);
+            uint32_t firstPart = std::min(chunk, m_capacity - position);
+            memcpy(m_data + position, buffer, firstPart);
+            memcpy(m_data, buffer + firstPart, chunk - firstPart);
+            head += chunk;
+            buffer += chunk;
+            left -= chunk;
+            written += (int) chunk;
+        }
+    }
+    m_control->head.store(head, std::memory_order_seq_cst);
+    wake(m_control->head, m_control->readerWaits);
+    return written;
+}
+
+int Ring::read(char *buffer, int count) {
+    uint32_t tail = m_control->tail.load(std::memory_order_relaxed);
+    uint32_t head = m_control->head.load(std::memory_order_acquire);
+    if (head == tail) {
+        if (!wait(m_control->head, m_control->readerWaits, tail)) return 0;
+        head = m_control->head.load(std::memory_order_acquire);
+    }
+    uint32_t chunk = std::min((uint32_t) count, head - tail);
+    uint32_t position = tail & (m_capacity - 1);
+    uint32_t firstPart = std::min(chunk, m_capacity - position);
+    memcpy(buffer, m_data + position, firstPart);
+    memcpy(buffer + firstPart, m_data, chunk - firstPart);
+    m_control->tail.store(tail + chunk, std::memory_order_seq_cst);
+    wake(m_control->tail, m_control->writerWaits);
+    return (int) chunk;
+}
+
+SharedMemoryChannel::SharedMemoryChannel() : m_fd(-1), m_region(nullptr), m_size(0) {}
+
+SharedMemoryChannel::~SharedMemoryChannel() {
+    close();
+}
+
+bool SharedMemoryChannel::create(uint32_t capacity) {
+    if (capacity == 0 || (capacity & (capacity - 1)) != 0) {
+        LOG_ERROR(tout << "Shared memory: capacity of ring " << capacity << " is not a power of two");
+        return false;
+    }
+    m_fd = (int) syscall(SYS_memfd_create, "vsharp-concolic", MFD_CLOEXEC);
+    if (m_fd < 0) {
+        LOG_ERROR(tout << "Shared memory: memfd_create failed: " << strerror(errno));
+        return false;
+    }
+    m_size = SharedMemoryHeaderSize + 2 * (size_t) capacity;
+    if (ftruncate(m_fd, (off_t) m_size) < 0) {
+        LOG_ERROR(tout << "Shared memory: ftruncate failed: " << strerror(errno));
+        close();
+        return false;
+    }
+    void *region = mmap(nullptr, m_size, PROT_READ | PROT_WRITE, MAP_SHARED, m_fd, 0);
+    if (region == MAP_FAILED) {
+        LOG_ERROR(tout << "Shared memory: mmap failed: " << strerror(errno));
+        close();
+        return false;
+    }
+    m_region = (char *) region;
+    // NOTE: fresh memfd is zero-filled, so all the counters and flags are already zero
+    auto header = (SharedMemoryHeader *) m_region;
+    header->magic = SharedMemoryMagic;
+    header->layoutVersion = SharedMemoryLayoutVersion;
+    header->capacity = capacity;
+    static_assert(sizeof(RingControl) == 128, "Ring control must occupy two cache lines");
+    auto controls = (RingControl *) (m_region + SharedMemoryControlsOffset);
+    char *data = m_region + SharedMemoryHeaderSize;
+    m_out.attach(&controls[0], data, capacity, &header->closed);
+    m_in.attach(&controls[1], data + capacity, capacity, &header->closed);
+    return true;
+}
+
+int SharedMemoryChannel::fd() const {
+    return m_fd;
+}
+
+int SharedMemoryChannel::read(char *buffer, int count) {
+    return m_in.read(buffer, count);
+}
+
+int SharedMemoryChannel::write(char **buffers, const int *counts, int buffersCount) {
+    return m_out.write(buffers, counts, buffersCount);
+}
+
+void SharedMemoryChannel::close() {
+    if (m_region) {
+        auto header = (SharedMemoryHeader *) m_region;
+        header->closed.store(1, std::memory_order_seq_cst);
+        munmap(m_region, m_size);
+        m_region = nullptr;
+    }
+    if (m_fd >= 0) {
+        ::close(m_fd);
+        m_fd = -1;
+    }
+}
@@ -0,0 +1,80 @@
+#ifndef SHAREDMEMORYCHANNEL_H_
+#define SHAREDMEMORYCHANNEL_H_
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+namespace vsharp {
+
+// Layout of the shared region (SILI mirrors it in SharedMemory.fs):
+//   [0, 64)                       header: magic, layout version, capacity of each ring, 'closed' flag
+//   [64 + 128 * k, 192 + 128 * k) control of ring k: head and 'writer waits' flag, then tail and 'reader waits' flag on another line
+//   [512 + capacity * k, ...)     data of ring k
+// Ring 0 is written by the profiler and read by SILI, ring 1 is written by SILI and read by the profiler.
+// Head and tail are the total amounts of written and read bytes modulo 2^32, they are also the futex words, on which
+// the reader and the writer sleep
+const uint32_t SharedMemoryMagic = 0x4D485356;
+const uint32_t SharedMemoryLayoutVersion = 1;
+const size_t SharedMemoryControlsOffset = 64;
+const size_t SharedMemoryHeaderSize = 512;
+
+struct SharedMemoryHeader {
+    uint32_t magic;
+    uint32_t layoutVersion;
+    uint32_t capacity;
+    std::atomic<uint32_t> closed;
+};
+
+struct alignas(64) RingControl {
+    alignas(64) std::atomic<uint32_t> head;
+    std::atomic<uint32_t> writerWaits;
+    alignas(64) std::atomic<uint32_t> tail;
+    std::atomic<uint32_t> readerWaits;
+};
+
+// Single-producer single-consumer byte ring in the shared region
+class Ring {
+private:
+    RingControl *m_control;
+    char *m_data;
+    uint32_t m_capacity;
+    const std::atomic<uint32_t> *m_closed;
+
+    bool wait(std::atomic<uint32_t> &word, std::atomic<uint32_t> &waits, uint32_t value);
+    void wake(std::atomic<uint32_t> &word, std::atomic<uint32_t> &waits);
+
+public:
+    Ring();
+    void attach(RingControl *control, char *data, uint32_t capacity, const std::atomic<uint32_t> *closed);
+
+    // Copies all the buffers into the ring and publishes them at once, waits while the ring is full
+    int write(char **buffers, const int *counts, int buffersCount);
+    // Reads at most 'count' available bytes, waits while the ring is empty. Returns 0 if the channel is closed
+    int read(char *buffer, int count);
+};
+
+class SharedMemoryChannel {
+private:
+    int m_fd;
+    char *m_region;
+    size_t m_size;
+    Ring m_in;
+    Ring m_out;
+
+public:
+    SharedMemoryChannel();
+    ~SharedMemoryChannel();
+
+    // Creates memfd-backed region with rings of 'capacity' bytes (power of two)
+    bool create(uint32_t capacity);
+    int fd() const;
+
+    int read(char *buffer, int count);
+    int write(char **buffers, const int *counts, int buffersCount);
+    void close();
+};
+
+}
+
+#endif // SHAREDMEMORYCHANNEL_H_
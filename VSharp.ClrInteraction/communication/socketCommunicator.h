@@ -0,0 +1,34 @@
+#ifndef SOCKETCOMMUNICATOR_H_
+#define SOCKETCOMMUNICATOR_H_
+
+#include "communicator.h"
+
+namespace vsharp {
+
+// Connects to the server via CONCOLIC_PIPE: unix domain socket (unixFifoCommunicator.cpp) or named pipe on Windows
+// (windowsFifoCommunicator.cpp)
+class SocketCommunicator : public Communicator {
+private:
+    // NOTE: state of connection is platform-specific, it is defined by the implementation
+    struct Connection;
+    Connection *m_connection;
+
+public:
+    SocketCommunicator();
+    ~SocketCommunicator() override;
+
+    bool open() override;
+    int read(char *buffer, int count) override;
+    int write(char *message, int count) override;
+    int writeVector(char **buffers, const int *counts, int buffersCount) override;
+    bool close() override;
+
+#ifdef VSHARP_SHARED_MEMORY
+    bool createSharedMemory(unsigned capacity, unsigned &pid, unsigned &memoryFd) override;
+    void switchToSharedMemory() override;
+#endif
+};
+
+}
+
+#endif // SOCKETCOMMUNICATOR_H_
@@ -1,52 +1,204 @@
-#include "communicator.h"
+#include "socketCommunicator.h"
+#ifdef VSHARP_SHARED_MEMORY
+#include "sharedMemoryChannel.h"
+#endif
 #include "../logging.h"
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <sys/un.h>
 #include <unistd.h>
+#include <algorithm>
+#include <cassert>
 #include <cstring>
 #include <cerrno>
+#include <vector>
 
 using namespace vsharp;
 
-int fd;
+struct SocketCommunicator::Connection {
+    int fd = -1;
 
-bool reportError() {
+    // NOTE: sequenced packet sockets preserve message boundaries: a record is read at once and its unread rest is discarded,
+    //       so records are buffered here and served to the readers byte by byte
+    bool packetMode = false;
+    std::vector<char> packet;
+    size_t packetOffset = 0;
+
+#ifdef VSHARP_SHARED_MEMORY
+    SharedMemoryChannel *sharedMemory = nullptr;
+    bool sharedMemoryActive = false;
+#endif
+
+    int readPacket(char *buffer, int count);
+};
+
+static bool reportError() {
     LOG_ERROR(tout << strerror(errno));
     return false;
 }
 
-bool Communicator::open() {
-    fd = socket(AF_UNIX, SOCK_STREAM, 0);
-    if (fd < 0)
-        return reportError();
+static int connectSocket(const sockaddr_un &addr, int type) {
+    int socketFd = socket(AF_UNIX, type, 0);
+    if (socketFd < 0)
+        return -1;
+    if (connect(socketFd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        ::close(socketFd);
+        return -1;
+    }
+    return socketFd;
+}
+
+SocketCommunicator::SocketCommunicator() : m_connection(new Connection()) {}
+
+SocketCommunicator::~SocketCommunicator() {
+    if (m_connection->fd >= 0)
+        close();
+    delete m_connection;
+}
+
+bool SocketCommunicator::open() {
     struct sockaddr_un addr;
     memset(&addr, 0, sizeof(addr));
     addr.sun_family = AF_UNIX;
     std::string pipeEnvVar = "CONCOLIC_PIPE";
     auto pipeFile = getenv(pipeEnvVar.c_str());
-    if (strlen(pipeFile) < 1) FAIL_LOUD("Invalid pipe environment variable!");
-    strncpy(addr.sun_path, pipeFile, strlen(pipeFile));
-    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0)
+    if (!pipeFile || strlen(pipeFile) < 1) FAIL_LOUD("Invalid pipe environment variable!");
+    strncpy(addr.sun_path, pipeFile, sizeof(addr.sun_path) - 1);
+#ifdef __linux__
+    // NOTE: servers, which listen on stream sockets, refuse sequenced packet connections, so stream socket is the fallback
+    m_connection->fd = connectSocket(addr, SOCK_SEQPACKET);
+    m_connection->packetMode = m_connection->fd >= 0;
+    if (m_connection->packetMode) {
+        LOG(tout << "Connected to server via sequenced packet socket");
+        return true;
+    }
+#endif
+    m_connection->fd = connectSocket(addr, SOCK_STREAM);
+    if (m_connection->fd < 0)
         return reportError();
     return true;
 }
 
-int Communicator::read(char *buffer, int count) {
-    int bytes = ::read(fd, buffer, count);
+int SocketCommunicator::Connection::readPacket(char *buffer, int count) {
+    if (packetOffset == packet.size()) {
+        ssize_t length = recv(fd, nullptr, 0, MSG_PEEK | MSG_TRUNC);
+        if (length <= 0) {
+            if (length < 0) reportError();
+            return (int) length;
+        }
+        packet.resize(length);
+        length = recv(fd, packet.data(), packet.size(), 0);
+        if (length < 0) {
+            reportError();
+            packet.clear();
+            packetOffset = 0;
+            return -1;
+        }
+        packet.resize(length);
+        packetOffset = 0;
+    }
+    size_t bytes = std::min((size_t) count, packet.size() - packetOffset);
+    memcpy(buffer, packet.data() + packetOffset, bytes);
+    packetOffset += bytes;
+    return (int) bytes;
+}
+
+int SocketCommunicator::read(char *buffer, int count) {
+#ifdef VSHARP_SHARED_MEMORY
+    if (m_connection->sharedMemoryActive)
+        return m_connection->sharedMemory->read(buffer, count);
+#endif
+    if (m_connection->packetMode)
+        return m_connection->readPacket(buffer, count);
+    int bytes = ::read(m_connection->fd, buffer, count);
 //    LOG(tout << "read " << count << " bytes: " << buffer);
     if (bytes < 0) reportError();
     return bytes;
 }
 
-int Communicator::write(char *message, int count) {
+int SocketCommunicator::write(char *message, int count) {
 //    LOG(tout << "writing " << count << " bytes: " << message);
-    int bytes = ::write(fd, message, count);
+#ifdef VSHARP_SHARED_MEMORY
+    if (m_connection->sharedMemoryActive)
+        return m_connection->sharedMemory->write(&message, &count, 1);
+#endif
+    int bytes = ::write(m_connection->fd, message, count);
     if (bytes < 0) reportError();
     return bytes;
 }
 
-bool Communicator::close() {
-    if (::close(fd)) 
+int SocketCommunicator::writeVector(char **buffers, const int *counts, int buffersCount) {
+    const int maxBuffersCount = 8;
+    assert(buffersCount <= maxBuffersCount);
+#ifdef VSHARP_SHARED_MEMORY
+    if (m_connection->sharedMemoryActive)
+        return m_connection->sharedMemory->write(buffers, counts, buffersCount);
+#endif
+    struct iovec vector[maxBuffersCount];
+    int total = 0;
+    for (int i = 0; i < buffersCount; ++i) {
+        vector[i].iov_base = buffers[i];
+        vector[i].iov_len = counts[i];
+        total += counts[i];
+    }
+    // NOTE: stream sockets may accept only a part of the data, the rest is written by the next calls
+    struct iovec *current = vector;
+    int left = buffersCount;
+    int written = 0;
+    while (written < total) {
+        ssize_t bytes = ::writev(m_connection->fd, current, left);
+        if (bytes < 0) {
+            reportError();
+            return written;
+        }
+        written += (int) bytes;
+        while (left > 0 && (size_t) bytes >= current->iov_len) {
+            bytes -= current->iov_len;
+            ++current;
+            --left;
+        }
+        if (left > 0) {
+            current->iov_base = (char *) current->iov_base + bytes;
+            current->iov_len -= bytes;
+        }
+    }
+    return written;
+}
+
+#ifdef VSHARP_SHARED_MEMORY
+bool SocketCommunicator::createSharedMemory(unsigned capacity, unsigned &pid, unsigned &memoryFd) {
+    if (m_connection->sharedMemory) {
+        LOG_ERROR(tout << "Shared memory is already created");
+        return false;
+    }
+    auto sharedMemory = new SharedMemoryChannel();
+    if (!sharedMemory->create(capacity)) {
+        delete sharedMemory;
+        return false;
+    }
+    m_connection->sharedMemory = sharedMemory;
+    pid = (unsigned) getpid();
+    memoryFd = (unsigned) sharedMemory->fd();
+    return true;
+}
+
+void SocketCommunicator::switchToSharedMemory() {
+    assert(m_connection->sharedMemory);
+    m_connection->sharedMemoryActive = true;
+}
+#endif
+
+bool SocketCommunicator::close() {
+#ifdef VSHARP_SHARED_MEMORY
+    if (m_connection->sharedMemory) {
+        m_connection->sharedMemoryActive = false;
+        delete m_connection->sharedMemory;
+        m_connection->sharedMemory = nullptr;
+    }
+#endif
+    int fd = m_connection->fd;
+    m_connection->fd = -1;
+    if (::close(fd))
         return reportError();
-    return true;   
+    return true;
 }
@@ -1,4 +1,4 @@
-#include "communicator.h"
+#include "socketCommunicator.h"
 #include "../logging.h"
 #include <windows.h>
 #include <stdio.h>
@@ -9,40 +9,56 @@
 
 using namespace vsharp;
 
-HANDLE hPipe;
+struct SocketCommunicator::Connection {
+    HANDLE pipe = INVALID_HANDLE_VALUE;
+};
 
-bool reportError() {
+static bool reportError() {
     LOG_ERROR(tout << "WinAPI error code = " << GetLastError());
     return false;
 }
 
-bool Communicator::open() {
+SocketCommunicator::SocketCommunicator() : m_connection(new Connection()) {}
+
+SocketCommunicator::~SocketCommunicator() {
+    if (m_connection->pipe != INVALID_HANDLE_VALUE)
+        close();
+    delete m_connection;
+}
+
+bool SocketCommunicator::open() {
     std::wstring pipeEnvVar = L"CONCOLIC_PIPE";
     const wchar_t *pipeFile = _wgetenv(pipeEnvVar.c_str());
     std::wstring pipe(pipeFile);
     if (pipe.size() < 1) FAIL_LOUD("Invalid pipe environment variable!");
-    hPipe = CreateFile(pipeFile, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
-    if (hPipe == INVALID_HANDLE_VALUE) return reportError();
+    m_connection->pipe = CreateFile(pipeFile, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (m_connection->pipe == INVALID_HANDLE_VALUE) return reportError();
     return true;
 }
 
-int Communicator::read(char *buffer, int count) {
+int SocketCommunicator::read(char *buffer, int count) {
     DWORD cbRead = -1;
-    BOOL fSuccess = ReadFile(hPipe, buffer, count, &cbRead, NULL);
+    BOOL fSuccess = ReadFile(m_connection->pipe, buffer, count, &cbRead, NULL);
 
     if (!fSuccess || cbRead < 0) reportError();
     return cbRead;
 }
 
-int Communicator::write(char *message, int count) {
+int SocketCommunicator::write(char *message, int count) {
     DWORD cbWritten;
-    BOOL fSuccess = WriteFile(hPipe, message, count, &cbWritten, NULL);
+    BOOL fSuccess = WriteFile(m_connection->pipe, message, count, &cbWritten, NULL);
 
     if (!fSuccess || cbWritten < 0) reportError();
     return cbWritten;
 }
 
-bool Communicator::close() {
-    CloseHandle(hPipe);
+int SocketCommunicator::writeVector(char **buffers, const int *counts, int buffersCount) {
+    // NOTE: message-mode pipes have no gathering write, so the buffers are written one by one
+    return Communicator::writeVector(buffers, counts, buffersCount);
+}
+
+bool SocketCommunicator::close() {
+    CloseHandle(m_connection->pipe);
+    m_connection->pipe = INVALID_HANDLE_VALUE;
     return true;
 }
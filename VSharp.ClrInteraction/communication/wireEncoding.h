@@ -0,0 +1,54 @@
+#ifndef WIREENCODING_H_
+#define WIREENCODING_H_
+
+namespace vsharp {
+
+// Encoding of exec commands and exec responses, which is negotiated during the handshake:
+//   fixed: 4-byte fields, 4-byte operand tags, 8-byte operand contents (see 'ExecCommand::serialize')
+//   compact: LEB128 varints, ZigZag for signed values, 1-byte operand tags, empty sections are omitted
+enum WireEncoding {
+    FixedEncoding = 0,
+    CompactEncoding = 1
+};
+
+inline unsigned varintSize(unsigned long long value) {
+    unsigned size = 1;
+    while (value >= 0x80) {
+        value >>= 7;
+        ++size;
+    }
+    return size;
+}
+
+inline void writeVarint(char *&buffer, unsigned long long value) {
+    while (value >= 0x80) {
+        *buffer++ = (char) (value | 0x80);
+        value >>= 7;
+    }
+    *buffer++ = (char) value;
+}
+
+inline unsigned long long readVarint(char *&buffer) {
+    unsigned long long result = 0;
+    unsigned shift = 0;
+    unsigned char byte;
+    do {
+        byte = (unsigned char) *buffer++;
+        result |= (unsigned long long) (byte & 0x7F) << shift;
+        shift += 7;
+    } while (byte & 0x80);
+    return result;
+}
+
+// NOTE: maps signed values to unsigned ones, so that small negative values are small too: 0, -1, 1, -2, ... -> 0, 1, 2, 3, ...
+inline unsigned long long zigZag(long long value) {
+    return ((unsigned long long) value << 1) ^ (unsigned long long) (value >> 63);
+}
+
+inline long long unZigZag(unsigned long long value) {
+    return (long long) (value >> 1) ^ -(long long) (value & 1);
+}
+
+}
+
+#endif // WIREENCODING_H_
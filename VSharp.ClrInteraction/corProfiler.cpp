@@ -3,6 +3,7 @@
 #include "profiler_pal.h"
 #include "logging.h"
 #include "instrumenter.h"
+#include "moduleCache.h"
 #include "communication/protocol.h"
 #include "memory/memory.h"
 
@@ -10,7 +11,7 @@
 
 using namespace vsharp;
 
-CorProfiler::CorProfiler() : refCount(0), corProfilerInfo(nullptr), instrumenter(nullptr)
+CorProfiler::CorProfiler() : refCount(0), corProfilerInfo(nullptr), instrumenter(nullptr), moduleCache(nullptr)
 {
 }
 
@@ -34,6 +35,7 @@ HRESULT STDMETHODCALLTYPE CorProfiler::Initialize(IUnknown *pICorProfilerInfoUnk
 
     DWORD eventMask =
         COR_PRF_MONITOR_JIT_COMPILATION |
+        COR_PRF_MONITOR_MODULE_LOADS |
         COR_PRF_DISABLE_ALL_NGEN_IMAGES |
 //        COR_PRF_DISABLE_OPTIMIZATIONS |
 //        COR_PRF_MONITOR_CACHE_SEARCHES |
@@ -66,8 +68,11 @@ HRESULT STDMETHODCALLTYPE CorProfiler::Initialize(IUnknown *pICorProfilerInfoUnk
     protocol = new vsharp::Protocol();
     if (!protocol->startSession()) return E_FAIL;
 
-    instrumenter = new Instrumenter(*corProfilerInfo, *protocol);
+    moduleCache = new ModuleCache(*corProfilerInfo);
+    instrumenter = new Instrumenter(*corProfilerInfo, *protocol, *moduleCache);
     instrumenter->configureEntryPoint();
+    if (FAILED(instrumenter->hookSkippedMethods()))
+        LOG_ERROR(tout << "Setting enter hook failed, skipped methods are rejitted, when main is reached");
 
     return S_OK;
 }
@@ -85,6 +90,7 @@ HRESULT STDMETHODCALLTYPE CorProfiler::Shutdown()
         this->corProfilerInfo->Release();
         this->corProfilerInfo = nullptr;
         delete instrumenter;
+        delete moduleCache;
     }
 
     if (!protocol->shutdown()) return E_FAIL;
@@ -152,9 +158,13 @@ HRESULT STDMETHODCALLTYPE CorProfiler::ModuleLoadStarted(ModuleID moduleId)
 
 HRESULT STDMETHODCALLTYPE CorProfiler::ModuleLoadFinished(ModuleID moduleId, HRESULT hrStatus)
 {
-    UNUSED(moduleId);
-    UNUSED(hrStatus);
-    return S_OK;
+    if (FAILED(hrStatus))
+        return S_OK;
+    // NOTE: names are cached once, so that JIT and allocations do not query the runtime about the module
+    HRESULT hr;
+    std::shared_ptr<const ModuleInfo> module;
+    IfFailRet(moduleCache->find(moduleId, module));
+    return instrumenter->instrumentModule(moduleId);
 }
 
 HRESULT STDMETHODCALLTYPE CorProfiler::ModuleUnloadStarted(ModuleID moduleId)
@@ -165,8 +175,9 @@ HRESULT STDMETHODCALLTYPE CorProfiler::ModuleUnloadStarted(ModuleID moduleId)
 
 HRESULT STDMETHODCALLTYPE CorProfiler::ModuleUnloadFinished(ModuleID moduleId, HRESULT hrStatus)
 {
-    UNUSED(moduleId);
     UNUSED(hrStatus);
+    instrumenter->unloadModule(moduleId);
+    moduleCache->unload(moduleId);
     return S_OK;
 }
 
@@ -446,32 +457,14 @@ void CorProfiler::resolveType(ClassID classId, std::vector<bool> &isValid, std::
             tokens.push_back(token);
             typeArgsCount.push_back((int) typeArgsNum);
 
-            LPCBYTE pBaseLoadAddress;
-            ULONG moduleSize;
-            auto moduleName = new WCHAR[0];
-            AssemblyID assemblyId;
-            if (FAILED(this->corProfilerInfo->GetModuleInfo(moduleId, &pBaseLoadAddress, 0, &moduleSize, moduleName, &assemblyId))) FAIL_LOUD("getting module info failed");
-            delete[] moduleName;
-            moduleName = new WCHAR[moduleSize];
-            if (FAILED(this->corProfilerInfo->GetModuleInfo(moduleId, &pBaseLoadAddress, moduleSize, &moduleSize, moduleName, &assemblyId))) FAIL_LOUD("getting module info failed");
-            moduleSizes.push_back((int) moduleSize * (int) sizeof(WCHAR));
-            for (int i = 0; i < moduleSize; ++i) {
-                moduleNames.push_back(moduleName[i]);
-            }
-            delete[] moduleName;
-            ULONG assemblySize;
-            auto assemblyName = new WCHAR[0];
-            AppDomainID appDomainId;
-            ModuleID assemblyModuleId;
-            if (FAILED(this->corProfilerInfo->GetAssemblyInfo(assemblyId, 0, &assemblySize, assemblyName, &appDomainId, &assemblyModuleId))) FAIL_LOUD("getting assembly info failed");
-            delete[] assemblyName;
-            assemblyName = new WCHAR[assemblySize];
-            if (FAILED(this->corProfilerInfo->GetAssemblyInfo(assemblyId, assemblySize, &assemblySize, assemblyName, &appDomainId, &assemblyModuleId))) FAIL_LOUD("getting assembly info failed");
-            assemblySizes.push_back((int) assemblySize * (int) sizeof(WCHAR));
-            for (int i = 0; i < assemblySize; ++i) {
-                assemblyNames.push_back(assemblyName[i]);
-            }
-            delete[] assemblyName;
+            std::shared_ptr<const ModuleInfo> module;
+            if (FAILED(moduleCache->find(moduleId, module))) FAIL_LOUD("getting module info failed");
+            const std::vector<WCHAR> &moduleName = *module->moduleName;
+            moduleSizes.push_back((int) moduleName.size() * (int) sizeof(WCHAR));
+            moduleNames.insert(moduleNames.end(), moduleName.begin(), moduleName.end());
+            const std::vector<WCHAR> &assemblyName = *module->assemblyName;
+            assemblySizes.push_back((int) assemblyName.size() * (int) sizeof(WCHAR));
+            assemblyNames.insert(assemblyNames.end(), assemblyName.begin(), assemblyName.end());
 
             for (int i = 0; i < typeArgsNum; ++i)
                 resolveType(typeArgs[i], isValid, isArray, arrayTypes, tokens, typeArgsCount, moduleNames, moduleSizes, assemblyNames, assemblySizes);
@@ -546,6 +539,9 @@ void CorProfiler::serializeType(const std::vector<bool> &isValid, const std::vec
 
 HRESULT STDMETHODCALLTYPE CorProfiler::ObjectAllocated(ObjectID objectId, ClassID classId)
 {
+    // NOTE: objects, allocated after main is left, are not tracked
+    if (trackingDisabled())
+        return S_OK;
     ULONG size;
     this->corProfilerInfo->GetObjectSize(objectId, &size);
 
@@ -9,6 +9,7 @@
 namespace vsharp {
 
 class Instrumenter;
+class ModuleCache;
 class Protocol;
 
 class CorProfiler : public ICorProfilerCallback8
@@ -17,6 +18,7 @@ private:
     std::atomic<int> refCount;
     ICorProfilerInfo8 *corProfilerInfo;
     Instrumenter *instrumenter;
+    ModuleCache *moduleCache;
     Protocol *protocol;
 
     void resolveType(ClassID classId, std::vector<bool> &isValid, std::vector<bool> &isArray, std::vector<std::pair<CorElementType, int>> &arrayTypes, std::vector<mdTypeDef> &tokens, std::vector<int> &typeArgsCount, std::vector<WCHAR> &moduleNames, std::vector<int> &moduleSizes, std::vector<WCHAR> &assemblyNames, std::vector<int> &assemblySizes);
@@ -0,0 +1,113 @@
+#ifndef FUSEDMEMPROBES_H_
+#define FUSEDMEMPROBES_H_
+
+#include "cor.h"
+#include "memory/memory.h"
+#include "probeRegistry.h"
+
+// Fused Mem probes store several evaluation stack operands into mem buffer with a single call.
+// For every arity from 2 up to this bound a probe is generated for each sequence of operand kinds,
+// so the amount of generated probes is 7^2 + ... + 7^MEM_FUSED_MAX_ARITY.
+// NOTE: every probe gets a signature token in each instrumented module, so the bound keeps it to 392 probes (4 would
+//       add 2401 more), while instructions, which pop more than 3 cells, are rare. SILI learns the bound from the probes
+#define MEM_FUSED_MAX_ARITY 3
+
+namespace vsharp {
+
+// NOTE: INT64 and INT_PTR may be the same C++ type, so operand kinds are described by tags, not by argument types
+struct MemI1 {
+    typedef INT8 type;
+    static void mem(type value) { mem_i1(value); }
+};
+struct MemI2 {
+    typedef INT16 type;
+    static void mem(type value) { mem_i2(value); }
+};
+struct MemI4 {
+    typedef INT32 type;
+    static void mem(type value) { mem_i4(value); }
+};
+struct MemI8 {
+    typedef ProbeI8 type;
+    static void mem(type value) { mem_i8(value); }
+};
+struct MemF4 {
+    typedef FLOAT type;
+    static void mem(type value) { mem_f4(value); }
+};
+struct MemF8 {
+    typedef DOUBLE type;
+    static void mem(type value) { mem_f8(value); }
+};
+struct MemP {
+    typedef INT_PTR type;
+    static void mem(type value) { mem_p(value); }
+};
+
+template<typename... Kinds>
+struct MemKindsList {};
+
+// NOTE: order of kinds defines the order of generated probes, SILI relies on it
+typedef MemKindsList<MemI1, MemI2, MemI4, MemI8, MemF4, MemF8, MemP> MemKinds;
+
+// Clears mem buffer after the responses of pipelined commands are read, see probes.h
+void joinAndClearMem();
+
+template<typename... Kinds>
+void STDMETHODCALLTYPE Mem(typename Kinds::type... args) {
+    joinAndClearMem();
+    // NOTE: elements of braced initializer are evaluated from left to right, so i-th argument gets mem index i
+    int unused[] = { 0, (Kinds::mem(args), 0)... };
+    (void) unused;
+}
+
+// Calls 'visitor.template visit<Prefix..., K1, ..., KLeft>()' for every sequence of 'Left' kinds from 'Rest' and then MemKinds,
+// sequences are enumerated in lexicographic order
+template<int Left, typename Prefix, typename Rest = MemKinds>
+struct MemKindsEnumerator;
+
+template<typename... Prefix>
+struct MemKindsEnumerator<0, MemKindsList<Prefix...>, MemKinds> {
+    template<typename Visitor>
+    static void visit(Visitor &visitor) { visitor.template visit<Prefix...>(); }
+};
+
+template<int Left, typename... Prefix, typename Kind, typename... Kinds>
+struct MemKindsEnumerator<Left, MemKindsList<Prefix...>, MemKindsList<Kind, Kinds...>> {
+    template<typename Visitor>
+    static void visit(Visitor &visitor) {
+        MemKindsEnumerator<Left - 1, MemKindsList<Prefix..., Kind>>::visit(visitor);
+        MemKindsEnumerator<Left, MemKindsList<Prefix...>, MemKindsList<Kinds...>>::visit(visitor);
+    }
+};
+
+template<int Left, typename... Prefix>
+struct MemKindsEnumerator<Left, MemKindsList<Prefix...>, MemKindsList<>> {
+    template<typename Visitor>
+    static void visit(Visitor &) {}
+};
+
+template<int Arity>
+struct FusedMemEnumerator {
+    template<typename Visitor>
+    static void visit(Visitor &visitor) {
+        FusedMemEnumerator<Arity - 1>::visit(visitor);
+        MemKindsEnumerator<Arity, MemKindsList<>>::visit(visitor);
+    }
+};
+
+template<>
+struct FusedMemEnumerator<1> {
+    template<typename Visitor>
+    static void visit(Visitor &) {}
+};
+
+// Visits all fused Mem probes: first by arity, then in lexicographic order of operand kinds
+template<typename Visitor>
+void forEachFusedMem(Visitor &visitor) {
+    FusedMemEnumerator<MEM_FUSED_MAX_ARITY>::visit(visitor);
+}
+
+}
+
+#endif // FUSEDMEMPROBES_H_
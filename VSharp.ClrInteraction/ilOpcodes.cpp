@@ -0,0 +1,168 @@
+#include "ilOpcodes.h"
+#include <cstring>
+#include <map>
+
+using namespace vsharp;
+
+// NOTE: columns of opcode.def are turned into the numbers, which are needed here: operand kinds into operand sizes,
+//       stack behaviours into amounts of values. Variable behaviour stays negative in sums
+#define InlineNone 0
+#define ShortInlineVar 1
+#define InlineVar 2
+#define ShortInlineI 1
+#define InlineI 4
+#define InlineI8 8
+#define ShortInlineR 4
+#define InlineR 8
+#define InlineMethod 4
+#define InlineSig 4
+#define ShortInlineBrTarget 1
+#define InlineBrTarget 4
+#define InlineSwitch VariableOperandSize
+#define InlineType 4
+#define InlineString 4
+#define InlineField 4
+#define InlineTok 4
+#define InlinePhi VariableOperandSize
+
+#define Pop0 0
+#define Pop1 1
+#define PopI 1
+#define PopI8 1
+#define PopR4 1
+#define PopR8 1
+#define PopRef 1
+#define VarPop (-1000)
+
+#define Push0 0
+#define Push1 1
+#define PushI 1
+#define PushI8 1
+#define PushR4 1
+#define PushR8 1
+#define PushRef 1
+#define VarPush (-1000)
+
+struct OpcodeDefinition {
+    const char *name;
+    int pops;
+    int pushes;
+    int operandSize;
+    unsigned length;
+    unsigned char first;
+    unsigned char second;
+};
+
+static const OpcodeDefinition definitions[] = {
+#define OPDEF(c, s, pop, push, args, type, l, s1, s2, ctrl) { s, pop, push, args, l, s1, s2 },
+#include "opcode.def"
+#undef OPDEF
+};
+
+struct OpcodeTables {
+    ILOpcode opcodes[sizeof(definitions) / sizeof(definitions[0])];
+    const ILOpcode *oneByte[256];
+    const ILOpcode *twoByte[256];
+
+    OpcodeTables() {
+        memset(oneByte, 0, sizeof(oneByte));
+        memset(twoByte, 0, sizeof(twoByte));
+        unsigned i = 0;
+        for (const OpcodeDefinition &definition : definitions) {
+            // NOTE: internal opcodes of the runtime have no encoding, prefixes of two-byte opcodes are not instructions
+            bool singleByte = definition.length == 1 && definition.first == 0xFF;
+            bool doubleByte = definition.length == 2 && definition.first == 0xFE;
+            if ((!singleByte && !doubleByte) || (singleByte && definition.second >= 0xF7))
+                continue;
+            ILOpcode &opcode = opcodes[i++];
+            opcode.name = definition.name;
+            opcode.value = singleByte ? definition.second : (unsigned short) (0xFE00 | definition.second);
+            opcode.operandSize = definition.operandSize;
+            opcode.pops = definition.pops < 0 ? VariableStackBehaviour : definition.pops;
+            opcode.pushes = definition.pushes < 0 ? VariableStackBehaviour : definition.pushes;
+            (singleByte ? oneByte : twoByte)[definition.second] = &opcode;
+        }
+    }
+};
+
+static const OpcodeTables &opcodeTables() {
+    static const OpcodeTables tables;
+    return tables;
+}
+
+unsigned vsharp::decodeILInstruction(const char *code, unsigned codeLength, unsigned offset, const ILOpcode *&opcode) {
+    const OpcodeTables &tables = opcodeTables();
+    if (offset >= codeLength) return 0;
+    unsigned char first = (unsigned char) code[offset];
+    unsigned length = 1;
+    if (first == 0xFE) {
+        if (offset + 1 >= codeLength) return 0;
+        opcode = tables.twoByte[(unsigned char) code[offset + 1]];
+        length = 2;
+    } else {
+        opcode = tables.oneByte[first];
+    }
+    if (!opcode) return 0;
+    if (opcode->operandSize == VariableOperandSize) {
+        // NOTE: operand of 'switch' is the amount of targets followed by the targets
+        unsigned targetsCount;
+        if (offset + length + sizeof(unsigned) > codeLength) return 0;
+        memcpy(&targetsCount, code + offset + length, sizeof(unsigned));
+        if (targetsCount > (codeLength - offset - length - sizeof(unsigned)) / sizeof(int)) return 0;
+        length += sizeof(unsigned) + targetsCount * sizeof(int);
+    } else {
+        length += opcode->operandSize;
+    }
+    return offset + length <= codeLength ? length : 0;
+}
+
+bool vsharp::relocateProbes(char *code, unsigned codeLength,
+                            const std::vector<unsigned long long> &oldAddresses, const std::vector<unsigned long long> &newAddresses,
+                            const std::vector<unsigned> &oldTokens, const std::vector<unsigned> &newTokens) {
+    std::map<unsigned long long, unsigned long long> addresses;
+    for (size_t i = 0; i < oldAddresses.size() && i < newAddresses.size(); ++i)
+        addresses[oldAddresses[i]] = newAddresses[i];
+    std::map<unsigned, unsigned> tokens;
+    for (size_t i = 0; i < oldTokens.size() && i < newTokens.size(); ++i)
+        tokens[oldTokens[i]] = newTokens[i];
+    // NOTE: only 'ldc.i8', which is followed by 'calli', is a probe address, other constants may coincide with addresses
+    char *previousAddress = nullptr;
+    unsigned offset = 0;
+    while (offset < codeLength) {
+        const ILOpcode *opcode;
+        unsigned length = decodeILInstruction(code, codeLength, offset, opcode);
+        if (!length) return false;
+        char *operand = code + offset + 1;
+        if (opcode->value == ILOpcodeCalli && previousAddress) {
+            unsigned long long address;
+            memcpy(&address, previousAddress, sizeof(address));
+            auto relocatedAddress = addresses.find(address);
+            if (relocatedAddress != addresses.end())
+                memcpy(previousAddress, &relocatedAddress->second, sizeof(address));
+            unsigned token;
+            memcpy(&token, operand, sizeof(token));
+            auto relocatedToken = tokens.find(token);
+            if (relocatedToken != tokens.end())
+                memcpy(operand, &relocatedToken->second, sizeof(token));
+        }
+        previousAddress = opcode->value == ILOpcodeLdcI8 ? operand : nullptr;
+        offset += length;
+    }
+    return true;
+}
+
+bool vsharp::collectCallees(const char *code, unsigned codeLength, std::vector<unsigned> &tokens) {
+    unsigned offset = 0;
+    while (offset < codeLength) {
+        const ILOpcode *opcode;
+        unsigned length = decodeILInstruction(code, codeLength, offset, opcode);
+        if (!length) return false;
+        if (opcode->value == ILOpcodeCall || opcode->value == ILOpcodeCallvirt || opcode->value == ILOpcodeNewobj) {
+            unsigned token;
+            memcpy(&token, code + offset + 1, sizeof(token));
+            tokens.push_back(token);
+        }
+        offset += length;
+    }
+    return true;
+}
@@ -0,0 +1,87 @@
+#ifndef ILOPCODES_H_
+#define ILOPCODES_H_
+
+#include <vector>
+
+namespace vsharp {
+
+const int VariableOperandSize = -1;
+const int VariableStackBehaviour = -1;
+
+// NOTE: values are the encodings of opcodes, see 'ILOpcode::value'
+const unsigned short ILOpcodeNop = 0x00;
+const unsigned short ILOpcodeBreak = 0x01;
+const unsigned short ILOpcodeLdarg0 = 0x02;
+const unsigned short ILOpcodeLdarg3 = 0x05;
+const unsigned short ILOpcodeLdloc0 = 0x06;
+const unsigned short ILOpcodeLdloc3 = 0x09;
+const unsigned short ILOpcodeStloc0 = 0x0A;
+const unsigned short ILOpcodeStloc3 = 0x0D;
+const unsigned short ILOpcodeLdargS = 0x0E;
+const unsigned short ILOpcodeLdargaS = 0x0F;
+const unsigned short ILOpcodeStargS = 0x10;
+const unsigned short ILOpcodeLdlocS = 0x11;
+const unsigned short ILOpcodeLdlocaS = 0x12;
+const unsigned short ILOpcodeStlocS = 0x13;
+const unsigned short ILOpcodeLdnull = 0x14;
+const unsigned short ILOpcodeLdcI4M1 = 0x15;
+const unsigned short ILOpcodeLdcI4 = 0x20;
+const unsigned short ILOpcodeLdcI8 = 0x21;
+const unsigned short ILOpcodeLdcR8 = 0x23;
+const unsigned short ILOpcodeDup = 0x25;
+const unsigned short ILOpcodePop = 0x26;
+const unsigned short ILOpcodeCall = 0x28;
+const unsigned short ILOpcodeCalli = 0x29;
+const unsigned short ILOpcodeRet = 0x2A;
+const unsigned short ILOpcodeBrS = 0x2B;
+const unsigned short ILOpcodeBrfalseS = 0x2C;
+const unsigned short ILOpcodeBrtrueS = 0x2D;
+const unsigned short ILOpcodeBltUnS = 0x37;
+const unsigned short ILOpcodeBr = 0x38;
+const unsigned short ILOpcodeBrfalse = 0x39;
+const unsigned short ILOpcodeBrtrue = 0x3A;
+const unsigned short ILOpcodeBltUn = 0x44;
+const unsigned short ILOpcodeSwitch = 0x45;
+const unsigned short ILOpcodeCallvirt = 0x6F;
+const unsigned short ILOpcodeNewobj = 0x73;
+const unsigned short ILOpcodeThrow = 0x7A;
+const unsigned short ILOpcodeLdtoken = 0xD0;
+const unsigned short ILOpcodeConvI = 0xD3;
+const unsigned short ILOpcodeEndfinally = 0xDC;
+const unsigned short ILOpcodeLeave = 0xDD;
+const unsigned short ILOpcodeLeaveS = 0xDE;
+const unsigned short ILOpcodeLdarg = 0xFE09;
+const unsigned short ILOpcodeLdarga = 0xFE0A;
+const unsigned short ILOpcodeStarg = 0xFE0B;
+const unsigned short ILOpcodeLdloc = 0xFE0C;
+const unsigned short ILOpcodeLdloca = 0xFE0D;
+const unsigned short ILOpcodeStloc = 0xFE0E;
+
+// Properties of IL opcode, which are taken from opcode.def of the runtime
+struct ILOpcode {
+    const char *name;
+    // Single-byte opcodes are their byte, two-byte ones are 0xFE00 | second byte
+    unsigned short value;
+    // Size of the inline operand in bytes, 'switch' has the variable one
+    int operandSize;
+    // Amounts of values, which are popped from and pushed onto the evaluation stack; calls depend on the signature
+    int pops;
+    int pushes;
+};
+
+// Decodes the instruction at 'offset'. Returns the length of the instruction or 0, if the code is malformed
+unsigned decodeILInstruction(const char *code, unsigned codeLength, unsigned offset, const ILOpcode *&opcode);
+
+// NOTE: instrumented code calls probes via 'ldc.i8 <address of probe>' and 'calli <signature token>'. Addresses differ between
+//       runs and tokens differ between modules, so code, which was instrumented before, is relocated: in every such pair
+//       i-th of 'oldAddresses' becomes i-th of 'newAddresses', the same for the tokens. Returns false, if the code is malformed
+bool relocateProbes(char *code, unsigned codeLength,
+                    const std::vector<unsigned long long> &oldAddresses, const std::vector<unsigned long long> &newAddresses,
+                    const std::vector<unsigned> &oldTokens, const std::vector<unsigned> &newTokens);
+
+// Appends the operands of 'call', 'callvirt' and 'newobj' instructions to 'tokens'. Returns false, if the code is malformed
+bool collectCallees(const char *code, unsigned codeLength, std::vector<unsigned> &tokens);
+
+}
+
+#endif // ILOPCODES_H_
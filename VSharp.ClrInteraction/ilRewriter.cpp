@@ -0,0 +1,596 @@
+#include "ilRewriter.h"
+#include "ilOpcodes.h"
+#include "logging.h"
+#include "probeRegistry.h"
+#include <cstdlib>
+#include <cstring>
+
+using namespace vsharp;
+
+// NOTE: names are in the order of 'ProbeId'
+enum ProbeId {
+    EnterProbe, LeaveProbe, ThrowProbe, BrTrueProbe, BrFalseProbe, SwitchProbe,
+    Ldarg0Probe, Ldarg1Probe, Ldarg2Probe, Ldarg3Probe, LdargSProbe, LdargProbe, LdargaProbe,
+    Ldloc0Probe, Ldloc1Probe, Ldloc2Probe, Ldloc3Probe, LdlocSProbe, LdlocProbe, LdlocaProbe,
+    StargSProbe, StargProbe, Stloc0Probe, Stloc1Probe, Stloc2Probe, Stloc3Probe, StlocSProbe, StlocProbe,
+    LdcProbe, PopProbe, LdtokenProbe,
+    Mem4Probe, Mem8Probe, MemF4Probe, MemF8Probe, MemPProbe,
+    Unmem4Probe, Unmem8Probe, UnmemF4Probe, UnmemF8Probe, UnmemPProbe,
+    ProbesCount
+};
+
+static const char *const probeNames[ProbesCount] = {
+    "Track_Enter", "Track_Leave", "Track_Throw", "BrTrue", "BrFalse", "Switch",
+    "Track_Ldarg_0", "Track_Ldarg_1", "Track_Ldarg_2", "Track_Ldarg_3", "Track_Ldarg_S", "Track_Ldarg", "Track_Ldarga",
+    "Track_Ldloc_0", "Track_Ldloc_1", "Track_Ldloc_2", "Track_Ldloc_3", "Track_Ldloc_S", "Track_Ldloc", "Track_Ldloca",
+    "Track_Starg_S", "Track_Starg", "Track_Stloc_0", "Track_Stloc_1", "Track_Stloc_2", "Track_Stloc_3", "Track_Stloc_S", "Track_Stloc",
+    "Track_Ldc", "Track_Pop", "Track_Ldtoken",
+    "Mem_4_idx", "Mem_8_idx", "Mem_f4_idx", "Mem_f8_idx", "Mem_p_idx",
+    "Unmem_4", "Unmem_8", "Unmem_f4", "Unmem_f8", "Unmem_p"
+};
+
+// Kind of the evaluation stack cell, which is stored into a local or an argument. It chooses Mem and Unmem probes
+enum CellKind {
+    UnsupportedCell,
+    Int32Cell,
+    Int64Cell,
+    Float32Cell,
+    Float64Cell,
+    NativeIntCell,
+    ReferenceCell
+};
+
+class SignatureReader {
+private:
+    PCCOR_SIGNATURE m_current;
+    PCCOR_SIGNATURE m_end;
+
+    bool peek(unsigned char &value) const {
+        if (m_current >= m_end) return false;
+        value = *m_current;
+        return true;
+    }
+
+    bool readByte(unsigned char &value) {
+        if (!peek(value)) return false;
+        ++m_current;
+        return true;
+    }
+
+    // NOTE: compressed integers take 1, 2 or 4 bytes, their length is encoded in the high bits of the first byte
+    bool readNumber(ULONG &value) {
+        unsigned char first;
+        if (!readByte(first)) return false;
+        unsigned length = (first & 0x80) == 0 ? 1 : (first & 0xC0) == 0x80 ? 2 : (first & 0xE0) == 0xC0 ? 4 : 0;
+        if (!length || m_end - m_current < (ptrdiff_t) length - 1) return false;
+        value = length == 1 ? first : length == 2 ? first & 0x3F : first & 0x1F;
+        for (unsigned i = 1; i < length; ++i)
+            value = (value << 8) | *m_current++;
+        return true;
+    }
+
+    bool skipCustomModifiers() {
+        unsigned char type;
+        ULONG token;
+        while (peek(type) && (type == ELEMENT_TYPE_CMOD_REQD || type == ELEMENT_TYPE_CMOD_OPT)) {
+            ++m_current;
+            if (!readNumber(token)) return false;
+        }
+        return true;
+    }
+
+    bool readReturnType(bool &returnsValue) {
+        unsigned char type;
+        if (!skipCustomModifiers() || !peek(type)) return false;
+        returnsValue = type != ELEMENT_TYPE_VOID;
+        if (returnsValue) {
+            CellKind kind;
+            return readType(kind);
+        }
+        ++m_current;
+        return true;
+    }
+
+public:
+    SignatureReader(PCCOR_SIGNATURE signature, ULONG length) : m_current(signature), m_end(signature + length) {}
+
+    bool readType(CellKind &kind) {
+        unsigned char type;
+        ULONG number;
+        CellKind inner;
+        if (!skipCustomModifiers() || !readByte(type)) return false;
+        switch (type) {
+            case ELEMENT_TYPE_BOOLEAN:
+            case ELEMENT_TYPE_CHAR:
+            case ELEMENT_TYPE_I1:
+            case ELEMENT_TYPE_U1:
+            case ELEMENT_TYPE_I2:
+            case ELEMENT_TYPE_U2:
+            case ELEMENT_TYPE_I4:
+            case ELEMENT_TYPE_U4:
+                kind = Int32Cell;
+                return true;
+            case ELEMENT_TYPE_I8:
+            case ELEMENT_TYPE_U8:
+                kind = Int64Cell;
+                return true;
+            case ELEMENT_TYPE_R4:
+                kind = Float32Cell;
+                return true;
+            case ELEMENT_TYPE_R8:
+                kind = Float64Cell;
+                return true;
+            case ELEMENT_TYPE_I:
+            case ELEMENT_TYPE_U:
+                kind = NativeIntCell;
+                return true;
+            case ELEMENT_TYPE_PTR: {
+                kind = NativeIntCell;
+                unsigned char pointee;
+                if (!skipCustomModifiers() || !peek(pointee)) return false;
+                if (pointee == ELEMENT_TYPE_VOID) {
+                    ++m_current;
+                    return true;
+                }
+                return readType(inner);
+            }
+            case ELEMENT_TYPE_FNPTR: {
+                kind = NativeIntCell;
+                bool hasThis, returnsValue;
+                std::vector<CellKind> parameters;
+                return readMethod(hasThis, parameters, returnsValue);
+            }
+            case ELEMENT_TYPE_STRING:
+            case ELEMENT_TYPE_OBJECT:
+                kind = ReferenceCell;
+                return true;
+            case ELEMENT_TYPE_CLASS:
+                kind = ReferenceCell;
+                return readNumber(number);
+            case ELEMENT_TYPE_SZARRAY:
+                kind = ReferenceCell;
+                return readType(inner);
+            case ELEMENT_TYPE_ARRAY: {
+                kind = ReferenceCell;
+                ULONG rank, sizes, bounds;
+                if (!readType(inner) || !readNumber(rank) || !readNumber(sizes)) return false;
+                for (ULONG i = 0; i < sizes; ++i)
+                    if (!readNumber(number)) return false;
+                if (!readNumber(bounds)) return false;
+                for (ULONG i = 0; i < bounds; ++i)
+                    if (!readNumber(number)) return false;
+                return true;
+            }
+            case ELEMENT_TYPE_GENERICINST: {
+                unsigned char generic;
+                ULONG count;
+                if (!readByte(generic) || !readNumber(number) || !readNumber(count)) return false;
+                kind = generic == ELEMENT_TYPE_CLASS ? ReferenceCell : UnsupportedCell;
+                for (ULONG i = 0; i < count; ++i)
+                    if (!readType(inner)) return false;
+                return generic == ELEMENT_TYPE_CLASS || generic == ELEMENT_TYPE_VALUETYPE;
+            }
+            // NOTE: structs, generic parameters and managed pointers can not be passed to Mem probes
+            case ELEMENT_TYPE_VALUETYPE:
+            case ELEMENT_TYPE_VAR:
+            case ELEMENT_TYPE_MVAR:
+                kind = UnsupportedCell;
+                return readNumber(number);
+            case ELEMENT_TYPE_BYREF:
+            case ELEMENT_TYPE_PINNED:
+                kind = UnsupportedCell;
+                return readType(inner);
+            case ELEMENT_TYPE_TYPEDBYREF:
+                kind = UnsupportedCell;
+                return true;
+            default:
+                return false;
+        }
+    }
+
+    bool readMethod(bool &hasThis, std::vector<CellKind> &parameters, bool &returnsValue) {
+        unsigned char convention;
+        ULONG count;
+        if (!readByte(convention)) return false;
+        if ((convention & IMAGE_CEE_CS_CALLCONV_GENERIC) && !readNumber(count)) return false;
+        if (!readNumber(count) || !readReturnType(returnsValue)) return false;
+        // NOTE: explicit 'this' is the first parameter of the signature
+        hasThis = (convention & IMAGE_CEE_CS_CALLCONV_HASTHIS) && !(convention & IMAGE_CEE_CS_CALLCONV_EXPLICITTHIS);
+        parameters.resize(count);
+        for (ULONG i = 0; i < count; ++i) {
+            unsigned char type;
+            if (peek(type) && type == ELEMENT_TYPE_SENTINEL) ++m_current;
+            if (!readType(parameters[i])) return false;
+        }
+        return true;
+    }
+
+    bool readLocals(std::vector<CellKind> &locals) {
+        unsigned char convention;
+        ULONG count;
+        if (!readByte(convention) || convention != IMAGE_CEE_CS_CALLCONV_LOCAL_SIG || !readNumber(count)) return false;
+        locals.resize(count);
+        for (ULONG i = 0; i < count; ++i)
+            if (!readType(locals[i])) return false;
+        return true;
+    }
+};
+
+// Original instruction with the probes, which are placed around it
+struct RewrittenInstruction {
+    unsigned offset;
+    unsigned length;
+    unsigned short opcode;
+    // NOTE: branches to the instruction come to the probes before it, the same as in 'Instrumenter.fs'
+    std::vector<char> before;
+    std::vector<char> after;
+    // Original offsets of the branch targets, the operand is encoded again after the layout
+    std::vector<unsigned> targets;
+    bool longBranch;
+    unsigned newOffset;
+
+    unsigned size() const {
+        unsigned instructionSize = targets.empty() || opcode == ILOpcodeSwitch ? length : longBranch ? 5 : 2;
+        return (unsigned) before.size() + instructionSize + (unsigned) after.size();
+    }
+};
+
+class ProbeWriter {
+private:
+    const std::vector<int> &m_slots;
+    const char *m_signatureTokens;
+
+public:
+    ProbeWriter(const std::vector<int> &slots, const char *signatureTokens) : m_slots(slots), m_signatureTokens(signatureTokens) {}
+
+    void arg(std::vector<char> &code, INT32 value) const {
+        code.push_back((char) ILOpcodeLdcI4);
+        code.insert(code.end(), (const char *) &value, (const char *) &value + sizeof(value));
+    }
+
+    void call(std::vector<char> &code, ProbeId probe) const {
+        const ProbeInfo &info = probesTable()[m_slots[probe]];
+        if (sizeof(void *) == sizeof(INT64)) {
+            INT64 address = (INT64) info.address;
+            code.push_back((char) ILOpcodeLdcI8);
+            code.insert(code.end(), (const char *) &address, (const char *) &address + sizeof(address));
+        } else {
+            arg(code, (INT32) info.address);
+        }
+        code.push_back((char) ILOpcodeCalli);
+        code.insert(code.end(), m_signatureTokens + m_slots[probe] * sizeof(mdSignature),
+                    m_signatureTokens + (m_slots[probe] + 1) * sizeof(mdSignature));
+    }
+
+    // NOTE: stored value goes through mem buffer, the same as in 'Instrumenter.fs': Mem probe takes it and Unmem puts it back
+    bool memUnmem(std::vector<char> &code, CellKind kind) const {
+        ProbeId mem, unmem;
+        switch (kind) {
+            case Int32Cell: mem = Mem4Probe; unmem = Unmem4Probe; break;
+            case Int64Cell: mem = Mem8Probe; unmem = Unmem8Probe; break;
+            case Float32Cell: mem = MemF4Probe; unmem = UnmemF4Probe; break;
+            case Float64Cell: mem = MemF8Probe; unmem = UnmemF8Probe; break;
+            case NativeIntCell:
+            case ReferenceCell:
+                code.push_back((char) ILOpcodeConvI);
+                mem = MemPProbe; unmem = UnmemPProbe;
+                break;
+            default:
+                return false;
+        }
+        arg(code, 0);
+        arg(code, 0);
+        call(code, mem);
+        arg(code, 0);
+        call(code, unmem);
+        return true;
+    }
+};
+
+static void emitOpcode(std::vector<char> &code, unsigned short opcode) {
+    if (opcode > 0xFF) code.push_back((char) 0xFE);
+    code.push_back((char) (opcode & 0xFF));
+}
+
+static bool isShortBranch(unsigned short opcode) {
+    return (opcode >= ILOpcodeBrS && opcode <= ILOpcodeBltUnS) || opcode == ILOpcodeLeaveS;
+}
+
+static unsigned short longBranchOf(unsigned short opcode) {
+    return opcode == ILOpcodeLeaveS ? (unsigned short) ILOpcodeLeave : (unsigned short) (opcode - ILOpcodeBrS + ILOpcodeBr);
+}
+
+// Places probes of the instruction, returns false, if the instruction is not supported
+static bool placeProbes(const ILMethod &method, const std::vector<CellKind> &arguments, bool returnsValue,
+                        const std::vector<CellKind> &locals, const ProbeWriter &probes, RewrittenInstruction &instruction) {
+    const unsigned char *operand = (const unsigned char *) method.code + instruction.offset + (instruction.opcode > 0xFF ? 2 : 1);
+    UINT16 index = 0;
+    if (instruction.length - (instruction.opcode > 0xFF ? 2 : 1) == sizeof(UINT8)) index = *operand;
+    else if (instruction.length - (instruction.opcode > 0xFF ? 2 : 1) == sizeof(UINT16)) memcpy(&index, operand, sizeof(index));
+    INT32 offset = (INT32) instruction.offset;
+    std::vector<char> &before = instruction.before;
+    std::vector<char> &after = instruction.after;
+    switch (instruction.opcode) {
+        case ILOpcodeNop:
+        case ILOpcodeBreak:
+        case ILOpcodeBrS:
+        case ILOpcodeBr:
+        case ILOpcodeLeaveS:
+        case ILOpcodeLeave:
+        case ILOpcodeEndfinally:
+            return true;
+        case ILOpcodeLdarg0:
+        case ILOpcodeLdarg0 + 1:
+        case ILOpcodeLdarg0 + 2:
+        case ILOpcodeLdarg3:
+            probes.arg(after, offset);
+            probes.call(after, (ProbeId) (Ldarg0Probe + instruction.opcode - ILOpcodeLdarg0));
+            return true;
+        case ILOpcodeLdloc0:
+        case ILOpcodeLdloc0 + 1:
+        case ILOpcodeLdloc0 + 2:
+        case ILOpcodeLdloc3:
+            probes.arg(after, offset);
+            probes.call(after, (ProbeId) (Ldloc0Probe + instruction.opcode - ILOpcodeLdloc0));
+            return true;
+        case ILOpcodeLdargS:
+        case ILOpcodeLdarg:
+        case ILOpcodeLdlocS:
+        case ILOpcodeLdloc:
+            probes.arg(after, index);
+            probes.arg(after, offset);
+            probes.call(after, instruction.opcode == ILOpcodeLdargS ? LdargSProbe : instruction.opcode == ILOpcodeLdarg ? LdargProbe
+                             : instruction.opcode == ILOpcodeLdlocS ? LdlocSProbe : LdlocProbe);
+            return true;
+        case ILOpcodeLdargaS:
+        case ILOpcodeLdarga:
+        case ILOpcodeLdlocaS:
+        case ILOpcodeLdloca:
+            after.push_back((char) ILOpcodeDup);
+            probes.arg(after, index);
+            probes.call(after, instruction.opcode == ILOpcodeLdargaS || instruction.opcode == ILOpcodeLdarga ? LdargaProbe : LdlocaProbe);
+            return true;
+        case ILOpcodeStloc0:
+        case ILOpcodeStloc0 + 1:
+        case ILOpcodeStloc0 + 2:
+        case ILOpcodeStloc3:
+            index = (UINT16) (instruction.opcode - ILOpcodeStloc0);
+            if (index >= locals.size() || !probes.memUnmem(before, locals[index])) return false;
+            probes.arg(after, offset);
+            probes.call(after, (ProbeId) (Stloc0Probe + index));
+            return true;
+        case ILOpcodeStlocS:
+        case ILOpcodeStloc:
+            if (index >= locals.size() || !probes.memUnmem(before, locals[index])) return false;
+            probes.arg(after, index);
+            probes.arg(after, offset);
+            probes.call(after, instruction.opcode == ILOpcodeStlocS ? StlocSProbe : StlocProbe);
+            return true;
+        case ILOpcodeStargS:
+        case ILOpcodeStarg:
+            if (index >= arguments.size() || !probes.memUnmem(before, arguments[index])) return false;
+            probes.arg(after, index);
+            probes.arg(after, offset);
+            probes.call(after, instruction.opcode == ILOpcodeStargS ? StargSProbe : StargProbe);
+            return true;
+        case ILOpcodeLdnull:
+        case ILOpcodeLdcI4M1:
+        case ILOpcodeLdcI4M1 + 1:
+        case ILOpcodeLdcI4M1 + 2:
+        case ILOpcodeLdcI4M1 + 3:
+        case ILOpcodeLdcI4M1 + 4:
+        case ILOpcodeLdcI4M1 + 5:
+        case ILOpcodeLdcI4M1 + 6:
+        case ILOpcodeLdcI4M1 + 7:
+        case ILOpcodeLdcI4M1 + 8:
+        case ILOpcodeLdcI4M1 + 9:
+        case ILOpcodeLdcI4M1 + 10:
+        case ILOpcodeLdcI4:
+        case ILOpcodeLdcI8:
+        case ILOpcodeLdcI8 + 1:
+        case ILOpcodeLdcR8:
+            probes.call(after, LdcProbe);
+            return true;
+        case ILOpcodePop:
+            probes.call(after, PopProbe);
+            return true;
+        case ILOpcodeLdtoken:
+            probes.call(after, LdtokenProbe);
+            return true;
+        case ILOpcodeBrfalseS:
+        case ILOpcodeBrfalse:
+        case ILOpcodeBrtrueS:
+        case ILOpcodeBrtrue:
+        case ILOpcodeSwitch:
+            probes.arg(before, offset);
+            probes.call(before, instruction.opcode == ILOpcodeSwitch ? SwitchProbe
+                              : instruction.opcode == ILOpcodeBrfalseS || instruction.opcode == ILOpcodeBrfalse ? BrFalseProbe : BrTrueProbe);
+            return true;
+        case ILOpcodeRet:
+            probes.arg(before, returnsValue ? 1 : 0);
+            probes.arg(before, offset);
+            probes.call(before, LeaveProbe);
+            return true;
+        case ILOpcodeThrow:
+            probes.arg(before, offset);
+            probes.call(before, ThrowProbe);
+            return true;
+        default:
+            return false;
+    }
+}
+
+static bool readTargets(const ILMethod &method, const ILOpcode &opcode, RewrittenInstruction &instruction) {
+    unsigned next = instruction.offset + instruction.length;
+    const char *operand = method.code + instruction.offset + 1;
+    if (opcode.value == ILOpcodeSwitch) {
+        UINT32 count;
+        memcpy(&count, operand, sizeof(count));
+        for (UINT32 i = 0; i < count; ++i) {
+            INT32 delta;
+            memcpy(&delta, operand + sizeof(count) + i * sizeof(delta), sizeof(delta));
+            instruction.targets.push_back(next + delta);
+        }
+    } else if (opcode.operandSize == sizeof(INT8)) {
+        instruction.targets.push_back(next + (INT8) *operand);
+    } else {
+        INT32 delta;
+        memcpy(&delta, operand, sizeof(delta));
+        instruction.targets.push_back(next + delta);
+    }
+    instruction.longBranch = opcode.operandSize == sizeof(INT32);
+    return true;
+}
+
+ILRewriter::ILRewriter()
+    : m_slots(ProbesCount)
+    , m_enabled(true)
+{
+    const char *mode = getenv("CONCOLIC_NATIVE_INSTRUMENTATION");
+    if (mode && !strcmp(mode, "0")) {
+        m_enabled = false;
+        return;
+    }
+    for (int i = 0; i < ProbesCount; ++i) {
+        m_slots[i] = probeSlot(probeNames[i]);
+        if (m_slots[i] < 0) {
+            LOG_ERROR(tout << "Probe " << probeNames[i] << " is not registered, native instrumentation is disabled");
+            m_enabled = false;
+        }
+    }
+}
+
+bool ILRewriter::enabled() const {
+    return m_enabled;
+}
+
+bool ILRewriter::rewrite(const ILMethod &method, const char *signatureTokens, unsigned signatureTokensLength, std::vector<char> &code,
+                         std::vector<IMAGE_COR_ILMETHOD_SECT_EH_CLAUSE_FAT> &ehs, unsigned &maxStackSize) const {
+    if (!m_enabled || signatureTokensLength < probesTable().size() * sizeof(mdSignature) || !method.codeLength)
+        return false;
+    bool hasThis, returnsValue;
+    std::vector<CellKind> arguments, locals;
+    SignatureReader signature(method.signature, method.signatureLength);
+    if (!signature.readMethod(hasThis, arguments, returnsValue)) return false;
+    // NOTE: 'this' of structs is a managed pointer, the kind of the declaring type is not known here
+    if (hasThis) arguments.insert(arguments.begin(), UnsupportedCell);
+    if (method.localsSignature) {
+        SignatureReader localsSignature(method.localsSignature, method.localsSignatureLength);
+        if (!localsSignature.readLocals(locals)) return false;
+        // NOTE: SILI tracks value-type, generic and byref locals by their types, which are not known here
+        for (CellKind local : locals)
+            if (local == UnsupportedCell) {
+                LOG(tout << "Locals of " << HEX(method.token) << " are left to SILI");
+                return false;
+            }
+    }
+
+    ProbeWriter probes(m_slots, signatureTokens);
+    std::vector<RewrittenInstruction> instructions;
+    std::vector<int> indices(method.codeLength + 1, -1);
+    for (unsigned offset = 0; offset < method.codeLength;) {
+        const ILOpcode *opcode;
+        unsigned length = decodeILInstruction(method.code, method.codeLength, offset, opcode);
+        if (!length) return false;
+        indices[offset] = (int) instructions.size();
+        RewrittenInstruction instruction;
+        instruction.offset = offset;
+        instruction.length = length;
+        instruction.opcode = opcode->value;
+        instruction.longBranch = false;
+        instruction.newOffset = 0;
+        if (!placeProbes(method, arguments, returnsValue, locals, probes, instruction)) {
+            LOG(tout << "Instruction " << opcode->name << " of " << HEX(method.token) << " is left to SILI");
+            return false;
+        }
+        bool isBranch = opcode->value == ILOpcodeSwitch || isShortBranch(opcode->value) || opcode->value == ILOpcodeLeave
+                     || (opcode->value >= ILOpcodeBr && opcode->value <= ILOpcodeBltUn);
+        if (isBranch) readTargets(method, *opcode, instruction);
+        instructions.push_back(instruction);
+        offset += length;
+    }
+    indices[method.codeLength] = (int) instructions.size();
+    for (const RewrittenInstruction &instruction : instructions)
+        for (unsigned target : instruction.targets)
+            if (target >= method.codeLength || indices[target] < 0) return false;
+
+    // NOTE: enter probe is placed before all the instructions, so that branches to the first one do not enter the method again,
+    //       the same as 'PlaceEnterProbe' of 'Instrumenter.fs' does
+    std::vector<char> prologue;
+    probes.arg(prologue, (INT32) method.token);
+    probes.arg(prologue, (INT32) method.maxStackSize);
+    probes.arg(prologue, (INT32) arguments.size());
+    probes.arg(prologue, (INT32) locals.size());
+    probes.call(prologue, EnterProbe);
+
+    // NOTE: short branches are widened until all the targets are in their range, that moves the code after them
+    unsigned end;
+    auto label = [&](unsigned originalOffset) {
+        int index = indices[originalOffset];
+        return index == (int) instructions.size() ? end : instructions[index].newOffset;
+    };
+    for (bool widened = true; widened;) {
+        end = (unsigned) prologue.size();
+        for (RewrittenInstruction &instruction : instructions) {
+            instruction.newOffset = end;
+            end += instruction.size();
+        }
+        widened = false;
+        for (RewrittenInstruction &instruction : instructions) {
+            if (instruction.targets.empty() || instruction.longBranch || instruction.opcode == ILOpcodeSwitch) continue;
+            int delta = (int) label(instruction.targets[0]) - (int) (instruction.newOffset + instruction.before.size() + 2);
+            if (delta < -128 || delta > 127) {
+                instruction.longBranch = true;
+                widened = true;
+            }
+        }
+    }
+
+    code.clear();
+    code.reserve(end);
+    code.insert(code.end(), prologue.begin(), prologue.end());
+    for (const RewrittenInstruction &instruction : instructions) {
+        code.insert(code.end(), instruction.before.begin(), instruction.before.end());
+        if (instruction.targets.empty()) {
+            code.insert(code.end(), method.code + instruction.offset, method.code + instruction.offset + instruction.length);
+        } else if (instruction.opcode == ILOpcodeSwitch) {
+            UINT32 count = (UINT32) instruction.targets.size();
+            unsigned next = (unsigned) code.size() + instruction.length;
+            code.push_back((char) ILOpcodeSwitch);
+            code.insert(code.end(), (const char *) &count, (const char *) &count + sizeof(count));
+            for (unsigned target : instruction.targets) {
+                INT32 delta = (INT32) label(target) - (INT32) next;
+                code.insert(code.end(), (const char *) &delta, (const char *) &delta + sizeof(delta));
+            }
+        } else if (instruction.longBranch) {
+            emitOpcode(code, isShortBranch(instruction.opcode) ? longBranchOf(instruction.opcode) : instruction.opcode);
+            INT32 delta = (INT32) label(instruction.targets[0]) - (INT32) (code.size() + sizeof(INT32));
+            code.insert(code.end(), (const char *) &delta, (const char *) &delta + sizeof(delta));
+        } else {
+            emitOpcode(code, instruction.opcode);
+            code.push_back((char) (INT8) ((INT32) label(instruction.targets[0]) - (INT32) (code.size() + sizeof(INT8))));
+        }
+        code.insert(code.end(), instruction.after.begin(), instruction.after.end());
+    }
+
+    ehs.assign(method.ehs, method.ehs + method.ehsCount);
+    for (IMAGE_COR_ILMETHOD_SECT_EH_CLAUSE_FAT &clause : ehs) {
+        unsigned tryEnd = clause.TryOffset + clause.TryLength, handlerEnd = clause.HandlerOffset + clause.HandlerLength;
+        bool isFilter = (clause.Flags & COR_ILEXCEPTION_CLAUSE_FILTER) != 0;
+        if (tryEnd > method.codeLength || handlerEnd > method.codeLength || indices[clause.TryOffset] < 0 || indices[tryEnd] < 0
+            || indices[clause.HandlerOffset] < 0 || indices[handlerEnd] < 0
+            || (isFilter && (clause.FilterOffset >= method.codeLength || indices[clause.FilterOffset] < 0)))
+            return false;
+        unsigned tryOffset = label(clause.TryOffset), handlerOffset = label(clause.HandlerOffset);
+        clause.TryLength = label(tryEnd) - tryOffset;
+        clause.HandlerLength = label(handlerEnd) - handlerOffset;
+        if (isFilter) clause.FilterOffset = label(clause.FilterOffset);
+        clause.TryOffset = tryOffset;
+        clause.HandlerOffset = handlerOffset;
+    }
+
+    // NOTE: enter probe takes 4 arguments and the address on the empty stack, other probes take at most 3 cells above the
+    //       cells of the instruction
+    maxStackSize = method.maxStackSize + 3 > 5 ? method.maxStackSize + 3 : 5;
+    return true;
+}
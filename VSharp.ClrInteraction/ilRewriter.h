@@ -0,0 +1,46 @@
+#ifndef ILREWRITER_H_
+#define ILREWRITER_H_
+
+#include "cor.h"
+#include <vector>
+
+namespace vsharp {
+
+// Method, which is given to 'ILRewriter'. Signatures are the metadata blobs of the method and of its locals
+struct ILMethod {
+    mdMethodDef token;
+    const char *code;
+    unsigned codeLength;
+    unsigned maxStackSize;
+    const IMAGE_COR_ILMETHOD_SECT_EH_CLAUSE_FAT *ehs;
+    unsigned ehsCount;
+    PCCOR_SIGNATURE signature;
+    ULONG signatureLength;
+    PCCOR_SIGNATURE localsSignature;
+    ULONG localsSignatureLength;
+};
+
+// Instruments method bodies right in the profiler, so that the JIT does not wait for the round trip to SILI.
+// Probes are placed the same way 'Instrumenter.fs' places them, but only for the instructions, whose probes do not depend on
+// the types of evaluation stack cells: loads of arguments, locals and constants, stores into locals and arguments of
+// primitive or reference types, branches, returns and throws. Methods with other instructions or with locals of value types,
+// generic parameters or managed pointers are left to SILI.
+// Probes get the original offsets, so SILI maps them back to the instructions of the original body as usual
+class ILRewriter {
+private:
+    std::vector<int> m_slots;
+    bool m_enabled;
+
+public:
+    ILRewriter();
+
+    bool enabled() const;
+
+    // Returns false, if the method has instructions, which are not supported, or its code is malformed
+    bool rewrite(const ILMethod &method, const char *signatureTokens, unsigned signatureTokensLength, std::vector<char> &code,
+                 std::vector<IMAGE_COR_ILMETHOD_SECT_EH_CLAUSE_FAT> &ehs, unsigned &maxStackSize) const;
+};
+
+}
+
+#endif // ILREWRITER_H_
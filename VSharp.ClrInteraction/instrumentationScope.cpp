@@ -0,0 +1,65 @@
+#include "instrumentationScope.h"
+#include "logging.h"
+#include <cstdlib>
+
+using namespace vsharp;
+
+static bool matches(const std::string &filter, const std::string &name) {
+    return name.compare(0, filter.size(), filter) == 0 && (name.size() == filter.size() || name[filter.size()] == '.');
+}
+
+NameFilters::NameFilters(const char *variable) {
+    const char *value = getenv(variable);
+    if (!value)
+        return;
+    std::string list(value);
+    size_t start = 0;
+    while (start <= list.size()) {
+        size_t end = list.find(';', start);
+        if (end == std::string::npos)
+            end = list.size();
+        if (end > start)
+            m_filters.push_back(list.substr(start, end - start));
+        start = end + 1;
+    }
+}
+
+bool NameFilters::empty() const {
+    return m_filters.empty();
+}
+
+size_t NameFilters::size() const {
+    return m_filters.size();
+}
+
+bool NameFilters::matches(const std::string &assemblyName, const std::string &typeName) const {
+    for (const std::string &filter : m_filters)
+        if (::matches(filter, assemblyName) || ::matches(filter, typeName))
+            return true;
+    return false;
+}
+
+InstrumentationScope::InstrumentationScope()
+    : m_includes("CONCOLIC_SCOPE_INCLUDE")
+    , m_excludes("CONCOLIC_SCOPE_EXCLUDE")
+{
+    if (restricted())
+        LOG(tout << "Instrumentation scope: " << m_includes.size() << " include and " << m_excludes.size() << " exclude filters");
+}
+
+bool InstrumentationScope::restricted() const {
+    return !m_includes.empty() || !m_excludes.empty();
+}
+
+bool InstrumentationScope::contains(const std::string &assemblyName, const std::string &typeName) const {
+    if (!m_includes.empty() && !m_includes.matches(assemblyName, typeName))
+        return false;
+    return !m_excludes.matches(assemblyName, typeName);
+}
+
+std::string vsharp::narrowName(const WCHAR *name) {
+    std::string result;
+    for (; *name; ++name)
+        result.push_back(*name < 0x80 ? (char) *name : '?');
+    return result;
+}
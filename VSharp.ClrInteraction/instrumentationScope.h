@@ -0,0 +1,46 @@
+#ifndef INSTRUMENTATIONSCOPE_H_
+#define INSTRUMENTATIONSCOPE_H_
+
+#include "cor.h"
+#include <string>
+#include <vector>
+
+namespace vsharp {
+
+// Filters from the environment variable: list of assemblies, namespaces or types, separated by ';'. Filter matches the name,
+// which equals it or starts with it and '.', e.g. "System" matches assembly "System.Linq" and namespace "System.Collections.Generic"
+class NameFilters {
+private:
+    std::vector<std::string> m_filters;
+
+public:
+    explicit NameFilters(const char *variable);
+
+    bool empty() const;
+    size_t size() const;
+    // Whether some filter matches the assembly or the outermost type
+    bool matches(const std::string &assemblyName, const std::string &typeName) const;
+};
+
+// Methods, which are instrumented. Filters are taken from CONCOLIC_SCOPE_INCLUDE and CONCOLIC_SCOPE_EXCLUDE (see 'NameFilters').
+// Method is in scope, if some include filter (or any, if there are none) matches its assembly or type and no exclude filter
+// matches them. Nested types are in scope of their outermost type. Out-of-scope methods keep their original code, so they run as externs
+class InstrumentationScope {
+private:
+    NameFilters m_includes;
+    NameFilters m_excludes;
+
+public:
+    InstrumentationScope();
+
+    // Whether some methods are out of scope
+    bool restricted() const;
+    bool contains(const std::string &assemblyName, const std::string &typeName) const;
+};
+
+// NOTE: metadata names are compared as ASCII, other characters become '?'
+std::string narrowName(const WCHAR *name);
+
+}
+
+#endif // INSTRUMENTATIONSCOPE_H_
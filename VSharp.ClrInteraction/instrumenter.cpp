@@ -6,21 +6,14 @@
 #include <stdexcept>
 #include <corhlpr.cpp>
 #include "memory/memory.h"
+#include "probeRegistry.h"
+#include "ilOpcodes.h"
 
 using namespace vsharp;
 
+// Amount of callees, which wait for the prefetch worker
+static const size_t MaxPrefetchQueueDepth = 64;
 
-#define TOKENPASTE(x, y) x ## y
-#define TOKENPASTE2(x, y) TOKENPASTE(x, y)
-#define UNIQUE TOKENPASTE2(Sig, __LINE__)
-#define SIG_DEF(...) \
-    constexpr COR_SIGNATURE UNIQUE[] = {__VA_ARGS__};\
-    IfFailRet(metadataEmit->GetTokenFromSig(UNIQUE, sizeof(UNIQUE), &signatureToken));\
-    tokens.push_back(signatureToken);
-
-#define ELEMENT_TYPE_COND ELEMENT_TYPE_I
-#define ELEMENT_TYPE_TOKEN ELEMENT_TYPE_U4
-#define ELEMENT_TYPE_OFFSET ELEMENT_TYPE_I4
 
 struct MethodBodyInfo {
     unsigned token;
@@ -36,10 +29,11 @@ struct MethodBodyInfo {
     const char *bytecode;
     const char *ehs;
 
-    void serialize(char *&bytes, unsigned &count) const {
-        count = codeLength + 6 * sizeof(unsigned) + ehsLength + assemblyNameLength + moduleNameLength + signatureTokensLength;
-        bytes = new char[count];
-        char *buffer = bytes;
+    unsigned size() const {
+        return codeLength + 6 * sizeof(unsigned) + ehsLength + assemblyNameLength + moduleNameLength + signatureTokensLength;
+    }
+
+    void serialize(char *buffer) const {
         unsigned size = sizeof(unsigned);
         *(unsigned *)buffer = token; buffer += size;
         *(unsigned *)buffer = codeLength; buffer += size;
@@ -60,458 +54,681 @@ struct MethodBodyInfo {
     }
 };
 
-HRESULT initTokens(const CComPtr<IMetaDataEmit> &metadataEmit, std::vector<mdSignature> &tokens) {
-    HRESULT hr;
-    mdSignature signatureToken;
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x00, ELEMENT_TYPE_VOID)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x00, ELEMENT_TYPE_COND)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x01, ELEMENT_TYPE_VOID, ELEMENT_TYPE_U1)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x01, ELEMENT_TYPE_VOID, ELEMENT_TYPE_U4)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x01, ELEMENT_TYPE_VOID, ELEMENT_TYPE_I)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x01, ELEMENT_TYPE_COND, ELEMENT_TYPE_I)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x01, ELEMENT_TYPE_COND, ELEMENT_TYPE_U2)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x01, ELEMENT_TYPE_I1, ELEMENT_TYPE_I1)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x01, ELEMENT_TYPE_I2, ELEMENT_TYPE_I1)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x01, ELEMENT_TYPE_I4, ELEMENT_TYPE_I1)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x01, ELEMENT_TYPE_I8, ELEMENT_TYPE_I1)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x01, ELEMENT_TYPE_R4, ELEMENT_TYPE_I1)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x01, ELEMENT_TYPE_R8, ELEMENT_TYPE_I1)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x01, ELEMENT_TYPE_I, ELEMENT_TYPE_I1)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x02, ELEMENT_TYPE_VOID, ELEMENT_TYPE_I, ELEMENT_TYPE_I1)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x02, ELEMENT_TYPE_VOID, ELEMENT_TYPE_I, ELEMENT_TYPE_I2)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x02, ELEMENT_TYPE_VOID, ELEMENT_TYPE_I, ELEMENT_TYPE_U2)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x02, ELEMENT_TYPE_VOID, ELEMENT_TYPE_I, ELEMENT_TYPE_I4)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x02, ELEMENT_TYPE_VOID, ELEMENT_TYPE_I, ELEMENT_TYPE_I8)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x02, ELEMENT_TYPE_VOID, ELEMENT_TYPE_I, ELEMENT_TYPE_R4)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x02, ELEMENT_TYPE_VOID, ELEMENT_TYPE_I, ELEMENT_TYPE_R8)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x02, ELEMENT_TYPE_VOID, ELEMENT_TYPE_I, ELEMENT_TYPE_I)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x02, ELEMENT_TYPE_VOID, ELEMENT_TYPE_I4, ELEMENT_TYPE_I4)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x02, ELEMENT_TYPE_VOID, ELEMENT_TYPE_I4, ELEMENT_TYPE_I)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x02, ELEMENT_TYPE_VOID, ELEMENT_TYPE_I8, ELEMENT_TYPE_I4)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x02, ELEMENT_TYPE_VOID, ELEMENT_TYPE_I8, ELEMENT_TYPE_I8)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x02, ELEMENT_TYPE_VOID, ELEMENT_TYPE_R4, ELEMENT_TYPE_R4)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x02, ELEMENT_TYPE_VOID, ELEMENT_TYPE_R8, ELEMENT_TYPE_R8)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x02, ELEMENT_TYPE_COND, ELEMENT_TYPE_I, ELEMENT_TYPE_I4)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x02, ELEMENT_TYPE_COND, ELEMENT_TYPE_I, ELEMENT_TYPE_I)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x03, ELEMENT_TYPE_VOID, ELEMENT_TYPE_I, ELEMENT_TYPE_I, ELEMENT_TYPE_I)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x03, ELEMENT_TYPE_VOID, ELEMENT_TYPE_I, ELEMENT_TYPE_I, ELEMENT_TYPE_I1)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x03, ELEMENT_TYPE_VOID, ELEMENT_TYPE_I, ELEMENT_TYPE_I, ELEMENT_TYPE_I2)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x03, ELEMENT_TYPE_VOID, ELEMENT_TYPE_I, ELEMENT_TYPE_I, ELEMENT_TYPE_I4)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x03, ELEMENT_TYPE_VOID, ELEMENT_TYPE_I, ELEMENT_TYPE_I, ELEMENT_TYPE_I8)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x03, ELEMENT_TYPE_VOID, ELEMENT_TYPE_I, ELEMENT_TYPE_I, ELEMENT_TYPE_R4)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x03, ELEMENT_TYPE_VOID, ELEMENT_TYPE_I, ELEMENT_TYPE_I, ELEMENT_TYPE_R8)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x03, ELEMENT_TYPE_VOID, ELEMENT_TYPE_I, ELEMENT_TYPE_I1, ELEMENT_TYPE_I)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x03, ELEMENT_TYPE_VOID, ELEMENT_TYPE_I1, ELEMENT_TYPE_I1, ELEMENT_TYPE_I1)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x03, ELEMENT_TYPE_VOID, ELEMENT_TYPE_I2, ELEMENT_TYPE_I1, ELEMENT_TYPE_I1)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x03, ELEMENT_TYPE_VOID, ELEMENT_TYPE_I4, ELEMENT_TYPE_I1, ELEMENT_TYPE_I1)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x03, ELEMENT_TYPE_VOID, ELEMENT_TYPE_I8, ELEMENT_TYPE_I1, ELEMENT_TYPE_I1)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x03, ELEMENT_TYPE_VOID, ELEMENT_TYPE_R4, ELEMENT_TYPE_I1, ELEMENT_TYPE_I1)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x03, ELEMENT_TYPE_VOID, ELEMENT_TYPE_R8, ELEMENT_TYPE_I1, ELEMENT_TYPE_I1)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x03, ELEMENT_TYPE_VOID, ELEMENT_TYPE_I, ELEMENT_TYPE_I1, ELEMENT_TYPE_I1)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x05, ELEMENT_TYPE_VOID, ELEMENT_TYPE_TOKEN, ELEMENT_TYPE_U2, ELEMENT_TYPE_BOOLEAN, ELEMENT_TYPE_U4, ELEMENT_TYPE_U4)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x01, ELEMENT_TYPE_VOID, ELEMENT_TYPE_OFFSET)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x02, ELEMENT_TYPE_VOID, ELEMENT_TYPE_U1, ELEMENT_TYPE_OFFSET)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x02, ELEMENT_TYPE_VOID, ELEMENT_TYPE_U2, ELEMENT_TYPE_OFFSET)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x02, ELEMENT_TYPE_VOID, ELEMENT_TYPE_I4, ELEMENT_TYPE_OFFSET)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x02, ELEMENT_TYPE_VOID, ELEMENT_TYPE_I8, ELEMENT_TYPE_OFFSET)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x02, ELEMENT_TYPE_VOID, ELEMENT_TYPE_R4, ELEMENT_TYPE_OFFSET)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x02, ELEMENT_TYPE_VOID, ELEMENT_TYPE_R8, ELEMENT_TYPE_OFFSET)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x02, ELEMENT_TYPE_VOID, ELEMENT_TYPE_I, ELEMENT_TYPE_OFFSET)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x02, ELEMENT_TYPE_VOID, ELEMENT_TYPE_TOKEN, ELEMENT_TYPE_OFFSET)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x03, ELEMENT_TYPE_VOID, ELEMENT_TYPE_I, ELEMENT_TYPE_I1, ELEMENT_TYPE_OFFSET)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x03, ELEMENT_TYPE_VOID, ELEMENT_TYPE_I, ELEMENT_TYPE_I2, ELEMENT_TYPE_OFFSET)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x03, ELEMENT_TYPE_VOID, ELEMENT_TYPE_I, ELEMENT_TYPE_I4, ELEMENT_TYPE_OFFSET)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x03, ELEMENT_TYPE_VOID, ELEMENT_TYPE_I, ELEMENT_TYPE_I8, ELEMENT_TYPE_OFFSET)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x03, ELEMENT_TYPE_VOID, ELEMENT_TYPE_I, ELEMENT_TYPE_R4, ELEMENT_TYPE_OFFSET)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x03, ELEMENT_TYPE_VOID, ELEMENT_TYPE_I, ELEMENT_TYPE_R8, ELEMENT_TYPE_OFFSET)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x03, ELEMENT_TYPE_VOID, ELEMENT_TYPE_I, ELEMENT_TYPE_I, ELEMENT_TYPE_OFFSET)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x03, ELEMENT_TYPE_VOID, ELEMENT_TYPE_I, ELEMENT_TYPE_TOKEN, ELEMENT_TYPE_OFFSET)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x04, ELEMENT_TYPE_VOID, ELEMENT_TYPE_I, ELEMENT_TYPE_I4, ELEMENT_TYPE_I4, ELEMENT_TYPE_OFFSET)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x04, ELEMENT_TYPE_VOID, ELEMENT_TYPE_U2, ELEMENT_TYPE_I4, ELEMENT_TYPE_I4, ELEMENT_TYPE_OFFSET)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x04, ELEMENT_TYPE_VOID, ELEMENT_TYPE_U2, ELEMENT_TYPE_I4, ELEMENT_TYPE_I, ELEMENT_TYPE_OFFSET)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x04, ELEMENT_TYPE_VOID, ELEMENT_TYPE_U2, ELEMENT_TYPE_I8, ELEMENT_TYPE_I4, ELEMENT_TYPE_OFFSET)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x04, ELEMENT_TYPE_VOID, ELEMENT_TYPE_U2, ELEMENT_TYPE_I8, ELEMENT_TYPE_I8, ELEMENT_TYPE_OFFSET)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x04, ELEMENT_TYPE_VOID, ELEMENT_TYPE_U2, ELEMENT_TYPE_R4, ELEMENT_TYPE_R4, ELEMENT_TYPE_OFFSET)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x04, ELEMENT_TYPE_VOID, ELEMENT_TYPE_U2, ELEMENT_TYPE_R8, ELEMENT_TYPE_R8, ELEMENT_TYPE_OFFSET)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x04, ELEMENT_TYPE_VOID, ELEMENT_TYPE_U2, ELEMENT_TYPE_I, ELEMENT_TYPE_I, ELEMENT_TYPE_OFFSET)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x04, ELEMENT_TYPE_VOID, ELEMENT_TYPE_U2, ELEMENT_TYPE_I, ELEMENT_TYPE_I4, ELEMENT_TYPE_OFFSET)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x04, ELEMENT_TYPE_VOID, ELEMENT_TYPE_I, ELEMENT_TYPE_I, ELEMENT_TYPE_I, ELEMENT_TYPE_OFFSET)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x04, ELEMENT_TYPE_VOID, ELEMENT_TYPE_I, ELEMENT_TYPE_I, ELEMENT_TYPE_I1, ELEMENT_TYPE_OFFSET)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x04, ELEMENT_TYPE_VOID, ELEMENT_TYPE_I, ELEMENT_TYPE_I, ELEMENT_TYPE_I2, ELEMENT_TYPE_OFFSET)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x04, ELEMENT_TYPE_VOID, ELEMENT_TYPE_I, ELEMENT_TYPE_I, ELEMENT_TYPE_I4, ELEMENT_TYPE_OFFSET)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x04, ELEMENT_TYPE_VOID, ELEMENT_TYPE_I, ELEMENT_TYPE_I, ELEMENT_TYPE_I8, ELEMENT_TYPE_OFFSET)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x04, ELEMENT_TYPE_VOID, ELEMENT_TYPE_I, ELEMENT_TYPE_I, ELEMENT_TYPE_R4, ELEMENT_TYPE_OFFSET)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x04, ELEMENT_TYPE_VOID, ELEMENT_TYPE_I, ELEMENT_TYPE_I, ELEMENT_TYPE_R8, ELEMENT_TYPE_OFFSET)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x04, ELEMENT_TYPE_VOID, ELEMENT_TYPE_I, ELEMENT_TYPE_I1, ELEMENT_TYPE_I, ELEMENT_TYPE_OFFSET)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x04, ELEMENT_TYPE_VOID, ELEMENT_TYPE_TOKEN, ELEMENT_TYPE_U4, ELEMENT_TYPE_U4, ELEMENT_TYPE_U4)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x04, ELEMENT_TYPE_VOID, ELEMENT_TYPE_TOKEN, ELEMENT_TYPE_I, ELEMENT_TYPE_I, ELEMENT_TYPE_OFFSET)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x04, ELEMENT_TYPE_VOID, ELEMENT_TYPE_TOKEN, ELEMENT_TYPE_I, ELEMENT_TYPE_I4, ELEMENT_TYPE_OFFSET)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x04, ELEMENT_TYPE_VOID, ELEMENT_TYPE_TOKEN, ELEMENT_TYPE_I, ELEMENT_TYPE_I8, ELEMENT_TYPE_OFFSET)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x04, ELEMENT_TYPE_VOID, ELEMENT_TYPE_TOKEN, ELEMENT_TYPE_I, ELEMENT_TYPE_R4, ELEMENT_TYPE_OFFSET)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x04, ELEMENT_TYPE_VOID, ELEMENT_TYPE_TOKEN, ELEMENT_TYPE_I, ELEMENT_TYPE_R8, ELEMENT_TYPE_OFFSET)
-    SIG_DEF(IMAGE_CEE_CS_CALLCONV_STDCALL, 0x05, ELEMENT_TYPE_VOID, ELEMENT_TYPE_TOKEN, ELEMENT_TYPE_TOKEN, ELEMENT_TYPE_BOOLEAN, ELEMENT_TYPE_U2, ELEMENT_TYPE_OFFSET)
-    return S_OK;
-}
+// Method, which is instrumented before it is JIT-ed. Code and signatures point into the image of the module
+struct ImportedMethod {
+    mdMethodDef token;
+    const char *code;
+    unsigned codeLength;
+    unsigned maxStackSize;
+    unsigned flags;
+    mdToken localsSignatureToken;
+    PCCOR_SIGNATURE signature;
+    ULONG signatureLength;
+    std::vector<IMAGE_COR_ILMETHOD_SECT_EH_CLAUSE_FAT> ehs;
+    InstrumentationCacheKey cacheKey;
+
+    unsigned ehsLength() const {
+        return (unsigned) (ehs.size() * sizeof(IMAGE_COR_ILMETHOD_SECT_EH_CLAUSE_FAT));
+    }
+};
 
+namespace vsharp {
 
-Instrumenter::Instrumenter(ICorProfilerInfo8 &profilerInfo, Protocol &protocol)
-    : m_profilerInfo(profilerInfo)
-    , m_protocol(protocol)
-    , m_methodMalloc(nullptr)
-    , m_moduleId(0)
-    , m_signatureTokens(nullptr)
-    , m_generateTinyHeader(false)
-    , m_pEH(nullptr)
-    , m_reJitInstrumentedStarted(false)
-    , m_mainModuleName(nullptr)
-    , m_mainModuleSize(0)
-    , m_mainMethod(0)
-    , m_mainReached(false)
-{
-}
+// State of one JIT or ReJIT of the method. Each JIT-ing thread has its own, so that methods are instrumented in parallel
+struct JitRequest {
+    ModuleID moduleId;
+    std::shared_ptr<const ModuleInfo> module;
+    // Signatures of the module of the method
+    std::shared_ptr<const ModuleSignatures> signatures;
+    // NOTE: 'method' points into the original body, which the runtime keeps
+    LPCBYTE originalBody;
+    ImportedMethod method;
+
+    JitRequest() : moduleId(0), originalBody(nullptr) {}
+};
 
-Instrumenter::~Instrumenter()
-{
-    delete[] m_signatureTokens;
-    delete[] m_mainModuleName;
 }
 
-unsigned Instrumenter::codeSize() const
-{
-    return m_codeSize;
+// NOTE: names and signature tokens are shared by all methods of the batch, so they are sent once:
+//       [count][assembly name length][module name length][signature tokens length][signature tokens][assembly name]
+//       [module name], then for each method [token][code length][max stack size][ehs length][code][ehs]
+struct MethodBatchInfo {
+    const std::vector<ImportedMethod> &methods;
+    unsigned assemblyNameLength;
+    unsigned moduleNameLength;
+    unsigned signatureTokensLength;
+    const char *signatureTokens;
+    const WCHAR *assemblyName;
+    const WCHAR *moduleName;
+
+    unsigned size() const {
+        unsigned size = 4 * sizeof(unsigned) + signatureTokensLength + assemblyNameLength + moduleNameLength;
+        for (const ImportedMethod &method : methods)
+            size += 4 * sizeof(unsigned) + method.codeLength + method.ehsLength();
+        return size;
+    }
+
+    void serialize(char *buffer) const {
+        unsigned size = sizeof(unsigned);
+        *(unsigned *)buffer = (unsigned) methods.size(); buffer += size;
+        *(unsigned *)buffer = assemblyNameLength; buffer += size;
+        *(unsigned *)buffer = moduleNameLength; buffer += size;
+        *(unsigned *)buffer = signatureTokensLength; buffer += size;
+        memcpy(buffer, signatureTokens, signatureTokensLength); buffer += signatureTokensLength;
+        memcpy(buffer, (char*)assemblyName, assemblyNameLength); buffer += assemblyNameLength;
+        memcpy(buffer, (char*)moduleName, moduleNameLength); buffer += moduleNameLength;
+        for (const ImportedMethod &method : methods) {
+            *(unsigned *)buffer = method.token; buffer += size;
+            *(unsigned *)buffer = method.codeLength; buffer += size;
+            *(unsigned *)buffer = method.maxStackSize; buffer += size;
+            *(unsigned *)buffer = method.ehsLength(); buffer += size;
+            memcpy(buffer, method.code, method.codeLength); buffer += method.codeLength;
+            memcpy(buffer, (char*)method.ehs.data(), method.ehsLength()); buffer += method.ehsLength();
+        }
+    }
+};
+
+HRESULT initTokens(const CComPtr<IMetaDataEmit> &metadataEmit, std::vector<mdSignature> &tokens) {
+    HRESULT hr;
+    const std::vector<ProbeInfo> &probes = probesTable();
+    tokens.reserve(probes.size());
+    for (const ProbeInfo &probe : probes) {
+        mdSignature signatureToken;
+        IfFailRet(metadataEmit->GetTokenFromSig(probe.signature, probe.signatureLength, &signatureToken));
+        tokens.push_back(signatureToken);
+    }
+    return S_OK;
 }
 
-char *Instrumenter::code() const
-{
-    return m_code;
+// Code of the decoded method points into 'methodBytes', clauses are expanded into the fat form
+static void decodeMethod(LPCBYTE methodBytes, mdMethodDef token, ImportedMethod &method) {
+    COR_ILMETHOD_DECODER decoder((COR_ILMETHOD*)methodBytes);
+    method.token = token;
+    method.code = (const char *) decoder.Code;
+    method.codeLength = decoder.GetCodeSize();
+    method.maxStackSize = decoder.GetMaxStack();
+    method.flags = decoder.GetFlags() & CorILMethod_InitLocals;
+    method.localsSignatureToken = decoder.GetLocalVarSigTok();
+    method.ehs.clear();
+    const COR_ILMETHOD_SECT_EH *sectEH = decoder.EH;
+    for (unsigned i = 0; i < decoder.EHCount(); i++) {
+        COR_ILMETHOD_SECT_EH_CLAUSE_FAT scratch;
+        auto clause = (const IMAGE_COR_ILMETHOD_SECT_EH_CLAUSE_FAT *) sectEH->EHClause(i, &scratch);
+        method.ehs.push_back(*clause);
+    }
 }
 
-unsigned Instrumenter::ehCount() const
-{
-    return m_nEH * sizeof(IMAGE_COR_ILMETHOD_SECT_EH_CLAUSE_FAT);
+// Sets 'hasIL' to false, if the method has no IL body, e.g. it is abstract, runtime-provided or native
+static HRESULT importMethod(ICorProfilerInfo8 &profilerInfo, ModuleID moduleId, const CComPtr<IMetaDataImport> &metadataImport,
+                            mdMethodDef token, ImportedMethod &method, bool &hasIL) {
+    HRESULT hr;
+    hasIL = false;
+    ULONG codeRVA;
+    DWORD implFlags;
+    IfFailRet(metadataImport->GetMethodProps(token, nullptr, nullptr, 0, nullptr, nullptr, &method.signature, &method.signatureLength, &codeRVA, &implFlags));
+    if (codeRVA == 0 || (implFlags & miCodeTypeMask) != miIL || (implFlags & miManagedMask) != miManaged)
+        return S_OK;
+    LPCBYTE methodBytes;
+    IfFailRet(profilerInfo.GetILFunctionBody(moduleId, token, &methodBytes, nullptr));
+    decodeMethod(methodBytes, token, method);
+    hasIL = true;
+    return S_OK;
 }
 
-IMAGE_COR_ILMETHOD_SECT_EH_CLAUSE_FAT *Instrumenter::ehs() const
-{
-    return m_pEH;
+// Name of the outermost type, which encloses 'type', with its namespace. Global functions have empty type name
+static HRESULT outermostTypeName(const CComPtr<IMetaDataImport> &metadataImport, mdTypeDef type, std::string &typeName) {
+    HRESULT hr;
+    typeName.clear();
+    if (IsNilToken(type))
+        return S_OK;
+    mdTypeDef enclosing;
+    while (metadataImport->GetNestedClassProps(type, &enclosing) == S_OK)
+        type = enclosing;
+    ULONG nameLength;
+    IfFailRet(metadataImport->GetTypeDefProps(type, nullptr, 0, &nameLength, nullptr, nullptr));
+    std::vector<WCHAR> name(nameLength);
+    IfFailRet(metadataImport->GetTypeDefProps(type, name.data(), nameLength, &nameLength, nullptr, nullptr));
+    typeName = narrowName(name.data());
+    return S_OK;
 }
 
-unsigned Instrumenter::maxStackSize() const
-{
-    return m_maxStack;
+// Returns false, if the rewriter does not support the method
+static bool rewriteAhead(const ILRewriter &rewriter, const CComPtr<IMetaDataImport> &metadataImport, const ImportedMethod &method,
+                         const char *signatureTokens, unsigned signatureTokensLength, PreparedBody &body) {
+    PCCOR_SIGNATURE localsSignature = nullptr;
+    ULONG localsSignatureLength = 0;
+    if (!IsNilToken(method.localsSignatureToken) &&
+        FAILED(metadataImport->GetSigFromToken(method.localsSignatureToken, &localsSignature, &localsSignatureLength)))
+        return false;
+    ILMethod ilMethod = { method.token, method.code, method.codeLength, method.maxStackSize, method.ehs.data(),
+                          (unsigned) method.ehs.size(), method.signature, method.signatureLength, localsSignature, localsSignatureLength };
+    std::vector<IMAGE_COR_ILMETHOD_SECT_EH_CLAUSE_FAT> clauses;
+    if (!rewriter.rewrite(ilMethod, signatureTokens, signatureTokensLength, body.code, clauses, body.maxStackSize))
+        return false;
+    body.ehs.assign((char *) clauses.data(), (char *) (clauses.data() + clauses.size()));
+    return true;
 }
 
-HRESULT Instrumenter::setILFunctionBody(LPCBYTE pBody)
+Instrumenter::Instrumenter(ICorProfilerInfo8 &profilerInfo, Protocol &protocol, ModuleCache &moduleCache)
+    : m_profilerInfo(profilerInfo)
+    , m_protocol(protocol)
+    , m_moduleCache(moduleCache)
+    , m_reJitInstrumentedStarted(false)
+    , m_reJitAfterMain(false)
+    , m_mainMethod(0)
+    , m_mainReached(false)
+    , m_prefetchStopped(false)
+    , m_lazyReJit(true)
+    , m_eagerReJit("CONCOLIC_REJIT_EAGER")
+    , m_reJitStopped(false)
 {
-    return m_profilerInfo.SetILFunctionBody(m_moduleId, m_jittedToken, pBody);
+    // NOTE: SILI passes the same cache to all the runs of the target, so that methods are instrumented once
+    const char *cachePath = getenv("CONCOLIC_CACHE");
+    if (cachePath && strlen(cachePath) > 0)
+        m_cache.open(cachePath);
+    // NOTE: requests of the worker go through its own channel, older protocols have the only one
+    const char *prefetch = getenv("CONCOLIC_PREFETCH");
+    if (m_protocol.multiplexesChannels() && !(prefetch && !strcmp(prefetch, "0")))
+        m_prefetchWorker = std::thread(&Instrumenter::prefetchLoop, this);
+    const char *reJitAfterMain = getenv("CONCOLIC_REJIT_AFTER_MAIN");
+    m_reJitAfterMain = reJitAfterMain && !strcmp(reJitAfterMain, "1");
+    const char *lazyReJit = getenv("CONCOLIC_LAZY_REJIT");
+    m_lazyReJit = !(lazyReJit && !strcmp(lazyReJit, "0"));
+    if (m_lazyReJit)
+        m_reJitWorker = std::thread(&Instrumenter::reJitLoop, this);
 }
 
-LPBYTE Instrumenter::allocateILMemory(unsigned size)
+Instrumenter::~Instrumenter()
 {
-    if (FAILED(m_profilerInfo.GetILFunctionBodyAllocator(m_moduleId, &m_methodMalloc)))
-        return nullptr;
-
-    return (LPBYTE)m_methodMalloc->Alloc(size);
+    if (m_prefetchWorker.joinable()) {
+        {
+            std::lock_guard<std::mutex> lock(m_prefetchLock);
+            m_prefetchStopped = true;
+        }
+        m_prefetchRequested.notify_one();
+        m_prefetchWorker.join();
+    }
+    if (m_reJitWorker.joinable()) {
+        {
+            std::lock_guard<std::mutex> lock(m_reJitLock);
+            m_reJitStopped = true;
+        }
+        m_reJitRequested.notify_one();
+        m_reJitWorker.join();
+    }
 }
 
 void Instrumenter::configureEntryPoint() {
     char *bytes; int messageLength;
     m_protocol.acceptEntryPoint(bytes, messageLength);
     char *start = bytes;
-    m_mainModuleSize = *(INT32*) bytes; bytes += sizeof(INT32);
+    int mainModuleSize = *(INT32*) bytes; bytes += sizeof(INT32);
     m_mainMethod = *(INT32*) bytes; bytes += sizeof(INT32);
-    m_mainModuleName = new WCHAR[m_mainModuleSize];
-    unsigned bytesCount = m_mainModuleSize * sizeof(WCHAR);
-    memcpy(m_mainModuleName, bytes, m_mainModuleSize * sizeof(WCHAR)); bytes += bytesCount;
+    m_moduleCache.setMainModule((WCHAR *) bytes, mainModuleSize); bytes += mainModuleSize * sizeof(WCHAR);
     assert(bytes - start == messageLength);
-    delete[] start;
 }
 
-bool Instrumenter::currentMethodIsMain(const WCHAR *moduleName, int moduleSize, mdMethodDef method) const {
-    // NOTE: decrementing 'moduleSize', because of null terminator
-    if (m_mainModuleSize != moduleSize - 1 || m_mainMethod != method)
-        return false;
-    for (int i = 0; i < m_mainModuleSize; i++)
-        if (m_mainModuleName[i] != moduleName[i]) return false;
-    return true;
+bool Instrumenter::currentMethodIsMain(const ModuleInfo &module, mdMethodDef method) const {
+    return module.isMain && m_mainMethod == method;
 }
 
-HRESULT Instrumenter::importIL()
+HRESULT Instrumenter::importIL(JitRequest &request)
 {
     HRESULT hr;
     LPCBYTE pMethodBytes;
 
-    IfFailRet(m_profilerInfo.GetILFunctionBody(m_moduleId, m_jittedToken, &pMethodBytes, NULL));
-
-    COR_ILMETHOD_DECODER decoder((COR_ILMETHOD*)pMethodBytes);
-
-    // Import the header flags
-    m_tkLocalVarSig = decoder.GetLocalVarSigTok();
-    m_maxStack = decoder.GetMaxStack();
-    m_flags = (decoder.GetFlags() & CorILMethod_InitLocals);
-
-    m_codeSize = decoder.GetCodeSize();
-    m_code = new char[m_codeSize];
-    memcpy(m_code, decoder.Code, m_codeSize);
+    IfFailRet(m_profilerInfo.GetILFunctionBody(request.moduleId, request.method.token, &pMethodBytes, NULL));
 
-    IfFailRet(importEH(decoder.EH, decoder.EHCount()));
-
-    return S_OK;
+    return importIL(request, pMethodBytes);
 }
 
-HRESULT Instrumenter::importEH(const COR_ILMETHOD_SECT_EH* pILEH, unsigned nEH)
+HRESULT Instrumenter::importIL(JitRequest &request, LPCBYTE pMethodBytes)
 {
-    assert(m_pEH == nullptr);
-
-    m_nEH = nEH;
-
-    if (nEH == 0)
-        return S_OK;
-
-    IfNullRet(m_pEH = new IMAGE_COR_ILMETHOD_SECT_EH_CLAUSE_FAT[m_nEH]);
-    for (unsigned iEH = 0; iEH < m_nEH; iEH++)
-    {
-        // If the EH clause is in tiny form, the call to pILEH->EHClause() below will
-        // use this as a scratch buffer to expand the EH clause into its fat form.
-        COR_ILMETHOD_SECT_EH_CLAUSE_FAT scratch;
-        const COR_ILMETHOD_SECT_EH_CLAUSE_FAT* ehInfo;
-        ehInfo = (COR_ILMETHOD_SECT_EH_CLAUSE_FAT*)pILEH->EHClause(iEH, &scratch);
-        memcpy(m_pEH + iEH, ehInfo, sizeof (IMAGE_COR_ILMETHOD_SECT_EH_CLAUSE_FAT));
-    }
-
+    request.originalBody = pMethodBytes;
+    decodeMethod(pMethodBytes, request.method.token, request.method);
     return S_OK;
 }
 
-
-HRESULT Instrumenter::exportIL(char *bytecode, unsigned codeLength, unsigned maxStackSize, char *ehs, unsigned ehsLength)
+HRESULT Instrumenter::allocateILBody(const JitRequest &request, unsigned codeLength, unsigned maxStackSize, unsigned ehsLength,
+                                     LPBYTE &pBody, char *&bytecode, char *&ehs)
 {
     HRESULT hr;
+    if (ehsLength % sizeof(IMAGE_COR_ILMETHOD_SECT_EH_CLAUSE_FAT) != 0) {
+        LOG_ERROR(tout << "Size of exception handling clauses " << ehsLength << " is not a multiple of the clause size");
+        return E_FAIL;
+    }
 
     // Use FAT header
-    m_nEH = ehsLength / sizeof(IMAGE_COR_ILMETHOD_SECT_EH_CLAUSE_FAT);
-    m_maxStack = maxStackSize;
+    unsigned nEH = ehsLength / sizeof(IMAGE_COR_ILMETHOD_SECT_EH_CLAUSE_FAT);
 
     unsigned alignedCodeSize = (codeLength + 3) & ~3;
 
     unsigned totalSize = sizeof(IMAGE_COR_ILMETHOD_FAT) + alignedCodeSize +
-        (m_nEH ? (sizeof(IMAGE_COR_ILMETHOD_SECT_FAT) + sizeof(IMAGE_COR_ILMETHOD_SECT_EH_CLAUSE_FAT) * m_nEH) : 0);
+        (nEH ? (sizeof(IMAGE_COR_ILMETHOD_SECT_FAT) + sizeof(IMAGE_COR_ILMETHOD_SECT_EH_CLAUSE_FAT) * nEH) : 0);
 
-    LPBYTE pBody = allocateILMemory(totalSize);
+    CComPtr<IMethodMalloc> methodMalloc;
+    IfFailRet(m_profilerInfo.GetILFunctionBodyAllocator(request.moduleId, &methodMalloc));
+    pBody = (LPBYTE)methodMalloc->Alloc(totalSize);
     IfNullRet(pBody);
 
     BYTE * pCurrent = pBody;
 
     IMAGE_COR_ILMETHOD_FAT *pHeader = (IMAGE_COR_ILMETHOD_FAT *)pCurrent;
-    pHeader->Flags = m_flags | (m_nEH ? CorILMethod_MoreSects : 0) | CorILMethod_FatFormat;
+    pHeader->Flags = request.method.flags | (nEH ? CorILMethod_MoreSects : 0) | CorILMethod_FatFormat;
     pHeader->Size = sizeof(IMAGE_COR_ILMETHOD_FAT) / sizeof(DWORD);
-    pHeader->MaxStack = m_maxStack;
+    pHeader->MaxStack = maxStackSize;
     pHeader->CodeSize = codeLength;
-    pHeader->LocalVarSigTok = m_tkLocalVarSig;
+    pHeader->LocalVarSigTok = request.method.localsSignatureToken;
 
     pCurrent = (BYTE*)(pHeader + 1);
 
-    CopyMemory(pCurrent, bytecode, codeLength);
+    bytecode = (char *)pCurrent;
     pCurrent += alignedCodeSize;
 
-    if (m_nEH != 0)
+    ehs = nullptr;
+    if (nEH != 0)
     {
         IMAGE_COR_ILMETHOD_SECT_FAT *pEH = (IMAGE_COR_ILMETHOD_SECT_FAT *)pCurrent;
         pEH->Kind = CorILMethod_Sect_EHTable | CorILMethod_Sect_FatFormat;
-        pEH->DataSize = (unsigned)(sizeof(IMAGE_COR_ILMETHOD_SECT_FAT) + sizeof(IMAGE_COR_ILMETHOD_SECT_EH_CLAUSE_FAT) * m_nEH);
-
-        pCurrent = (BYTE*)(pEH + 1);
+        pEH->DataSize = (unsigned)(sizeof(IMAGE_COR_ILMETHOD_SECT_FAT) + sizeof(IMAGE_COR_ILMETHOD_SECT_EH_CLAUSE_FAT) * nEH);
 
-        for (unsigned iEH = 0; iEH < m_nEH; iEH++)
-        {
-            IMAGE_COR_ILMETHOD_SECT_EH_CLAUSE_FAT * pDst = (IMAGE_COR_ILMETHOD_SECT_EH_CLAUSE_FAT *)pCurrent;
-            *pDst = *(IMAGE_COR_ILMETHOD_SECT_EH_CLAUSE_FAT *)(ehs + iEH * sizeof(IMAGE_COR_ILMETHOD_SECT_EH_CLAUSE_FAT));
-            pCurrent = (BYTE*)(pDst + 1);
-        }
+        // NOTE: clauses are laid out in the same format, in which they are stored and sent
+        ehs = (char *)(pEH + 1);
     }
 
-    IfFailRet(setILFunctionBody(pBody));
+    return S_OK;
+}
 
-    if (m_pEH) {
-        delete[] m_pEH;
-        m_pEH = nullptr;
-    }
+HRESULT Instrumenter::commitILBody(const JitRequest &request, LPBYTE pBody)
+{
+    return m_profilerInfo.SetILFunctionBody(request.moduleId, request.method.token, pBody);
+}
 
-    if (m_methodMalloc)
-        m_methodMalloc->Release();
+HRESULT Instrumenter::exportIL(const JitRequest &request, const char *bytecode, unsigned codeLength, unsigned maxStackSize,
+                               const char *ehs, unsigned ehsLength)
+{
+    HRESULT hr;
+    LPBYTE pBody;
+    char *codeLocation, *ehsLocation;
+    IfFailRet(allocateILBody(request, codeLength, maxStackSize, ehsLength, pBody, codeLocation, ehsLocation));
+    CopyMemory(codeLocation, bytecode, codeLength);
+    if (ehsLength) CopyMemory(ehsLocation, ehs, ehsLength);
+    return commitILBody(request, pBody);
+}
 
+HRESULT Instrumenter::instrumentNatively(JitRequest &request, const CComPtr<IMetaDataImport> &metadataImport, bool &instrumented)
+{
+    HRESULT hr;
+    instrumented = false;
+    ImportedMethod &method = request.method;
+    IfFailRet(metadataImport->GetMethodProps(method.token, nullptr, nullptr, 0, nullptr, nullptr, &method.signature, &method.signatureLength, nullptr, nullptr));
+    PreparedBody body;
+    if (!rewriteAhead(m_rewriter, metadataImport, method, request.signatures->bytes(), request.signatures->length(), body))
+        return S_OK;
+    LOG(tout << "Exporting " << body.code.size() << " natively instrumented IL bytes!");
+    IfFailRet(exportIL(request, body.code.data(), (unsigned) body.code.size(), body.maxStackSize, body.ehs.data(),
+                       (unsigned) body.ehs.size()));
+    instrumented = true;
     return S_OK;
 }
 
+bool Instrumenter::awaitMethodBody(bool &stringsSent) {
+#ifdef _DEBUG
+    CommandType command;
+    do {
+        if (!m_protocol.acceptCommand(command)) return false;
+        switch (command) {
+            case ReadString: {
+                char *string;
+                if (!m_protocol.acceptString(string)) return false;
+                unsigned index = allocateString(string);
+                stringsSent = true;
+                if (!m_protocol.sendStringsPoolIndex(index)) return false;
+                break;
+            }
+            default:
+                break;
+        }
+    } while (command != ReadMethodBody);
+#endif
+    return true;
+}
+
+bool Instrumenter::skipMethodBodies(size_t count) {
+    std::vector<char> scratch;
+    for (size_t i = 0; i < count; i++) {
+        bool stringsSent = false;
+        unsigned length, maxStackSize, ehsLength;
+        if (!awaitMethodBody(stringsSent) || !m_protocol.acceptMethodBodyHeader(length, maxStackSize, ehsLength))
+            return false;
+        scratch.resize(length + ehsLength);
+        if (!m_protocol.acceptMethodBodyContents(scratch.data(), length, scratch.data() + length, ehsLength))
+            return false;
+    }
+    return true;
+}
+
 HRESULT Instrumenter::startReJitInstrumented() {
     LOG(tout << "ReJIT of instrumented methods is started" << std::endl);
-    m_reJitInstrumentedStarted = true;
-    ULONG count = instrumentedFunctions.size();
-    auto *modules = new ModuleID[count];
-    auto *methods = new mdMethodDef[count];
-    int i = 0;
-    for (const auto &it : instrumentedFunctions) {
-        modules[i] = it.first.first;
-        methods[i] = it.first.second;
-        i++;
-    }
-    HRESULT hr = m_profilerInfo.RequestReJIT(count, modules, methods);
-    delete[] modules;
-    delete[] methods;
-    return hr;
+    if (m_reJitInstrumentedStarted.exchange(true))
+        return S_OK;
+    std::vector<ModuleID> modules;
+    std::vector<mdMethodDef> methods;
+    std::lock_guard<std::mutex> lock(m_instrumentedLock);
+    instrumentedFunctions.forEach([&](MethodKey key, const InstrumentedMethod &method) {
+        modules.push_back(method.moduleId);
+        methods.push_back(methodOfKey(key));
+    });
+    return m_profilerInfo.RequestReJIT((ULONG) methods.size(), modules.data(), methods.data());
 }
 
 HRESULT Instrumenter::startReJitSkipped() {
-    LOG(tout << "ReJIT of skipped methods is started" << std::endl);
-    ULONG count = skippedBeforeMain.size();
-    auto *modules = new ModuleID[count];
-    auto *methods = new mdMethodDef[count];
-    int i = 0;
-    for (const auto &it : skippedBeforeMain) {
-        modules[i] = it.first;
-        methods[i] = it.second;
-        i++;
-    }
-    HRESULT hr = m_profilerInfo.RequestReJIT(count, modules, methods);
-    delete[] modules;
-    delete[] methods;
+    std::vector<ModuleID> modules;
+    std::vector<mdMethodDef> methods;
+    size_t left;
+    {
+        std::lock_guard<std::mutex> lock(m_skippedLock);
+        skippedBeforeMain.eraseIf([&](MethodKey key, ModuleID moduleId) {
+            if (m_lazyReJit && !reJitEagerly(moduleId, methodOfKey(key)))
+                return false;
+            modules.push_back(moduleId);
+            methods.push_back(methodOfKey(key));
+            return true;
+        });
+        left = skippedBeforeMain.size();
+    }
+    LOG(tout << "ReJIT of " << methods.size() << " skipped methods is started, " << left << " are left until they are called" << std::endl);
+    if (methods.empty())
+        return S_OK;
+    return m_profilerInfo.RequestReJIT((ULONG) methods.size(), modules.data(), methods.data());
+}
+
+bool Instrumenter::reJitEagerly(ModuleID moduleId, mdMethodDef method) {
+    if (m_eagerReJit.empty())
+        return false;
+    std::shared_ptr<const ModuleInfo> module;
+    std::string typeName;
+    if (FAILED(m_moduleCache.find(moduleId, module)) || FAILED(methodTypeName(moduleId, method, typeName)))
+        return false;
+    return m_eagerReJit.matches(module->narrowAssemblyName, typeName);
+}
+
+HRESULT Instrumenter::hookSkippedMethods() {
+    if (!m_lazyReJit)
+        return S_OK;
+    DWORD eventMask;
+    HRESULT hr = m_profilerInfo.GetEventMask(&eventMask);
+    if (SUCCEEDED(hr))
+        hr = m_profilerInfo.SetEventMask(eventMask | COR_PRF_MONITOR_ENTERLEAVE);
+    if (SUCCEEDED(hr))
+        hr = m_profilerInfo.SetFunctionIDMapper2(&Instrumenter::hookSkipped, this);
+    if (SUCCEEDED(hr))
+        hr = m_profilerInfo.SetEnterLeaveFunctionHooks3WithInfo(&Instrumenter::enterSkipped, nullptr, nullptr);
+    // NOTE: without the hook, skipped methods are rejitted at once, when main is reached
+    if (FAILED(hr))
+        m_lazyReJit = false;
     return hr;
 }
 
-HRESULT Instrumenter::doInstrumentation(ModuleID oldModuleId, const WCHAR *assemblyName, ULONG assemblyNameLength, const WCHAR *moduleName, ULONG moduleNameLength) {
+UINT_PTR Instrumenter::hookSkipped(FunctionID functionId, void *clientData, BOOL *hookFunction) {
+    auto *instrumenter = (Instrumenter *) clientData;
+    *hookFunction = FALSE;
+    // NOTE: methods, which are JIT-ed after main is reached, are instrumented right away, so they are not hooked
+    if (instrumenter->m_mainReached)
+        return functionId;
+    ClassID classId;
+    ModuleID moduleId;
+    mdToken method;
+    std::shared_ptr<const ModuleInfo> module;
+    if (FAILED(instrumenter->m_profilerInfo.GetFunctionInfo(functionId, &classId, &moduleId, &method)) ||
+        FAILED(instrumenter->m_moduleCache.find(moduleId, module)))
+        return functionId;
+    std::lock_guard<std::mutex> lock(instrumenter->m_skippedLock);
+    instrumenter->m_hookedMethods.emplace_back(new SkippedMethod(instrumenter, methodKey(module->index, method)));
+    *hookFunction = TRUE;
+    return (UINT_PTR) instrumenter->m_hookedMethods.back().get();
+}
+
+void Instrumenter::enterSkipped(FunctionIDOrClientID function, COR_PRF_ELT_INFO eltInfo) {
+    auto *skipped = (SkippedMethod *) function.clientID;
+    // NOTE: hook stays in the code of the method, so the calls after its ReJIT is requested return at once
+    if (skipped->requested.load(std::memory_order_relaxed) || !skipped->instrumenter->m_mainReached || trackingDisabled())
+        return;
+    if (!skipped->requested.exchange(true))
+        skipped->instrumenter->requestReJit(skipped->key);
+}
+
+void Instrumenter::requestReJit(MethodKey key) {
+    {
+        std::lock_guard<std::mutex> lock(m_reJitLock);
+        m_reJitQueue.push_back(key);
+    }
+    m_reJitRequested.notify_one();
+}
+
+// NOTE: ReJIT is requested by the worker, since the runtime can not be suspended from the enter hook.
+//       Until it is done, the called method runs its original code, i.e. as an extern
+void Instrumenter::reJitLoop() {
+    while (true) {
+        std::vector<MethodKey> requested;
+        {
+            std::unique_lock<std::mutex> lock(m_reJitLock);
+            m_reJitRequested.wait(lock, [this]() { return m_reJitStopped || !m_reJitQueue.empty(); });
+            if (m_reJitStopped)
+                return;
+            requested.swap(m_reJitQueue);
+        }
+        std::vector<ModuleID> modules;
+        std::vector<mdMethodDef> methods;
+        {
+            // NOTE: methods, which were not skipped (e.g. out of scope) or were already rejitted, are dropped
+            std::lock_guard<std::mutex> lock(m_skippedLock);
+            for (MethodKey key : requested) {
+                const ModuleID *moduleId = skippedBeforeMain.find(key);
+                if (!moduleId)
+                    continue;
+                modules.push_back(*moduleId);
+                methods.push_back(methodOfKey(key));
+                skippedBeforeMain.erase(key);
+            }
+        }
+        if (methods.empty())
+            continue;
+        LOG(tout << "ReJIT of " << methods.size() << " skipped methods, which are called after main, is requested" << std::endl);
+        if (FAILED(m_profilerInfo.RequestReJIT((ULONG) methods.size(), modules.data(), methods.data())))
+            LOG_ERROR(tout << "ReJIT of " << methods.size() << " skipped methods failed");
+    }
+}
+
+HRESULT Instrumenter::doInstrumentation(JitRequest &request) {
     HRESULT hr;
+    const ModuleInfo &module = *request.module;
+    mdMethodDef token = request.method.token;
     CComPtr<IMetaDataImport> metadataImport;
-    CComPtr<IMetaDataEmit> metadataEmit;
-    IfFailRet(m_profilerInfo.GetModuleMetaData(m_moduleId, ofRead | ofWrite, IID_IMetaDataImport, reinterpret_cast<IUnknown **>(&metadataImport)));
-    IfFailRet(metadataImport->QueryInterface(IID_IMetaDataEmit, reinterpret_cast<void **>(&metadataEmit)));
+    IfFailRet(m_profilerInfo.GetModuleMetaData(request.moduleId, ofRead | ofWrite, IID_IMetaDataImport, reinterpret_cast<IUnknown **>(&metadataImport)));
 
     // TODO: analyze the IL code instead to understand that we've injected functions?
-    if (instrumentedFunctions.find({m_moduleId, m_jittedToken}) != instrumentedFunctions.end()) {
-        LOG(tout << "Duplicate jitting of " << HEX(m_jittedToken) << std::endl);
+    MethodKey key = methodKey(module.index, token);
+    if (isInstrumented(key)) {
+        LOG(tout << "Duplicate jitting of " << HEX(token) << std::endl);
         return S_OK;
     }
     if (mainLeft()) {
-        if (!m_reJitInstrumentedStarted)
+        if (m_reJitAfterMain && !m_reJitInstrumentedStarted)
             IfFailRet(startReJitInstrumented());
-        LOG(tout << "Main left! Skipping instrumentation of " << HEX(m_jittedToken) << std::endl);
+        LOG(tout << "Main left! Skipping instrumentation of " << HEX(token) << std::endl);
         return S_OK;
     }
 
-    if (oldModuleId != m_moduleId) {
-        delete[] m_signatureTokens;
-        std::vector<mdSignature> *tokens = new std::vector<mdSignature>;
-        initTokens(metadataEmit, *tokens);
-        m_signatureTokensLength = tokens->size() * sizeof(mdSignature);
-        m_signatureTokens = (char *) &(*tokens)[0];
-    }
+    IfFailRet(moduleSignatures(request.moduleId, metadataImport, request.signatures));
+    const ModuleSignatures &signatures = *request.signatures;
 
-    LOG(tout << "Instrumenting token " << HEX(m_jittedToken) << "..." << std::endl);
+    LOG(tout << "Instrumenting token " << HEX(token) << "..." << std::endl);
 
-    IfFailRet(importIL());
+    IfFailRet(importIL(request));
+    const ImportedMethod &method = request.method;
 
-    unsigned codeLength = codeSize();
-    char *bytes = new char[codeLength];
-    char *ehcs = new char[ehCount()];
-    memcpy(bytes, code(), codeLength);
-    memcpy(ehcs, ehs(), ehCount());
-    MethodInfo mi = MethodInfo{m_jittedToken, bytes, codeLength, maxStackSize(), ehcs, ehCount()};
-    instrumentedFunctions[{m_moduleId, m_jittedToken}] = mi;
+    {
+        // NOTE: the method may be JIT-ed by several threads at once, only one of them instruments it
+        std::lock_guard<std::mutex> lock(m_instrumentedLock);
+        if (!instrumentedFunctions.insert(key, InstrumentedMethod{request.moduleId, request.originalBody})) {
+            LOG(tout << "Duplicate jitting of " << HEX(token) << std::endl);
+            return S_OK;
+        }
+    }
+
+    PreparedBody prepared;
+    if (takePreparedBody(request.moduleId, token, prepared)) {
+        LOG(tout << "Exporting " << prepared.code.size() << " prepared IL bytes!");
+        return exportIL(request, prepared.code.data(), (unsigned) prepared.code.size(), prepared.maxStackSize, prepared.ehs.data(),
+                        (unsigned) prepared.ehs.size());
+    }
+
+    // NOTE: SILI starts instrumenting, when it gets main, so main always goes to the server
+    bool isMain = currentMethodIsMain(module, token);
+    if (m_rewriter.enabled() && !isMain) {
+        bool instrumented;
+        IfFailRet(instrumentNatively(request, metadataImport, instrumented));
+        if (instrumented) return S_OK;
+    }
+    bool cacheable = m_cache.enabled() && !isMain;
+    InstrumentationCacheKey cacheKey;
+    if (cacheable) {
+        cacheKey = m_cache.key(&signatures.versionId, token, method.code, method.codeLength, (char *) method.ehs.data(),
+                               method.ehsLength(), method.maxStackSize, method.flags, method.localsSignatureToken);
+        CachedBody cached;
+        std::lock_guard<std::mutex> lock(m_cacheLock);
+        if (m_cache.find(cacheKey, cached)) {
+            LPBYTE pBody;
+            char *bytecode, *ehsLocation;
+            IfFailRet(allocateILBody(request, cached.codeLength, cached.maxStackSize, cached.ehsLength, pBody, bytecode, ehsLocation));
+            if (m_cache.restore(cached, bytecode, ehsLocation, signatures.bytes(), signatures.length())) {
+                LOG(tout << "Exporting " << cached.codeLength << " cached IL bytes!");
+                return commitILBody(request, pBody);
+            }
+            LOG_ERROR(tout << "Cached body of " << HEX(token) << " is malformed, asking the server");
+        }
+    }
 
     MethodBodyInfo info{
-        (unsigned)m_jittedToken,
-        (unsigned)codeSize(),
-        (unsigned)(assemblyNameLength - 1) * sizeof(WCHAR),
-        (unsigned)(moduleNameLength - 1) * sizeof(WCHAR),
-        (unsigned)maxStackSize(),
-        (unsigned)ehCount(),
-        m_signatureTokensLength,
-        m_signatureTokens,
-        assemblyName,
-        moduleName,
-        code(),
-        (char*)ehs()
+        (unsigned)token,
+        method.codeLength,
+        (unsigned)(module.assemblyName->size() - 1) * sizeof(WCHAR),
+        (unsigned)(module.moduleName->size() - 1) * sizeof(WCHAR),
+        method.maxStackSize,
+        method.ehsLength(),
+        signatures.length(),
+        (char *) signatures.bytes(),
+        module.assemblyName->data(),
+        module.moduleName->data(),
+        method.code,
+        (char *) method.ehs.data()
     };
+    // NOTE: the body is read right after the request, before the other threads send theirs
+    std::unique_lock<std::mutex> exchange = m_protocol.lockExchange();
     if (!m_protocol.sendSerializable(InstrumentCommand, info)) return false;
     LOG(tout << "Successfully sent method body!");
-    char *bytecode; int length; unsigned maxStackSize; char *ehs; unsigned ehsLength;
-#ifdef _DEBUG
-    CommandType command;
-    do {
-        if (!m_protocol.acceptCommand(command)) return false;
-        switch (command) {
-            case ReadString: {
-                char *string;
-                if (!m_protocol.acceptString(string)) return false;
-                unsigned index = allocateString(string);
-                if (!m_protocol.sendStringsPoolIndex(index)) return false;
-                break;
-            }
-            default:
-                break;
-        }
-    } while (command != ReadMethodBody);
-#endif
+    // NOTE: code, which refers to the strings of this run, is not cached
+    bool stringsSent = false;
+    if (!awaitMethodBody(stringsSent)) return false;
     LOG(tout << "Reading method body back...");
-    if (!m_protocol.acceptMethodBody(bytecode, length, maxStackSize, ehs, ehsLength)) return false;
+    unsigned length, maxStackSize, ehsLength;
+    if (!m_protocol.acceptMethodBodyHeader(length, maxStackSize, ehsLength)) return false;
+    // NOTE: instrumented code and exception handling clauses are read right into the body, which is given to the runtime
+    LPBYTE pBody;
+    char *bytecode, *ehs;
+    hr = allocateILBody(request, length, maxStackSize, ehsLength, pBody, bytecode, ehs);
+    if (FAILED(hr)) {
+        // NOTE: contents are read anyway, so that the next message is read from its start
+        std::vector<char> scratch(length + ehsLength);
+        m_protocol.acceptMethodBodyContents(scratch.data(), length, scratch.data() + length, ehsLength);
+        return hr;
+    }
+    if (!m_protocol.acceptMethodBodyContents(bytecode, length, ehs, ehsLength)) return false;
+    if (exchange.owns_lock())
+        exchange.unlock();
+    // NOTE: server returns the original code, if it does not instrument the method, e.g. it was instrumented by another run
+    bool instrumented = length != method.codeLength || memcmp(bytecode, method.code, length);
+    if (cacheable && !stringsSent && instrumented) {
+        std::lock_guard<std::mutex> lock(m_cacheLock);
+        m_cache.store(cacheKey, bytecode, length, maxStackSize, ehs, ehsLength, signatures.bytes(), signatures.length());
+    }
     LOG(tout << "Exporting " << length << " IL bytes!");
-    IfFailRet(exportIL(bytecode, length, maxStackSize, ehs, ehsLength));
+    IfFailRet(commitILBody(request, pBody));
 
     return S_OK;
 }
 
-HRESULT Instrumenter::instrument(FunctionID functionId) {
+HRESULT Instrumenter::startRequest(FunctionID functionId, JitRequest &request) {
     HRESULT hr;
-    ModuleID oldModuleId = m_moduleId;
     ClassID classId;
-    IfFailRet(m_profilerInfo.GetFunctionInfo(functionId, &classId, &m_moduleId, &m_jittedToken));
-    assert((m_jittedToken & 0xFF000000L) == mdtMethodDef);
-
-    LPCBYTE baseLoadAddress;
-    ULONG moduleNameLength;
-    AssemblyID assembly;
-    IfFailRet(m_profilerInfo.GetModuleInfo(m_moduleId, &baseLoadAddress, 0, &moduleNameLength, nullptr, &assembly));
-    WCHAR *moduleName = new WCHAR[moduleNameLength];
-    IfFailRet(m_profilerInfo.GetModuleInfo(m_moduleId, &baseLoadAddress, moduleNameLength, &moduleNameLength, moduleName, &assembly));
-    ULONG assemblyNameLength;
-    AppDomainID appDomainId;
-    ModuleID startModuleId;
-    IfFailRet(m_profilerInfo.GetAssemblyInfo(assembly, 0, &assemblyNameLength, nullptr, &appDomainId, &startModuleId));
-    WCHAR *assemblyName = new WCHAR[assemblyNameLength];
-    IfFailRet(m_profilerInfo.GetAssemblyInfo(assembly, assemblyNameLength, &assemblyNameLength, assemblyName, &appDomainId, &startModuleId));
+    IfFailRet(m_profilerInfo.GetFunctionInfo(functionId, &classId, &request.moduleId, &request.method.token));
+    assert((request.method.token & 0xFF000000L) == mdtMethodDef);
+    return m_moduleCache.find(request.moduleId, request.module);
+}
 
+bool Instrumenter::isInstrumented(MethodKey key) {
+    std::lock_guard<std::mutex> lock(m_instrumentedLock);
+    return instrumentedFunctions.contains(key);
+}
+
+HRESULT Instrumenter::instrument(FunctionID functionId) {
+    HRESULT hr;
+    JitRequest request;
+    IfFailRet(startRequest(functionId, request));
+    ModuleID moduleId = request.moduleId;
+    mdMethodDef token = request.method.token;
+    const ModuleInfo &module = *request.module;
+    MethodKey key = methodKey(module.index, token);
+
+    bool isMain = currentMethodIsMain(module, token);
     if (!m_mainReached) {
-        if (currentMethodIsMain(moduleName, (int) moduleNameLength, m_jittedToken)) {
+        if (isMain) {
             m_mainReached = true;
             IfFailRet(startReJitSkipped());
         }
     }
 
-    if (m_mainReached) {
+    // NOTE: main is always instrumented
+    bool inScope = true;
+    if (!isMain)
+        IfFailRet(methodInScope(moduleId, token, module, inScope));
+
+    if (!inScope) {
+        LOG(tout << "Token " << HEX(token) << " is out of scope, it is not instrumented" << std::endl);
+    } else if (m_mainReached) {
         LOG(tout << "Main function reached!" << std::endl);
-        doInstrumentation(oldModuleId, assemblyName, assemblyNameLength, moduleName, moduleNameLength);
+        doInstrumentation(request);
+        // NOTE: callees are requested after the method itself, so that SILI gets main before any of them
+        if (request.originalBody && isInstrumented(key))
+            prefetchCallees(moduleId, request.method.code, request.method.codeLength);
     } else {
-        LOG(tout << "Instrumentation of token " << HEX(m_jittedToken) << " is skipped" << std::endl);
-        skippedBeforeMain.insert({m_moduleId, m_jittedToken});
+        LOG(tout << "Instrumentation of token " << HEX(token) << " is skipped" << std::endl);
+        std::lock_guard<std::mutex> lock(m_skippedLock);
+        skippedBeforeMain.insert(key, moduleId);
     }
 
-    delete[] moduleName;
-    delete[] assemblyName;
-
     return S_OK;
 }
 
 HRESULT Instrumenter::undoInstrumentation(FunctionID functionId) {
     HRESULT hr;
-    ClassID classId;
-    IfFailRet(m_profilerInfo.GetFunctionInfo(functionId, &classId, &m_moduleId, &m_jittedToken));
-    assert((m_jittedToken & 0xFF000000L) == mdtMethodDef);
-    const auto instrumented = instrumentedFunctions.find({m_moduleId, m_jittedToken});
-    if (instrumented != instrumentedFunctions.end()) {
-        MethodInfo mi = instrumented->second;
-        LOG(tout << "Undo instrumentation token " << HEX(m_jittedToken) << "..." << std::endl);
-        IfFailRet(exportIL(mi.bytecode, mi.codeLength, mi.maxStackSize, mi.ehs, mi.ehsLength));
-        instrumentedFunctions.erase(instrumented);
+    JitRequest request;
+    IfFailRet(startRequest(functionId, request));
+    MethodKey key = methodKey(request.module->index, request.method.token);
+    LPCBYTE originalBody;
+    {
+        std::lock_guard<std::mutex> lock(m_instrumentedLock);
+        const InstrumentedMethod *instrumented = instrumentedFunctions.find(key);
+        if (!instrumented)
+            return S_OK;
+        originalBody = instrumented->originalBody;
+        instrumentedFunctions.erase(key);
     }
-    return S_OK;
+    LOG(tout << "Undo instrumentation token " << HEX(request.method.token) << "..." << std::endl);
+    IfFailRet(importIL(request, originalBody));
+    const ImportedMethod &method = request.method;
+    return exportIL(request, method.code, method.codeLength, method.maxStackSize, (char *) method.ehs.data(), method.ehsLength());
 }
 
 HRESULT Instrumenter::reInstrument(FunctionID functionId) {
@@ -522,3 +739,320 @@ HRESULT Instrumenter::reInstrument(FunctionID functionId) {
     else
         return instrument(functionId);
 }
+
+HRESULT Instrumenter::moduleSignatures(ModuleID moduleId, const CComPtr<IMetaDataImport> &metadataImport,
+                                       std::shared_ptr<const ModuleSignatures> &signatures) {
+    HRESULT hr;
+    std::lock_guard<std::mutex> lock(m_modulesLock);
+    const auto known = m_moduleSignatures.find(moduleId);
+    if (known != m_moduleSignatures.end()) {
+        signatures = known->second;
+        return S_OK;
+    }
+    CComPtr<IMetaDataEmit> metadataEmit;
+    IfFailRet(metadataImport->QueryInterface(IID_IMetaDataEmit, reinterpret_cast<void **>(&metadataEmit)));
+    auto created = std::make_shared<ModuleSignatures>();
+    IfFailRet(initTokens(metadataEmit, created->tokens));
+    IfFailRet(metadataImport->GetScopeProps(nullptr, 0, nullptr, &created->versionId));
+    m_moduleSignatures[moduleId] = created;
+    signatures = created;
+    return S_OK;
+}
+
+void Instrumenter::unloadModule(ModuleID moduleId) {
+    {
+        std::lock_guard<std::mutex> lock(m_modulesLock);
+        m_moduleSignatures.erase(moduleId);
+    }
+    {
+        // NOTE: original bodies of the module are freed by the runtime
+        std::lock_guard<std::mutex> lock(m_instrumentedLock);
+        instrumentedFunctions.eraseIf([moduleId](MethodKey, const InstrumentedMethod &method) { return method.moduleId == moduleId; });
+    }
+    {
+        std::lock_guard<std::mutex> lock(m_skippedLock);
+        skippedBeforeMain.eraseIf([moduleId](MethodKey, ModuleID skipped) { return skipped == moduleId; });
+    }
+    std::lock_guard<std::mutex> lock(m_preparedLock);
+    auto first = m_preparedBodies.lower_bound({moduleId, 0});
+    auto last = m_preparedBodies.upper_bound({moduleId, ~(mdMethodDef) 0});
+    m_preparedBodies.erase(first, last);
+    m_claimedMethods.erase(m_claimedMethods.lower_bound({moduleId, 0}), m_claimedMethods.upper_bound({moduleId, ~(mdMethodDef) 0}));
+}
+
+HRESULT Instrumenter::methodTypeName(ModuleID moduleId, mdMethodDef method, std::string &typeName) {
+    HRESULT hr;
+    CComPtr<IMetaDataImport> metadataImport;
+    IfFailRet(m_profilerInfo.GetModuleMetaData(moduleId, ofRead, IID_IMetaDataImport, reinterpret_cast<IUnknown **>(&metadataImport)));
+    mdTypeDef type;
+    IfFailRet(metadataImport->GetMethodProps(method, &type, nullptr, 0, nullptr, nullptr, nullptr, nullptr, nullptr, nullptr));
+    return outermostTypeName(metadataImport, type, typeName);
+}
+
+HRESULT Instrumenter::methodInScope(ModuleID moduleId, mdMethodDef method, const ModuleInfo &module, bool &inScope) {
+    HRESULT hr;
+    inScope = true;
+    if (!m_scope.restricted())
+        return S_OK;
+    std::string typeName;
+    IfFailRet(methodTypeName(moduleId, method, typeName));
+    inScope = m_scope.contains(module.narrowAssemblyName, typeName);
+    return S_OK;
+}
+
+bool Instrumenter::claimMethod(ModuleID moduleId, mdMethodDef method) {
+    std::lock_guard<std::mutex> lock(m_preparedLock);
+    if (!m_claimedMethods.insert({moduleId, method}).second)
+        return false;
+    m_preparingMethods.insert({moduleId, method});
+    return true;
+}
+
+void Instrumenter::finishPreparing(ModuleID moduleId, mdMethodDef method, PreparedBody *body) {
+    {
+        std::lock_guard<std::mutex> lock(m_preparedLock);
+        if (body)
+            m_preparedBodies[{moduleId, method}] = std::move(*body);
+        m_preparingMethods.erase({moduleId, method});
+    }
+    m_bodyPrepared.notify_all();
+}
+
+bool Instrumenter::takePreparedBody(ModuleID moduleId, mdMethodDef method, PreparedBody &body) {
+    std::unique_lock<std::mutex> lock(m_preparedLock);
+    m_claimedMethods.insert({moduleId, method});
+    m_bodyPrepared.wait(lock, [&]() { return m_preparingMethods.find({moduleId, method}) == m_preparingMethods.end(); });
+    const auto prepared = m_preparedBodies.find({moduleId, method});
+    if (prepared == m_preparedBodies.end())
+        return false;
+    body = std::move(prepared->second);
+    m_preparedBodies.erase(prepared);
+    return true;
+}
+
+HRESULT Instrumenter::instrumentModule(ModuleID moduleId) {
+    // NOTE: methods, which are JIT-ed before main, are not instrumented, so modules, loaded before it, are not batched
+    if (!m_protocol.batchesInstrumentation() || !m_mainReached || mainLeft())
+        return S_OK;
+
+    HRESULT hr;
+    std::shared_ptr<const ModuleInfo> module;
+    IfFailRet(m_moduleCache.find(moduleId, module));
+    if (module->flags & (COR_PRF_MODULE_DYNAMIC | COR_PRF_MODULE_RESOURCE))
+        return S_OK;
+
+    CComPtr<IMetaDataImport> metadataImport;
+    IfFailRet(m_profilerInfo.GetModuleMetaData(moduleId, ofRead | ofWrite, IID_IMetaDataImport, reinterpret_cast<IUnknown **>(&metadataImport)));
+    std::shared_ptr<const ModuleSignatures> signatures;
+    IfFailRet(moduleSignatures(moduleId, metadataImport, signatures));
+    const char *signatureTokens = signatures->bytes();
+    unsigned signatureTokensLength = signatures->length();
+
+    // NOTE: global functions are the methods of nil type
+    std::vector<mdTypeDef> types(1, mdTypeDefNil);
+    HCORENUM typesEnum = nullptr;
+    mdTypeDef typesChunk[64];
+    ULONG count;
+    while (SUCCEEDED(metadataImport->EnumTypeDefs(&typesEnum, typesChunk, 64, &count)) && count > 0)
+        types.insert(types.end(), typesChunk, typesChunk + count);
+    metadataImport->CloseEnum(typesEnum);
+
+    std::vector<ImportedMethod> methods;
+    for (mdTypeDef type : types) {
+        if (m_scope.restricted()) {
+            std::string typeName;
+            if (FAILED(outermostTypeName(metadataImport, type, typeName)) || !m_scope.contains(module->narrowAssemblyName, typeName))
+                continue;
+        }
+        HCORENUM methodsEnum = nullptr;
+        mdMethodDef methodsChunk[64];
+        while (SUCCEEDED(metadataImport->EnumMethods(&methodsEnum, type, methodsChunk, 64, &count)) && count > 0) {
+            for (ULONG i = 0; i < count; i++) {
+                ImportedMethod method;
+                bool hasIL;
+                if (FAILED(importMethod(m_profilerInfo, moduleId, metadataImport, methodsChunk[i], method, hasIL)) || !hasIL)
+                    continue;
+                if (!claimMethod(moduleId, method.token))
+                    continue;
+                // NOTE: methods, which the profiler instruments itself, do not go to the server
+                PreparedBody body;
+                if (m_rewriter.enabled() && rewriteAhead(m_rewriter, metadataImport, method, signatureTokens, signatureTokensLength, body)) {
+                    finishPreparing(moduleId, method.token, &body);
+                    continue;
+                }
+                // NOTE: cached methods are restored, when they are JIT-ed
+                if (m_cache.enabled()) {
+                    method.cacheKey = m_cache.key(&signatures->versionId, method.token, method.code, method.codeLength, (char *) method.ehs.data(),
+                                                  method.ehsLength(), method.maxStackSize, method.flags, method.localsSignatureToken);
+                    CachedBody cached;
+                    std::lock_guard<std::mutex> lock(m_cacheLock);
+                    if (m_cache.find(method.cacheKey, cached)) {
+                        finishPreparing(moduleId, method.token, nullptr);
+                        continue;
+                    }
+                }
+                methods.push_back(std::move(method));
+            }
+        }
+        metadataImport->CloseEnum(methodsEnum);
+    }
+    if (methods.empty())
+        return S_OK;
+
+    LOG(tout << "Sending batch of " << methods.size() << " methods of module " << HEX(moduleId) << "...");
+    MethodBatchInfo info{
+        methods,
+        (unsigned)(module->assemblyName->size() - 1) * sizeof(WCHAR),
+        (unsigned)(module->moduleName->size() - 1) * sizeof(WCHAR),
+        signatureTokensLength,
+        signatureTokens,
+        module->assemblyName->data(),
+        module->moduleName->data()
+    };
+    std::unique_lock<std::mutex> exchange = m_protocol.lockExchange();
+    bool sent = m_protocol.sendSerializable(InstrumentBatchCommand, info);
+
+    // NOTE: server answers with the bodies in the order of the batch. If it fails, the rest of the methods are left to their JIT
+    size_t received = 0;
+    for (; sent && received < methods.size(); received++) {
+        const ImportedMethod &method = methods[received];
+        bool stringsSent = false;
+        unsigned length, maxStackSize, ehsLength;
+        if (!awaitMethodBody(stringsSent) || !m_protocol.acceptMethodBodyHeader(length, maxStackSize, ehsLength))
+            break;
+        PreparedBody body;
+        body.code.resize(length);
+        body.maxStackSize = maxStackSize;
+        body.ehs.resize(ehsLength);
+        if (!m_protocol.acceptMethodBodyContents(body.code.data(), length, body.ehs.data(), ehsLength))
+            break;
+        bool instrumented = length != method.codeLength || memcmp(body.code.data(), method.code, length);
+        if (m_cache.enabled() && !stringsSent && instrumented) {
+            std::lock_guard<std::mutex> lock(m_cacheLock);
+            m_cache.store(method.cacheKey, body.code.data(), length, maxStackSize, body.ehs.data(), ehsLength,
+                          signatureTokens, signatureTokensLength);
+        }
+        finishPreparing(moduleId, method.token, &body);
+    }
+    for (size_t i = received; i < methods.size(); i++)
+        finishPreparing(moduleId, methods[i].token, nullptr);
+    if (received < methods.size()) {
+        LOG_ERROR(tout << "Batch of module " << HEX(moduleId) << " failed after " << received << " of " << methods.size() << " methods");
+        // NOTE: server still sends the rest of the bodies, which must not be taken for the next responses. Since v5 each body
+        //       is a frame of its own, so the failed one is already read; before v5 the position in the stream is unknown
+        if (!sent || !m_protocol.multiplexesChannels() || !skipMethodBodies(methods.size() - received - 1))
+            m_protocol.abort();
+        return E_FAIL;
+    }
+    LOG(tout << "Batch of module " << HEX(moduleId) << " is instrumented");
+    return S_OK;
+}
+
+void Instrumenter::prefetchCallees(ModuleID moduleId, const char *code, unsigned codeLength) {
+    if (!m_prefetchWorker.joinable() || mainLeft())
+        return;
+    std::vector<unsigned> callees;
+    collectCallees(code, codeLength, callees);
+    {
+        std::lock_guard<std::mutex> lock(m_prefetchLock);
+        for (unsigned callee : callees) {
+            // NOTE: callees from other modules are referenced by member refs, they are not resolved
+            if (TypeFromToken(callee) != mdtMethodDef)
+                continue;
+            // NOTE: the latest callees are the most likely to be JIT-ed soon, so the oldest ones are dropped
+            if (m_prefetchQueue.size() >= MaxPrefetchQueueDepth)
+                m_prefetchQueue.pop_front();
+            m_prefetchQueue.push_back({moduleId, callee});
+        }
+    }
+    m_prefetchRequested.notify_one();
+}
+
+void Instrumenter::prefetchLoop() {
+    while (true) {
+        std::pair<ModuleID, mdMethodDef> method;
+        {
+            std::unique_lock<std::mutex> lock(m_prefetchLock);
+            m_prefetchRequested.wait(lock, [this]() { return m_prefetchStopped || !m_prefetchQueue.empty(); });
+            if (m_prefetchStopped)
+                return;
+            method = m_prefetchQueue.front();
+            m_prefetchQueue.pop_front();
+        }
+        if (mainLeft() || !claimMethod(method.first, method.second))
+            continue;
+        PreparedBody body;
+        bool prepared = false;
+        if (FAILED(prefetch(method.first, method.second, body, prepared)))
+            LOG_ERROR(tout << "Prefetch of " << HEX(method.second) << " failed, it is left to its JIT");
+        finishPreparing(method.first, method.second, prepared ? &body : nullptr);
+    }
+}
+
+HRESULT Instrumenter::prefetch(ModuleID moduleId, mdMethodDef method, PreparedBody &body, bool &prepared) {
+    HRESULT hr;
+    CComPtr<IMetaDataImport> metadataImport;
+    IfFailRet(m_profilerInfo.GetModuleMetaData(moduleId, ofRead | ofWrite, IID_IMetaDataImport, reinterpret_cast<IUnknown **>(&metadataImport)));
+    std::shared_ptr<const ModuleInfo> module;
+    IfFailRet(m_moduleCache.find(moduleId, module));
+    bool inScope;
+    IfFailRet(methodInScope(moduleId, method, *module, inScope));
+    if (!inScope)
+        return S_OK;
+    ImportedMethod imported;
+    bool hasIL;
+    IfFailRet(importMethod(m_profilerInfo, moduleId, metadataImport, method, imported, hasIL));
+    if (!hasIL)
+        return S_OK;
+    std::shared_ptr<const ModuleSignatures> signatures;
+    IfFailRet(moduleSignatures(moduleId, metadataImport, signatures));
+    const char *signatureTokens = signatures->bytes();
+    unsigned signatureTokensLength = signatures->length();
+
+    if (m_rewriter.enabled() && rewriteAhead(m_rewriter, metadataImport, imported, signatureTokens, signatureTokensLength, body)) {
+        prepared = true;
+        return S_OK;
+    }
+    // NOTE: cached methods are restored, when they are JIT-ed
+    if (m_cache.enabled()) {
+        imported.cacheKey = m_cache.key(&signatures->versionId, method, imported.code, imported.codeLength, (char *) imported.ehs.data(),
+                                        imported.ehsLength(), imported.maxStackSize, imported.flags, imported.localsSignatureToken);
+        CachedBody cached;
+        std::lock_guard<std::mutex> lock(m_cacheLock);
+        if (m_cache.find(imported.cacheKey, cached))
+            return S_OK;
+    }
+
+    LOG(tout << "Prefetching token " << HEX(method) << "...");
+    MethodBodyInfo info{
+        (unsigned)method,
+        imported.codeLength,
+        (unsigned)(module->assemblyName->size() - 1) * sizeof(WCHAR),
+        (unsigned)(module->moduleName->size() - 1) * sizeof(WCHAR),
+        imported.maxStackSize,
+        imported.ehsLength(),
+        signatureTokensLength,
+        (char *) signatureTokens,
+        module->assemblyName->data(),
+        module->moduleName->data(),
+        imported.code,
+        (char *) imported.ehs.data()
+    };
+    std::unique_lock<std::mutex> exchange = m_protocol.lockExchange();
+    if (!m_protocol.sendSerializable(InstrumentCommand, info)) return E_FAIL;
+    bool stringsSent = false;
+    unsigned length, maxStackSize, ehsLength;
+    if (!awaitMethodBody(stringsSent) || !m_protocol.acceptMethodBodyHeader(length, maxStackSize, ehsLength)) return E_FAIL;
+    body.code.resize(length);
+    body.maxStackSize = maxStackSize;
+    body.ehs.resize(ehsLength);
+    if (!m_protocol.acceptMethodBodyContents(body.code.data(), length, body.ehs.data(), ehsLength)) return E_FAIL;
+    prepared = true;
+    bool instrumented = length != imported.codeLength || memcmp(body.code.data(), imported.code, length);
+    if (m_cache.enabled() && !stringsSent && instrumented) {
+        std::lock_guard<std::mutex> lock(m_cacheLock);
+        m_cache.store(imported.cacheKey, body.code.data(), length, maxStackSize, body.ehs.data(), ehsLength,
+                      signatureTokens, signatureTokensLength);
+    }
+    return S_OK;
+}
@@ -1,91 +1,178 @@
 #ifndef INSTRUMENTER_H_
 #define INSTRUMENTER_H_
 
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <set>
+#include <thread>
+#include <vector>
 #include "corProfiler.h"
 #include "cComPtr.h"
-
-struct COR_ILMETHOD_SECT_EH;
-struct IMAGE_COR_ILMETHOD_SECT_EH_CLAUSE_FAT;
+#include "cache/instrumentationCache.h"
+#include "ilRewriter.h"
+#include "instrumentationScope.h"
+#include "methodTable.h"
+#include "moduleCache.h"
 
 namespace vsharp {
 
 class Protocol;
+struct JitRequest;
 
-struct MethodInfo {
-    unsigned token;
-    char *bytecode;
-    unsigned codeLength;
-    unsigned maxStackSize;
-    char *ehs;
-    unsigned ehsLength;
+// NOTE: original body of the instrumented method is not copied: the runtime keeps it, while the module is loaded
+struct InstrumentedMethod {
+    ModuleID moduleId;
+    LPCBYTE originalBody;
 };
 
-class Instrumenter {
-private:
-    ICorProfilerInfo8 &m_profilerInfo;  // Does not have ownership
-    IMethodMalloc *m_methodMalloc;  // Does not have ownership
-
-    Protocol &m_protocol;
-
-    WCHAR *m_mainModuleName;
-    int m_mainModuleSize;
-    mdMethodDef m_mainMethod;
-    bool m_mainReached;
-
-    mdMethodDef m_jittedToken;
-    ModuleID m_moduleId;
-
-    char *m_signatureTokens;
-    unsigned m_signatureTokensLength;
+// Signature tokens of the probes in the module, in the order of the probes table, and the version of the module
+struct ModuleSignatures {
+    std::vector<mdSignature> tokens;
+    GUID versionId;
 
-    mdToken     m_tkLocalVarSig;
-    unsigned    m_maxStack;
-    unsigned    m_flags;
-    bool        m_generateTinyHeader;
+    const char *bytes() const { return (const char *) tokens.data(); }
+    unsigned length() const { return (unsigned) (tokens.size() * sizeof(mdSignature)); }
+};
 
-    unsigned    m_nEH;
-    IMAGE_COR_ILMETHOD_SECT_EH_CLAUSE_FAT *m_pEH;
+// Instrumented body, which is ready before its method is JIT-ed
+struct PreparedBody {
+    std::vector<char> code;
+    unsigned maxStackSize;
+    std::vector<char> ehs;
+};
 
-    char *m_code;
-    unsigned    m_codeSize;
+class Instrumenter;
 
-    std::map<std::pair<ModuleID, mdMethodDef>, MethodInfo> instrumentedFunctions;
-    std::set<std::pair<ModuleID, mdMethodDef>> skippedBeforeMain;
+// Method, which is JIT-ed before main: its enter hook requests its ReJIT, when it is called after main is reached
+struct SkippedMethod {
+    Instrumenter *instrumenter;
+    MethodKey key;
+    std::atomic<bool> requested;
 
-    bool m_reJitInstrumentedStarted;
+    SkippedMethod(Instrumenter *instrumenter, MethodKey key)
+        : instrumenter(instrumenter), key(key), requested(false) {}
+};
 
-    unsigned codeSize() const;
-    char *code() const;
-    unsigned ehCount() const;
-    IMAGE_COR_ILMETHOD_SECT_EH_CLAUSE_FAT *ehs() const;
-    unsigned maxStackSize() const;
+class Instrumenter {
+private:
+    ICorProfilerInfo8 &m_profilerInfo;  // Does not have ownership
 
-    HRESULT setILFunctionBody(LPCBYTE pBody);
-    LPBYTE allocateILMemory(unsigned size);
+    Protocol &m_protocol;
+    ModuleCache &m_moduleCache;  // Does not have ownership
 
-    HRESULT importIL();
-    HRESULT importEH(const COR_ILMETHOD_SECT_EH* pILEH, unsigned nEH);
-    HRESULT exportIL(char *bytecode, unsigned codeLength, unsigned maxStackSize, char *ehs, unsigned ehsLength);
+    mdMethodDef m_mainMethod;
+    std::atomic<bool> m_mainReached;
+
+    // NOTE: signatures are defined once per module and dropped, when it is unloaded
+    std::mutex m_modulesLock;
+    std::map<ModuleID, std::shared_ptr<const ModuleSignatures>> m_moduleSignatures;
+
+    InstrumentationCache m_cache;
+    ILRewriter m_rewriter;
+    InstrumentationScope m_scope;
+
+    // NOTE: state of each JIT is kept in its 'JitRequest', so several threads instrument at once
+    std::mutex m_instrumentedLock;
+    MethodTable<InstrumentedMethod> instrumentedFunctions;
+    // Modules of the methods, which are skipped before main
+    MethodTable<ModuleID> skippedBeforeMain;
+    // NOTE: methods, skipped before main, are rejitted lazily: when they are called after main (see 'enterSkipped') or,
+    //       if they match CONCOLIC_REJIT_EAGER filters, as soon as main is reached. If CONCOLIC_LAZY_REJIT is "0",
+    //       all of them are rejitted, when main is reached
+    bool m_lazyReJit;
+    NameFilters m_eagerReJit;
+    std::mutex m_skippedLock;
+    std::vector<std::unique_ptr<SkippedMethod>> m_hookedMethods;
+    // Skipped methods, which were called after main, the worker thread requests their ReJIT in batches
+    std::thread m_reJitWorker;
+    std::mutex m_reJitLock;
+    std::condition_variable m_reJitRequested;
+    std::vector<MethodKey> m_reJitQueue;
+    bool m_reJitStopped;
+
+    std::map<std::pair<ModuleID, mdMethodDef>, PreparedBody> m_preparedBodies;
+    // NOTE: bodies are prepared by other threads, so each method is claimed once: either by its JIT or by the thread,
+    //       which prepares it ahead of time. JIT of the method, which is being prepared, waits for it
+    std::mutex m_preparedLock;
+    std::condition_variable m_bodyPrepared;
+    std::set<std::pair<ModuleID, mdMethodDef>> m_claimedMethods;
+    std::set<std::pair<ModuleID, mdMethodDef>> m_preparingMethods;
+    std::mutex m_cacheLock;
+
+    // Callees of the instrumented methods, which the worker thread instruments before they are JIT-ed
+    std::thread m_prefetchWorker;
+    std::mutex m_prefetchLock;
+    std::condition_variable m_prefetchRequested;
+    std::deque<std::pair<ModuleID, mdMethodDef>> m_prefetchQueue;
+    bool m_prefetchStopped;
+
+    std::atomic<bool> m_reJitInstrumentedStarted;
+    // NOTE: probes return at once after main is left (see 'disableTracking'), so instrumented methods are rejitted
+    //       to their original code only if CONCOLIC_REJIT_AFTER_MAIN is "1"
+    bool m_reJitAfterMain;
+
+    // Fills the method and the module of the request
+    HRESULT startRequest(FunctionID functionId, JitRequest &request);
+    HRESULT importIL(JitRequest &request);
+    HRESULT importIL(JitRequest &request, LPCBYTE pMethodBytes);
+    HRESULT allocateILBody(const JitRequest &request, unsigned codeLength, unsigned maxStackSize, unsigned ehsLength,
+                           LPBYTE &pBody, char *&bytecode, char *&ehs);
+    HRESULT commitILBody(const JitRequest &request, LPBYTE pBody);
+    HRESULT exportIL(const JitRequest &request, const char *bytecode, unsigned codeLength, unsigned maxStackSize,
+                     const char *ehs, unsigned ehsLength);
+    HRESULT instrumentNatively(JitRequest &request, const CComPtr<IMetaDataImport> &metadataImport, bool &instrumented);
+    // Reads the commands, which server sends before the instrumented body, e.g. requests of strings
+    bool awaitMethodBody(bool &stringsSent);
+    // Reads and drops the next 'count' method bodies, e.g. the rest of a failed batch
+    bool skipMethodBodies(size_t count);
+    HRESULT moduleSignatures(ModuleID moduleId, const CComPtr<IMetaDataImport> &metadataImport,
+                             std::shared_ptr<const ModuleSignatures> &signatures);
+    HRESULT methodTypeName(ModuleID moduleId, mdMethodDef method, std::string &typeName);
+    HRESULT methodInScope(ModuleID moduleId, mdMethodDef method, const ModuleInfo &module, bool &inScope);
+
+    // Returns false, if the method was already claimed
+    bool claimMethod(ModuleID moduleId, mdMethodDef method);
+    // Finishes the preparation of the claimed method, 'body' is nullptr, if it was not prepared
+    void finishPreparing(ModuleID moduleId, mdMethodDef method, PreparedBody *body);
+    // Claims the method for its JIT: waits, if it is being prepared, and takes its body, if it was prepared
+    bool takePreparedBody(ModuleID moduleId, mdMethodDef method, PreparedBody &body);
+
+    void prefetchCallees(ModuleID moduleId, const char *code, unsigned codeLength);
+    void prefetchLoop();
+    HRESULT prefetch(ModuleID moduleId, mdMethodDef method, PreparedBody &body, bool &prepared);
 
     HRESULT startReJitInstrumented();
     HRESULT startReJitSkipped();
+    bool reJitEagerly(ModuleID moduleId, mdMethodDef method);
+    void requestReJit(MethodKey key);
+    void reJitLoop();
+    static UINT_PTR STDMETHODCALLTYPE hookSkipped(FunctionID functionId, void *clientData, BOOL *hookFunction);
+    static void STDMETHODCALLTYPE enterSkipped(FunctionIDOrClientID function, COR_PRF_ELT_INFO eltInfo);
+    bool isInstrumented(MethodKey key);
     HRESULT undoInstrumentation(FunctionID functionId);
-    HRESULT doInstrumentation(ModuleID oldModuleId, const WCHAR *assemblyName, ULONG assemblyNameLength, const WCHAR *moduleName, ULONG moduleNameLength);
+    HRESULT doInstrumentation(JitRequest &request);
 
-    bool currentMethodIsMain(const WCHAR *moduleName, int moduleSize, mdMethodDef method) const;
+    bool currentMethodIsMain(const ModuleInfo &module, mdMethodDef method) const;
 
 public:
-    explicit Instrumenter(ICorProfilerInfo8 &profilerInfo, Protocol &protocol);
+    Instrumenter(ICorProfilerInfo8 &profilerInfo, Protocol &protocol, ModuleCache &moduleCache);
     ~Instrumenter();
 
-    const char *signatureTokens() const { return m_signatureTokens; }
-    unsigned signatureTokensLength() const { return m_signatureTokensLength; }
-
     void configureEntryPoint();
+    // Sets the enter hook of the methods, which are JIT-ed before main, must be called during the profiler initialization
+    HRESULT hookSkippedMethods();
 
     HRESULT instrument(FunctionID functionId);
     HRESULT reInstrument(FunctionID functionId);
+    // If the session batches instrumentation, sends the methods of the loaded module to the server at once and keeps
+    // the instrumented bodies until the methods are JIT-ed
+    HRESULT instrumentModule(ModuleID moduleId);
+    // Drops the signatures and the prepared bodies of the module
+    void unloadModule(ModuleID moduleId);
 };
 
 }
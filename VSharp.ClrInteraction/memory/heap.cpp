@@ -157,6 +157,7 @@ namespace vsharp {
     Heap::Heap() = default;
 
     OBJID Heap::allocateObject(ADDR address, SIZE size, char *type, unsigned long typeLength) {
+        std::lock_guard<std::mutex> guard(lock);
         auto *obj = new Object(address, size);
         tree.add(*obj);
         auto id = (OBJID) obj;
@@ -165,12 +166,14 @@ namespace vsharp {
     }
 
     void Heap::moveAndMark(ADDR oldLeft, ADDR newLeft, SIZE length) {
+        std::lock_guard<std::mutex> guard(lock);
         Interval i(oldLeft, length);
         Shift s{oldLeft, newLeft};
         tree.moveAndMark(i, s);
     }
 
     bool Heap::read(ADDR address, SIZE sizeOfPtr) const {
+        std::lock_guard<std::mutex> guard(lock);
         VirtualAddress vAddress{};
         if (!resolve(address, vAddress)) {
             return false;
@@ -181,6 +184,7 @@ namespace vsharp {
     }
 
     void Heap::write(ADDR address, SIZE sizeOfPtr, bool vConcreteness) const {
+        std::lock_guard<std::mutex> guard(lock);
         VirtualAddress vAddress{};
         if (!resolve(address, vAddress)) {
             FAIL_LOUD("Writing to heap: unable to resolve address");
@@ -200,27 +204,35 @@ namespace vsharp {
     }
 
     void Heap::markSurvivedObjects(ADDR start, SIZE length) {
+        std::lock_guard<std::mutex> guard(lock);
         Interval i(start, length);
         tree.mark(i);
     }
 
     void Heap::clearAfterGC() {
+        std::lock_guard<std::mutex> guard(lock);
         auto deleted = tree.clearUnmarked();
         for (Interval *address : deleted)
             deletedAddresses.push_back((OBJID) address);
     }
 
     // TODO: store new addresses or get them from tree? #do
-    std::map<OBJID, std::pair<char*, unsigned long>> Heap::flushObjects() {
+    void Heap::flushObjects(std::vector<OBJID> &addresses, std::vector<unsigned long> &typeLengths, std::vector<char> &types) {
+        std::lock_guard<std::mutex> guard(lock);
 //        return tree.flush();
-        std::map<OBJID, std::pair<char*, unsigned long>> result;
-        for (const auto &address : newAddresses)
-            result[address.first] = address.second;
+        for (const auto &address : newAddresses) {
+            char *type = address.second.first;
+            unsigned long typeLength = address.second.second;
+            addresses.push_back(address.first);
+            typeLengths.push_back(typeLength);
+            types.insert(types.end(), type, type + typeLength);
+            delete[] type;
+        }
         newAddresses.clear();
-        return result;
     }
 
     void Heap::dump() const {
+        std::lock_guard<std::mutex> guard(lock);
         LOG(tout << "-------------- HEAP DUMP --------------" << std::endl);
         std::string dump = tree.dumpObjects();
         LOG(tout << dump.c_str() << std::endl);
@@ -228,6 +240,7 @@ namespace vsharp {
     }
 
     VirtualAddress Heap::physToVirtAddress(ADDR physAddress) const {
+        std::lock_guard<std::mutex> guard(lock);
         VirtualAddress vAddress{};
         if (!resolve(physAddress, vAddress)) {
             FAIL_LOUD("unable to resolve physical address!");
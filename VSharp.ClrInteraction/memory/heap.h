@@ -2,6 +2,7 @@
 #define HEAP_H_
 
 #include <map>
+#include <mutex>
 #include <vector>
 #include "intervalTree.h"
 #include "cor.h"
@@ -79,8 +80,11 @@ struct VirtualAddress
     SIZE offset;
 };
 
+// NOTE: objects are allocated and moved by the callbacks of the runtime on any thread, while probes of the explored thread
+//       read the heap, so every operation takes the lock
 class Heap {
 private:
+    mutable std::mutex lock;
     Intervals tree;
     // TODO: store new addresses or get them from tree? #do
     std::map<OBJID, std::pair<char*, unsigned long>> newAddresses;
@@ -97,7 +101,8 @@ public:
     void markSurvivedObjects(ADDR start, SIZE length);
     void clearAfterGC();
 
-    std::map<OBJID, std::pair<char*, unsigned long>> flushObjects();
+    // Appends objects allocated since the last flush and their serialized types to the given vectors
+    void flushObjects(std::vector<OBJID> &addresses, std::vector<unsigned long> &typeLengths, std::vector<char> &types);
 
     VirtualAddress physToVirtAddress(ADDR physAddress) const;
     static ADDR virtToPhysAddress(const VirtualAddress &virtAddress);
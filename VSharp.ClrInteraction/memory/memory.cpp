@@ -10,20 +10,24 @@ ThreadID currentThreadNotConfigured() {
 
 std::function<ThreadID()> vsharp::currentThread(&currentThreadNotConfigured);
 
-Heap vsharp::heap = Heap();
+Heap vsharp::heap;
 
 #ifdef _DEBUG
 std::map<unsigned, const char*> vsharp::stringsPool;
 int topStringIndex = 0;
 #endif
 
-ThreadID lastThreadID = 0;
-Stack *currentStack = nullptr;
+// NOTE: probes of any thread may run at the same time (e.g. while another one waits for instrumentation), so each thread
+//       caches its own stack. SILI accepts exec commands of one thread only, see 'claimExecChannel' of Communication.fs
+thread_local ThreadID lastThreadID = 0;
+thread_local Stack *currentStack = nullptr;
+std::mutex stacksLock;
 
 inline void switchContext() {
     ThreadID tid = currentThread();
-    if (tid != lastThreadID) {
+    if (tid != lastThreadID || !currentStack) {
         lastThreadID = tid;
+        std::lock_guard<std::mutex> lock(stacksLock);
         Stack *&s = stacks[tid];
         if (!s) s = new Stack();
         currentStack = s;
@@ -63,11 +67,12 @@ unsigned vsharp::allocateString(const char *s) {
 }
 #endif
 
-unsigned entries_count, data_ptr;
-std::vector<char> data;
-std::vector<unsigned> dataPtrs;
+// NOTE: mem buffer passes operands of a single instruction, so every thread has its own
+thread_local unsigned entries_count, data_ptr;
+thread_local std::vector<char> data;
+thread_local std::vector<unsigned> dataPtrs;
 
-int memSize = 0;
+thread_local int memSize = 0;
 
 void vsharp::clear_mem() {
     LOG(tout << "clear_mem()" << std::endl);
@@ -287,6 +292,12 @@ bool vsharp::mainLeft() {
     return _mainEntered && stack().isEmpty();
 }
 
+std::atomic<bool> vsharp::trackingDisabledFlag(false);
+
+void vsharp::disableTracking() {
+    trackingDisabledFlag.store(true, std::memory_order_relaxed);
+}
+
 VirtualAddress vsharp::resolve(INT_PTR p) {
     // TODO: add stack and statics case #do
     return heap.physToVirtAddress(p);
@@ -4,6 +4,7 @@
 #include "cor.h"
 #include "stack.h"
 #include "heap.h"
+#include <atomic>
 #include <functional>
 #include <map>
 
@@ -24,6 +25,11 @@ StackFrame &topFrame();
 void mainEntered();
 bool mainLeft();
 
+// NOTE: when main is left, tracking is disabled: probes of instrumented methods return at once instead of being rejitted
+extern std::atomic<bool> trackingDisabledFlag;
+inline bool trackingDisabled() { return trackingDisabledFlag.load(std::memory_order_relaxed); }
+void disableTracking();
+
 unsigned allocateString(const char *s);
 
 INT8 entriesCount();
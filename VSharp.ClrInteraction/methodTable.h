@@ -0,0 +1,130 @@
+#ifndef METHODTABLE_H_
+#define METHODTABLE_H_
+
+#include "cor.h"
+#include <vector>
+
+namespace vsharp {
+
+typedef unsigned long long MethodKey;
+
+// NOTE: ModuleID is a pointer, so methods are keyed by the index of their module (see 'ModuleInfo') and their token
+inline MethodKey methodKey(unsigned moduleIndex, mdMethodDef method) {
+    return ((MethodKey) moduleIndex << 32) | (MethodKey) method;
+}
+
+inline mdMethodDef methodOfKey(MethodKey key) {
+    return (mdMethodDef) key;
+}
+
+// Hash table of methods with open addressing and linear probing, so that lookups on every JIT do not chase pointers.
+// Key 0 marks empty slots: tokens of methods are never 0. Erased entries are not marked, the following ones are shifted back
+template<typename V>
+class MethodTable {
+private:
+    struct Slot {
+        MethodKey key;
+        V value;
+    };
+
+    std::vector<Slot> m_slots;
+    size_t m_count;
+
+    static size_t hash(MethodKey key) {
+        key ^= key >> 33;
+        key *= 0xff51afd7ed558ccdULL;
+        key ^= key >> 33;
+        return (size_t) key;
+    }
+
+    size_t mask() const { return m_slots.size() - 1; }
+
+    // Slot of the key or the empty slot, where it would be placed
+    size_t probe(MethodKey key) const {
+        size_t i = hash(key) & mask();
+        while (m_slots[i].key != 0 && m_slots[i].key != key)
+            i = (i + 1) & mask();
+        return i;
+    }
+
+    void grow() {
+        std::vector<Slot> slots(m_slots.empty() ? 16 : m_slots.size() * 2, Slot{0, V()});
+        slots.swap(m_slots);
+        for (Slot &slot : slots)
+            if (slot.key != 0)
+                m_slots[probe(slot.key)] = slot;
+    }
+
+public:
+    MethodTable() : m_count(0) {}
+
+    size_t size() const { return m_count; }
+
+    V *find(MethodKey key) {
+        if (m_slots.empty())
+            return nullptr;
+        Slot &slot = m_slots[probe(key)];
+        return slot.key != 0 ? &slot.value : nullptr;
+    }
+
+    bool contains(MethodKey key) {
+        return find(key) != nullptr;
+    }
+
+    // Returns false, if the key is already there: its value is kept then
+    bool insert(MethodKey key, const V &value) {
+        // NOTE: load factor is kept below 3/4
+        if ((m_count + 1) * 4 > m_slots.size() * 3)
+            grow();
+        Slot &slot = m_slots[probe(key)];
+        if (slot.key != 0)
+            return false;
+        slot = Slot{key, value};
+        m_count++;
+        return true;
+    }
+
+    bool erase(MethodKey key) {
+        if (m_slots.empty())
+            return false;
+        size_t i = probe(key);
+        if (m_slots[i].key == 0)
+            return false;
+        // NOTE: entries after the erased one are moved into the hole, if it lies between their home slot and them
+        size_t j = i;
+        while (true) {
+            j = (j + 1) & mask();
+            if (m_slots[j].key == 0)
+                break;
+            size_t home = hash(m_slots[j].key) & mask();
+            if (((j - home) & mask()) >= ((j - i) & mask())) {
+                m_slots[i] = m_slots[j];
+                i = j;
+            }
+        }
+        m_slots[i] = Slot{0, V()};
+        m_count--;
+        return true;
+    }
+
+    // Calls 'f(key, value)' for each entry
+    template<typename F>
+    void forEach(F f) const {
+        for (const Slot &slot : m_slots)
+            if (slot.key != 0)
+                f(slot.key, slot.value);
+    }
+
+    // Erases the entries, for which 'p(key, value)' holds
+    template<typename P>
+    void eraseIf(P p) {
+        std::vector<MethodKey> erased;
+        forEach([&](MethodKey key, const V &value) { if (p(key, value)) erased.push_back(key); });
+        for (MethodKey key : erased)
+            erase(key);
+    }
+};
+
+}
+
+#endif // METHODTABLE_H_
@@ -0,0 +1,459 @@
+// Stand-in for SILI, which runs the profiler end-to-end without the F# engine: it talks the protocol on the unix domain
+// socket (CONCOLIC_PIPE), so the profiler, the protocol and the instrumentation can be exercised and timed alone.
+//   Instrumentation: bodies are echoed back uninstrumented, or, with --replay, the bodies of the session, which was recorded
+//   by the profiler with CONCOLIC_RECORD, are sent back with their probe addresses and signature tokens relocated
+//   (see 'relocateProbes'). Bodies, whose original code differs from the recorded one, are stale and echoed.
+//   Execution: the call stack frames of every channel are tracked, so the responses carry the right amount of frames; nothing
+//   is concretized and the pushed value is symbolic, if the instruction at the offset pushes one (taken from the original code).
+// Usage: mockServer [options] <socket path> [-- command...]
+//   --entry-point <module path> <token>  entry point to send, by default the recorded one or none
+//   --replay <recording>                 replay instrumented bodies of the recording
+//   --release-profiler                   the profiler is built without _DEBUG, so bodies are sent without commands
+//   --protocol <version>                 latest offered version of the framing (default is the latest one)
+//   --fixed                              offer only the fixed encoding
+//   --shm                                offer shared memory transport (the command gets CONCOLIC_TRANSPORT=shm)
+//   --seqpacket                          listen on sequenced packet socket
+//   --sessions <count>                   amount of sessions to serve (default 1)
+// The command is started with CONCOLIC_PIPE and CONCOLIC_TRANSPORT set, profiler variables of the runtime are inherited.
+
+#include "mockServer/serverConnection.h"
+#include "mockServer/recordedBodies.h"
+#include "communication/execCommand.h"
+#include "ilOpcodes.h"
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <map>
+#include <string>
+#include <vector>
+
+using namespace vsharp;
+
+struct Options {
+    const char *socketPath = nullptr;
+    const char *entryPointModule = nullptr;
+    unsigned entryPointToken = 0;
+    const char *recordingPath = nullptr;
+    bool releaseProfiler = false;
+    ProtocolVersion version = LatestProtocolVersion;
+    bool fixedOnly = false;
+    bool sharedMemory = false;
+    bool seqpacket = false;
+    unsigned sessions = 1;
+    char **command = nullptr;
+};
+
+struct MockStats {
+    unsigned long long methodsEchoed = 0;
+    unsigned long long methodsReplayed = 0;
+    unsigned long long methodsStale = 0;
+    unsigned long long commands = 0;
+    unsigned long long events = 0;
+    unsigned long long unpredictedPushes = 0;
+};
+
+// Entry point message: [length of module name in chars][token][UTF-16 module name]
+static std::vector<char> entryPointMessage(const char *module, unsigned token) {
+    std::vector<char16_t> name;
+    const unsigned char *bytes = (const unsigned char *) module;
+    while (*bytes) {
+        unsigned codePoint = *bytes++;
+        unsigned continuations = codePoint >= 0xF0 ? 3 : codePoint >= 0xE0 ? 2 : codePoint >= 0xC0 ? 1 : 0;
+        codePoint &= continuations ? 0x3F >> continuations : 0x7F;
+        for (; continuations && (*bytes & 0xC0) == 0x80; --continuations)
+            codePoint = (codePoint << 6) | (*bytes++ & 0x3F);
+        if (codePoint >= 0x10000) {
+            codePoint -= 0x10000;
+            name.push_back((char16_t) (0xD800 | (codePoint >> 10)));
+            name.push_back((char16_t) (0xDC00 | (codePoint & 0x3FF)));
+        } else {
+            name.push_back((char16_t) codePoint);
+        }
+    }
+    int header[] = { (int) name.size(), (int) token };
+    std::vector<char> message((char *) header, (char *) header + sizeof(header));
+    message.insert(message.end(), (char *) name.data(), (char *) (name.data() + name.size()));
+    return message;
+}
+
+// Server side of one session of the profiler
+class MockSession {
+private:
+    ServerConnection &m_connection;
+    const Options &m_options;
+    const RecordedBodies *m_recorded;
+    MockStats &m_stats;
+    std::vector<unsigned long long> m_probeAddresses;
+    unsigned m_mainToken;
+    // NOTE: while a thread waits for the response, frames of the other channels are put aside
+    std::map<unsigned, std::deque<std::vector<char>>> m_backlog;
+    std::map<unsigned, std::vector<unsigned>> m_frames;
+    // Original code of the instrumented methods by token, from which the pushes of instructions are predicted
+    std::map<unsigned, std::vector<char>> m_originalCode;
+
+    bool readFrame(std::vector<char> &frame, unsigned &channel) {
+        for (auto &entry : m_backlog) {
+            if (entry.second.empty()) continue;
+            channel = entry.first;
+            frame.swap(entry.second.front());
+            entry.second.pop_front();
+            return true;
+        }
+        return m_connection.readMessage(frame, channel);
+    }
+
+    bool readFrameOf(unsigned channel, std::vector<char> &frame) {
+        std::deque<std::vector<char>> &backlog = m_backlog[channel];
+        if (!backlog.empty()) {
+            frame.swap(backlog.front());
+            backlog.pop_front();
+            return true;
+        }
+        unsigned frameChannel;
+        while (m_connection.readMessage(frame, frameChannel)) {
+            if (frameChannel == channel) return true;
+            m_backlog[frameChannel].push_back(frame);
+        }
+        return false;
+    }
+
+    bool writeCommand(CommandType command, unsigned channel) {
+        char byte = (char) command;
+        return m_connection.writeMessage(&byte, 1, channel);
+    }
+
+    bool sendBody(unsigned channel, const char *code, unsigned codeLength, unsigned maxStackSize, const char *ehs, unsigned ehsLength) {
+        if (!m_options.releaseProfiler && !writeCommand(ReadMethodBody, channel)) return false;
+        std::vector<char> body(sizeof(int) + sizeof(unsigned));
+        int length = (int) codeLength;
+        memcpy(body.data(), &length, sizeof(int));
+        memcpy(body.data() + sizeof(int), &maxStackSize, sizeof(unsigned));
+        body.insert(body.end(), code, code + codeLength);
+        body.insert(body.end(), ehs, ehs + ehsLength);
+        return m_connection.writeMessage(body.data(), (int) body.size(), channel);
+    }
+
+    bool replay(unsigned channel, const InstrumentRequest &request, const RecordedBody &body, const std::vector<char> &code) {
+        if (!m_options.releaseProfiler) {
+            std::vector<char> index;
+            for (size_t i = 0; i < body.strings.size(); ++i) {
+                const std::vector<char> &string = body.strings[i];
+                if (!writeCommand(ReadString, channel) || !m_connection.writeMessage(string.data(), (int) string.size(), channel)
+                    || !readFrameOf(channel, index) || index.size() != sizeof(unsigned))
+                    return false;
+                unsigned stringIndex;
+                memcpy(&stringIndex, index.data(), sizeof(unsigned));
+                if (stringIndex != body.stringIndices[i])
+                    fprintf(stderr, "Warning: string of %x got index %u instead of recorded %u\n", request.token, stringIndex, body.stringIndices[i]);
+            }
+        }
+        ++m_stats.methodsReplayed;
+        return sendBody(channel, code.data(), (unsigned) code.size(), body.maxStackSize, body.ehs.data(), (unsigned) body.ehs.size());
+    }
+
+    bool serveInstrument(unsigned channel) {
+        std::vector<char> message;
+        InstrumentRequest request;
+        if (!readFrameOf(channel, message) || !request.parse(message.data(), message.size())) {
+            fprintf(stderr, "Malformed instrument request\n");
+            return false;
+        }
+        m_originalCode[request.token].assign(request.code, request.code + request.codeLength);
+        if (m_recorded) {
+            bool stale;
+            const RecordedBody *body = m_recorded->find(request, stale);
+            if (stale) ++m_stats.methodsStale;
+            if (body) {
+                std::vector<char> code = body->code;
+                if (relocateProbes(code.data(), (unsigned) code.size(), m_recorded->probeAddresses(), m_probeAddresses,
+                                   body->signatureTokens, request.signatureTokens))
+                    return replay(channel, request, *body, code);
+                fprintf(stderr, "Warning: recorded body of %x is malformed, echoing it\n", request.token);
+            }
+        }
+        ++m_stats.methodsEchoed;
+        return sendBody(channel, request.code, request.codeLength, request.maxStackSize, request.ehs, request.ehsLength);
+    }
+
+    // Applies frames of the exec command to the call stack of the channel. Returns the amount of evaluation stack operands
+    bool applyCommand(char *&bytes, const char *end, unsigned channel, unsigned &offset, unsigned &opsCount) {
+        unsigned newFramesCount, framesPops = 0;
+        std::vector<unsigned> newFrames;
+        opsCount = 0;
+        // NOTE: only prefixes of commands are parsed, the rest is skipped by the caller
+        if (m_connection.encoding() == CompactEncoding) {
+            offset = (unsigned) readVarint(bytes);
+            unsigned char sections = (unsigned char) *bytes++;
+            if (sections & SectionNewCallStackFrames) {
+                newFramesCount = (unsigned) readVarint(bytes);
+                for (unsigned i = 0; i < newFramesCount && bytes < end; ++i)
+                    newFrames.push_back((unsigned) readVarint(bytes));
+            }
+            if (sections & SectionCallStackFramesPops) framesPops = (unsigned) readVarint(bytes);
+            if (sections & SectionEvaluationStackPushes) opsCount = (unsigned) readVarint(bytes);
+        } else {
+            unsigned header[7];
+            if (bytes + sizeof(header) > end) return false;
+            memcpy(header, bytes, sizeof(header));
+            bytes += sizeof(header);
+            offset = header[0];
+            newFramesCount = header[2];
+            framesPops = header[3];
+            opsCount = header[4];
+            if (bytes + (size_t) newFramesCount * sizeof(unsigned) > end) return false;
+            newFrames.resize(newFramesCount);
+            if (newFramesCount) memcpy(newFrames.data(), bytes, newFramesCount * sizeof(unsigned));
+        }
+        if (bytes > end) return false;
+        // NOTE: the profiler starts tracking of the frames with the frame of main
+        auto inserted = m_frames.insert(std::make_pair(channel, std::vector<unsigned>(1, m_mainToken)));
+        std::vector<unsigned> &frames = inserted.first->second;
+        frames.resize(framesPops < frames.size() ? frames.size() - framesPops : 0);
+        frames.insert(frames.end(), newFrames.begin(), newFrames.end());
+        return true;
+    }
+
+    // NOTE: 0 if the instruction pushes nothing, 1 if it pushes symbolic value: calls push their results after the return,
+    //       'ret' of main pushes the returned value back
+    char predictPush(unsigned channel, unsigned offset, unsigned opsCount) {
+        const std::vector<unsigned> &frames = m_frames[channel];
+        auto code = frames.empty() ? m_originalCode.end() : m_originalCode.find(frames.back());
+        const ILOpcode *opcode;
+        if (code == m_originalCode.end() || !decodeILInstruction(code->second.data(), (unsigned) code->second.size(), offset, opcode)) {
+            ++m_stats.unpredictedPushes;
+            return 0;
+        }
+        if (opcode->value == ILOpcodeRet)
+            return opsCount > 0 ? 1 : 0;
+        if (opcode->pushes == VariableStackBehaviour)
+            return 0;
+        return opcode->pushes > 0 ? 1 : 0;
+    }
+
+    bool respond(unsigned channel, char lastPush) {
+        int framesCount = (int) m_frames[channel].size();
+        if (m_connection.encoding() == CompactEncoding) {
+            char response[1 + 5];
+            char *end = response;
+            *end++ = lastPush;
+            writeVarint(end, (unsigned) framesCount);
+            return m_connection.writeMessage(response, (int) (end - response), channel);
+        }
+        char response[2 * sizeof(int) + 2];
+        memcpy(response, &framesCount, sizeof(int));
+        response[sizeof(int)] = lastPush;
+        int noOps = -1;
+        memcpy(response + sizeof(int) + 1, &noOps, sizeof(int));
+        response[2 * sizeof(int) + 1] = 0;
+        return m_connection.writeMessage(response, sizeof(response), channel);
+    }
+
+    bool serveExec(unsigned channel, CommandType command) {
+        std::vector<char> message;
+        if (!readFrameOf(channel, message)) return false;
+        char *bytes = message.data();
+        char *end = bytes + message.size();
+        unsigned offset, opsCount;
+        if (command != ExecuteCommand) {
+            unsigned count;
+            if (message.size() < sizeof(unsigned)) return false;
+            memcpy(&count, bytes, sizeof(unsigned));
+            bytes += sizeof(unsigned);
+            for (unsigned i = 0; i < count; ++i) {
+                unsigned length;
+                if (bytes + sizeof(unsigned) > end) return false;
+                memcpy(&length, bytes, sizeof(unsigned));
+                bytes += sizeof(unsigned);
+                char *event = bytes;
+                if (bytes + length > end || !applyCommand(event, bytes + length, channel, offset, opsCount)) return false;
+                bytes += length;
+            }
+            m_stats.events += count;
+        }
+        if (!applyCommand(bytes, end, channel, offset, opsCount)) return false;
+        ++m_stats.commands;
+        // NOTE: pipelined commands always push the symbolic result, the profiler checks it
+        char lastPush = command == ExecutePipelinedCommand ? 1 : predictPush(channel, offset, opsCount);
+        return respond(channel, lastPush);
+    }
+
+public:
+    MockSession(ServerConnection &connection, const Options &options, const RecordedBodies *recorded, MockStats &stats)
+        : m_connection(connection), m_options(options), m_recorded(recorded), m_stats(stats), m_mainToken(0) {}
+
+    bool serve() {
+        ServerOffer offer = { m_options.version, 1 << FixedEncoding, { 0, MaxBatchEvents, SharedMemoryRingCapacity } };
+        if (!m_options.fixedOnly)
+            offer.encodings |= 1 << CompactEncoding;
+        offer.capabilities.mask = EventBatchesCapability | PipelinedCommandsCapability | (m_options.sharedMemory ? SharedMemoryCapability : 0);
+        if (!m_connection.handshake(offer) || !m_connection.setupTransport()) {
+            fprintf(stderr, "Handshake with the profiler failed\n");
+            return false;
+        }
+        if (m_connection.version() < ProtocolV2) {
+            fprintf(stderr, "Profiler chose protocol v1, which is not supported\n");
+            return false;
+        }
+        std::vector<char> frame;
+        unsigned channel;
+        if (!readFrame(frame, channel) || !parseProbeAddresses(frame, m_probeAddresses)) {
+            fprintf(stderr, "Malformed probes\n");
+            return false;
+        }
+        std::vector<char> entryPoint = m_options.entryPointModule ? entryPointMessage(m_options.entryPointModule, m_options.entryPointToken)
+                                     : m_recorded ? m_recorded->entryPoint() : entryPointMessage("", 0);
+        if (entryPoint.size() >= 2 * sizeof(int))
+            memcpy(&m_mainToken, entryPoint.data() + sizeof(int), sizeof(unsigned));
+        if (!m_connection.writeMessage(entryPoint.data(), (int) entryPoint.size(), channel))
+            return false;
+
+        while (readFrame(frame, channel)) {
+            if (frame.size() != 1) {
+                fprintf(stderr, "Unexpected message of %u bytes from channel %u\n", (unsigned) frame.size(), channel);
+                return false;
+            }
+            CommandType command = (CommandType) frame[0];
+            bool served;
+            switch (command) {
+                case InstrumentCommand:
+                    served = serveInstrument(channel);
+                    break;
+                case ExecuteCommand:
+                case ExecuteBatchCommand:
+                case ExecutePipelinedCommand:
+                    served = serveExec(channel, command);
+                    break;
+                default:
+                    fprintf(stderr, "Unexpected command %x from channel %u\n", (unsigned char) frame[0], channel);
+                    served = false;
+            }
+            if (!served) return false;
+        }
+        return true;
+    }
+};
+
+static bool parseOptions(int argc, char *argv[], Options &options) {
+    int i = 1;
+    for (; i < argc && argv[i][0] == '-' && strcmp(argv[i], "--"); ++i) {
+        std::string option = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (option == "--entry-point" && i + 2 < argc) {
+            options.entryPointModule = argv[++i];
+            options.entryPointToken = (unsigned) strtoul(argv[++i], nullptr, 0);
+        } else if (option == "--replay" && hasValue) {
+            options.recordingPath = argv[++i];
+        } else if (option == "--release-profiler") {
+            options.releaseProfiler = true;
+        } else if (option == "--protocol" && hasValue) {
+            int version = atoi(argv[++i]);
+            if (version < ProtocolV1 || version > LatestProtocolVersion) return false;
+            options.version = (ProtocolVersion) version;
+        } else if (option == "--fixed") {
+            options.fixedOnly = true;
+        } else if (option == "--shm") {
+            if (!(SupportedCapabilities & SharedMemoryCapability)) return false;
+            options.sharedMemory = true;
+        } else if (option == "--seqpacket") {
+            options.seqpacket = true;
+        } else if (option == "--sessions" && hasValue) {
+            options.sessions = (unsigned) strtoul(argv[++i], nullptr, 10);
+        } else {
+            return false;
+        }
+    }
+    if (i >= argc || !strcmp(argv[i], "--")) return false;
+    options.socketPath = argv[i++];
+    if (i < argc) {
+        if (strcmp(argv[i], "--") || i + 1 >= argc) return false;
+        options.command = argv + i + 1;
+    }
+    return true;
+}
+
+// Waits for the connection of the profiler. Returns -1, if the started command exited without connecting
+static int acceptSession(int listener, pid_t child, int &status, bool &exited) {
+    while (true) {
+        struct pollfd request = { listener, POLLIN, 0 };
+        int ready = poll(&request, 1, 100);
+        if (ready > 0) return accept(listener, nullptr, nullptr);
+        if (ready < 0) return -1;
+        if (child > 0 && waitpid(child, &status, WNOHANG) == child) {
+            exited = true;
+            return -1;
+        }
+    }
+}
+
+int main(int argc, char *argv[]) {
+    Options options;
+    if (!parseOptions(argc, argv, options)) {
+        fprintf(stderr, "Usage: %s [--entry-point <module path> <token>] [--replay <recording>] [--release-profiler] "
+                        "[--protocol <version>] [--fixed] [--shm] [--seqpacket] [--sessions <count>] <socket path> [-- command...]\n", argv[0]);
+        return 2;
+    }
+    RecordedBodies recorded;
+    if (options.recordingPath) {
+        if (!recorded.load(options.recordingPath)) return 1;
+        printf("Loaded %u recorded bodies\n", (unsigned) recorded.size());
+    }
+    int listener = ServerConnection::listen(options.socketPath, options.seqpacket);
+    if (listener < 0) {
+        perror("listen");
+        return 1;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    pid_t child = 0;
+    if (options.command) {
+        child = fork();
+        if (child < 0) {
+            perror("fork");
+            return 1;
+        }
+        if (child == 0) {
+            close(listener);
+            setenv("CONCOLIC_PIPE", options.socketPath, 1);
+            setenv("CONCOLIC_TRANSPORT", options.sharedMemory ? "shm" : "socket", 1);
+            execvp(options.command[0], options.command);
+            perror("execvp");
+            _exit(127);
+        }
+    }
+
+    MockStats stats;
+    int status = 0;
+    bool exited = false;
+    unsigned sessions = 0;
+    bool failed = false;
+    for (; sessions < options.sessions; ++sessions) {
+        int fd = acceptSession(listener, child, status, exited);
+        if (fd < 0) break;
+        ServerConnection connection(fd, options.seqpacket);
+        if (!MockSession(connection, options, options.recordingPath ? &recorded : nullptr, stats).serve())
+            failed = true;
+    }
+    close(listener);
+    unlink(options.socketPath);
+    if (child > 0 && !exited)
+        waitpid(child, &status, 0);
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    printf("sessions: %u, methods: %llu echoed, %llu replayed, %llu stale; commands: %llu, batched events: %llu, "
+           "unpredicted pushes: %llu; %.3f s\n",
+           sessions, stats.methodsEchoed, stats.methodsReplayed, stats.methodsStale, stats.commands, stats.events,
+           stats.unpredictedPushes, seconds);
+    if (child > 0) {
+        int code = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+        printf("command exited with %d\n", code);
+        return code ? code : failed ? 1 : 0;
+    }
+    return failed ? 1 : 0;
+}
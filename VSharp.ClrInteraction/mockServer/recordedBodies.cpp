@@ -0,0 +1,242 @@
+#include "recordedBodies.h"
+#include "communication/fileCommunicator.h"
+#include "communication/protocol.h"
+
+#include <cstdio>
+#include <cstring>
+#include <deque>
+
+using namespace vsharp;
+
+bool InstrumentRequest::parse(const char *message, size_t length) {
+    const size_t headerLength = 6 * sizeof(unsigned);
+    if (length < headerLength) return false;
+    unsigned header[6];
+    memcpy(header, message, headerLength);
+    token = header[0];
+    codeLength = header[1];
+    unsigned assemblyNameLength = header[2];
+    unsigned moduleNameLength = header[3];
+    maxStackSize = header[4];
+    unsigned signatureTokensLength = header[5];
+    // NOTE: length of exception handling clauses is not sent, they take the rest of the message
+    unsigned long long known = (unsigned long long) headerLength + signatureTokensLength + assemblyNameLength
+                             + moduleNameLength + codeLength;
+    if (known > length || signatureTokensLength % sizeof(unsigned)) return false;
+    const char *bytes = message + headerLength;
+    signatureTokens.resize(signatureTokensLength / sizeof(unsigned));
+    if (signatureTokensLength) memcpy(signatureTokens.data(), bytes, signatureTokensLength);
+    bytes += signatureTokensLength;
+    assemblyName.assign(bytes, assemblyNameLength); bytes += assemblyNameLength;
+    moduleName.assign(bytes, moduleNameLength); bytes += moduleNameLength;
+    code = bytes; bytes += codeLength;
+    ehs = bytes;
+    ehsLength = (unsigned) (length - known);
+    return true;
+}
+
+bool vsharp::parseProbeAddresses(const std::vector<char> &message, std::vector<unsigned long long> &addresses) {
+    addresses.clear();
+    size_t offset = 0;
+    while (offset < message.size()) {
+        unsigned long long address;
+        if (offset + sizeof(address) + 1 > message.size()) return false;
+        memcpy(&address, message.data() + offset, sizeof(address));
+        unsigned signatureLength = (unsigned char) message[offset + sizeof(address)];
+        offset += sizeof(address) + 1 + signatureLength;
+        addresses.push_back(address);
+    }
+    return offset == message.size();
+}
+
+// Splits the recorded stream of one direction into the frames of v2 or later
+class RecordedFrames {
+private:
+    const std::vector<char> &m_stream;
+    size_t m_offset;
+    bool m_withChannels;
+
+public:
+    RecordedFrames(const std::vector<char> &stream, size_t offset, bool withChannels)
+        : m_stream(stream), m_offset(offset), m_withChannels(withChannels) {}
+
+    bool atEnd() const { return m_offset >= m_stream.size(); }
+
+    bool next(std::vector<char> &frame, unsigned &channel) {
+        int header[2] = { 0, 0 };
+        size_t headerLength = (m_withChannels ? 2 : 1) * sizeof(int);
+        if (m_offset + headerLength > m_stream.size()) return false;
+        memcpy(header, m_stream.data() + m_offset, headerLength);
+        if (header[0] < 0 || m_offset + headerLength + header[0] > m_stream.size()) return false;
+        const char *payload = m_stream.data() + m_offset + headerLength;
+        frame.assign(payload, payload + header[0]);
+        channel = (unsigned) header[1];
+        m_offset += headerLength + header[0];
+        return true;
+    }
+};
+
+typedef std::deque<std::vector<char>> FrameQueue;
+
+static bool takeFrame(FrameQueue &queue, std::vector<char> &frame) {
+    if (queue.empty()) return false;
+    frame.swap(queue.front());
+    queue.pop_front();
+    return true;
+}
+
+static bool isCommand(const std::vector<char> &frame, CommandType command) {
+    return frame.size() == 1 && frame[0] == (char) command;
+}
+
+bool RecordedBodies::load(const char *path) {
+    FILE *file = fopen(path, "rb");
+    if (!file) {
+        fprintf(stderr, "Could not open recording %s\n", path);
+        return false;
+    }
+    std::vector<char> incoming, outgoing;
+    char magic[sizeof(RecordMagic)];
+    bool valid = fread(magic, 1, sizeof(magic), file) == sizeof(magic) && !memcmp(magic, RecordMagic, sizeof(magic));
+    int direction;
+    while (valid && (direction = fgetc(file)) != EOF) {
+        int count;
+        if (fread(&count, sizeof(int), 1, file) != 1 || count < 0 || (direction != RecordRead && direction != RecordWrite)) {
+            valid = false;
+            break;
+        }
+        std::vector<char> &stream = direction == RecordRead ? incoming : outgoing;
+        size_t start = stream.size();
+        stream.resize(start + count);
+        valid = fread(stream.data() + start, 1, count, file) == (size_t) count;
+    }
+    fclose(file);
+    if (!valid) {
+        fprintf(stderr, "Recording %s is corrupted\n", path);
+        return false;
+    }
+
+    // NOTE: handshake is framed by v1: the profiler reads [count][greeting] and confirms twice, then writes [count][answer],
+    //       which the server confirms twice
+    int greetingLength, answerLength;
+    if (incoming.size() < sizeof(int) || outgoing.size() < 2 + sizeof(int)) {
+        fprintf(stderr, "Recording %s has no handshake\n", path);
+        return false;
+    }
+    memcpy(&greetingLength, incoming.data(), sizeof(int));
+    memcpy(&answerLength, outgoing.data() + 2, sizeof(int));
+    size_t incomingOffset = sizeof(int) + greetingLength + 2;
+    size_t outgoingOffset = 2 + sizeof(int) + answerLength;
+    if (greetingLength < 4 || answerLength < 3 || incomingOffset > incoming.size() || outgoingOffset > outgoing.size()) {
+        fprintf(stderr, "Recording %s has corrupted handshake\n", path);
+        return false;
+    }
+    const char *answer = outgoing.data() + 2 + sizeof(int);
+    ProtocolVersion version = answerLength > 4 ? (ProtocolVersion) answer[4] : ProtocolV1;
+    if (version < ProtocolV2) {
+        fprintf(stderr, "Recording %s: sessions of protocol v1 are not supported\n", path);
+        return false;
+    }
+    RecordedFrames reads(incoming, incomingOffset, version >= ProtocolV5);
+    RecordedFrames writes(outgoing, outgoingOffset, version >= ProtocolV5);
+    std::vector<char> frame;
+    unsigned channel;
+
+    // NOTE: setup of shared memory is [pid][fd][capacity] and the answer [1]; older clients do not send the capabilities,
+    //       so the setup is recognized by its shape, probes message is much longer
+    bool sharedMemory;
+    if (answerLength >= 6 + (int) sizeof(Capabilities)) {
+        Capabilities chosen;
+        memcpy(&chosen, answer + 6, sizeof(Capabilities));
+        sharedMemory = (chosen.mask & SharedMemoryCapability) != 0;
+    } else {
+        RecordedFrames peek(outgoing, outgoingOffset, version >= ProtocolV5);
+        sharedMemory = peek.next(frame, channel) && frame.size() == 3 * sizeof(unsigned);
+    }
+    if (sharedMemory && (!writes.next(frame, channel) || !reads.next(frame, channel))) {
+        fprintf(stderr, "Recording %s has corrupted setup of shared memory\n", path);
+        return false;
+    }
+
+    if (!writes.next(frame, channel) || !parseProbeAddresses(frame, m_probeAddresses) || !reads.next(m_entryPoint, channel)) {
+        fprintf(stderr, "Recording %s has no probes or entry point\n", path);
+        return false;
+    }
+
+    // NOTE: frames of each channel are in the order of the conversation of its thread
+    std::map<unsigned, FrameQueue> channelReads, channelWrites;
+    while (reads.next(frame, channel))
+        channelReads[channel].push_back(frame);
+    while (writes.next(frame, channel))
+        channelWrites[channel].push_back(frame);
+
+    for (auto &entry : channelWrites) {
+        FrameQueue &written = entry.second;
+        FrameQueue &read = channelReads[entry.first];
+        std::vector<char> message, response;
+        while (takeFrame(written, frame)) {
+            if (isCommand(frame, ExecuteCommand) || isCommand(frame, ExecuteBatchCommand) || isCommand(frame, ExecutePipelinedCommand)) {
+                takeFrame(written, message);
+                takeFrame(read, response);
+                continue;
+            }
+            InstrumentRequest request;
+            if (!isCommand(frame, InstrumentCommand) || !takeFrame(written, message) || !request.parse(message.data(), message.size()))
+                continue;
+            RecordedBody body;
+            body.originalCode.assign(request.code, request.code + request.codeLength);
+            body.signatureTokens = request.signatureTokens;
+            // NOTE: profilers, built without _DEBUG, expect the body right after the request, the others expect commands first
+            bool complete = false;
+            while (takeFrame(read, response)) {
+                if (isCommand(response, ReadMethodBody)) continue;
+                if (isCommand(response, ReadString)) {
+                    std::vector<char> string, index;
+                    if (!takeFrame(read, string) || !takeFrame(written, index) || index.size() != sizeof(unsigned)) break;
+                    unsigned stringIndex;
+                    memcpy(&stringIndex, index.data(), sizeof(unsigned));
+                    body.strings.push_back(string);
+                    body.stringIndices.push_back(stringIndex);
+                    continue;
+                }
+                int codeLength;
+                const size_t headerLength = sizeof(int) + sizeof(unsigned);
+                if (response.size() < headerLength) break;
+                memcpy(&codeLength, response.data(), sizeof(int));
+                memcpy(&body.maxStackSize, response.data() + sizeof(int), sizeof(unsigned));
+                if (codeLength < 0 || headerLength + codeLength > response.size()) break;
+                body.code.assign(response.begin() + headerLength, response.begin() + headerLength + codeLength);
+                body.ehs.assign(response.begin() + headerLength + codeLength, response.end());
+                complete = true;
+                break;
+            }
+            if (!complete) break;
+            m_bodies[std::make_pair(request.moduleName, request.token)] = body;
+        }
+    }
+    return true;
+}
+
+const std::vector<unsigned long long> &RecordedBodies::probeAddresses() const {
+    return m_probeAddresses;
+}
+
+const std::vector<char> &RecordedBodies::entryPoint() const {
+    return m_entryPoint;
+}
+
+size_t RecordedBodies::size() const {
+    return m_bodies.size();
+}
+
+const RecordedBody *RecordedBodies::find(const InstrumentRequest &request, bool &stale) const {
+    stale = false;
+    auto found = m_bodies.find(std::make_pair(request.moduleName, request.token));
+    if (found == m_bodies.end()) return nullptr;
+    const std::vector<char> &original = found->second.originalCode;
+    if (original.size() != request.codeLength || (request.codeLength && memcmp(original.data(), request.code, request.codeLength))) {
+        stale = true;
+        return nullptr;
+    }
+    return &found->second;
+}
@@ -0,0 +1,67 @@
+#ifndef RECORDEDBODIES_H_
+#define RECORDEDBODIES_H_
+
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace vsharp {
+
+// Parsed message of 'InstrumentCommand' (see 'MethodBodyInfo' in instrumenter.cpp): pointers refer to the message
+struct InstrumentRequest {
+    unsigned token;
+    unsigned maxStackSize;
+    std::vector<unsigned> signatureTokens;
+    // NOTE: names are UTF-16 bytes without null terminator
+    std::string assemblyName;
+    std::string moduleName;
+    const char *code;
+    unsigned codeLength;
+    const char *ehs;
+    unsigned ehsLength;
+
+    bool parse(const char *message, size_t length);
+};
+
+// Parses message of 'Protocol::sendProbes' into the addresses of probes
+bool parseProbeAddresses(const std::vector<char> &message, std::vector<unsigned long long> &addresses);
+
+// Instrumented method body, which the server sent to the profiler in the recorded session
+struct RecordedBody {
+    // Code, which the profiler asked to instrument: replayed body is valid only for the same code
+    std::vector<char> originalCode;
+    // Tokens of probe signatures in the module of the recorded session, which instrumented code refers to
+    std::vector<unsigned> signatureTokens;
+    // Strings, which the server put into the strings pool of the profiler before sending the body, and their indices
+    std::vector<std::vector<char>> strings;
+    std::vector<unsigned> stringIndices;
+    unsigned maxStackSize;
+    std::vector<char> code;
+    std::vector<char> ehs;
+};
+
+// Instrumented bodies of the session, which was recorded by the profiler with CONCOLIC_RECORD (see fileCommunicator.h).
+// NOTE: only sessions, which were framed by v2 or later, are supported: v1 interleaves confirmations with the frames
+class RecordedBodies {
+private:
+    std::vector<unsigned long long> m_probeAddresses;
+    std::vector<char> m_entryPoint;
+    std::map<std::pair<std::string, unsigned>, RecordedBody> m_bodies;
+
+public:
+    bool load(const char *path);
+
+    // Addresses of probes in the recorded session, see 'relocateProbes'
+    const std::vector<unsigned long long> &probeAddresses() const;
+    // Message of the entry point, which the server sent in the recorded session
+    const std::vector<char> &entryPoint() const;
+    size_t size() const;
+
+    // Returns the recorded body of the method or nullptr. 'stale' is set, if the method was recorded with another code
+    const RecordedBody *find(const InstrumentRequest &request, bool &stale) const;
+};
+
+}
+
+#endif // RECORDEDBODIES_H_
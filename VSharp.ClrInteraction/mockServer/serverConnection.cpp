@@ -0,0 +1,205 @@
+#include "serverConnection.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+using namespace vsharp;
+
+int ServerConnection::listen(const char *path, bool packetMode) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    int fd = socket(AF_UNIX, packetMode ? SOCK_SEQPACKET : SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+    unlink(path);
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 || ::listen(fd, 1) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+ServerConnection::ServerConnection(int fd, bool packetMode)
+    : m_fd(fd)
+    , m_packetMode(packetMode)
+    , m_packetOffset(0)
+    , m_region(nullptr)
+    , m_regionSize(0)
+    , m_sharedMemoryActive(false)
+    , m_version(ProtocolV1)
+    , m_encoding(FixedEncoding)
+    , m_capabilities{0, 0, 0} {}
+
+ServerConnection::~ServerConnection() {
+#ifdef VSHARP_SHARED_MEMORY
+    if (m_region) {
+        ((SharedMemoryHeader *) m_region)->closed = 1;
+        munmap(m_region, m_regionSize);
+    }
+#endif
+    close(m_fd);
+}
+
+int ServerConnection::readSome(char *buffer, int count) {
+#ifdef VSHARP_SHARED_MEMORY
+    if (m_sharedMemoryActive)
+        return m_in.read(buffer, count);
+#endif
+    if (!m_packetMode)
+        return (int) ::read(m_fd, buffer, count);
+    if (m_packetOffset == m_packet.size()) {
+        ssize_t length = recv(m_fd, nullptr, 0, MSG_PEEK | MSG_TRUNC);
+        if (length <= 0) return (int) length;
+        m_packet.resize(length);
+        length = recv(m_fd, m_packet.data(), m_packet.size(), 0);
+        if (length <= 0) return (int) length;
+        m_packet.resize(length);
+        m_packetOffset = 0;
+    }
+    size_t bytes = std::min((size_t) count, m_packet.size() - m_packetOffset);
+    memcpy(buffer, m_packet.data() + m_packetOffset, bytes);
+    m_packetOffset += bytes;
+    return (int) bytes;
+}
+
+bool ServerConnection::readExactly(char *buffer, int count) {
+    int bytesRead = 0;
+    while (bytesRead < count) {
+        int bytes = readSome(buffer + bytesRead, count - bytesRead);
+        if (bytes <= 0) return false;
+        bytesRead += bytes;
+    }
+    return true;
+}
+
+bool ServerConnection::writeExactly(const char *buffer, int count) {
+#ifdef VSHARP_SHARED_MEMORY
+    if (m_sharedMemoryActive) {
+        char *buffers[] = { (char *) buffer };
+        return m_out.write(buffers, &count, 1) == count;
+    }
+#endif
+    return ::write(m_fd, buffer, count) == count;
+}
+
+bool ServerConnection::confirm() {
+    char confirmation = Confirmation;
+    return writeExactly(&confirmation, 1);
+}
+
+bool ServerConnection::awaitConfirmation() {
+    char confirmation;
+    return readExactly(&confirmation, 1) && confirmation == Confirmation;
+}
+
+bool ServerConnection::readMessage(std::vector<char> &message, unsigned &channel) {
+    int header[2] = { 0, 0 };
+    int headerLength = m_version >= ProtocolV5 ? 2 : 1;
+    if (!readExactly((char *) header, headerLength * sizeof(int)) || header[0] <= 0)
+        return false;
+    channel = (unsigned) header[1];
+    message.resize(header[0]);
+    if (m_version < ProtocolV2 && !confirm()) return false;
+    if (!readExactly(message.data(), header[0])) return false;
+    return m_version >= ProtocolV2 || confirm();
+}
+
+bool ServerConnection::writeMessage(const char *payload, int count, unsigned channel) {
+    int header[] = { count, (int) channel };
+    if (m_version < ProtocolV2) {
+        return writeExactly((char *) header, sizeof(int)) && awaitConfirmation()
+            && writeExactly(payload, count) && awaitConfirmation();
+    }
+    // NOTE: header and payload are written together, so that a sequenced packet holds the whole frame
+    std::vector<char> frame((char *) header, (char *) header + (m_version >= ProtocolV5 ? 2 : 1) * sizeof(int));
+    frame.insert(frame.end(), payload, payload + count);
+    return writeExactly(frame.data(), (int) frame.size());
+}
+
+bool ServerConnection::handshake(const ServerOffer &offer) {
+    char greeting[6 + sizeof(Capabilities)] = { 'H', 'i', '!', '\0', (char) offer.version, (char) offer.encodings };
+    memcpy(greeting + 6, &offer.capabilities, sizeof(Capabilities));
+    int greetingLength = offer.version >= ProtocolV5 ? (int) sizeof(greeting) : offer.version >= ProtocolV2 ? 6 : 4;
+    // NOTE: the greeting and the answer are always framed by v1
+    m_version = ProtocolV1;
+    std::vector<char> answer;
+    unsigned channel;
+    if (!writeMessage(greeting, greetingLength, 0) || !readMessage(answer, channel) || answer.size() < 3
+        || memcmp(answer.data(), "Hi!", 3))
+        return false;
+    if (answer.size() > 4)
+        m_version = (ProtocolVersion) answer[4];
+    if (answer.size() > 5)
+        m_encoding = (WireEncoding) answer[5];
+    if (answer.size() >= 6 + sizeof(Capabilities)) {
+        memcpy(&m_capabilities, answer.data() + 6, sizeof(Capabilities));
+    } else {
+        // NOTE: clients of older servers derive capabilities from the version, see 'Protocol::chooseCapabilities'
+        const char *transport = getenv("CONCOLIC_TRANSPORT");
+        bool sharedMemory = (offer.capabilities.mask & SharedMemoryCapability) && transport && !strcmp(transport, "shm");
+        m_capabilities.mask = (m_version >= ProtocolV3 ? EventBatchesCapability : 0)
+                            | (m_version >= ProtocolV4 ? PipelinedCommandsCapability : 0)
+                            | (sharedMemory ? SharedMemoryCapability : 0);
+        m_capabilities.maxBatchEvents = MaxBatchEvents;
+        m_capabilities.ringCapacity = SharedMemoryRingCapacity;
+    }
+    return true;
+}
+
+bool ServerConnection::mapSharedMemory(unsigned pid, unsigned memoryFd, unsigned capacity) {
+#ifndef VSHARP_SHARED_MEMORY
+    return false;
+#else
+    // NOTE: memfd of the client is reachable through its descriptors in procfs, the same way SILI maps it
+    std::string path = "/proc/" + std::to_string(pid) + "/fd/" + std::to_string(memoryFd);
+    int fd = open(path.c_str(), O_RDWR);
+    if (fd < 0) return false;
+    m_regionSize = SharedMemoryHeaderSize + 2 * (size_t) capacity;
+    void *region = mmap(nullptr, m_regionSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (region == MAP_FAILED) return false;
+    m_region = (char *) region;
+    auto header = (SharedMemoryHeader *) m_region;
+    auto controls = (RingControl *) (m_region + SharedMemoryControlsOffset);
+    m_in.attach(controls, m_region + SharedMemoryHeaderSize, capacity, &header->closed);
+    m_out.attach(controls + 1, m_region + SharedMemoryHeaderSize + capacity, capacity, &header->closed);
+    return header->magic == SharedMemoryMagic && header->layoutVersion == SharedMemoryLayoutVersion
+        && header->capacity == capacity;
+#endif
+}
+
+bool ServerConnection::setupTransport() {
+    if (!(m_capabilities.mask & SharedMemoryCapability))
+        return true;
+    std::vector<char> setup;
+    unsigned channel;
+    if (!readMessage(setup, channel) || setup.size() != 3 * sizeof(unsigned)) return false;
+    unsigned values[3];
+    memcpy(values, setup.data(), sizeof(values));
+    char mapped = mapSharedMemory(values[0], values[1], values[2]) ? 1 : 0;
+    // NOTE: the answer goes through the socket, so the switch happens after it is written
+    if (!writeMessage(&mapped, 1, channel) || !mapped) return false;
+    m_sharedMemoryActive = true;
+    return true;
+}
+
+ProtocolVersion ServerConnection::version() const {
+    return m_version;
+}
+
+WireEncoding ServerConnection::encoding() const {
+    return m_encoding;
+}
+
+const Capabilities &ServerConnection::capabilities() const {
+    return m_capabilities;
+}
@@ -0,0 +1,75 @@
+#ifndef SERVERCONNECTION_H_
+#define SERVERCONNECTION_H_
+
+#include "communication/protocol.h"
+#ifdef VSHARP_SHARED_MEMORY
+#include "communication/sharedMemoryChannel.h"
+#endif
+#include <vector>
+
+namespace vsharp {
+
+// Features, which the server offers in the greeting. Servers of older versions send only the parts they know about:
+// v1 sends plain greeting, v2-v4 add the version and the encodings, v5 adds the capabilities
+struct ServerOffer {
+    ProtocolVersion version;
+    // Mask of '1 << WireEncoding'
+    unsigned encodings;
+    Capabilities capabilities;
+};
+
+// Server side of the protocol, i.e. the part of SILI, which talks to the profiler (see Communication.fs).
+// Stand-in servers of benchmarks and the mock server are built on it
+class ServerConnection {
+private:
+    int m_fd;
+    // NOTE: unread rest of a sequenced packet is discarded, so packets are buffered, as the client does
+    bool m_packetMode;
+    std::vector<char> m_packet;
+    size_t m_packetOffset;
+
+    char *m_region;
+    size_t m_regionSize;
+    bool m_sharedMemoryActive;
+#ifdef VSHARP_SHARED_MEMORY
+    Ring m_in;
+    Ring m_out;
+#endif
+
+    ProtocolVersion m_version;
+    WireEncoding m_encoding;
+    Capabilities m_capabilities;
+
+    int readSome(char *buffer, int count);
+    bool readExactly(char *buffer, int count);
+    bool writeExactly(const char *buffer, int count);
+    bool confirm();
+    bool awaitConfirmation();
+    bool mapSharedMemory(unsigned pid, unsigned memoryFd, unsigned capacity);
+
+public:
+    // Listens on the unix domain socket at 'path', the stale socket file is removed. Returns -1 on failure
+    static int listen(const char *path, bool packetMode);
+
+    // NOTE: takes ownership of the accepted socket
+    ServerConnection(int fd, bool packetMode);
+    ~ServerConnection();
+
+    // Greets the client with 'offer' and reads its choice
+    bool handshake(const ServerOffer &offer);
+    // Maps the shared region, if the client chose shared memory, and switches to its rings after the answer
+    bool setupTransport();
+
+    ProtocolVersion version() const;
+    WireEncoding encoding() const;
+    const Capabilities &capabilities() const;
+
+    // Reads the next message and the channel of the client thread, which sent it (always 0 before v5).
+    // Returns false at the end of the session
+    bool readMessage(std::vector<char> &message, unsigned &channel);
+    bool writeMessage(const char *payload, int count, unsigned channel);
+};
+
+}
+
+#endif // SERVERCONNECTION_H_
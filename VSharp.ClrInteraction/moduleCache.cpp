@@ -0,0 +1,76 @@
+#include "moduleCache.h"
+#include "corhlpr.h"
+#include "instrumentationScope.h"
+#include "logging.h"
+#include <algorithm>
+
+using namespace vsharp;
+
+ModuleCache::ModuleCache(ICorProfilerInfo8 &profilerInfo)
+    : m_profilerInfo(profilerInfo)
+    , m_nextIndex(0)
+{
+}
+
+void ModuleCache::setMainModule(const WCHAR *name, int length) {
+    std::lock_guard<std::mutex> lock(m_lock);
+    m_mainModuleName.assign(name, name + length);
+    // NOTE: modules are usually loaded after the entry point is configured, the ones loaded before are queried again
+    m_modules.clear();
+}
+
+const std::vector<WCHAR> *ModuleCache::intern(const std::vector<WCHAR> &name) {
+    return &*m_names.insert(name).first;
+}
+
+HRESULT ModuleCache::query(ModuleID moduleId, ModuleInfo &info) {
+    HRESULT hr;
+    LPCBYTE baseLoadAddress;
+    ULONG moduleNameLength;
+    IfFailRet(m_profilerInfo.GetModuleInfo2(moduleId, &baseLoadAddress, 0, &moduleNameLength, nullptr, &info.assemblyId, &info.flags));
+    std::vector<WCHAR> moduleName(moduleNameLength);
+    IfFailRet(m_profilerInfo.GetModuleInfo2(moduleId, &baseLoadAddress, moduleNameLength, &moduleNameLength, moduleName.data(), &info.assemblyId, &info.flags));
+    ULONG assemblyNameLength;
+    AppDomainID appDomainId;
+    ModuleID startModuleId;
+    IfFailRet(m_profilerInfo.GetAssemblyInfo(info.assemblyId, 0, &assemblyNameLength, nullptr, &appDomainId, &startModuleId));
+    std::vector<WCHAR> assemblyName(assemblyNameLength);
+    IfFailRet(m_profilerInfo.GetAssemblyInfo(info.assemblyId, assemblyNameLength, &assemblyNameLength, assemblyName.data(), &appDomainId, &startModuleId));
+    info.narrowAssemblyName = narrowName(assemblyName.data());
+    // NOTE: names of the runtime include null terminator, name of the main module does not
+    std::lock_guard<std::mutex> lock(m_lock);
+    info.isMain = moduleName.size() == m_mainModuleName.size() + 1 && std::equal(m_mainModuleName.begin(), m_mainModuleName.end(), moduleName.begin());
+    info.moduleName = intern(moduleName);
+    info.assemblyName = intern(assemblyName);
+    return S_OK;
+}
+
+HRESULT ModuleCache::find(ModuleID moduleId, std::shared_ptr<const ModuleInfo> &info) {
+    {
+        std::lock_guard<std::mutex> lock(m_lock);
+        const auto known = m_modules.find(moduleId);
+        if (known != m_modules.end()) {
+            info = known->second;
+            return S_OK;
+        }
+    }
+    HRESULT hr;
+    auto queried = std::make_shared<ModuleInfo>();
+    IfFailRet(query(moduleId, *queried));
+    std::lock_guard<std::mutex> lock(m_lock);
+    // NOTE: if another thread has queried the module meanwhile, its info is kept
+    const auto known = m_modules.find(moduleId);
+    if (known != m_modules.end()) {
+        info = known->second;
+        return S_OK;
+    }
+    queried->index = m_nextIndex++;
+    m_modules[moduleId] = queried;
+    info = queried;
+    return S_OK;
+}
+
+void ModuleCache::unload(ModuleID moduleId) {
+    std::lock_guard<std::mutex> lock(m_lock);
+    m_modules.erase(moduleId);
+}
@@ -0,0 +1,58 @@
+#ifndef MODULECACHE_H_
+#define MODULECACHE_H_
+
+#include "cor.h"
+#include "corprof.h"
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <vector>
+
+namespace vsharp {
+
+// Names of the loaded module and of its assembly. Names are null-terminated and interned: modules of one assembly share them
+struct ModuleInfo {
+    const std::vector<WCHAR> *moduleName;
+    const std::vector<WCHAR> *assemblyName;
+    // Assembly name for the scope filters, see 'narrowName'
+    std::string narrowAssemblyName;
+    AssemblyID assemblyId;
+    DWORD flags;
+    // Number of the module in the order of caching, modules are never renumbered (see 'methodKey')
+    unsigned index;
+    // Whether this is the module of the entry point, which SILI sends
+    bool isMain;
+};
+
+// Modules, which are filled when they are loaded and dropped when they are unloaded, so that JIT and allocations
+// do not query the runtime about them each time
+class ModuleCache {
+private:
+    ICorProfilerInfo8 &m_profilerInfo;  // Does not have ownership
+
+    std::vector<WCHAR> m_mainModuleName;
+    unsigned m_nextIndex;
+
+    std::mutex m_lock;
+    std::map<ModuleID, std::shared_ptr<const ModuleInfo>> m_modules;
+    // NOTE: interned names are never dropped, so they outlive the infos, which are still used after their modules are unloaded
+    std::set<std::vector<WCHAR>> m_names;
+
+    const std::vector<WCHAR> *intern(const std::vector<WCHAR> &name);
+    HRESULT query(ModuleID moduleId, ModuleInfo &info);
+
+public:
+    explicit ModuleCache(ICorProfilerInfo8 &profilerInfo);
+
+    // Name of the main module without null terminator, as SILI sends it
+    void setMainModule(const WCHAR *name, int length);
+    // Queries the runtime, if the module is not cached yet
+    HRESULT find(ModuleID moduleId, std::shared_ptr<const ModuleInfo> &info);
+    void unload(ModuleID moduleId);
+};
+
+}
+
+#endif // MODULECACHE_H_
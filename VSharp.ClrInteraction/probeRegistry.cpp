@@ -0,0 +1,20 @@
+#include "probeRegistry.h"
+#include <cstring>
+
+namespace vsharp {
+
+std::vector<ProbeInfo> &probesTable() {
+    // NOTE: probes are registered during static initialization, so the table is constructed on first use
+    static std::vector<ProbeInfo> table;
+    return table;
+}
+
+int probeSlot(const char *name) {
+    const std::vector<ProbeInfo> &probes = probesTable();
+    for (unsigned i = 0; i < probes.size(); ++i)
+        if (probes[i].name && !strcmp(probes[i].name, name))
+            return (int) i;
+    return -1;
+}
+
+}
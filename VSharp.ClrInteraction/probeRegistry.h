@@ -0,0 +1,74 @@
+#ifndef PROBEREGISTRY_H_
+#define PROBEREGISTRY_H_
+
+#include "cor.h"
+#include <type_traits>
+#include <vector>
+
+namespace vsharp {
+
+// 64-bit integer argument or result of the probe. INT64 and INT_PTR may be the same C++ type, so int64 is declared by this tag:
+// it is passed as INT64 and converts to it implicitly
+enum ProbeI8 : INT64 {};
+
+// Metadata element type of C++ type of probe argument or return value. Unsupported types are mapped into ELEMENT_TYPE_END
+// NOTE: INT_PTR coincides with one of the fixed-size integer types, so it is checked first: native int is what probes mean by it.
+//       Plain INT64 is not supported, see 'ProbeI8'
+template<typename T>
+constexpr CorElementType probeElementType() {
+    return std::is_same<T, void>::value ? ELEMENT_TYPE_VOID
+         : std::is_same<T, bool>::value ? ELEMENT_TYPE_BOOLEAN
+         : std::is_same<T, ProbeI8>::value ? ELEMENT_TYPE_I8
+         : std::is_same<T, INT_PTR>::value ? ELEMENT_TYPE_I
+         : std::is_same<T, INT8>::value ? ELEMENT_TYPE_I1
+         : std::is_same<T, UINT8>::value ? ELEMENT_TYPE_U1
+         : std::is_same<T, INT16>::value ? ELEMENT_TYPE_I2
+         : std::is_same<T, UINT16>::value ? ELEMENT_TYPE_U2
+         : std::is_same<T, INT32>::value ? ELEMENT_TYPE_I4
+         : std::is_same<T, UINT32>::value ? ELEMENT_TYPE_U4
+         : std::is_same<T, FLOAT>::value ? ELEMENT_TYPE_R4
+         : std::is_same<T, DOUBLE>::value ? ELEMENT_TYPE_R8
+         : ELEMENT_TYPE_END;
+}
+
+template<typename T>
+struct ProbeElementType {
+    static constexpr CorElementType value = probeElementType<T>();
+    static_assert(value != ELEMENT_TYPE_END, "Unsupported type of probe argument or return value");
+};
+
+// Metadata signature blob of the probe with C++ signature 'Ret (Args...)'
+template<typename Ret, typename... Args>
+struct ProbeSignature {
+    static constexpr COR_SIGNATURE value[] = {
+        IMAGE_CEE_CS_CALLCONV_STDCALL, sizeof...(Args), ProbeElementType<Ret>::value, ProbeElementType<Args>::value...
+    };
+};
+template<typename Ret, typename... Args>
+constexpr COR_SIGNATURE ProbeSignature<Ret, Args...>::value[];
+
+struct ProbeInfo {
+    unsigned long long address;
+    const COR_SIGNATURE *signature;
+    unsigned signatureLength;
+    // Name of the probe function, generated probes have none
+    const char *name;
+};
+
+// Table of all probes in the order of registration. Slot of the probe is its index in this table:
+// SILI gets probes addresses in this order and signature tokens of each module are defined in this order too
+std::vector<ProbeInfo> &probesTable();
+
+// Slot of the probe with the name or -1, if there is no such probe
+int probeSlot(const char *name);
+
+template<typename Ret, typename... Args>
+int registerProbe(Ret (STDMETHODCALLTYPE *probe)(Args...), const char *name = nullptr) {
+    typedef ProbeSignature<Ret, Args...> Signature;
+    probesTable().push_back({(unsigned long long) probe, Signature::value, sizeof(Signature::value), name});
+    return 0;
+}
+
+}
+
+#endif // PROBEREGISTRY_H_
@@ -4,6 +4,10 @@
 #include "cor.h"
 #include "memory/memory.h"
 #include "communication/protocol.h"
+#include "communication/execCommand.h"
+#include "fusedMemProbes.h"
+#include "probeRegistry.h"
+#include <initializer_list>
 #include <vector>
 
 #define COND INT_PTR
@@ -18,104 +22,14 @@ void setProtocol(Protocol *p) {
     protocol = p;
 }
 
-enum EvalStackArgType {
-    OpSymbolic = 1,
-    OpI4 = 2,
-    OpI8 = 3,
-    OpR4 = 4,
-    OpR8 = 5,
-    OpRef = 6
-};
-
-union OperandContent {
-    long long number;
-    VirtualAddress address;
-};
-
-struct EvalStackOperand {
-    EvalStackArgType typ;
-    OperandContent content;
-
-    size_t size() const {
-        if (typ == OpRef)
-            return sizeof(EvalStackArgType) + sizeof(unsigned long) + sizeof(unsigned long);
-        return sizeof(EvalStackArgType) + sizeof(long long);
-    }
-
-    void serialize(char *&buffer) const {
-        *(EvalStackArgType *)buffer = typ;
-        buffer += sizeof(EvalStackArgType);
-        if (typ == OpRef) {
-            *(unsigned long *)buffer = content.address.obj; buffer += sizeof(unsigned long);
-            *(unsigned long *)buffer = content.address.offset; buffer += sizeof(unsigned long);
-        } else {
-            *(long long *)buffer = content.number;
-            buffer += sizeof(long long);
-        }
-    }
-
-    void deserialize(char *&buffer) {
-        typ = *(EvalStackArgType *)buffer;
-        buffer += sizeof(EvalStackArgType);
-        if (typ == OpRef) {
-            content.address.obj = (OBJID) *(unsigned long *)buffer; buffer += sizeof(unsigned long);
-            content.address.offset = (SIZE) *(unsigned long *)buffer; buffer += sizeof(unsigned long);
-        } else {
-            content.number = *(long long *)buffer;
-            buffer += sizeof(long long);
-        }
-    }
-};
-
-struct ExecCommand {
-    unsigned offset;
-    unsigned isBranch;
-    unsigned newCallStackFramesCount;
-    unsigned callStackFramesPops;
-    unsigned evaluationStackPushesCount;
-    unsigned evaluationStackPops;
-    unsigned newAddressesCount;
-    unsigned *newCallStackFrames;
-    EvalStackOperand *evaluationStackPushes;
-    // TODO: add deleted addresses
-    OBJID *newAddresses;
-    unsigned long *newAddressesTypeLengths;
-    char *newAddressesTypes;
-
-    void serialize(char *&bytes, unsigned &count) const {
-        count = 7 * sizeof(unsigned) + sizeof(unsigned) * newCallStackFramesCount;
-        for (unsigned i = 0; i < evaluationStackPushesCount; ++i)
-            count += evaluationStackPushes[i].size();
-        count += sizeof(UINT_PTR) * newAddressesCount;
-        count += newAddressesCount * sizeof(unsigned long);
-        unsigned long fullTypesSize = 0;
-        for (int i = 0; i < newAddressesCount; ++i)
-            fullTypesSize += newAddressesTypeLengths[i];
-        count += fullTypesSize;
-        bytes = new char[count];
-        char *buffer = bytes;
-        unsigned size = sizeof(unsigned);
-        *(unsigned *)buffer = offset; buffer += size;
-        *(unsigned *)buffer = isBranch; buffer += size;
-        *(unsigned *)buffer = newCallStackFramesCount; buffer += size;
-        *(unsigned *)buffer = callStackFramesPops; buffer += size;
-        *(unsigned *)buffer = evaluationStackPushesCount; buffer += size;
-        *(unsigned *)buffer = evaluationStackPops; buffer += size;
-        *(unsigned *)buffer = newAddressesCount; buffer += size;
-        size = newCallStackFramesCount * sizeof(unsigned);
-        memcpy(buffer, (char*)newCallStackFrames, size); buffer += size;
-        for (unsigned i = 0; i < evaluationStackPushesCount; ++i) {
-            evaluationStackPushes[i].serialize(buffer);
-        }
-        size = newAddressesCount * sizeof(UINT_PTR);
-        memcpy(buffer, (char*)newAddresses, size); buffer += size;
-        size = newAddressesCount * sizeof(unsigned long);
-        memcpy(buffer, (char*)newAddressesTypeLengths, size); buffer += size;
-        memcpy(buffer, newAddressesTypes, fullTypesSize); buffer += fullTypesSize;
-    }
-};
+// Per-thread command, which is rebuilt by every step of the thread
+ExecCommand &scratchCommand() {
+    static thread_local ExecCommand command;
+    return command;
+}
 
-void initCommand(OFFSET offset, bool isBranch, unsigned opsCount, EvalStackOperand *ops, ExecCommand &command) {
+// NOTE: 'command.evaluationStackPushes' must be already filled with operands of the instruction
+void initCommand(OFFSET offset, bool isBranch, ExecCommand &command) {
     Stack &stack = vsharp::stack();
     StackFrame &top = stack.topFrame();
     command.offset = offset;
@@ -124,16 +38,17 @@ void initCommand(OFFSET offset, bool isBranch, unsigned opsCount, EvalStackOpera
     unsigned minCallFrames = stack.minTopSinceLastSent();
     unsigned currCallFrames = stack.framesCount();
     assert(minCallFrames <= currCallFrames);
-    command.newCallStackFramesCount = currCallFrames - minCallFrames;
-    command.newCallStackFrames = new unsigned[command.newCallStackFramesCount];
+    command.newCallStackFrames.clear();
     for (unsigned i = minCallFrames; i < currCallFrames; ++i) {
-        command.newCallStackFrames[i - minCallFrames] = stack.tokenAt(i);
+        command.newCallStackFrames.push_back(stack.tokenAt(i));
     }
 
     command.callStackFramesPops = stack.unsentPops();
     unsigned afterPop = top.symbolicsCount();
     const std::vector<std::pair<unsigned, unsigned>> &poppedSymbs = top.poppedSymbolics();
     unsigned currentSymbs = afterPop + poppedSymbs.size();
+    unsigned opsCount = command.evaluationStackPushes.size();
+    EvalStackOperand *ops = command.evaluationStackPushes.data();
     for (auto &pair : poppedSymbs) {
         assert((int)opsCount - (int)pair.second - 1 >= 0);
         unsigned idx = opsCount - pair.second - 1;
@@ -141,73 +56,54 @@ void initCommand(OFFSET offset, bool isBranch, unsigned opsCount, EvalStackOpera
         ops[idx].typ = OpSymbolic;
         ops[idx].content.number = (long long)(currentSymbs - pair.first);
     }
-    command.evaluationStackPushesCount = opsCount;
     command.evaluationStackPops = top.evaluationStackPops();
-    command.evaluationStackPushes = ops;
-    auto newAddresses = heap.flushObjects();
-    auto addressesSize = newAddresses.size();
-    command.newAddressesCount = addressesSize;
-    command.newAddresses = new UINT_PTR[addressesSize];
-    unsigned long fullTypesSize = 0;
-    for (const auto &newAddress : newAddresses)
-        fullTypesSize += newAddress.second.second;
-    command.newAddressesTypes = new char[fullTypesSize];
-    command.newAddressesTypeLengths = new unsigned long[addressesSize];
-    auto begin = command.newAddressesTypes;
-    int i = 0;
-    for (const auto &newAddress : newAddresses) {
-        command.newAddresses[i] = newAddress.first;
-        auto pair = newAddress.second;
-        auto typeSize = pair.second;
-        command.newAddressesTypeLengths[i] = typeSize;
-        if (typeSize != 0) memcpy(command.newAddressesTypes, pair.first, typeSize);
-        command.newAddressesTypes += typeSize;
-        delete pair.first;
-        i++;
-    }
-    command.newAddressesTypes = begin;
-}
-
-bool readExecResponse(StackFrame &top, EvalStackOperand *ops, unsigned &count, int &framesCount, EvalStackOperand &result) {
+    command.newAddresses.clear();
+    command.newAddressesTypeLengths.clear();
+    command.newAddressesTypes.clear();
+    heap.flushObjects(command.newAddresses, command.newAddressesTypeLengths, command.newAddressesTypes);
+}
+
+// NOTE: 'lastPush' is 0 if the instruction pushed nothing, 1 if it pushed symbolic value and 2 if the pushed value is concrete
+bool readExecResponse(char &lastPush, EvalStackOperand *ops, unsigned &count, int &framesCount, EvalStackOperand &result) {
     char *bytes; int messageLength;
     protocol->acceptExecResult(bytes, messageLength);
     char *start = bytes;
-    framesCount = *(int*)bytes; bytes += sizeof(int);
-    char lastPush = *(char*)bytes; bytes += sizeof(char);
-    int opsLength = *(int*)bytes; bytes += sizeof(int);
-    bool hasInternalCallResult = *(char*)bytes > 0; bytes += sizeof(char);
-    bool opsConcretized = opsLength > -1;
-    if (lastPush > 0) {
-        bool returnValueIsConcrete = (lastPush == 2);
-        top.push1(returnValueIsConcrete);
+    bool compact = protocol->encoding() == CompactEncoding;
+    int opsLength;
+    bool hasInternalCallResult;
+    if (compact) {
+        // NOTE: compact response is [flags: last push in bits 0-1, concretized operands in bit 2, result in bit 3][frames count]
+        //       [operands count, if concretized]
+        char flags = *bytes++;
+        lastPush = (char) (flags & 3);
+        hasInternalCallResult = (flags & 8) != 0;
+        framesCount = (int) readVarint(bytes);
+        opsLength = (flags & 4) ? (int) readVarint(bytes) : -1;
+    } else {
+        framesCount = *(int*)bytes; bytes += sizeof(int);
+        lastPush = *(char*)bytes; bytes += sizeof(char);
+        opsLength = *(int*)bytes; bytes += sizeof(int);
+        hasInternalCallResult = *(char*)bytes > 0; bytes += sizeof(char);
     }
+    bool opsConcretized = opsLength > -1;
 
     if (opsConcretized) {
         // NOTE: if internal call with symbolic arguments has concrete result, no arguments concretization is needed, so opsLength = 0
         assert(opsLength == count || opsLength == 0);
         for (unsigned i = 0; i < opsLength; ++i)
-            ops[i].deserialize(bytes);
+            compact ? ops[i].deserializeCompact(bytes) : ops[i].deserialize(bytes);
     }
     count = opsLength;
 
     if (hasInternalCallResult) {
         // NOTE: internal call with symbolic arguments but concrete result
-        result.deserialize(bytes);
+        compact ? result.deserializeCompact(bytes) : result.deserialize(bytes);
     }
     assert(bytes - start == messageLength);
 
-    delete start;
     return opsConcretized;
 }
 
-void freeCommand(ExecCommand &command) {
-    delete[] command.newCallStackFrames;
-    delete[] command.evaluationStackPushes;
-    delete[] command.newAddresses;
-    delete[] command.newAddressesTypeLengths;
-    delete[] command.newAddressesTypes;
-}
-
 void updateMemory(EvalStackOperand &op, unsigned int idx) {
     switch (op.typ) {
         case OpI4:
@@ -229,15 +125,111 @@ void updateMemory(EvalStackOperand &op, unsigned int idx) {
             FAIL_LOUD("updateMemory: unexpected symbolic value after concretization!");
     }
 }
-bool sendCommand(OFFSET offset, unsigned opsCount, EvalStackOperand *ops) {
-    ExecCommand command;
-    initCommand(offset, false, opsCount, ops, command);
-    protocol->sendSerializable(ExecuteCommand, command);
+
+// Per-thread events, which are not sent yet
+ExecEventBatch &eventBatch() {
+    static thread_local ExecEventBatch batch;
+    return batch;
+}
+
+// NOTE: pending events go before the command. Pipelined command is always sent as a batch, possibly empty one
+template<typename T>
+void sendEncodedExecCommand(const T &command, bool pipelined) {
+    ExecEventBatch &batch = eventBatch();
+    if (batch.empty() && !pipelined) {
+        protocol->sendSerializable(ExecuteCommand, command);
+        return;
+    }
+    protocol->sendSerializable(pipelined ? ExecutePipelinedCommand : ExecuteBatchCommand, BatchedExecCommand<T>{batch, command});
+    batch.clear();
+}
+
+void sendExecCommand(ExecCommand &command, bool pipelined) {
+    if (protocol->encoding() == CompactEncoding)
+        sendEncodedExecCommand(CompactExecCommand{command}, pipelined);
+    else
+        sendEncodedExecCommand(command, pipelined);
+}
+
+// Pipelined command is sent without waiting for its response: the result of the instruction stays symbolic and the frames
+// are the same, so the client predicts everything but the concretized operands. The response is read at the next point,
+// which depends on it: reading or refilling the mem buffer, leaving the frame or waiting for another response
+const unsigned MaxPipelinedCommands = 32;
+
+struct PipelinedCommand {
+    unsigned opsCount;
+    // NOTE: i-th bit is set if i-th operand was symbolic, so its concretized value is put into i-th mem entry
+    unsigned long long symbolicOps;
+    int framesCount;
+};
+
+// Per-thread queue of pipelined commands, whose responses are not read yet
+struct CommandPipeline {
+    PipelinedCommand commands[MaxPipelinedCommands];
+    unsigned first = 0;
+    unsigned count = 0;
+    std::vector<EvalStackOperand> ops;
+};
+
+CommandPipeline &pipeline() {
+    static thread_local CommandPipeline pipeline;
+    return pipeline;
+}
+
+// Reads the response of the oldest pipelined command and updates the memory with concretized operands
+void joinPipelinedCommand() {
+    CommandPipeline &pipeline = vsharp::pipeline();
+    assert(pipeline.count > 0);
+    const PipelinedCommand &pending = pipeline.commands[pipeline.first];
+    pipeline.ops.resize(pending.opsCount);
+    unsigned opsCount = pending.opsCount;
+    char lastPush;
+    int framesCount;
+    EvalStackOperand internalCallResult = EvalStackOperand {OpSymbolic, 0};
+    bool opsConcretized = readExecResponse(lastPush, pipeline.ops.data(), opsCount, framesCount, internalCallResult);
+    if (lastPush != 1 || framesCount != pending.framesCount || internalCallResult.typ != OpSymbolic)
+        FAIL_LOUD("joinPipelinedCommand: response of pipelined command differs from the predicted one!");
+    if (opsConcretized) {
+        for (unsigned i = 0; i < opsCount; ++i)
+            if (pending.symbolicOps & (1ull << i))
+                updateMemory(pipeline.ops[i], i);
+    }
+    pipeline.first = (pipeline.first + 1) % MaxPipelinedCommands;
+    --pipeline.count;
+}
+
+void joinPipelinedCommands() {
+    CommandPipeline &pipeline = vsharp::pipeline();
+    while (pipeline.count > 0)
+        joinPipelinedCommand();
+}
+
+// NOTE: sends 'command' with operands, which are already put into it, and updates the memory with their concretized values
+bool sendCommand(OFFSET offset, ExecCommand &command) {
+    initCommand(offset, false, command);
+    unsigned opsCount = command.evaluationStackPushes.size();
+    EvalStackOperand *ops = command.evaluationStackPushes.data();
     StackFrame &top = vsharp::topFrame();
+    char lastPush;
     int framesCount;
     EvalStackOperand internalCallResult = EvalStackOperand {OpSymbolic, 0};
     unsigned oldOpsCount = opsCount;
-    bool opsConcretized = readExecResponse(top, ops, opsCount, framesCount, internalCallResult);
+    bool opsConcretized;
+    {
+        // NOTE: threads, which share the only channel, send the command and read its response under the lock.
+        //       Nothing is pipelined then, see 'sendPipelinedCommand'
+        std::unique_lock<std::mutex> exchange;
+        if (!protocol->multiplexesChannels())
+            exchange = protocol->lockExchange();
+        sendExecCommand(command, false);
+        // NOTE: responses come in the order of commands, so responses of pipelined commands are read first
+        joinPipelinedCommands();
+        opsConcretized = readExecResponse(lastPush, ops, opsCount, framesCount, internalCallResult);
+    }
+    if (lastPush > 0) {
+        bool returnValueIsConcrete = (lastPush == 2);
+        top.push1(returnValueIsConcrete);
+    }
     if (opsConcretized && opsCount > 0) {
         const std::vector<std::pair<unsigned, unsigned>> &poppedSymbs = top.poppedSymbolics();
         for (const auto &poppedSymb : poppedSymbs) {
@@ -252,12 +244,89 @@ bool sendCommand(OFFSET offset, unsigned opsCount, EvalStackOperand *ops) {
         updateMemory(internalCallResult, oldOpsCount);
 
     vsharp::stack().resetPopsTracking(framesCount);
-    freeCommand(command);
     return opsConcretized;
 }
 
-bool sendCommand0(OFFSET offset) { return sendCommand(offset, 0, nullptr); }
-bool sendCommand1(OFFSET offset) { return sendCommand(offset, 1, new EvalStackOperand[1]); }
+bool sendCommand(OFFSET offset, std::initializer_list<EvalStackOperand> ops) {
+    ExecCommand &command = scratchCommand();
+    command.evaluationStackPushes.assign(ops);
+    return sendCommand(offset, command);
+}
+
+bool sendCommand0(OFFSET offset) { return sendCommand(offset, {}); }
+// NOTE: the only operand is symbolic, so its content is filled by 'initCommand'
+bool sendCommand1(OFFSET offset) { return sendCommand(offset, { EvalStackOperand{OpSymbolic, 0} }); }
+
+// NOTE: pipelined command must push the result of instruction and must not throw, see 'PipelinedCommand'.
+//       Response of pipelined command is read after the exchange lock is released, so threads, which share the only
+//       channel, could take each other's responses: commands are pipelined only since v5
+void sendPipelinedCommand(OFFSET offset, ExecCommand &command) {
+    if (!protocol->pipelinesCommands() || !protocol->multiplexesChannels()) {
+        sendCommand(offset, command);
+        return;
+    }
+    CommandPipeline &pipeline = vsharp::pipeline();
+    if (pipeline.count == MaxPipelinedCommands)
+        joinPipelinedCommand();
+    initCommand(offset, false, command);
+    Stack &stack = vsharp::stack();
+    StackFrame &top = stack.topFrame();
+    unsigned opsCount = command.evaluationStackPushes.size();
+    assert(opsCount <= 8 * sizeof(unsigned long long));
+    PipelinedCommand &pending = pipeline.commands[(pipeline.first + pipeline.count) % MaxPipelinedCommands];
+    pending.opsCount = opsCount;
+    pending.symbolicOps = 0;
+    for (const auto &poppedSymb : top.poppedSymbolics())
+        pending.symbolicOps |= 1ull << (opsCount - poppedSymb.second - 1);
+    pending.framesCount = (int) stack.framesCount();
+    sendExecCommand(command, true);
+    ++pipeline.count;
+    top.push1(false);
+    stack.resetPopsTracking(pending.framesCount);
+}
+
+// NOTE: the only operand is symbolic, so its content is filled by 'initCommand'
+void sendPipelinedCommand1(OFFSET offset) {
+    ExecCommand &command = scratchCommand();
+    command.evaluationStackPushes.assign({ EvalStackOperand{OpSymbolic, 0} });
+    sendPipelinedCommand(offset, command);
+}
+
+// Event is a command, whose response cannot change the concrete execution: symbolic value is only moved between
+// the evaluation stack and a local or an argument, so there is nothing to concretize and the response is predicted here:
+// the loaded value stays symbolic and the frames are the same. Events are sent with the next command, which needs a response.
+// NOTE: server keeps the loaded value on its stack even if it is concrete, so the shadow state stays consistent
+void postEvent(OFFSET offset, ExecCommand &command, bool pushesSymbolic) {
+    ExecEventBatch &batch = vsharp::eventBatch();
+    // NOTE: full batch is sent with this step as its command
+    if (!protocol->batchesEvents() || batch.count >= protocol->maxBatchEvents()) {
+        sendCommand(offset, command);
+        return;
+    }
+    initCommand(offset, false, command);
+    if (protocol->encoding() == CompactEncoding)
+        batch.append(CompactExecCommand{command});
+    else
+        batch.append(command);
+    if (pushesSymbolic)
+        topFrame().push1(false);
+    Stack &stack = vsharp::stack();
+    stack.resetPopsTracking((int) stack.framesCount());
+}
+
+// Loads symbolic value from a local or an argument
+void postLoadEvent(OFFSET offset) {
+    ExecCommand &command = scratchCommand();
+    command.evaluationStackPushes.clear();
+    postEvent(offset, command, true);
+}
+
+// Stores symbolic value into a local or an argument
+void postStoreEvent(OFFSET offset) {
+    ExecCommand &command = scratchCommand();
+    command.evaluationStackPushes.assign({ EvalStackOperand{OpSymbolic, 0} });
+    postEvent(offset, command, false);
+}
 
 // TODO:
 EvalStackOperand mkop_4(INT32 op) { return {OpI4, (long long)op}; }
@@ -282,8 +351,8 @@ EvalStackOperand mkop_p(INT_PTR op) {
 }
 EvalStackOperand mkop_struct(INT_PTR op) { FAIL_LOUD("not implemented"); }
 
-EvalStackOperand* createOps(int opsCount) {
-    auto ops = new EvalStackOperand[opsCount];
+void createOps(int opsCount, std::vector<EvalStackOperand> &ops) {
+    ops.resize(opsCount);
     for (int i = 0; i < opsCount; ++i) {
         CorElementType type = unmemType((INT8) i);
         switch (type) {
@@ -314,21 +383,42 @@ EvalStackOperand* createOps(int opsCount) {
                 break;
         }
     }
-    return ops;
 }
 
 /// ------------------------------ Probes declarations ---------------------------
 
-std::vector<unsigned long long> ProbesAddresses;
+// NOTE: COND probes report concrete operands after tracking is disabled, so that Exec probes are not called
+template<typename Ret>
+struct UntrackedResult {
+    static Ret value() { return (Ret) 1; }
+};
+template<>
+struct UntrackedResult<void> {
+    static void value() {}
+};
 
-int registerProbe(unsigned long long probe) {
-    ProbesAddresses.push_back(probe);
-    return 0;
-}
+// Entry of the probe, which instrumented code calls: once tracking is disabled, it returns without calling the probe
+template<typename Probe, Probe probe>
+struct TrackingGuard;
+template<typename Ret, typename... Args, Ret (STDMETHODCALLTYPE *probe)(Args...)>
+struct TrackingGuard<Ret (STDMETHODCALLTYPE *)(Args...), probe> {
+    static Ret STDMETHODCALLTYPE call(Args... args) {
+        if (trackingDisabled())
+            return UntrackedResult<Ret>::value();
+        return probe(args...);
+    }
+};
 
+// NOTE: metadata signature of the probe is generated from its C++ signature, see probeRegistry.h
 #define PROBE(RETTYPE, NAME, ARGS) \
     RETTYPE STDMETHODCALLTYPE NAME ARGS;\
-    int NAME##_tmp = registerProbe((unsigned long long)&NAME);\
+    int NAME##_tmp = registerProbe(&TrackingGuard<decltype(&NAME), &NAME>::call, #NAME);\
+    RETTYPE STDMETHODCALLTYPE NAME ARGS
+
+// Probes, which keep working after tracking is disabled: Mem and Unmem pass values of the instrumented code itself
+#define UNTRACKED_PROBE(RETTYPE, NAME, ARGS) \
+    RETTYPE STDMETHODCALLTYPE NAME ARGS;\
+    int NAME##_tmp = registerProbe(&NAME, #NAME);\
     RETTYPE STDMETHODCALLTYPE NAME ARGS
 
 inline bool ldarg(INT16 idx) {
@@ -340,12 +430,12 @@ inline bool ldarg(INT16 idx) {
     }
     return concreteness;
 }
-PROBE(void, Track_Ldarg_0, (OFFSET offset)) { if (!ldarg(0)) sendCommand0(offset); }
-PROBE(void, Track_Ldarg_1, (OFFSET offset)) { if (!ldarg(1)) sendCommand0(offset); }
-PROBE(void, Track_Ldarg_2, (OFFSET offset)) { if (!ldarg(2)) sendCommand0(offset); }
-PROBE(void, Track_Ldarg_3, (OFFSET offset)) { if (!ldarg(3)) sendCommand0(offset); }
-PROBE(void, Track_Ldarg_S, (UINT8 idx, OFFSET offset)) { if (!ldarg(idx)) sendCommand0(offset); }
-PROBE(void, Track_Ldarg, (UINT16 idx, OFFSET offset)) { if (!ldarg(idx)) sendCommand0(offset); }
+PROBE(void, Track_Ldarg_0, (OFFSET offset)) { if (!ldarg(0)) postLoadEvent(offset); }
+PROBE(void, Track_Ldarg_1, (OFFSET offset)) { if (!ldarg(1)) postLoadEvent(offset); }
+PROBE(void, Track_Ldarg_2, (OFFSET offset)) { if (!ldarg(2)) postLoadEvent(offset); }
+PROBE(void, Track_Ldarg_3, (OFFSET offset)) { if (!ldarg(3)) postLoadEvent(offset); }
+PROBE(void, Track_Ldarg_S, (UINT8 idx, OFFSET offset)) { if (!ldarg(idx)) postLoadEvent(offset); }
+PROBE(void, Track_Ldarg, (UINT16 idx, OFFSET offset)) { if (!ldarg(idx)) postLoadEvent(offset); }
 PROBE(void, Track_Ldarga, (INT_PTR ptr, UINT16 idx)) { topFrame().push1Concrete(); }
 
 inline bool ldloc(INT16 idx) {
@@ -357,12 +447,12 @@ inline bool ldloc(INT16 idx) {
     }
     return concreteness;
 }
-PROBE(void, Track_Ldloc_0, (OFFSET offset)) { if (!ldloc(0)) sendCommand0(offset); }
-PROBE(void, Track_Ldloc_1, (OFFSET offset)) { if (!ldloc(1)) sendCommand0(offset); }
-PROBE(void, Track_Ldloc_2, (OFFSET offset)) { if (!ldloc(2)) sendCommand0(offset); }
-PROBE(void, Track_Ldloc_3, (OFFSET offset)) { if (!ldloc(3)) sendCommand0(offset); }
-PROBE(void, Track_Ldloc_S, (UINT8 idx, OFFSET offset)) { if (!ldloc(idx)) sendCommand0(offset); }
-PROBE(void, Track_Ldloc, (UINT16 idx, OFFSET offset)) { if (!ldloc(idx)) sendCommand0(offset); }
+PROBE(void, Track_Ldloc_0, (OFFSET offset)) { if (!ldloc(0)) postLoadEvent(offset); }
+PROBE(void, Track_Ldloc_1, (OFFSET offset)) { if (!ldloc(1)) postLoadEvent(offset); }
+PROBE(void, Track_Ldloc_2, (OFFSET offset)) { if (!ldloc(2)) postLoadEvent(offset); }
+PROBE(void, Track_Ldloc_3, (OFFSET offset)) { if (!ldloc(3)) postLoadEvent(offset); }
+PROBE(void, Track_Ldloc_S, (UINT8 idx, OFFSET offset)) { if (!ldloc(idx)) postLoadEvent(offset); }
+PROBE(void, Track_Ldloc, (UINT16 idx, OFFSET offset)) { if (!ldloc(idx)) postLoadEvent(offset); }
 PROBE(void, Track_Ldloca, (INT_PTR ptr, UINT16 idx)) { topFrame().push1Concrete(); }
 
 inline bool starg(INT16 idx) {
@@ -371,8 +461,8 @@ inline bool starg(INT16 idx) {
     top.setArg(idx, concreteness);
     return concreteness;
 }
-PROBE(void, Track_Starg_S, (UINT8 idx, OFFSET offset)) { if (!starg(idx)) sendCommand1(offset); }
-PROBE(void, Track_Starg, (UINT16 idx, OFFSET offset)) { if (!starg(idx)) sendCommand1(offset); }
+PROBE(void, Track_Starg_S, (UINT8 idx, OFFSET offset)) { if (!starg(idx)) postStoreEvent(offset); }
+PROBE(void, Track_Starg, (UINT16 idx, OFFSET offset)) { if (!starg(idx)) postStoreEvent(offset); }
 
 inline bool stloc(INT16 idx) {
     // TODO
@@ -381,12 +471,12 @@ inline bool stloc(INT16 idx) {
     top.setLoc(idx, concreteness);
     return concreteness;
 }
-PROBE(void, Track_Stloc_0, (OFFSET offset)) { if (!stloc(0)) sendCommand1(offset); }
-PROBE(void, Track_Stloc_1, (OFFSET offset)) { if (!stloc(1)) sendCommand1(offset); }
-PROBE(void, Track_Stloc_2, (OFFSET offset)) { if (!stloc(2)) sendCommand1(offset); }
-PROBE(void, Track_Stloc_3, (OFFSET offset)) { if (!stloc(3)) sendCommand1(offset); }
-PROBE(void, Track_Stloc_S, (UINT8 idx, OFFSET offset)) { if (!stloc(idx)) sendCommand1(offset); }
-PROBE(void, Track_Stloc, (UINT16 idx, OFFSET offset)) { if (!stloc(idx)) sendCommand1(offset); }
+PROBE(void, Track_Stloc_0, (OFFSET offset)) { if (!stloc(0)) postStoreEvent(offset); }
+PROBE(void, Track_Stloc_1, (OFFSET offset)) { if (!stloc(1)) postStoreEvent(offset); }
+PROBE(void, Track_Stloc_2, (OFFSET offset)) { if (!stloc(2)) postStoreEvent(offset); }
+PROBE(void, Track_Stloc_3, (OFFSET offset)) { if (!stloc(3)) postStoreEvent(offset); }
+PROBE(void, Track_Stloc_S, (UINT8 idx, OFFSET offset)) { if (!stloc(idx)) postStoreEvent(offset); }
+PROBE(void, Track_Stloc, (UINT16 idx, OFFSET offset)) { if (!stloc(idx)) postStoreEvent(offset); }
 
 PROBE(void, Track_Ldc, ()) { topFrame().push1Concrete(); }
 PROBE(void, Track_Dup, (OFFSET offset)) {
@@ -417,7 +507,7 @@ PROBE(void, Track_UnOp, (UINT16 op, OFFSET offset)) {
     if (concreteness)
         top.push1Concrete();
     else
-        sendCommand1(offset);
+        sendPipelinedCommand1(offset);
 }
 PROBE(COND, Track_BinOp, ()) {
     StackFrame &top = vsharp::topFrame();
@@ -426,22 +516,22 @@ PROBE(COND, Track_BinOp, ()) {
         top.push1Concrete();
     return concreteness; }
 // TODO: do we need op?
-PROBE(void, Exec_BinOp_4, (UINT16 op, INT32 arg1, INT32 arg2, OFFSET offset)) { sendCommand(offset, 2, new EvalStackOperand[2] { mkop_4(arg1), mkop_4(arg2) }); }
-PROBE(void, Exec_BinOp_8, (UINT16 op, INT64 arg1, INT64 arg2, OFFSET offset)) { sendCommand(offset, 2, new EvalStackOperand[2] { mkop_8(arg1), mkop_8(arg2) }); }
-PROBE(void, Exec_BinOp_f4, (UINT16 op, FLOAT arg1, FLOAT arg2, OFFSET offset)) { sendCommand(offset, 2, new EvalStackOperand[2] { mkop_f4(arg1), mkop_f4(arg2) }); }
-PROBE(void, Exec_BinOp_f8, (UINT16 op, DOUBLE arg1, DOUBLE arg2, OFFSET offset)) { sendCommand(offset, 2, new EvalStackOperand[2] { mkop_f8(arg1), mkop_f8(arg2) }); }
-PROBE(void, Exec_BinOp_p, (UINT16 op, INT_PTR arg1, INT_PTR arg2, OFFSET offset)) { sendCommand(offset, 2, new EvalStackOperand[2] { mkop_p(arg1), mkop_p(arg2) }); }
-PROBE(void, Exec_BinOp_8_4, (UINT16 op, INT64 arg1, INT32 arg2, OFFSET offset)) { sendCommand(offset, 2, new EvalStackOperand[2] { mkop_8(arg1), mkop_4(arg2) }); }
-PROBE(void, Exec_BinOp_4_p, (UINT16 op, INT32 arg1, INT_PTR arg2, OFFSET offset)) { sendCommand(offset, 2, new EvalStackOperand[2] { mkop_4(arg1), mkop_p(arg2) }); }
-PROBE(void, Exec_BinOp_p_4, (UINT16 op, INT_PTR arg1, INT32 arg2, OFFSET offset)) { sendCommand(offset, 2, new EvalStackOperand[2] { mkop_p(arg1), mkop_4(arg2) }); }
-PROBE(void, Exec_BinOp_4_ovf, (UINT16 op, INT32 arg1, INT32 arg2, OFFSET offset)) { sendCommand(offset, 2, new EvalStackOperand[2] { mkop_4(arg1), mkop_4(arg2) }); }
-PROBE(void, Exec_BinOp_8_ovf, (UINT16 op, INT64 arg1, INT64 arg2, OFFSET offset)) { sendCommand(offset, 2, new EvalStackOperand[2] { mkop_8(arg1), mkop_8(arg2) }); }
-PROBE(void, Exec_BinOp_f4_ovf, (UINT16 op, FLOAT arg1, FLOAT arg2, OFFSET offset)) { sendCommand(offset, 2, new EvalStackOperand[2] { mkop_f4(arg1), mkop_f4(arg2) }); }
-PROBE(void, Exec_BinOp_f8_ovf, (UINT16 op, DOUBLE arg1, DOUBLE arg2, OFFSET offset)) { sendCommand(offset, 2, new EvalStackOperand[2] { mkop_f8(arg1), mkop_f8(arg2) }); }
-PROBE(void, Exec_BinOp_p_ovf, (UINT16 op, INT_PTR arg1, INT_PTR arg2, OFFSET offset)) { sendCommand(offset, 2, new EvalStackOperand[2] { mkop_p(arg1), mkop_p(arg2) }); }
-PROBE(void, Exec_BinOp_8_4_ovf, (UINT16 op, INT64 arg1, INT32 arg2, OFFSET offset)) { sendCommand(offset, 2, new EvalStackOperand[2] { mkop_8(arg1), mkop_4(arg2) }); }
-PROBE(void, Exec_BinOp_4_p_ovf, (UINT16 op, INT32 arg1, INT_PTR arg2, OFFSET offset)) { sendCommand(offset, 2, new EvalStackOperand[2] { mkop_4(arg1), mkop_p(arg2) }); }
-PROBE(void, Exec_BinOp_p_4_ovf, (UINT16 op, INT_PTR arg1, INT32 arg2, OFFSET offset)) { sendCommand(offset, 2, new EvalStackOperand[2] { mkop_p(arg1), mkop_4(arg2) }); }
+PROBE(void, Exec_BinOp_4, (UINT16 op, INT32 arg1, INT32 arg2, OFFSET offset)) { sendCommand(offset, { mkop_4(arg1), mkop_4(arg2) }); }
+PROBE(void, Exec_BinOp_8, (UINT16 op, ProbeI8 arg1, ProbeI8 arg2, OFFSET offset)) { sendCommand(offset, { mkop_8(arg1), mkop_8(arg2) }); }
+PROBE(void, Exec_BinOp_f4, (UINT16 op, FLOAT arg1, FLOAT arg2, OFFSET offset)) { sendCommand(offset, { mkop_f4(arg1), mkop_f4(arg2) }); }
+PROBE(void, Exec_BinOp_f8, (UINT16 op, DOUBLE arg1, DOUBLE arg2, OFFSET offset)) { sendCommand(offset, { mkop_f8(arg1), mkop_f8(arg2) }); }
+PROBE(void, Exec_BinOp_p, (UINT16 op, INT_PTR arg1, INT_PTR arg2, OFFSET offset)) { sendCommand(offset, { mkop_p(arg1), mkop_p(arg2) }); }
+PROBE(void, Exec_BinOp_8_4, (UINT16 op, ProbeI8 arg1, INT32 arg2, OFFSET offset)) { sendCommand(offset, { mkop_8(arg1), mkop_4(arg2) }); }
+PROBE(void, Exec_BinOp_4_p, (UINT16 op, INT32 arg1, INT_PTR arg2, OFFSET offset)) { sendCommand(offset, { mkop_4(arg1), mkop_p(arg2) }); }
+PROBE(void, Exec_BinOp_p_4, (UINT16 op, INT_PTR arg1, INT32 arg2, OFFSET offset)) { sendCommand(offset, { mkop_p(arg1), mkop_4(arg2) }); }
+PROBE(void, Exec_BinOp_4_ovf, (UINT16 op, INT32 arg1, INT32 arg2, OFFSET offset)) { sendCommand(offset, { mkop_4(arg1), mkop_4(arg2) }); }
+PROBE(void, Exec_BinOp_8_ovf, (UINT16 op, ProbeI8 arg1, ProbeI8 arg2, OFFSET offset)) { sendCommand(offset, { mkop_8(arg1), mkop_8(arg2) }); }
+PROBE(void, Exec_BinOp_f4_ovf, (UINT16 op, FLOAT arg1, FLOAT arg2, OFFSET offset)) { sendCommand(offset, { mkop_f4(arg1), mkop_f4(arg2) }); }
+PROBE(void, Exec_BinOp_f8_ovf, (UINT16 op, DOUBLE arg1, DOUBLE arg2, OFFSET offset)) { sendCommand(offset, { mkop_f8(arg1), mkop_f8(arg2) }); }
+PROBE(void, Exec_BinOp_p_ovf, (UINT16 op, INT_PTR arg1, INT_PTR arg2, OFFSET offset)) { sendCommand(offset, { mkop_p(arg1), mkop_p(arg2) }); }
+PROBE(void, Exec_BinOp_8_4_ovf, (UINT16 op, ProbeI8 arg1, INT32 arg2, OFFSET offset)) { sendCommand(offset, { mkop_8(arg1), mkop_4(arg2) }); }
+PROBE(void, Exec_BinOp_4_p_ovf, (UINT16 op, INT32 arg1, INT_PTR arg2, OFFSET offset)) { sendCommand(offset, { mkop_4(arg1), mkop_p(arg2) }); }
+PROBE(void, Exec_BinOp_p_4_ovf, (UINT16 op, INT_PTR arg1, INT32 arg2, OFFSET offset)) { sendCommand(offset, { mkop_p(arg1), mkop_4(arg2) }); }
 
 PROBE(void, Track_Ldind, (INT_PTR ptr, OFFSET offset)) {
     // TODO
@@ -455,14 +545,16 @@ PROBE(COND, Track_Stind, (INT_PTR ptr, INT32 sizeOfPtr)) {
     return topFrame().pop(2);
 }
 
-PROBE(void, Exec_Stind_I1, (INT_PTR ptr, INT8 value, OFFSET offset)) { sendCommand(offset, 2, new EvalStackOperand[2] { mkop_p(ptr), mkop_4(value) }); }
-PROBE(void, Exec_Stind_I2, (INT_PTR ptr, INT16 value, OFFSET offset)) { sendCommand(offset, 2, new EvalStackOperand[2] { mkop_p(ptr), mkop_4(value) }); }
-PROBE(void, Exec_Stind_I4, (INT_PTR ptr, INT32 value, OFFSET offset)) { sendCommand(offset, 2, new EvalStackOperand[2] { mkop_p(ptr), mkop_4(value) }); }
-PROBE(void, Exec_Stind_I8, (INT_PTR ptr, INT64 value, OFFSET offset)) { sendCommand(offset, 2, new EvalStackOperand[2] { mkop_p(ptr), mkop_8(value) }); }
-PROBE(void, Exec_Stind_R4, (INT_PTR ptr, FLOAT value, OFFSET offset)) { sendCommand(offset, 2, new EvalStackOperand[2] { mkop_p(ptr), mkop_f4(value) }); }
-PROBE(void, Exec_Stind_R8, (INT_PTR ptr, DOUBLE value, OFFSET offset)) { sendCommand(offset, 2, new EvalStackOperand[2] { mkop_p(ptr), mkop_f8(value) }); }
-PROBE(void, Exec_Stind_ref, (INT_PTR ptr, INT_PTR value, OFFSET offset)) { sendCommand(offset, 2, new EvalStackOperand[2] { mkop_p(ptr), mkop_p(value) }); }
+PROBE(void, Exec_Stind_I1, (INT_PTR ptr, INT8 value, OFFSET offset)) { sendCommand(offset, { mkop_p(ptr), mkop_4(value) }); }
+PROBE(void, Exec_Stind_I2, (INT_PTR ptr, INT16 value, OFFSET offset)) { sendCommand(offset, { mkop_p(ptr), mkop_4(value) }); }
+PROBE(void, Exec_Stind_I4, (INT_PTR ptr, INT32 value, OFFSET offset)) { sendCommand(offset, { mkop_p(ptr), mkop_4(value) }); }
+PROBE(void, Exec_Stind_I8, (INT_PTR ptr, ProbeI8 value, OFFSET offset)) { sendCommand(offset, { mkop_p(ptr), mkop_8(value) }); }
+PROBE(void, Exec_Stind_R4, (INT_PTR ptr, FLOAT value, OFFSET offset)) { sendCommand(offset, { mkop_p(ptr), mkop_f4(value) }); }
+PROBE(void, Exec_Stind_R8, (INT_PTR ptr, DOUBLE value, OFFSET offset)) { sendCommand(offset, { mkop_p(ptr), mkop_f8(value) }); }
+PROBE(void, Exec_Stind_ref, (INT_PTR ptr, INT_PTR value, OFFSET offset)) { sendCommand(offset, { mkop_p(ptr), mkop_p(value) }); }
 
+// NOTE: conversion is not pipelined: checked one may throw, and the converted value is usually unmemed right away,
+//       which joins the response at once, so pipelining would only add bookkeeping
 inline void conv(OFFSET offset) {
     StackFrame &top = vsharp::topFrame();
     bool concreteness = top.pop1();
@@ -498,6 +590,7 @@ PROBE(void, Track_Ldlen, (INT_PTR ptr, OFFSET offset)) {
     if (concreteness)
         top.push1Concrete();
     else
+        // NOTE: ldlen throws on null array, so it is not pipelined
         sendCommand1(offset);
     // TODO: check concreteness of referenced memory
 }
@@ -557,7 +650,7 @@ inline bool ldfld(INT_PTR fieldPtr, INT32 fieldSize) {
 // TODO: if objPtr = null, it's static field
 PROBE(void, Track_Ldfld, (INT_PTR objPtr, INT32 fieldOffset, INT32 fieldSize, OFFSET offset)) {
     if (!ldfld(objPtr + fieldOffset, fieldSize)) {
-        sendCommand(offset, 1, new EvalStackOperand[1] { mkop_p(objPtr) });
+        sendCommand(offset, { mkop_p(objPtr) });
     } else {
         vsharp::topFrame().push1Concrete();
     }
@@ -572,32 +665,32 @@ inline bool stfld(mdToken fieldToken, INT_PTR ptr) {
 
 PROBE(void, Track_Stfld_4, (mdToken fieldToken, INT_PTR ptr, INT32 value, OFFSET offset)) {
     if (!stfld(fieldToken, ptr)) {
-        sendCommand(offset, 2, new EvalStackOperand[2] { mkop_p(ptr), mkop_4(value) });
+        sendCommand(offset, { mkop_p(ptr), mkop_4(value) });
     }
 }
-PROBE(void, Track_Stfld_8, (mdToken fieldToken, INT_PTR ptr, INT64 value, OFFSET offset)) {
+PROBE(void, Track_Stfld_8, (mdToken fieldToken, INT_PTR ptr, ProbeI8 value, OFFSET offset)) {
     if (!stfld(fieldToken, ptr)) {
-        sendCommand(offset, 2, new EvalStackOperand[2] { mkop_p(ptr), mkop_8(value) });
+        sendCommand(offset, { mkop_p(ptr), mkop_8(value) });
     }
 }
 PROBE(void, Track_Stfld_f4, (mdToken fieldToken, INT_PTR ptr, FLOAT value, OFFSET offset)) {
     if (!stfld(fieldToken, ptr)) {
-        sendCommand(offset, 2, new EvalStackOperand[2] { mkop_p(ptr), mkop_f4(value) });
+        sendCommand(offset, { mkop_p(ptr), mkop_f4(value) });
     }
 }
 PROBE(void, Track_Stfld_f8, (mdToken fieldToken, INT_PTR ptr, DOUBLE value, OFFSET offset)) {
     if (!stfld(fieldToken, ptr)) {
-        sendCommand(offset, 2, new EvalStackOperand[2] { mkop_p(ptr), mkop_f8(value) });
+        sendCommand(offset, { mkop_p(ptr), mkop_f8(value) });
     }
 }
 PROBE(void, Track_Stfld_p, (mdToken fieldToken, INT_PTR ptr, INT_PTR value, OFFSET offset)) {
     if (!stfld(fieldToken, ptr)) {
-        sendCommand(offset, 2, new EvalStackOperand[2] { mkop_p(ptr), mkop_p(value) });
+        sendCommand(offset, { mkop_p(ptr), mkop_p(value) });
     }
 }
 PROBE(void, Track_Stfld_struct, (mdToken fieldToken, INT_PTR ptr, INT_PTR value, OFFSET offset)) {
     if (!stfld(fieldToken, ptr)) {
-        sendCommand(offset, 2, new EvalStackOperand[2] { mkop_p(ptr), mkop_struct(value) });
+        sendCommand(offset, { mkop_p(ptr), mkop_struct(value) });
     }
 }
 /// TODO: stfld may be called with any value type! :(
@@ -634,7 +727,7 @@ PROBE(void, Exec_Stelem_I, (INT_PTR ptr, INT_PTR index, INT_PTR value, OFFSET of
 PROBE(void, Exec_Stelem_I1, (INT_PTR ptr, INT_PTR index, INT8 value, OFFSET offset)) { /*send command*/ }
 PROBE(void, Exec_Stelem_I2, (INT_PTR ptr, INT_PTR index, INT16 value, OFFSET offset)) { /*send command*/ }
 PROBE(void, Exec_Stelem_I4, (INT_PTR ptr, INT_PTR index, INT32 value, OFFSET offset)) { /*send command*/ }
-PROBE(void, Exec_Stelem_I8, (INT_PTR ptr, INT_PTR index, INT64 value, OFFSET offset)) { /*send command*/ }
+PROBE(void, Exec_Stelem_I8, (INT_PTR ptr, INT_PTR index, ProbeI8 value, OFFSET offset)) { /*send command*/ }
 PROBE(void, Exec_Stelem_R4, (INT_PTR ptr, INT_PTR index, FLOAT value, OFFSET offset)) { /*send command*/ }
 PROBE(void, Exec_Stelem_R8, (INT_PTR ptr, INT_PTR index, DOUBLE value, OFFSET offset)) { /*send command*/ }
 PROBE(void, Exec_Stelem_Ref, (INT_PTR ptr, INT_PTR index, INT_PTR value, OFFSET offset)) { /*send command*/ }
@@ -690,6 +783,7 @@ PROBE(void, Track_EnterMain, (mdMethodDef token, UINT16 argsCount, bool argsConc
 }
 
 PROBE(void, Track_Leave, (UINT8 returnValues, OFFSET offset)) {
+    joinPipelinedCommands();
     Stack &stack = vsharp::stack();
     StackFrame &top = stack.topFrame();
 #ifdef _DEBUG
@@ -715,7 +809,8 @@ PROBE(void, Track_Leave, (UINT8 returnValues, OFFSET offset)) {
     LOG(tout << "Managed leave to frame " << stack.framesCount() << ". After popping top frame stack balance is " << top.count() << std::endl);
 }
 
-void leaveMain(OFFSET offset, UINT8 opsCount, EvalStackOperand *ops) {
+void leaveMain(OFFSET offset, std::initializer_list<EvalStackOperand> ops) {
+    UINT8 opsCount = (UINT8) ops.size();
     Stack &stack = vsharp::stack();
     StackFrame &top = stack.topFrame();
     LOG(tout << "Main left!");
@@ -724,17 +819,18 @@ void leaveMain(OFFSET offset, UINT8 opsCount, EvalStackOperand *ops) {
         bool returnValue = top.pop1();
         LOG(tout << "Return value is " << (returnValue ? "concrete" : "symbolic") << std::endl);
     }
-    sendCommand(offset, opsCount, ops);
+    sendCommand(offset, ops);
     // NOTE: popping return value from SILI
     if (opsCount > 0) stack.topFrame().pop1();
     stack.popFrame();
+    disableTracking();
 }
-PROBE(void, Track_LeaveMain_0, (OFFSET offset)) { leaveMain(offset, 0, new EvalStackOperand[0] { }); }
-PROBE(void, Track_LeaveMain_4, (INT32 returnValue, OFFSET offset)) { leaveMain(offset, 1, new EvalStackOperand[1] { mkop_4(returnValue) }); }
-PROBE(void, Track_LeaveMain_8, (INT64 returnValue, OFFSET offset)) { leaveMain(offset, 1, new EvalStackOperand[1] { mkop_8(returnValue) }); }
-PROBE(void, Track_LeaveMain_f4, (FLOAT returnValue, OFFSET offset)) { leaveMain(offset, 1, new EvalStackOperand[1] { mkop_f4(returnValue) }); }
-PROBE(void, Track_LeaveMain_f8, (DOUBLE returnValue, OFFSET offset)) { leaveMain(offset, 1, new EvalStackOperand[1] { mkop_f8(returnValue) }); }
-PROBE(void, Track_LeaveMain_p, (INT_PTR returnValue, OFFSET offset)) { leaveMain(offset, 1, new EvalStackOperand[1] { mkop_p(returnValue) }); }
+PROBE(void, Track_LeaveMain_0, (OFFSET offset)) { leaveMain(offset, {}); }
+PROBE(void, Track_LeaveMain_4, (INT32 returnValue, OFFSET offset)) { leaveMain(offset, { mkop_4(returnValue) }); }
+PROBE(void, Track_LeaveMain_8, (ProbeI8 returnValue, OFFSET offset)) { leaveMain(offset, { mkop_8(returnValue) }); }
+PROBE(void, Track_LeaveMain_f4, (FLOAT returnValue, OFFSET offset)) { leaveMain(offset, { mkop_f4(returnValue) }); }
+PROBE(void, Track_LeaveMain_f8, (DOUBLE returnValue, OFFSET offset)) { leaveMain(offset, { mkop_f8(returnValue) }); }
+PROBE(void, Track_LeaveMain_p, (INT_PTR returnValue, OFFSET offset)) { leaveMain(offset, { mkop_p(returnValue) }); }
 
 PROBE(void, Finalize_Call, (UINT8 returnValues)) {
     Stack &stack = vsharp::stack();
@@ -755,8 +851,9 @@ PROBE(void, Finalize_Call, (UINT8 returnValues)) {
 }
 
 PROBE(VOID, Exec_Call, (INT32 argsCount, OFFSET offset)) {
-    auto ops = createOps(argsCount);
-    sendCommand(offset, argsCount, ops);
+    ExecCommand &command = scratchCommand();
+    createOps(argsCount, command.evaluationStackPushes);
+    sendCommand(offset, command);
 }
 PROBE(COND, Track_Call, (UINT16 argsCount)) {
     return vsharp::stack().topFrame().pop(argsCount);
@@ -803,52 +900,38 @@ PROBE(void, Track_Throw, (OFFSET offset)) {
 }
 PROBE(void, Track_Rethrow, (OFFSET offset)) { /*TODO*/ }
 
-PROBE(void, Mem_p, (INT_PTR arg)) { clear_mem(); mem_p(arg); }
-
-PROBE(void, Mem_1_idx, (INT8 arg, INT8 idx, INT8 order)) { if (order == 0) clear_mem(); mem_i1(arg, idx); }
-PROBE(void, Mem_2_idx, (INT16 arg, INT8 idx, INT8 order)) { if (order == 0) clear_mem(); mem_i2(arg, idx); }
-PROBE(void, Mem_4_idx, (INT32 arg, INT8 idx, INT8 order)) { if (order == 0) clear_mem(); mem_i4(arg, idx); }
-PROBE(void, Mem_8_idx, (INT64 arg, INT8 idx, INT8 order)) { if (order == 0) clear_mem(); mem_i8(arg, idx); }
-PROBE(void, Mem_f4_idx, (FLOAT arg, INT8 idx, INT8 order)) { if (order == 0) clear_mem(); mem_f4(arg, idx); }
-PROBE(void, Mem_f8_idx, (DOUBLE arg, INT8 idx, INT8 order)) { if (order == 0) clear_mem(); mem_f8(arg, idx); }
-PROBE(void, Mem_p_idx, (INT_PTR arg, INT8 idx, INT8 order)) { if (order == 0) clear_mem(); mem_p(arg, idx); }
-
-PROBE(void, Mem2_4, (INT32 arg1, INT32 arg2)) { clear_mem(); mem_i4(arg1); mem_i4(arg2); }
-PROBE(void, Mem2_8, (INT64 arg1, INT64 arg2)) { clear_mem(); mem_i8(arg1); mem_i8(arg2); }
-PROBE(void, Mem2_f4, (FLOAT arg1, FLOAT arg2)) { clear_mem(); mem_f4(arg1); mem_f4(arg2); }
-PROBE(void, Mem2_f8, (DOUBLE arg1, DOUBLE arg2)) { clear_mem(); mem_f8(arg1); mem_f8(arg2); }
-//PROBE(void, Mem2_p, (INT_PTR arg1, INT_PTR arg2)) { clear_mem(); mem_p(arg1); mem_p(arg2); }
-PROBE(void, Mem2_8_4, (INT64 arg1, INT32 arg2)) { clear_mem(); mem_i8(arg1); mem_i4(arg2); }
-//PROBE(void, Mem2_4_p, (INT32 arg1, INT_PTR arg2)) { clear_mem(); mem_i4(arg1); mem_p(arg2); }
-//PROBE(void, Mem2_p_1, (INT_PTR arg1, INT8 arg2)) { clear_mem(); mem_p(arg1); mem_i1(arg2); }
-//PROBE(void, Mem2_p_2, (INT_PTR arg1, INT16 arg2)) { clear_mem(); mem_p(arg1); mem_i2(arg2); }
-//PROBE(void, Mem2_p_4, (INT_PTR arg1, INT32 arg2)) { clear_mem(); mem_p(arg1); mem_i4(arg2); }
-//PROBE(void, Mem2_p_8, (INT_PTR arg1, INT64 arg2)) { clear_mem(); mem_p(arg1); mem_i8(arg2); }
-//PROBE(void, Mem2_p_f4, (INT_PTR arg1, FLOAT arg2)) { clear_mem(); mem_p(arg1); mem_f4(arg2); }
-//PROBE(void, Mem2_p_f8, (INT_PTR arg1, DOUBLE arg2)) { clear_mem(); mem_p(arg1); mem_f8(arg2); }
-
-//PROBE(void, Mem3_p_p_p, (INT_PTR arg1, INT_PTR arg2, INT_PTR arg3)) { clear_mem(); mem_p(arg1); mem_p(arg2); mem_p(arg3); }
-//PROBE(void, Mem3_p_p_i1, (INT_PTR arg1, INT_PTR arg2, INT8 arg3)) { clear_mem(); mem_p(arg1); mem_p(arg2); mem_i1(arg3); }
-//PROBE(void, Mem3_p_p_i2, (INT_PTR arg1, INT_PTR arg2, INT16 arg3)) { clear_mem(); mem_p(arg1); mem_p(arg2); mem_i2(arg3); }
-// In instrumentation, replace Mem3_p_p_i4 probe with:
-// mem_i4_idx 2 0
-// convi
-// mem_p_idx 1 1
-// convi
-// mem_p_idx 0 2
-//PROBE(void, Mem3_p_p_i4, (INT_PTR arg1, INT_PTR arg2, INT32 arg3)) { clear_mem(); mem_p(arg1); mem_p(arg2); mem_i4(arg3); }
-//PROBE(void, Mem3_p_p_i8, (INT_PTR arg1, INT_PTR arg2, INT64 arg3)) { clear_mem(); mem_p(arg1); mem_p(arg2); mem_i8(arg3); }
-//PROBE(void, Mem3_p_p_f4, (INT_PTR arg1, INT_PTR arg2, FLOAT arg3)) { clear_mem(); mem_p(arg1); mem_p(arg2); mem_f4(arg3); }
-//PROBE(void, Mem3_p_p_f8, (INT_PTR arg1, INT_PTR arg2, DOUBLE arg3)) { clear_mem(); mem_p(arg1); mem_p(arg2); mem_f8(arg3); }
-//PROBE(void, Mem3_p_i1_p, (INT_PTR arg1, INT8 arg2, INT_PTR arg3)) { clear_mem(); mem_p(arg1); mem_i1(arg2); mem_p(arg3); }
-
-PROBE(INT8, Unmem_1, (INT8 idx)) { return unmem_i1(idx); }
-PROBE(INT16, Unmem_2, (INT8 idx)) { return unmem_i2(idx); }
-PROBE(INT32, Unmem_4, (INT8 idx)) { return unmem_i4(idx); }
-PROBE(INT64, Unmem_8, (INT8 idx)) { return unmem_i8(idx); }
-PROBE(FLOAT, Unmem_f4, (INT8 idx)) { return unmem_f4(idx); }
-PROBE(DOUBLE, Unmem_f8, (INT8 idx)) { return unmem_f8(idx); }
-PROBE(INT_PTR, Unmem_p, (INT8 idx)) { return unmem_p(idx); }
+// NOTE: mem buffer may still wait for concretized operands of pipelined commands, so it is refilled after joining them
+void joinAndClearMem() {
+    if (pipeline().count > 0)
+        joinPipelinedCommands();
+    clear_mem();
+}
+
+UNTRACKED_PROBE(void, Mem_p, (INT_PTR arg)) { joinAndClearMem(); mem_p(arg); }
+
+UNTRACKED_PROBE(void, Mem_1_idx, (INT8 arg, INT8 idx, INT8 order)) { if (order == 0) joinAndClearMem(); mem_i1(arg, idx); }
+UNTRACKED_PROBE(void, Mem_2_idx, (INT16 arg, INT8 idx, INT8 order)) { if (order == 0) joinAndClearMem(); mem_i2(arg, idx); }
+UNTRACKED_PROBE(void, Mem_4_idx, (INT32 arg, INT8 idx, INT8 order)) { if (order == 0) joinAndClearMem(); mem_i4(arg, idx); }
+UNTRACKED_PROBE(void, Mem_8_idx, (ProbeI8 arg, INT8 idx, INT8 order)) { if (order == 0) joinAndClearMem(); mem_i8(arg, idx); }
+UNTRACKED_PROBE(void, Mem_f4_idx, (FLOAT arg, INT8 idx, INT8 order)) { if (order == 0) joinAndClearMem(); mem_f4(arg, idx); }
+UNTRACKED_PROBE(void, Mem_f8_idx, (DOUBLE arg, INT8 idx, INT8 order)) { if (order == 0) joinAndClearMem(); mem_f8(arg, idx); }
+UNTRACKED_PROBE(void, Mem_p_idx, (INT_PTR arg, INT8 idx, INT8 order)) { if (order == 0) joinAndClearMem(); mem_p(arg, idx); }
+
+// NOTE: multi-operand Mem probes are generated from 'Mem' template, see fusedMemProbes.h
+
+// NOTE: concretized operands of pipelined commands are put into mem buffer when the buffer is read
+inline void joinBeforeUnmem() {
+    if (pipeline().count > 0)
+        joinPipelinedCommands();
+}
+
+UNTRACKED_PROBE(INT8, Unmem_1, (INT8 idx)) { joinBeforeUnmem(); return unmem_i1(idx); }
+UNTRACKED_PROBE(INT16, Unmem_2, (INT8 idx)) { joinBeforeUnmem(); return unmem_i2(idx); }
+UNTRACKED_PROBE(INT32, Unmem_4, (INT8 idx)) { joinBeforeUnmem(); return unmem_i4(idx); }
+UNTRACKED_PROBE(ProbeI8, Unmem_8, (INT8 idx)) { joinBeforeUnmem(); return (ProbeI8) unmem_i8(idx); }
+UNTRACKED_PROBE(FLOAT, Unmem_f4, (INT8 idx)) { joinBeforeUnmem(); return unmem_f4(idx); }
+UNTRACKED_PROBE(DOUBLE, Unmem_f8, (INT8 idx)) { joinBeforeUnmem(); return unmem_f8(idx); }
+UNTRACKED_PROBE(INT_PTR, Unmem_p, (INT8 idx)) { joinBeforeUnmem(); return unmem_p(idx); }
 
 PROBE(void, DumpInstruction, (UINT32 index)) {
 #ifdef _DEBUG
@@ -862,6 +945,19 @@ PROBE(void, DumpInstruction, (UINT32 index)) {
 #endif
 }
 
+// NOTE: fused Mem probes are registered after all the other probes
+struct FusedMemRegistrator {
+    template<typename... Kinds>
+    void visit() { registerProbe(&Mem<Kinds...>); }
+};
+
+int registerFusedMemProbes() {
+    FusedMemRegistrator registrator;
+    forEachFusedMem(registrator);
+    return 0;
+}
+int FusedMem_tmp = registerFusedMemProbes();
+
 }
 
 #endif // PROBES_H_
@@ -158,27 +158,6 @@ type probes = {
     mutable mem_f4_idx : uint64
     mutable mem_f8_idx : uint64
     mutable mem_p_idx : uint64
-    mutable mem2_4 : uint64
-    mutable mem2_8 : uint64
-    mutable mem2_f4 : uint64
-    mutable mem2_f8 : uint64
-//    mutable mem2_p : uint64
-    mutable mem2_8_4 : uint64
-//    mutable mem2_4_p : uint64
-//    mutable mem2_p_1 : uint64
-//    mutable mem2_p_2 : uint64
-//    mutable mem2_p_4 : uint64
-//    mutable mem2_p_8 : uint64
-//    mutable mem2_p_f4 : uint64
-//    mutable mem2_p_f8 : uint64
-//    mutable mem3_p_p_p : uint64
-//    mutable mem3_p_p_i1 : uint64
-//    mutable mem3_p_p_i2 : uint64
-//    mutable mem3_p_p_i4 : uint64
-//    mutable mem3_p_p_i8 : uint64
-//    mutable mem3_p_p_f4 : uint64
-//    mutable mem3_p_p_f8 : uint64
-//    mutable mem3_p_i1_p : uint64
     mutable unmem_1 : uint64
     mutable unmem_2 : uint64
     mutable unmem_4 : uint64
@@ -332,6 +311,7 @@ type rawMethodBody = {
     assembly : string
     moduleName : string
     tokens : signatureTokens
+    fusedMemTokens : uint32 array
     il : byte array
     ehs : rawExceptionHandler array
 }
@@ -356,6 +336,49 @@ type evaluationStackCellType =
 
 type stackState = evaluationStackCellType stack
 
+// NOTE: multi-operand Mem probes are generated by the profiler for every sequence of operand kinds of arity from 2 to 'maxArity'.
+//       Their addresses and signature tokens follow the ones of 'probes'.
+//       Probes are ordered by arity, then lexicographically by kinds of operands (the first operand is the most significant)
+module FusedMem =
+    let private kindsCount = 7
+
+    // NOTE: profiler chooses the bound of arity (MEM_FUSED_MAX_ARITY) and sends the fused probes after all the others,
+    //       so the bound is learned from the received probes, see 'learnMaxArity'. Until then no probe is fused
+    let mutable private arityBound = 1
+
+    let maxArity() = arityBound
+
+    let private kindOf = function
+        | evaluationStackCellType.I1 -> 0
+        | evaluationStackCellType.I2 -> 1
+        | evaluationStackCellType.I4 -> 2
+        | evaluationStackCellType.I8 -> 3
+        | evaluationStackCellType.R4 -> 4
+        | evaluationStackCellType.R8 -> 5
+        | evaluationStackCellType.I
+        | evaluationStackCellType.Ref
+        | evaluationStackCellType.Struct -> 6
+        | t -> internalfailf "FusedMem: unexpected operand kind %O" t
+
+    let private probesBefore arity = List.sumBy (pown kindsCount) [2 .. arity - 1]
+
+    let count() = probesBefore (arityBound + 1)
+
+    // Takes the arity of the last received probe, which is the fused one of the maximal arity, if 'fusedCount' probes follow
+    // the probes of 'probes'. Returns false if there are not as many fused probes of arities up to it
+    let learnMaxArity (fusedCount : int) (lastArity : int) =
+        let arity = if fusedCount = 0 then 1 else lastArity
+        if probesBefore (arity + 1) <> fusedCount then false
+        else
+            arityBound <- arity
+            true
+
+    // Index of the probe, which mems 'operands' (listed from the deepest stack cell to the top one) into indices 0, 1, ...
+    let index (operands : evaluationStackCellType list) =
+        let arity = List.length operands
+        assert(arity >= 2 && arity <= arityBound)
+        probesBefore arity + List.fold (fun acc t -> acc * kindsCount + kindOf t) 0 operands
+
 type opcode =
     | OpCode of OpCode
     | SwitchArg
@@ -8,6 +8,14 @@ open VSharp
 open VSharp.Core
 open VSharp.Interpreter.IL
 
+// How the client waits for the response to exec command
+type private execMode =
+    | Blocking
+    // NOTE: client predicted the whole response, so it is not sent
+    | Event
+    // NOTE: client reads the response later, predicting that the pushed value stays symbolic
+    | Pipelined
+
 [<AllowNullLiteral>]
 type ClientMachine(entryPoint : Method, requestMakeStep : cilState -> unit, cilState : cilState) =
     let extension =
@@ -58,6 +66,9 @@ type ClientMachine(entryPoint : Method, requestMakeStep : cilState -> unit, cilS
     let mutable callIsSkipped = false
     let mutable mainReached = false
     let mutable operands : list<_> = List.Empty
+    // NOTE: commands of the last batch, which are not executed yet
+    let pendingCommands = System.Collections.Generic.Queue<execCommand * execMode>()
+    let mutable currentMode = Blocking
     let environment (method : Method) pipePath =
         let result = ProcessStartInfo()
         let profiler = sprintf "%s%c%s" (Directory.GetCurrentDirectory()) Path.DirectorySeparatorChar pathToClient
@@ -65,6 +76,17 @@ type ClientMachine(entryPoint : Method, requestMakeStep : cilState -> unit, cilS
         result.EnvironmentVariables.["CORECLR_ENABLE_PROFILING"] <- "1"
         result.EnvironmentVariables.["CORECLR_PROFILER_PATH"] <- profiler
         result.EnvironmentVariables.["CONCOLIC_PIPE"] <- pipePath
+        // NOTE: Communicator reads the same variable, so both sides agree on the transport
+        match Environment.GetEnvironmentVariable("CONCOLIC_TRANSPORT") with
+        | null -> result.EnvironmentVariables.["CONCOLIC_TRANSPORT"] <- "socket"
+        | transport -> result.EnvironmentVariables.["CONCOLIC_TRANSPORT"] <- transport
+        // NOTE: runs share instrumented bodies; the cache depends on the instrumenter, so each build of SILI has its own one.
+        //       Empty CONCOLIC_CACHE disables it
+        match Environment.GetEnvironmentVariable("CONCOLIC_CACHE") with
+        | null ->
+            let version = typeof<Instrumenter>.Assembly.ManifestModule.ModuleVersionId
+            result.EnvironmentVariables.["CONCOLIC_CACHE"] <- sprintf "%sconcolic_bodies_%O.cache" pathToTmp version
+        | cache -> result.EnvironmentVariables.["CONCOLIC_CACHE"] <- cache
         result.WorkingDirectory <- Directory.GetCurrentDirectory()
         result.FileName <- "dotnet"
         result.UseShellExecute <- false
@@ -100,9 +122,10 @@ type ClientMachine(entryPoint : Method, requestMakeStep : cilState -> unit, cilS
         proc.BeginErrorReadLine()
         Logger.info "Successfully spawned pid %d, working dir \"%s\"" proc.Id env.WorkingDirectory
         if x.communicator.Connect() then
-            x.probes <- x.communicator.ReadProbes()
+            let probes, fusedMemProbes = x.communicator.ReadProbes()
+            x.probes <- probes
             x.communicator.SendEntryPoint entryPoint.Module.FullyQualifiedName entryPoint.MetadataToken
-            x.instrumenter <- Instrumenter(x.communicator, (entryPoint :> IMethod).MethodBase, x.probes)
+            x.instrumenter <- Instrumenter(x.communicator, (entryPoint :> IMethod).MethodBase, x.probes, fusedMemProbes)
             true
         else false
 
@@ -153,28 +176,55 @@ type ClientMachine(entryPoint : Method, requestMakeStep : cilState -> unit, cilS
 
     member x.State with get() = cilState
 
+    member private x.ExecuteInstruction (c : execCommand) mode =
+        x.SynchronizeStates c
+        currentMode <- mode
+        cilState.suspended <- false
+        requestMakeStep cilState
+
+    member private x.ExecuteNextPending() =
+        let c, mode = pendingCommands.Dequeue()
+        x.ExecuteInstruction c mode
+        true
+
+    member private x.EnqueueBatch events c mode =
+        events |> List.iter (fun event -> pendingCommands.Enqueue((event, Event)))
+        pendingCommands.Enqueue((c, mode))
+        x.ExecuteNextPending()
+
     member x.ExecCommand() =
-        Logger.trace "Reading next command..."
-        match x.communicator.ReadCommand() with
-        | Instrument methodBody ->
-            if int methodBody.properties.token = entryPoint.MetadataToken && methodBody.moduleName = entryPoint.Module.FullyQualifiedName then
-                mainReached <- true
-            let mb =
-                if mainReached then
-                    Logger.trace "Got instrument command! bytes count = %d, max stack size = %d, eh count = %d" methodBody.il.Length methodBody.properties.maxStackSize methodBody.ehs.Length
-                    x.instrumenter.Instrument methodBody
-                else x.instrumenter.Skip methodBody
-            x.communicator.SendMethodBody mb
-            true
-        | ExecuteInstruction c ->
-            Logger.trace "Got execute instruction command!"
-            x.SynchronizeStates c
-            cilState.suspended <- false
-            requestMakeStep cilState
-            true
-        | Terminate ->
-            Logger.trace "Got terminate command!"
-            false
+        if pendingCommands.Count > 0 then x.ExecuteNextPending()
+        else
+            Logger.trace "Reading next command..."
+            match x.communicator.ReadCommand() with
+            | Instrument methodBody ->
+                if int methodBody.properties.token = entryPoint.MetadataToken && methodBody.moduleName = entryPoint.Module.FullyQualifiedName then
+                    mainReached <- true
+                let mb =
+                    if mainReached then
+                        Logger.trace "Got instrument command! bytes count = %d, max stack size = %d, eh count = %d" methodBody.il.Length methodBody.properties.maxStackSize methodBody.ehs.Length
+                        x.instrumenter.Instrument methodBody
+                    else x.instrumenter.Skip methodBody
+                x.communicator.SendMethodBody mb
+                true
+            | InstrumentBatch methodBodies ->
+                Logger.trace "Got batch of %d methods of %s!" (List.length methodBodies) (match methodBodies with b :: _ -> b.moduleName | [] -> "")
+                let instrument methodBody = if mainReached then x.instrumenter.Instrument methodBody else x.instrumenter.Skip methodBody
+                methodBodies |> List.iter (instrument >> x.communicator.SendMethodBody)
+                true
+            | ExecuteInstruction c ->
+                Logger.trace "Got execute instruction command!"
+                x.ExecuteInstruction c Blocking
+                true
+            | ExecuteBatch(events, c) ->
+                Logger.trace "Got batch of %d events!" (List.length events)
+                x.EnqueueBatch events c Blocking
+            | ExecutePipelined(events, c) ->
+                Logger.trace "Got pipelined command after %d events!" (List.length events)
+                x.EnqueueBatch events c Pipelined
+            | Terminate ->
+                Logger.trace "Got terminate command!"
+                false
 
     member private x.ConcreteToObj term =
         let evalRefType baseAddress offset typ =
@@ -208,6 +258,12 @@ type ClientMachine(entryPoint : Method, requestMakeStep : cilState -> unit, cilS
         if method.IsInternalCall then
             callIsSkipped <- true
             cilState
+        elif currentMode = Event then
+            // NOTE: client has already predicted the response of event: loaded value stays on the stack, frames are the same
+            steppedStates |> List.tryPick x.EvalOperands |> ignore
+            cilState.suspended <- true
+            currentMode <- Blocking
+            cilState
         else
             let concretizedOps =
                 if callIsSkipped then Some List.empty
@@ -215,7 +271,7 @@ type ClientMachine(entryPoint : Method, requestMakeStep : cilState -> unit, cilS
             cilState.suspended <- true
             let lastPushInfo =
                 match cilState.lastPushInfo with
-                | Some x when IsConcrete x && CilStateOperations.currentIp cilState <> Exit entryPoint ->
+                | Some x when currentMode <> Pipelined && IsConcrete x && CilStateOperations.currentIp cilState <> Exit entryPoint ->
                     CilStateOperations.pop cilState |> ignore
                     Some true
                 | Some _ -> Some false
@@ -228,4 +284,5 @@ type ClientMachine(entryPoint : Method, requestMakeStep : cilState -> unit, cilS
             let framesCount = Memory.CallStackSize cilState.state
             x.communicator.SendExecResponse concretizedOps internalCallResult lastPushInfo framesCount
             callIsSkipped <- false
+            currentMode <- Blocking
             cilState
@@ -5,6 +5,7 @@ open System.IO
 open System.IO.Pipes
 open System.Text
 open System.Runtime.InteropServices
+open Microsoft.FSharp.Reflection
 open VSharp
 open VSharp.Core.API
 
@@ -52,6 +53,45 @@ type CorElementType =
     | ELEMENT_TYPE_SENTINEL       = 0x41uy
     | ELEMENT_TYPE_PINNED         = 0x45uy
 
+// NOTE: profiler generates metadata signatures of probes from their C++ signatures, named signatures of 'signatureTokens'
+//       are resolved by them. Profiler tells native int from int64 by tags, so element types are compared exactly;
+//       only if no probe has the exact signature, the one, which differs by signedness of integers, is taken
+module private ProbeSignatures =
+    let private signed = function
+        | CorElementType.ELEMENT_TYPE_U1 -> CorElementType.ELEMENT_TYPE_I1
+        | CorElementType.ELEMENT_TYPE_U2 -> CorElementType.ELEMENT_TYPE_I2
+        | CorElementType.ELEMENT_TYPE_U4 -> CorElementType.ELEMENT_TYPE_I4
+        | CorElementType.ELEMENT_TYPE_U8 -> CorElementType.ELEMENT_TYPE_I8
+        | CorElementType.ELEMENT_TYPE_U -> CorElementType.ELEMENT_TYPE_I
+        | t -> t
+
+    let withoutSignedness signature = List.map signed signature
+
+    // Signature blob is: calling convention, amount of parameters, return type, types of parameters
+    let ofBlob (blob : byte array) =
+        blob |> Seq.skip 2 |> Seq.map LanguagePrimitives.EnumOfValue |> List.ofSeq
+
+    let private ofNamePart isReturn = function
+        | "void" -> CorElementType.ELEMENT_TYPE_VOID
+        // NOTE: probes return conditions as native int
+        | "bool" when isReturn -> CorElementType.ELEMENT_TYPE_I
+        | "bool" -> CorElementType.ELEMENT_TYPE_BOOLEAN
+        | "i1" -> CorElementType.ELEMENT_TYPE_I1
+        | "u1" -> CorElementType.ELEMENT_TYPE_U1
+        | "i2" -> CorElementType.ELEMENT_TYPE_I2
+        | "u2" -> CorElementType.ELEMENT_TYPE_U2
+        | "i4" -> CorElementType.ELEMENT_TYPE_I4
+        | "u4" | "token" | "offset" -> CorElementType.ELEMENT_TYPE_U4
+        | "i8" -> CorElementType.ELEMENT_TYPE_I8
+        | "r4" -> CorElementType.ELEMENT_TYPE_R4
+        | "r8" -> CorElementType.ELEMENT_TYPE_R8
+        | "i" -> CorElementType.ELEMENT_TYPE_I
+        | part -> internalfailf "Unexpected part %s of signature name" part
+
+    // Name of signature is: return type, types of parameters and suffix 'sig', separated by '_'
+    let ofName (name : string) =
+        name.Split('_') |> Array.filter ((<>) "sig") |> Array.mapi (fun i part -> ofNamePart (i = 0) part) |> List.ofArray
+
 type evalStackArgType =
     | OpSymbolic = 1
     | OpI4 = 2
@@ -96,13 +136,65 @@ type execResponseStaticPart = {
 
 type commandFromConcolic =
     | Instrument of rawMethodBody
+    // NOTE: methods of the module, which was loaded after main; each of them needs its instrumented body in the same order
+    | InstrumentBatch of rawMethodBody list
     | ExecuteInstruction of execCommand
+    // NOTE: commands of 'events' need no responses, client predicted them, so they are only replayed before 'command'
+    | ExecuteBatch of events : execCommand list * command : execCommand
+    // NOTE: client does not wait for the response of pipelined 'command': it predicts that the pushed value stays symbolic
+    | ExecutePipelined of events : execCommand list * command : execCommand
     | Terminate
 
 type commandForConcolic =
     | ReadMethodBody
     | ReadString
 
+// NOTE: compact encoding of exec commands and responses: LEB128 varints, ZigZag for signed values, 1-byte operand tags.
+//       Floating point operands keep their 8 bytes
+module private CompactEncoding =
+    let fixedEncoding = 0uy
+    let compactEncoding = 1uy
+
+    // Sections of exec command, which are present in the message
+    let sectionBranch = 1uy
+    let sectionNewCallStackFrames = 2uy
+    let sectionCallStackFramesPops = 4uy
+    let sectionEvaluationStackPushes = 8uy
+    let sectionEvaluationStackPops = 16uy
+    let sectionNewAddresses = 32uy
+
+    let zigZag (value : int64) = uint64 ((value <<< 1) ^^^ (value >>> 63))
+    let unZigZag (value : uint64) = int64 (value >>> 1) ^^^ -(int64 (value &&& 1UL))
+
+    let writeVarint (stream : MemoryStream) (value : uint64) =
+        let mutable value = value
+        while value >= 0x80UL do
+            stream.WriteByte(byte value ||| 0x80uy)
+            value <- value >>> 7
+        stream.WriteByte(byte value)
+
+    type Reader(bytes : byte array) =
+        let mutable position = 0
+        member x.Position = position
+        member x.ReadByte() =
+            let result = bytes.[position]
+            position <- position + 1
+            result
+        member x.ReadVarint() =
+            let mutable result = 0UL
+            let mutable shift = 0
+            let mutable current = x.ReadByte()
+            while current &&& 0x80uy <> 0uy do
+                result <- result ||| (uint64 (current &&& 0x7Fuy) <<< shift)
+                shift <- shift + 7
+                current <- x.ReadByte()
+            result ||| (uint64 current <<< shift)
+        member x.ReadZigZag() = x.ReadVarint() |> unZigZag
+        member x.ReadInt64() =
+            let result = BitConverter.ToInt64(bytes, position)
+            position <- position + sizeof<int64>
+            result
+
 type Communicator(pipeFile) =
 
     let confirmationByte = byte(0x55)
@@ -110,10 +202,18 @@ type Communicator(pipeFile) =
     let executeCommandByte = byte(0x57)
     let readMethodBodyByte = byte(0x58)
     let readStringByte = byte(0x59)
+    let executeBatchCommandByte = byte(0x5A)
+    let executePipelinedCommandByte = byte(0x5B)
+    let instrumentBatchCommandByte = byte(0x5C)
     let confirmation = Array.singleton confirmationByte
 
+    // Slot of each field of 'signatureTokens' in the table of probes, None if no probe has such signature
+    let mutable signatureSlots : int array = Array.empty
+    let mutable probesCount = 0
+
     let server = new NamedPipeServerStream(pipeFile, PipeDirection.InOut)
-    let stream = server :> Stream
+    // NOTE: after the handshake stream may be switched to the shared memory, see 'setupTransport'
+    let mutable stream = server :> Stream
 
     let reportError (exn : IOException) =
         Logger.error "Error occured during communication with the concolic client! Message: %s" exn.Message
@@ -123,6 +223,45 @@ type Communicator(pipeFile) =
 
     let unexpectedlyTerminated() = fail "Communication with CLR: interaction unexpectedly terminated"
 
+    // NOTE: framing of messages is negotiated during the handshake, see 'handshake'.
+    //       v1: count, confirmation, payload, confirmation; v2: count and payload in one write, without confirmations;
+    //       v3: framing of v2, exec commands may be sent in batches, see 'ReadExecuteBatch';
+    //       v4: framing of v2, exec commands may be pipelined, see 'ExecutePipelined';
+    //       v5: count, channel and payload in one write: every thread of the target has its own channel, see 'readFrame'
+    let latestProtocolVersion = 5uy
+    let mutable protocolVersion = 1uy
+    // NOTE: encoding of exec commands and responses is negotiated during the handshake too, see 'CompactEncoding'
+    let supportedEncodings = (1uy <<< int CompactEncoding.fixedEncoding) ||| (1uy <<< int CompactEncoding.compactEncoding)
+    let mutable wireEncoding = CompactEncoding.fixedEncoding
+    // NOTE: optional features are negotiated during the handshake too: server offers the mask of capabilities and its limits,
+    //       client chooses. Capabilities of the profiler: event batches = 1, pipelined commands = 2, shared memory = 4,
+    //       batched instrumentation = 8
+    let eventBatchesCapability = 1u
+    let pipelinedCommandsCapability = 2u
+    let sharedMemoryCapability = 4u
+    let batchInstrumentationCapability = 8u
+    let offeredCapabilities =
+        let sharedMemory = if SharedMemoryStream.IsSupported then sharedMemoryCapability else 0u
+        eventBatchesCapability ||| pipelinedCommandsCapability ||| sharedMemory ||| batchInstrumentationCapability
+    let maxBatchEvents = 4096u
+    let maxRingCapacity = 1u <<< 24
+    let mutable capabilities = 0u
+    let mutable batchEvents = 0u
+    let mutable ringCapacity = 0u
+    let mutable messagesSent = 0L
+    let mutable bytesSent = 0L
+    let mutable messagesReceived = 0L
+    let mutable bytesReceived = 0L
+
+    let readExactly (buffer : byte[]) count =
+        let mutable bytesRead = 0
+        let mutable finished = false
+        while not finished && bytesRead < count do
+            let newBytesCount = stream.Read(buffer, bytesRead, count - bytesRead)
+            if newBytesCount = 0 then finished <- true
+            bytesRead <- bytesRead + newBytesCount
+        bytesRead
+
     let readConfirmation () =
         let buffer : byte[] = Array.zeroCreate 1
         let bytesRead = stream.Read(buffer, 0, 1)
@@ -134,41 +273,90 @@ type Communicator(pipeFile) =
 
     let readCount () =
         let countBytes : byte[] = Array.zeroCreate 4
-        let countCount = stream.Read(countBytes, 0, 4)
+        let countCount = readExactly countBytes 4
         if countCount <> 4 then
             fail "Communication with CLR: could not get the amount of bytes of the next message. Instead read %d bytes" countCount
         BitConverter.ToInt32(countBytes, 0)
 
-    let readBuffer () =
-        let chunkSize = 8192
+    // NOTE: since v5 requests of different threads of the target are served one by one: reply goes to the channel
+    //       of the current request, frames of the other channels, which come meanwhile, wait in 'parkedFrames'
+    let mutable currentChannel = 0u
+    let parkedFrames = System.Collections.Generic.List<uint32 * byte[] option>()
+    // NOTE: there is the only symbolic state, so exec commands are accepted from the channel of one thread only, other
+    //       channels may only request instrumentation. Exploring target threads concurrently needs a symbolic state per channel
+    let mutable execChannel : uint32 option = None
+    let claimExecChannel () =
+        match execChannel with
+        | None -> execChannel <- Some currentChannel
+        | Some channel when channel = currentChannel -> ()
+        | Some channel ->
+            fail "Communication with CLR: channel %d executes instrumented code, but the symbolic state belongs to channel %d. Concurrent target threads are not supported" currentChannel channel
+
+    // Reads the next frame of any channel: None if client terminated the session
+    let readFrame () =
         let count = readCount()
         assert(count <> 0)
-        if count < 0 then None
+        let channel = if protocolVersion >= 5uy then readCount() |> uint32 else currentChannel
+        if count < 0 then channel, None
         else
-            writeConfirmation()
+            messagesReceived <- messagesReceived + 1L
+            bytesReceived <- bytesReceived + int64 count + (if protocolVersion >= 5uy then 8L else 4L)
+            if protocolVersion < 2uy then writeConfirmation()
             let buffer : byte[] = Array.zeroCreate count
-            let mutable bytesRead = 0
-            while bytesRead < count do
-                let length = min chunkSize (count - bytesRead)
-                let chunk : byte[] = Array.zeroCreate length
-                let offset = bytesRead
-                bytesRead <- bytesRead + server.Read(chunk, 0, length)
-                Array.Copy(chunk, 0, buffer, offset, length)
+            let bytesRead = readExactly buffer count
             if bytesRead <> count then
                 fail "Communication with CLR: expected %d bytes, but read %d bytes" count bytesRead
             else
-                writeConfirmation()
-                Some buffer
+                if protocolVersion < 2uy then writeConfirmation()
+                channel, Some buffer
+
+    // Reads the next message of the current channel
+    let readBuffer () =
+        match parkedFrames.FindIndex(fun (channel, _) -> channel = currentChannel) with
+        | -1 ->
+            let mutable result = None
+            while Option.isNone result do
+                let channel, frame = readFrame()
+                if channel = currentChannel then result <- Some frame
+                else parkedFrames.Add((channel, frame))
+            result.Value
+        | index ->
+            let _, frame = parkedFrames.[index]
+            parkedFrames.RemoveAt index
+            frame
+
+    // Reads the first message of the next request, which may come from any channel
+    let readRequest () =
+        if parkedFrames.Count > 0 then
+            let channel, frame = parkedFrames.[0]
+            parkedFrames.RemoveAt 0
+            currentChannel <- channel
+            frame
+        else
+            let channel, frame = readFrame()
+            currentChannel <- channel
+            frame
 
     let writeBuffer (buffer : byte[]) =
         if buffer.LongLength > int64(Int32.MaxValue) then
             fail "Communication with CLR: too large message (length = %s)!" (buffer.LongLength.ToString())
         let countBuffer = BitConverter.GetBytes(buffer.Length)
         assert(countBuffer.Length = 4)
-        stream.Write(countBuffer, 0, 4)
-        readConfirmation()
-        stream.Write(buffer, 0, buffer.Length)
-        readConfirmation()
+        if protocolVersion >= 2uy then
+            // NOTE: header and payload are sent by a single write
+            let header = if protocolVersion >= 5uy then Array.append countBuffer (BitConverter.GetBytes currentChannel) else countBuffer
+            let frame : byte[] = Array.zeroCreate (header.Length + buffer.Length)
+            Buffer.BlockCopy(header, 0, frame, 0, header.Length)
+            Buffer.BlockCopy(buffer, 0, frame, header.Length, buffer.Length)
+            stream.Write(frame, 0, frame.Length)
+            bytesSent <- bytesSent + int64 frame.Length
+        else
+            stream.Write(countBuffer, 0, 4)
+            readConfirmation()
+            stream.Write(buffer, 0, buffer.Length)
+            readConfirmation()
+            bytesSent <- bytesSent + int64 buffer.Length + 4L
+        messagesSent <- messagesSent + 1L
 
     let readString () =
         match readBuffer() with
@@ -186,15 +374,89 @@ type Communicator(pipeFile) =
         server.WaitForConnection()
         Logger.trace "Client connected!"
 
+    let describeFeatures () =
+        let features = ResizeArray<string>()
+        features.Add(sprintf "protocol v%d" protocolVersion)
+        features.Add(if wireEncoding = CompactEncoding.compactEncoding then "compact encoding" else "fixed encoding")
+        if capabilities &&& eventBatchesCapability <> 0u then features.Add(sprintf "event batches (up to %d events)" batchEvents)
+        if capabilities &&& pipelinedCommandsCapability <> 0u then features.Add "pipelined commands"
+        if capabilities &&& sharedMemoryCapability <> 0u then features.Add(sprintf "shared memory (%d bytes per ring)" ringCapacity)
+        if capabilities &&& batchInstrumentationCapability <> 0u then features.Add "batched instrumentation"
+        join ", " features
+
+    // NOTE: clients, which do not negotiate capabilities, enable batches and pipelining by protocol version and
+    //       shared memory by CONCOLIC_TRANSPORT
+    let legacyCapabilities () =
+        let byVersion version capability = if protocolVersion >= version then capability else 0u
+        let sharedMemory = if Environment.GetEnvironmentVariable("CONCOLIC_TRANSPORT") = "shm" then offeredCapabilities &&& sharedMemoryCapability else 0u
+        capabilities <- byVersion 3uy eventBatchesCapability ||| byVersion 4uy pipelinedCommandsCapability ||| sharedMemory
+
+    // NOTE: server puts the latest supported protocol version, the mask of supported encodings and offered capabilities
+    //       with limits (max events in batch and max capacity of shared memory ring) after the null terminator of greeting.
+    //       Clients, which support versioning, answer with the chosen version, encoding and capabilities after the null
+    //       terminator, old clients answer with plain greeting, clients without encodings or capabilities omit them
     let handshake () =
         let message = "Hi!"
-        writeString message
+        let offer = Array.concat [BitConverter.GetBytes offeredCapabilities; BitConverter.GetBytes maxBatchEvents; BitConverter.GetBytes maxRingCapacity]
+        Array.concat [Encoding.ASCII.GetBytes(message + Char.MinValue.ToString()); [|latestProtocolVersion; supportedEncodings|]; offer] |> writeBuffer
         let expectedMessage = "Hi!"
-        let s = readString ()
-        if s <> expectedMessage then
-            fail "Communication with CLR: handshake failed: got %s instead of %s" s expectedMessage
+        let answer = match readBuffer() with Some answer -> answer | None -> unexpectedlyTerminated()
+        let greetingLength = expectedMessage.Length
+        let capabilitiesLength = offer.Length
+        let greeting = Encoding.ASCII.GetString(answer, 0, min greetingLength answer.Length)
+        let validLengths = [greetingLength; greetingLength + 2; greetingLength + 3; greetingLength + 3 + capabilitiesLength]
+        if greeting <> expectedMessage || not <| List.contains answer.Length validLengths then
+            fail "Communication with CLR: handshake failed: got %s instead of %s" (Encoding.ASCII.GetString answer) expectedMessage
+        if answer.Length >= greetingLength + 2 then
+            let version = answer.[greetingLength + 1]
+            if version < 1uy || version > latestProtocolVersion then
+                fail "Communication with CLR: handshake failed: unsupported protocol version %d" version
+            protocolVersion <- version
+        if answer.Length = greetingLength + 3 then
+            let encoding = answer.[greetingLength + 2]
+            if encoding > 7uy || (1uy <<< int encoding) &&& supportedEncodings = 0uy then
+                fail "Communication with CLR: handshake failed: unsupported encoding %d" encoding
+            wireEncoding <- encoding
+        if answer.Length = greetingLength + 3 + capabilitiesLength then
+            let offset = greetingLength + 3
+            capabilities <- BitConverter.ToUInt32(answer, offset)
+            batchEvents <- BitConverter.ToUInt32(answer, offset + 4)
+            ringCapacity <- BitConverter.ToUInt32(answer, offset + 8)
+            if capabilities &&& ~~~offeredCapabilities <> 0u || batchEvents > maxBatchEvents || ringCapacity > maxRingCapacity then
+                fail "Communication with CLR: handshake failed: client chose capabilities %x, which were not offered" capabilities
+        else legacyCapabilities()
+        Logger.info "Communication with CLR: %s" (describeFeatures())
+
+    // NOTE: transport is chosen by CONCOLIC_TRANSPORT, which is passed to the profiler too, if shared memory capability is
+    //       negotiated, the profiler sends its pid, the descriptor of shared region and the capacity of rings;
+    //       after the answer both sides use the rings
+    let setupTransport () =
+        match Environment.GetEnvironmentVariable("CONCOLIC_TRANSPORT") with
+        | null | "" | "socket" | "shm" -> ()
+        | transport -> fail "Communication with CLR: unknown transport %s" transport
+        if capabilities &&& sharedMemoryCapability <> 0u then
+            let setup = match readBuffer() with Some setup -> setup | None -> unexpectedlyTerminated()
+            if setup.Length <> 12 then
+                fail "Communication with CLR: unexpected shared memory setup message of %d bytes" setup.Length
+            let pid = BitConverter.ToUInt32(setup, 0)
+            let fd = BitConverter.ToUInt32(setup, 4)
+            let capacity = BitConverter.ToUInt32(setup, 8)
+            let sharedMemory =
+                try Some (new SharedMemoryStream(pid, fd, capacity))
+                with e ->
+                    Logger.error "Communication with CLR: could not map shared memory: %s" e.Message
+                    None
+            match sharedMemory with
+            | Some sharedMemory ->
+                writeBuffer [|1uy|]
+                stream <- sharedMemory
+                Logger.trace "Communication with CLR: switched to shared memory transport"
+            | None ->
+                writeBuffer [|0uy|]
+                fail "Communication with CLR: shared memory transport setup failed"
 
     override x.Finalize() =
+        if not (obj.ReferenceEquals(stream, server)) then stream.Dispose()
         server.Close()
 
     member private x.Deserialize<'a> (bytes : byte array, startIndex : int) =
@@ -232,6 +494,7 @@ type Communicator(pipeFile) =
         try
             waitClient()
             handshake()
+            setupTransport()
             true
         with
         | :? IOException as e -> reportError e
@@ -241,7 +504,47 @@ type Communicator(pipeFile) =
         | Some bytes -> x.Deserialize<'a> bytes
         | None -> unexpectedlyTerminated()
 
-    member x.ReadProbes() = x.ReadStructure<probes>()
+    member private x.ResolveSignatureSlots (signatures : CorElementType list array) =
+        // NOTE: probes with equal signatures have equal tokens, so the first slot of each signature is taken
+        let slots = System.Collections.Generic.Dictionary<CorElementType list, int>()
+        signatures |> Array.iteri (fun slot signature -> if not <| slots.ContainsKey signature then slots.Add(signature, slot))
+        let slotsWithoutSignedness = slots |> Seq.groupBy (fun kv -> ProbeSignatures.withoutSignedness kv.Key) |> dict
+        FSharpType.GetRecordFields typeof<signatureTokens> |> Array.map (fun field ->
+            let signature = ProbeSignatures.ofName field.Name
+            let slot = ref 0
+            if slots.TryGetValue(signature, slot) then slot.Value
+            else
+                // NOTE: token 0 would be emitted as the signature of calli, so unresolved signature is a mismatch of probes
+                match slotsWithoutSignedness.TryGetValue(ProbeSignatures.withoutSignedness signature) with
+                | true, candidates when Seq.length candidates = 1 -> (Seq.head candidates).Value
+                | true, _ -> fail "Communication with CLR: several probes differ from signature %s by signedness only" field.Name
+                | false, _ -> fail "Communication with CLR: no probe has signature %s" field.Name)
+
+    // NOTE: probes are received in the order of registration: first the ones of 'probes', then fused Mem probes.
+    //       Each of them is its address, the length of its signature blob and the blob itself
+    member x.ReadProbes() =
+        match readBuffer() with
+        | Some bytes ->
+            let addresses = ResizeArray<uint64>()
+            let signatures = ResizeArray<CorElementType list>()
+            let mutable offset = 0
+            while offset < bytes.Length do
+                addresses.Add(BitConverter.ToUInt64(bytes, offset))
+                let signatureLength = int bytes.[offset + sizeof<uint64>]
+                signatures.Add(ProbeSignatures.ofBlob bytes.[offset + sizeof<uint64> + 1 .. offset + sizeof<uint64> + signatureLength])
+                offset <- offset + sizeof<uint64> + 1 + signatureLength
+            let probesSize = Marshal.SizeOf typeof<probes>
+            let fusedCount = addresses.Count - probesSize / sizeof<uint64>
+            // NOTE: signature is return type and types of parameters, fused Mem probe has a parameter per memed cell
+            let lastArity = if signatures.Count = 0 then 0 else List.length signatures.[signatures.Count - 1] - 1
+            if fusedCount < 0 || not <| FusedMem.learnMaxArity fusedCount lastArity then
+                fail "Amount of received probes mismatch the expected! Probably you've altered the client-side probes, but forgot to alter the server-side structure (or vice-versa)"
+            probesCount <- addresses.Count
+            signatureSlots <- x.ResolveSignatureSlots(signatures.ToArray())
+            let addressBytes = addresses |> Seq.map BitConverter.GetBytes |> Array.concat
+            let fusedMem = Array.sub (addresses.ToArray()) (probesCount - FusedMem.count()) (FusedMem.count())
+            x.Deserialize<probes> addressBytes, fusedMem
+        | None -> unexpectedlyTerminated()
 
     member x.SendEntryPoint (moduleName : string) (metadataToken : int) =
         let moduleNameBytes = Encoding.Unicode.GetBytes moduleName
@@ -261,25 +564,71 @@ type Communicator(pipeFile) =
         | Some bytes -> BitConverter.ToUInt32(bytes, 0)
         | None -> unexpectedlyTerminated()
 
+    member private x.SignatureTokensOf (probeTokens : uint32 array) =
+        let tokens = signatureSlots |> Array.map (fun slot -> box probeTokens.[slot])
+        FSharpValue.MakeRecord(typeof<signatureTokens>, tokens) :?> signatureTokens
+
+    // NOTE: profiler sends signature token of every probe in the order of probes
+    member private x.ReadProbeTokens (bytes : byte array) offset length =
+        if length <> probesCount * sizeof<uint32> then
+            fail "Size of received signature tokens buffer mismatch the amount of probes!"
+        let probeTokens = Array.init probesCount (fun i -> BitConverter.ToUInt32(bytes, offset + i * sizeof<uint32>))
+        let fusedMemTokens = Array.sub probeTokens (probesCount - FusedMem.count()) (FusedMem.count())
+        x.SignatureTokensOf probeTokens, fusedMemTokens
+
+    member private x.ReadExceptionHandlers (bytes : byte array) offset length =
+        let ehSize = Marshal.SizeOf typeof<rawExceptionHandler>
+        Array.init (length / ehSize) (fun i -> x.Deserialize<rawExceptionHandler>(bytes, offset + i * ehSize))
+
     member x.ReadMethodBody() =
         match readBuffer() with
         | Some bytes ->
             let propertiesBytes, rest = Array.splitAt (Marshal.SizeOf typeof<rawMethodProperties>) bytes
             let properties = x.Deserialize<rawMethodProperties> propertiesBytes
-            let sizeOfSignatureTokens = Marshal.SizeOf typeof<signatureTokens>
-            if int properties.signatureTokensLength <> sizeOfSignatureTokens then
-                fail "Size of received signature tokens buffer mismatch the expected! Probably you've altered the client-side signatures, but forgot to alter the server-side structure (or vice-versa)"
-            let signatureTokenBytes, rest = Array.splitAt sizeOfSignatureTokens rest
+            let signatureTokenBytes, rest = Array.splitAt (int properties.signatureTokensLength) rest
+            let signatureTokens, fusedMemTokens = x.ReadProbeTokens signatureTokenBytes 0 signatureTokenBytes.Length
             let assemblyNameBytes, rest = Array.splitAt (int properties.assemblyNameLength) rest
             let moduleNameBytes, rest = Array.splitAt (int properties.moduleNameLength) rest
-            let signatureTokens = x.Deserialize<signatureTokens> signatureTokenBytes
             let assemblyName = Encoding.Unicode.GetString(assemblyNameBytes)
             let moduleName = Encoding.Unicode.GetString(moduleNameBytes)
             let ilBytes, ehBytes  = Array.splitAt (int properties.ilCodeSize) rest
-            let ehSize = Marshal.SizeOf typeof<rawExceptionHandler>
-            let ehCount = Array.length ehBytes / ehSize
-            let ehs = Array.init ehCount (fun i -> x.Deserialize<rawExceptionHandler>(ehBytes, i * ehSize))
-            {properties = properties; tokens = signatureTokens; assembly = assemblyName; moduleName = moduleName; il = ilBytes; ehs = ehs}
+            let ehs = x.ReadExceptionHandlers ehBytes 0 ehBytes.Length
+            {properties = properties; tokens = signatureTokens; fusedMemTokens = fusedMemTokens; assembly = assemblyName; moduleName = moduleName; il = ilBytes; ehs = ehs}
+        | None -> unexpectedlyTerminated()
+
+    // NOTE: batch is [count][assembly name length][module name length][signature tokens length][signature tokens]
+    //       [assembly name][module name], then for each method [token][code length][max stack size][ehs length][code][ehs]
+    member x.ReadInstrumentBatch() =
+        match readBuffer() with
+        | Some bytes ->
+            let readUInt32 offset = BitConverter.ToUInt32(bytes, offset)
+            let count = int (readUInt32 0)
+            let assemblyNameLength = readUInt32 4
+            let moduleNameLength = readUInt32 8
+            let signatureTokensLength = readUInt32 12
+            let mutable offset = 16
+            let signatureTokens, fusedMemTokens = x.ReadProbeTokens bytes offset (int signatureTokensLength)
+            offset <- offset + int signatureTokensLength
+            let assemblyName = Encoding.Unicode.GetString(bytes, offset, int assemblyNameLength)
+            offset <- offset + int assemblyNameLength
+            let moduleName = Encoding.Unicode.GetString(bytes, offset, int moduleNameLength)
+            offset <- offset + int moduleNameLength
+            let bodies = ResizeArray<rawMethodBody>()
+            for _ in 1 .. count do
+                let token = readUInt32 offset
+                let ilCodeSize = readUInt32 (offset + 4)
+                let maxStackSize = readUInt32 (offset + 8)
+                let ehsLength = int (readUInt32 (offset + 12))
+                offset <- offset + 16
+                let ilBytes = Array.sub bytes offset (int ilCodeSize)
+                offset <- offset + int ilCodeSize
+                let ehs = x.ReadExceptionHandlers bytes offset ehsLength
+                offset <- offset + ehsLength
+                let properties : rawMethodProperties =
+                    {token = token; ilCodeSize = ilCodeSize; assemblyNameLength = assemblyNameLength; moduleNameLength = moduleNameLength
+                     maxStackSize = maxStackSize; signatureTokensLength = signatureTokensLength}
+                bodies.Add {properties = properties; tokens = signatureTokens; fusedMemTokens = fusedMemTokens; assembly = assemblyName; moduleName = moduleName; il = ilBytes; ehs = ehs}
+            List.ofSeq bodies
         | None -> unexpectedlyTerminated()
 
     member private x.ToUIntPtr =
@@ -304,90 +653,149 @@ type Communicator(pipeFile) =
         | CorElementType.ELEMENT_TYPE_U       -> Some(typeof<UIntPtr>)
         | _ -> None
 
+    // NOTE: types are self-delimiting, so they are parsed from 'offset' till the end of the message
+    member private x.ReadTypes (dynamicBytes : byte array) (offset : int) count =
+        let mutable offset = offset
+        Array.init count (fun _ (*i*) ->
+//                let size = int newAddressesTypesLengths.[i]
+            let rec readType () =
+                let isValid = BitConverter.ToBoolean(dynamicBytes, offset)
+                offset <- offset + sizeof<bool>
+                if isValid then
+                    let isArray = BitConverter.ToBoolean(dynamicBytes, offset)
+                    offset <- offset + sizeof<bool>
+                    if isArray then
+                        let corElementType = Microsoft.FSharp.Core.LanguagePrimitives.EnumOfValue<byte, CorElementType>(dynamicBytes.[offset])
+                        offset <- offset + sizeof<byte>
+                        let rank = BitConverter.ToInt32(dynamicBytes, offset)
+                        offset <- offset + sizeof<int32>
+                        match x.corElementTypeToType corElementType with
+                        | Some t -> t.MakeArrayType(rank)
+                        | None ->
+                            let t : Type = readType()
+                            t.MakeArrayType(rank)
+                    else
+                        let token = BitConverter.ToInt32(dynamicBytes, offset)
+                        offset <- offset + sizeof<int>
+                        let assemblySize = BitConverter.ToInt32(dynamicBytes, offset)
+                        offset <- offset + sizeof<int>
+                        // NOTE: truncating null terminator
+                        let assemblyBytes = dynamicBytes.[offset .. offset + assemblySize - 3]
+                        offset <- offset + assemblySize
+                        let assemblyName = Encoding.Unicode.GetString(assemblyBytes)
+                        let assembly = Reflection.loadAssembly assemblyName
+                        let moduleSize = BitConverter.ToInt32(dynamicBytes, offset)
+                        offset <- offset + sizeof<int>
+                        let moduleBytes = dynamicBytes.[offset .. offset + moduleSize - 1]
+                        offset <- offset + moduleSize
+                        let moduleName = Encoding.Unicode.GetString(moduleBytes) |> Path.GetFileName
+                        let typeModule = Reflection.resolveModuleFromAssembly assembly moduleName
+                        let typeArgsCount = BitConverter.ToInt32(dynamicBytes, offset)
+                        offset <- offset + sizeof<int>
+                        let typeArgs = Array.init typeArgsCount (fun _ -> readType())
+                        let resultType = Reflection.resolveTypeFromModule typeModule token
+                        if Array.isEmpty typeArgs then resultType else resultType.MakeGenericType(typeArgs)
+                else typeof<Void>
+            readType())
+
+    member private x.ReadFixedExecuteCommand (bytes : byte array) =
+        let staticSize = Marshal.SizeOf typeof<execCommandStatic>
+        let staticBytes, dynamicBytes = Array.splitAt staticSize bytes
+        let staticPart = x.Deserialize<execCommandStatic> staticBytes
+        let callStackEntrySize = Marshal.SizeOf typeof<int32>
+        let callStackOffset = (int staticPart.newCallStackFramesCount) * callStackEntrySize
+        let newCallStackFrames = Array.init (int staticPart.newCallStackFramesCount) (fun i -> BitConverter.ToInt32(dynamicBytes, i * callStackEntrySize))
+        let mutable offset = callStackOffset
+        let evaluationStackPushes = Array.init (int staticPart.evaluationStackPushesCount) (fun _ ->
+            let evalStackArgTypeNum = BitConverter.ToInt32(dynamicBytes, offset)
+            offset <- offset + sizeof<int32>
+            let evalStackArgType = LanguagePrimitives.EnumOfValue evalStackArgTypeNum
+            match evalStackArgType with
+            | evalStackArgType.OpRef -> // TODO: mb use UIntPtr? #do
+                let baseAddr = BitConverter.ToUInt64(dynamicBytes, offset)
+                offset <- offset + sizeof<uint64>
+                let shift = BitConverter.ToUInt64(dynamicBytes, offset)
+                offset <- offset + sizeof<uint64>
+                PointerOp(baseAddr, shift)
+            | evalStackArgType.OpSymbolic
+            | evalStackArgType.OpI4
+            | evalStackArgType.OpI8
+            | evalStackArgType.OpR4
+            | evalStackArgType.OpR8 ->
+                let content = BitConverter.ToInt64(dynamicBytes, offset)
+                offset <- offset + sizeof<int64>
+                NumericOp(evalStackArgType, content)
+            | _ -> internalfailf "unexpected evaluation stack argument type %O" evalStackArgType)
+        let newAddresses = Array.init (int staticPart.newAddressesCount) (fun _ ->
+            let res = x.ToUIntPtr dynamicBytes offset in offset <- offset + IntPtr.Size; res)
+        // TODO: 2Misha what's with these sizes?
+//            let newAddressesTypesLengths = Array.init (int staticPart.newAddressesCount) (fun _ ->
+//                let res = BitConverter.ToUInt64(dynamicBytes, offset) in offset <- offset + sizeof<uint64>; res)
+        let newAddressesTypes = x.ReadTypes dynamicBytes offset (int staticPart.newAddressesCount)
+        { offset = staticPart.offset
+          isBranch = staticPart.isBranch
+          callStackFramesPops = staticPart.callStackFramesPops
+          evaluationStackPops = staticPart.evaluationStackPops
+          newCallStackFrames = newCallStackFrames
+          evaluationStackPushes = evaluationStackPushes
+          newAddresses = newAddresses
+          newAddressesTypes = newAddressesTypes }
+
+    member private x.ReadCompactExecuteCommand (bytes : byte array) =
+        let reader = CompactEncoding.Reader(bytes)
+        let offset = reader.ReadVarint() |> uint32
+        let sections = reader.ReadByte()
+        let hasSection section = sections &&& section <> 0uy
+        let readCount section = if hasSection section then reader.ReadVarint() |> int else 0
+        let newCallStackFrames = Array.init (readCount CompactEncoding.sectionNewCallStackFrames) (fun _ -> reader.ReadVarint() |> int32)
+        let callStackFramesPops = readCount CompactEncoding.sectionCallStackFramesPops |> uint32
+        let evaluationStackPushes = Array.init (readCount CompactEncoding.sectionEvaluationStackPushes) (fun _ ->
+            let evalStackArgType : evalStackArgType = reader.ReadByte() |> int |> LanguagePrimitives.EnumOfValue
+            match evalStackArgType with
+            | evalStackArgType.OpRef ->
+                let baseAddr = reader.ReadVarint()
+                let shift = reader.ReadVarint()
+                PointerOp(baseAddr, shift)
+            | evalStackArgType.OpR4
+            | evalStackArgType.OpR8 -> NumericOp(evalStackArgType, reader.ReadInt64())
+            | evalStackArgType.OpSymbolic
+            | evalStackArgType.OpI4
+            | evalStackArgType.OpI8 -> NumericOp(evalStackArgType, reader.ReadZigZag())
+            | _ -> internalfailf "unexpected evaluation stack argument type %O" evalStackArgType)
+        let evaluationStackPops = readCount CompactEncoding.sectionEvaluationStackPops |> uint32
+        let newAddressesCount = readCount CompactEncoding.sectionNewAddresses
+        let newAddresses = Array.init newAddressesCount (fun _ -> reader.ReadVarint() |> UIntPtr)
+        let newAddressesTypes = x.ReadTypes bytes reader.Position newAddressesCount
+        { offset = offset
+          isBranch = if hasSection CompactEncoding.sectionBranch then 1u else 0u
+          callStackFramesPops = callStackFramesPops
+          evaluationStackPops = evaluationStackPops
+          newCallStackFrames = newCallStackFrames
+          evaluationStackPushes = evaluationStackPushes
+          newAddresses = newAddresses
+          newAddressesTypes = newAddressesTypes }
+
+    member private x.DeserializeExecuteCommand (bytes : byte array) =
+        if wireEncoding = CompactEncoding.compactEncoding then x.ReadCompactExecuteCommand bytes
+        else x.ReadFixedExecuteCommand bytes
+
     member x.ReadExecuteCommand() =
+        match readBuffer() with
+        | Some bytes -> x.DeserializeExecuteCommand bytes
+        | None -> unexpectedlyTerminated()
+
+    // NOTE: batch is [events count]([event length][event])*[command, which needs a response]
+    member x.ReadExecuteBatch() =
         match readBuffer() with
         | Some bytes ->
-            let staticSize = Marshal.SizeOf typeof<execCommandStatic>
-            let staticBytes, dynamicBytes = Array.splitAt staticSize bytes
-            let staticPart = x.Deserialize<execCommandStatic> staticBytes
-            let callStackEntrySize = Marshal.SizeOf typeof<int32>
-            let callStackOffset = (int staticPart.newCallStackFramesCount) * callStackEntrySize
-            let newCallStackFrames = Array.init (int staticPart.newCallStackFramesCount) (fun i -> BitConverter.ToInt32(dynamicBytes, i * callStackEntrySize))
-            let mutable offset = callStackOffset
-            let evaluationStackPushes = Array.init (int staticPart.evaluationStackPushesCount) (fun _ ->
-                let evalStackArgTypeNum = BitConverter.ToInt32(dynamicBytes, offset)
-                offset <- offset + sizeof<int32>
-                let evalStackArgType = LanguagePrimitives.EnumOfValue evalStackArgTypeNum
-                match evalStackArgType with
-                | evalStackArgType.OpRef -> // TODO: mb use UIntPtr? #do
-                    let baseAddr = BitConverter.ToUInt64(dynamicBytes, offset)
-                    offset <- offset + sizeof<uint64>
-                    let shift = BitConverter.ToUInt64(dynamicBytes, offset)
-                    offset <- offset + sizeof<uint64>
-                    PointerOp(baseAddr, shift)
-                | evalStackArgType.OpSymbolic
-                | evalStackArgType.OpI4
-                | evalStackArgType.OpI8
-                | evalStackArgType.OpR4
-                | evalStackArgType.OpR8 ->
-                    let content = BitConverter.ToInt64(dynamicBytes, offset)
-                    offset <- offset + sizeof<int64>
-                    NumericOp(evalStackArgType, content)
-                | _ -> internalfailf "unexpected evaluation stack argument type %O" evalStackArgType)
-            let newAddresses = Array.init (int staticPart.newAddressesCount) (fun _ ->
-                let res = x.ToUIntPtr dynamicBytes offset in offset <- offset + IntPtr.Size; res)
-            // TODO: 2Misha what's with these sizes?
-//            let newAddressesTypesLengths = Array.init (int staticPart.newAddressesCount) (fun _ ->
-//                let res = BitConverter.ToUInt64(dynamicBytes, offset) in offset <- offset + sizeof<uint64>; res)
-            let newAddressesTypes = Array.init (int staticPart.newAddressesCount) (fun _ (*i*) ->
-//                let size = int newAddressesTypesLengths.[i]
-                let rec readType () =
-                    let isValid = BitConverter.ToBoolean(dynamicBytes, offset)
-                    offset <- offset + sizeof<bool>
-                    if isValid then
-                        let isArray = BitConverter.ToBoolean(dynamicBytes, offset)
-                        offset <- offset + sizeof<bool>
-                        if isArray then
-                            let corElementType = Microsoft.FSharp.Core.LanguagePrimitives.EnumOfValue<byte, CorElementType>(dynamicBytes.[offset])
-                            offset <- offset + sizeof<byte>
-                            let rank = BitConverter.ToInt32(dynamicBytes, offset)
-                            offset <- offset + sizeof<int32>
-                            match x.corElementTypeToType corElementType with
-                            | Some t -> t.MakeArrayType(rank)
-                            | None ->
-                                let t : Type = readType()
-                                t.MakeArrayType(rank)
-                        else
-                            let token = BitConverter.ToInt32(dynamicBytes, offset)
-                            offset <- offset + sizeof<int>
-                            let assemblySize = BitConverter.ToInt32(dynamicBytes, offset)
-                            offset <- offset + sizeof<int>
-                            // NOTE: truncating null terminator
-                            let assemblyBytes = dynamicBytes.[offset .. offset + assemblySize - 3]
-                            offset <- offset + assemblySize
-                            let assemblyName = Encoding.Unicode.GetString(assemblyBytes)
-                            let assembly = Reflection.loadAssembly assemblyName
-                            let moduleSize = BitConverter.ToInt32(dynamicBytes, offset)
-                            offset <- offset + sizeof<int>
-                            let moduleBytes = dynamicBytes.[offset .. offset + moduleSize - 1]
-                            offset <- offset + moduleSize
-                            let moduleName = Encoding.Unicode.GetString(moduleBytes) |> Path.GetFileName
-                            let typeModule = Reflection.resolveModuleFromAssembly assembly moduleName
-                            let typeArgsCount = BitConverter.ToInt32(dynamicBytes, offset)
-                            offset <- offset + sizeof<int>
-                            let typeArgs = Array.init typeArgsCount (fun _ -> readType())
-                            let resultType = Reflection.resolveTypeFromModule typeModule token
-                            if Array.isEmpty typeArgs then resultType else resultType.MakeGenericType(typeArgs)
-                    else typeof<Void>
-                readType())
-            { offset = staticPart.offset
-              isBranch = staticPart.isBranch
-              callStackFramesPops = staticPart.callStackFramesPops
-              evaluationStackPops = staticPart.evaluationStackPops
-              newCallStackFrames = newCallStackFrames
-              evaluationStackPushes = evaluationStackPushes
-              newAddresses = newAddresses
-              newAddressesTypes = newAddressesTypes }
+            let count = BitConverter.ToInt32(bytes, 0)
+            let mutable offset = sizeof<int32>
+            let events = List.init count (fun _ ->
+                let length = BitConverter.ToInt32(bytes, offset)
+                let event = x.DeserializeExecuteCommand bytes.[offset + sizeof<int32> .. offset + sizeof<int32> + length - 1]
+                offset <- offset + sizeof<int32> + length
+                event)
+            events, x.DeserializeExecuteCommand bytes.[offset ..]
         | None -> unexpectedlyTerminated()
 
     member private x.SizeOfConcrete (typ : Type) =
@@ -409,41 +817,41 @@ type Communicator(pipeFile) =
             | _ -> internalfailf "IntegerBytesToLong: unexpected object %O" obj
         BitConverter.ToInt64 extended
 
+    member private x.ConcreteOperand (obj : obj, typ : Type) =
+        if Types.IsValueType typ then
+            if Types.IsInteger typ then
+                let typ = if Types.SizeOf typ = sizeof<int64> then evalStackArgType.OpI8 else evalStackArgType.OpI4
+                NumericOp(typ, x.IntegerBytesToLong obj)
+            elif Types.IsReal typ then
+                if Types.SizeOf typ = sizeof<double> then
+                    NumericOp(evalStackArgType.OpR8, BitConverter.DoubleToInt64Bits (obj :?> double))
+                else NumericOp(evalStackArgType.OpR4, BitConverter.DoubleToInt64Bits (obj :?> float |> double))
+            elif Types.IsBool typ then
+                NumericOp(evalStackArgType.OpI4, if obj :?> bool then 1L else 0L)
+            else
+                // TODO: support structs
+                __notImplemented__()
+        elif isNull obj then
+            // NOTE: null refs handling
+            PointerOp(0UL, 0UL)
+        else
+            // NOTE: nonnull refs handling
+            let address, offset = obj :?> uint32 * uint64
+            PointerOp(uint64 address, offset)
+
     member private x.SerializeConcrete (obj : obj, typ : Type) =
         let bytes = x.SizeOfConcrete typ |> Array.zeroCreate
         let mutable index = 0
-        if Types.IsValueType typ then
-            let opType, (content : int64) =
-                if Types.IsInteger typ then
-                    let typ = if Types.SizeOf typ = sizeof<int64> then evalStackArgType.OpI8 else evalStackArgType.OpI4
-                    typ, x.IntegerBytesToLong obj
-                elif Types.IsReal typ then
-                    if Types.SizeOf typ = sizeof<double> then
-                        evalStackArgType.OpR8, BitConverter.DoubleToInt64Bits (obj :?> double)
-                    else evalStackArgType.OpR4, BitConverter.DoubleToInt64Bits (obj :?> float |> double)
-                elif Types.IsBool typ then
-                    evalStackArgType.OpI4, if obj :?> bool then 1L else 0L
-                else
-                    // TODO: support structs
-                    __notImplemented__()
+        match x.ConcreteOperand(obj, typ) with
+        | NumericOp(opType, content) ->
             let success = BitConverter.TryWriteBytes(Span(bytes, index, sizeof<int>), LanguagePrimitives.EnumToValue opType) in assert success
             index <- index + sizeof<int>
             let success = BitConverter.TryWriteBytes(Span(bytes, index, sizeof<int64>), content) in assert success
             index <- index + sizeof<int64>
-        elif isNull obj then
-            // NOTE: null refs handling
+        | PointerOp(address, offset) ->
             let success = BitConverter.TryWriteBytes(Span(bytes, index, sizeof<int>), LanguagePrimitives.EnumToValue evalStackArgType.OpRef) in assert success
             index <- index + sizeof<int>
-            let success = BitConverter.TryWriteBytes(Span(bytes, index, sizeof<uint64>), 0UL) in assert success
-            index <- index + sizeof<uint64>
-            let success = BitConverter.TryWriteBytes(Span(bytes, index, sizeof<uint64>), 0UL) in assert success
-            index <- index + sizeof<uint64>
-        else
-            // NOTE: nonnull refs handling
-            let address, offset = obj :?> uint32 * uint64
-            let success = BitConverter.TryWriteBytes(Span(bytes, index, sizeof<int>), LanguagePrimitives.EnumToValue evalStackArgType.OpRef) in assert success
-            index <- index + sizeof<int>
-            let success = BitConverter.TryWriteBytes(Span(bytes, index, sizeof<uint64>), uint64 address) in assert success
+            let success = BitConverter.TryWriteBytes(Span(bytes, index, sizeof<uint64>), address) in assert success
             index <- index + sizeof<int64>
             let success = BitConverter.TryWriteBytes(Span(bytes, index, sizeof<uint64>), offset) in assert success
             index <- index + sizeof<int64>
@@ -460,23 +868,56 @@ type Communicator(pipeFile) =
             index <- index + size)
         bytes
 
+    member private x.WriteCompactOperand (stream : MemoryStream) (obj : obj, typ : Type) =
+        match x.ConcreteOperand(obj, typ) with
+        | NumericOp(opType, content) ->
+            stream.WriteByte(LanguagePrimitives.EnumToValue opType |> byte)
+            match opType with
+            | evalStackArgType.OpR4
+            | evalStackArgType.OpR8 -> stream.Write(BitConverter.GetBytes content, 0, sizeof<int64>)
+            | _ -> CompactEncoding.zigZag content |> CompactEncoding.writeVarint stream
+        | PointerOp(address, offset) ->
+            stream.WriteByte(LanguagePrimitives.EnumToValue evalStackArgType.OpRef |> byte)
+            CompactEncoding.writeVarint stream address
+            CompactEncoding.writeVarint stream offset
+
+    // NOTE: compact response is [flags: last push in bits 0-1, concretized operands in bit 2, result in bit 3][frames count]
+    //       [operands count, if concretized][operands][result]
+    member private x.SerializeCompactExecResponse (ops : (obj * Type) list option) (result : (obj * Type) option) (lastPush : byte) (framesCount : int) =
+        use stream = new MemoryStream()
+        let opsFlag = if Option.isSome ops then 4uy else 0uy
+        let resultFlag = if Option.isSome result then 8uy else 0uy
+        stream.WriteByte(lastPush ||| opsFlag ||| resultFlag)
+        CompactEncoding.writeVarint stream (uint64 framesCount)
+        match ops with
+        | Some ops ->
+            CompactEncoding.writeVarint stream (uint64 ops.Length)
+            List.iter (x.WriteCompactOperand stream) ops
+        | None -> ()
+        Option.iter (x.WriteCompactOperand stream) result
+        stream.ToArray()
+
     member x.SendExecResponse (ops : (obj * Type) list option) (result : (obj * Type) option) lastPush (framesCount : int) =
         let lastPush =
             match lastPush with
             | Some isConcrete when isConcrete -> 2uy
             | Some _ -> 1uy
             | None -> 0uy
-        let len, opsBytes =
-            match ops with
-            | Some ops -> ops.Length, x.SerializeOperands ops
-            | None -> -1, Array.empty
-        let hasInternalCallResult, resultBytes =
-            match result with
-            | Some r -> 1uy, x.SerializeConcrete r
-            | None -> 0uy, Array.empty
-        let staticPart = { framesCount = uint framesCount; lastPush = lastPush; opsLength = len; hasResult = hasInternalCallResult }
-        let staticPartBytes = x.Serialize<execResponseStaticPart> staticPart
-        let message = Array.concat [staticPartBytes; opsBytes; resultBytes]
+        let message =
+            if wireEncoding = CompactEncoding.compactEncoding then
+                x.SerializeCompactExecResponse ops result lastPush framesCount
+            else
+                let len, opsBytes =
+                    match ops with
+                    | Some ops -> ops.Length, x.SerializeOperands ops
+                    | None -> -1, Array.empty
+                let hasInternalCallResult, resultBytes =
+                    match result with
+                    | Some r -> 1uy, x.SerializeConcrete r
+                    | None -> 0uy, Array.empty
+                let staticPart = { framesCount = uint framesCount; lastPush = lastPush; opsLength = len; hasResult = hasInternalCallResult }
+                let staticPartBytes = x.Serialize<execResponseStaticPart> staticPart
+                Array.concat [staticPartBytes; opsBytes; resultBytes]
         Logger.trace "Sending exec response! Total %d bytes" message.Length
         writeBuffer message
 
@@ -491,16 +932,27 @@ type Communicator(pipeFile) =
         writeBuffer message
 
     member x.ReadCommand() =
-        match readBuffer() with
+        match readRequest() with
         | Some bytes ->
             if bytes.Length <> 1 then fail "Invalid command number!"
             match bytes.[0] with
             | b when b = instrumentCommandByte ->
                 x.ReadMethodBody() |> Instrument
             | b when b = executeCommandByte ->
+                claimExecChannel()
                 x.ReadExecuteCommand() |> ExecuteInstruction
+            | b when b = executeBatchCommandByte ->
+                claimExecChannel()
+                x.ReadExecuteBatch() |> ExecuteBatch
+            | b when b = executePipelinedCommandByte ->
+                claimExecChannel()
+                x.ReadExecuteBatch() |> ExecutePipelined
+            | b when b = instrumentBatchCommandByte ->
+                x.ReadInstrumentBatch() |> InstrumentBatch
             | b -> fail "Unexpected command %d from client machine!" b
-        | None -> Terminate
+        | None ->
+            Logger.info "Communication with CLR: %s; sent %d messages (%d bytes), received %d messages (%d bytes)" (describeFeatures()) messagesSent bytesSent messagesReceived bytesReceived
+            Terminate
 
     interface IDisposable with
         member x.Dispose() =
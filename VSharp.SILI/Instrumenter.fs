@@ -6,11 +6,12 @@ open System.Reflection.Emit
 open System.Collections.Generic
 open VSharp.Interpreter.IL
 
-type Instrumenter(communicator : Communicator, entryPoint : MethodBase, probes : probes) =
+type Instrumenter(communicator : Communicator, entryPoint : MethodBase, probes : probes, fusedMemProbes : uint64 array) =
     // TODO: should we consider executed assembly build options here?
     let ldc_i : opcode = (if System.Environment.Is64BitOperatingSystem then OpCodes.Ldc_I8 else OpCodes.Ldc_I4) |> VSharp.OpCode
     static member private instrumentedFunctions = HashSet<MethodBase>()
     [<DefaultValue>] val mutable tokens : signatureTokens
+    [<DefaultValue>] val mutable fusedMemTokens : uint32 array
     [<DefaultValue>] val mutable rewriter : ILRewriter
     [<DefaultValue>] val mutable m : MethodBase
 
@@ -107,7 +108,21 @@ type Instrumenter(communicator : Communicator, entryPoint : MethodBase, probes :
         let probe, token = x.PrependMemUnmemForType(t, 0, 0, &prependTarget)
         x.PrependProbe(probe, [(OpCodes.Ldc_I4, Arg32 0)], token, &prependTarget) |> ignore
 
-    member private x.PlaceEnterProbe (firstInstr : ilInstr byref) =
+    // NOTE: unlike 'PrependProbe', branches to 'beforeInstr' do not come to the probe
+    member private x.InsertProbeBefore(methodAddress : uint64, args : (OpCode * ilInstrOperand) list, signature, beforeInstr : ilInstr) =
+        for (opcode, arg) in args do
+            let newInstr = x.rewriter.NewInstr opcode
+            newInstr.arg <- arg
+            x.rewriter.InsertBefore(beforeInstr, newInstr)
+        let mutable newInstr = x.rewriter.NewInstr ldc_i
+        newInstr.arg <- Arg64 (int64 methodAddress)
+        x.rewriter.InsertBefore(beforeInstr, newInstr)
+        x.MkCalli(&newInstr, signature)
+        x.rewriter.InsertBefore(beforeInstr, newInstr)
+
+    // NOTE: enter probe is placed before the first instruction, so that branches to it do not enter the method again
+    //       and the protected block, which starts at it, does not cover the probe
+    member private x.PlaceEnterProbe (firstInstr : ilInstr) =
         let localsCount =
             match x.m.GetMethodBody() with
             | null -> 0
@@ -121,13 +136,13 @@ type Instrumenter(communicator : Communicator, entryPoint : MethodBase, probes :
                         (OpCodes.Ldc_I4, Arg32 0) // Arguments of entry point are symbolic
                         (OpCodes.Ldc_I4, x.rewriter.MaxStackSize |> int32 |> Arg32)
                         (OpCodes.Ldc_I4, Arg32 localsCount)]
-            x.PrependProbe(probes.enterMain, args, x.tokens.void_token_u2_bool_u4_u4_sig, &firstInstr)
+            x.InsertProbeBefore(probes.enterMain, args, x.tokens.void_token_u2_bool_u4_u4_sig, firstInstr)
         else
             let args = [(OpCodes.Ldc_I4, Arg32 x.m.MetadataToken)
                         (OpCodes.Ldc_I4, x.rewriter.MaxStackSize |> int32 |> Arg32)
                         (OpCodes.Ldc_I4, Arg32 argsCount)
                         (OpCodes.Ldc_I4, Arg32 localsCount)]
-            x.PrependProbe(probes.enter, args, x.tokens.void_token_u4_u4_u4_sig, &firstInstr)
+            x.InsertProbeBefore(probes.enter, args, x.tokens.void_token_u4_u4_u4_sig, firstInstr)
 
     member private x.PrependMem_p(idx, order, instr : ilInstr byref) =
         x.PrependInstr(OpCodes.Conv_I, NoArg, &instr)
@@ -151,57 +166,41 @@ type Instrumenter(communicator : Communicator, entryPoint : MethodBase, probes :
     member private x.PrependMem_f8(idx, order, instr : ilInstr byref) =
         x.PrependProbe(probes.mem_f8_idx, [(OpCodes.Ldc_I4, Arg32 idx); (OpCodes.Ldc_I4, Arg32 order)], x.tokens.void_r8_i1_i1_sig, &instr) |> ignore
 
-    member private x.PrependMem2_p (instr : ilInstr byref) =
-        x.PrependMem_p(1, 0, &instr)
-        x.PrependMem_p(0, 1, &instr)
+    member private x.PrependMem2_p (stackInstr : ilInstr, instr : ilInstr byref) =
+        x.PrependMemMany([evaluationStackCellType.I; evaluationStackCellType.I], stackInstr, &instr)
 
-    member private x.PrependMem2_p_1 (instr : ilInstr byref) =
-        x.PrependMem_i1(1, 0, &instr)
-        x.PrependMem_p(0, 1, &instr)
+    member private x.PrependMem2_p_1 (stackInstr : ilInstr, instr : ilInstr byref) =
+        x.PrependMemMany([evaluationStackCellType.I1; evaluationStackCellType.I], stackInstr, &instr)
 
-    member private x.PrependMem2_p_2 (instr : ilInstr byref) =
-        x.PrependMem_i2(1, 0, &instr)
-        x.PrependMem_p(0, 1, &instr)
+    member private x.PrependMem2_p_2 (stackInstr : ilInstr, instr : ilInstr byref) =
+        x.PrependMemMany([evaluationStackCellType.I2; evaluationStackCellType.I], stackInstr, &instr)
 
-    member private x.PrependMem2_p_4 (instr : ilInstr byref) =
-        x.PrependMem_i4(1, 0, &instr)
-        x.PrependMem_p(0, 1, &instr)
+    member private x.PrependMem2_p_4 (stackInstr : ilInstr, instr : ilInstr byref) =
+        x.PrependMemMany([evaluationStackCellType.I4; evaluationStackCellType.I], stackInstr, &instr)
 
-    member private x.PrependMem2_p_8 (instr : ilInstr byref) =
-        x.PrependMem_i8(1, 0, &instr)
-        x.PrependMem_p(0, 1, &instr)
+    member private x.PrependMem2_p_8 (stackInstr : ilInstr, instr : ilInstr byref) =
+        x.PrependMemMany([evaluationStackCellType.I8; evaluationStackCellType.I], stackInstr, &instr)
 
-    member private x.PrependMem2_p_f4 (instr : ilInstr byref) =
-        x.PrependMem_f4(1, 0, &instr)
-        x.PrependMem_p(0, 1, &instr)
+    member private x.PrependMem2_p_f4 (stackInstr : ilInstr, instr : ilInstr byref) =
+        x.PrependMemMany([evaluationStackCellType.R4; evaluationStackCellType.I], stackInstr, &instr)
 
-    member private x.PrependMem2_p_f8 (instr : ilInstr byref) =
-        x.PrependMem_f8(1, 0, &instr)
-        x.PrependMem_p(0, 1, &instr)
+    member private x.PrependMem2_p_f8 (stackInstr : ilInstr, instr : ilInstr byref) =
+        x.PrependMemMany([evaluationStackCellType.R8; evaluationStackCellType.I], stackInstr, &instr)
 
-    member private x.PrependMem2_4_p (instr : ilInstr byref) =
-        x.PrependMem_p(1, 0, &instr)
-        x.PrependMem_i4(0, 1, &instr)
+    member private x.PrependMem2_4_p (stackInstr : ilInstr, instr : ilInstr byref) =
+        x.PrependMemMany([evaluationStackCellType.I; evaluationStackCellType.I4], stackInstr, &instr)
 
-    member private x.PrependMem3_p (instr : ilInstr byref) =
-        x.PrependMem_p(2, 0, &instr)
-        x.PrependMem_p(1, 1, &instr)
-        x.PrependMem_p(0, 2, &instr)
+    member private x.PrependMem3_p (stackInstr : ilInstr, instr : ilInstr byref) =
+        x.PrependMemMany([evaluationStackCellType.I; evaluationStackCellType.I; evaluationStackCellType.I], stackInstr, &instr)
 
-    member private x.PrependMem3_p_i1_p (instr : ilInstr byref) =
-        x.PrependMem_p(2, 0, &instr)
-        x.PrependMem_i1(1, 1, &instr)
-        x.PrependMem_p(0, 2, &instr)
+    member private x.PrependMem3_p_i1_p (stackInstr : ilInstr, instr : ilInstr byref) =
+        x.PrependMemMany([evaluationStackCellType.I; evaluationStackCellType.I1; evaluationStackCellType.I], stackInstr, &instr)
 
-    member private x.PrependMem3_p_p_i1 (instr : ilInstr byref) =
-        x.PrependMem_i1(2, 0, &instr)
-        x.PrependMem_p(1, 1, &instr)
-        x.PrependMem_p(0, 2, &instr)
+    member private x.PrependMem3_p_p_i1 (stackInstr : ilInstr, instr : ilInstr byref) =
+        x.PrependMemMany([evaluationStackCellType.I1; evaluationStackCellType.I; evaluationStackCellType.I], stackInstr, &instr)
 
-    member private x.PrependMem3_p_p_i2 (instr : ilInstr byref) =
-        x.PrependMem_i2(2, 0, &instr)
-        x.PrependMem_p(1, 1, &instr)
-        x.PrependMem_p(0, 2, &instr)
+    member private x.PrependMem3_p_p_i2 (stackInstr : ilInstr, instr : ilInstr byref) =
+        x.PrependMemMany([evaluationStackCellType.I2; evaluationStackCellType.I; evaluationStackCellType.I], stackInstr, &instr)
 
     member private x.PrependValidLeaveMain(instr : ilInstr byref) =
         match instr.stackState with
@@ -299,46 +298,70 @@ type Instrumenter(communicator : Communicator, entryPoint : MethodBase, probes :
         | OpCodeValues.Stind_Ref -> System.IntPtr.Size
         | _ -> __unreachable__()
 
-    member private x.PrependMemUnmemForType(t : evaluationStackCellType, idx, order, instr : ilInstr byref) =
+    member private x.PrependMemForType(t : evaluationStackCellType, idx, order, instr : ilInstr byref) =
         match t with
-        | evaluationStackCellType.I1 ->
-            x.PrependMem_i1(idx, order, &instr)
-            probes.unmem_1, x.tokens.i1_i1_sig
-        | evaluationStackCellType.I2 ->
-            x.PrependMem_i2(idx, order, &instr)
-            probes.unmem_2, x.tokens.i2_i1_sig
-        | evaluationStackCellType.I4 ->
-            x.PrependMem_i4(idx, order, &instr)
-            probes.unmem_4, x.tokens.i4_i1_sig
-        | evaluationStackCellType.I8 ->
-            x.PrependMem_i8(idx, order, &instr)
-            probes.unmem_8, x.tokens.i8_i1_sig
-        | evaluationStackCellType.R4 ->
-            x.PrependMem_f4(idx, order, &instr)
-            probes.unmem_f4, x.tokens.r4_i1_sig
-        | evaluationStackCellType.R8 ->
-            x.PrependMem_f8(idx, order, &instr)
-            probes.unmem_f8, x.tokens.r8_i1_sig
-        | evaluationStackCellType.I ->
-            x.PrependMem_p(idx, order, &instr)
-            probes.unmem_p, x.tokens.i_i1_sig
-        | evaluationStackCellType.Ref ->
-            x.PrependMem_p(idx, order, &instr)
-            probes.unmem_p, x.tokens.i_i1_sig
+        | evaluationStackCellType.I1 -> x.PrependMem_i1(idx, order, &instr)
+        | evaluationStackCellType.I2 -> x.PrependMem_i2(idx, order, &instr)
+        | evaluationStackCellType.I4 -> x.PrependMem_i4(idx, order, &instr)
+        | evaluationStackCellType.I8 -> x.PrependMem_i8(idx, order, &instr)
+        | evaluationStackCellType.R4 -> x.PrependMem_f4(idx, order, &instr)
+        | evaluationStackCellType.R8 -> x.PrependMem_f8(idx, order, &instr)
+        | evaluationStackCellType.I
+        | evaluationStackCellType.Ref -> x.PrependMem_p(idx, order, &instr)
         | evaluationStackCellType.Struct ->
             // TODO: support struct
 //            x.PrependInstr(OpCodes.Box, NoArg, &instr)
             x.PrependMem_p(idx, order, &instr)
-            probes.unmem_p, x.tokens.i_i1_sig
         | _ -> __unreachable__()
 
+    member private x.UnmemForType(t : evaluationStackCellType) =
+        match t with
+        | evaluationStackCellType.I1 -> probes.unmem_1, x.tokens.i1_i1_sig
+        | evaluationStackCellType.I2 -> probes.unmem_2, x.tokens.i2_i1_sig
+        | evaluationStackCellType.I4 -> probes.unmem_4, x.tokens.i4_i1_sig
+        | evaluationStackCellType.I8 -> probes.unmem_8, x.tokens.i8_i1_sig
+        | evaluationStackCellType.R4 -> probes.unmem_f4, x.tokens.r4_i1_sig
+        | evaluationStackCellType.R8 -> probes.unmem_f8, x.tokens.r8_i1_sig
+        | evaluationStackCellType.I
+        | evaluationStackCellType.Ref
+        | evaluationStackCellType.Struct -> probes.unmem_p, x.tokens.i_i1_sig
+        | _ -> __unreachable__()
+
+    member private x.PrependMemUnmemForType(t : evaluationStackCellType, idx, order, instr : ilInstr byref) =
+        x.PrependMemForType(t, idx, order, &instr)
+        x.UnmemForType t
+
+    // NOTE: mems top cells of evaluation stack (kinds are listed from the top), the deepest cell gets index 0.
+    //       Fused probe takes all of them with one call, but only the top cell can be converted to native int in place,
+    //       so if some deeper cell is managed reference, the cells are memed one by one
+    member private x.PrependMemMany(kinds : evaluationStackCellType list, stackInstr : ilInstr, instr : ilInstr byref) =
+        let isManaged t = t = evaluationStackCellType.Ref || t = evaluationStackCellType.Struct
+        let arity = List.length kinds
+        let cells =
+            match stackInstr.stackState with
+            | Some cells -> List.take arity cells
+            | None -> internalfail "PrependMemMany: unexpected stack state"
+        // NOTE: value type can not be converted to native int, so structs on the stack are remembered cell by cell
+        let hasStruct = List.contains evaluationStackCellType.Struct cells
+        if arity >= 2 && arity <= FusedMem.maxArity() && not hasStruct && not (List.exists isManaged (List.tail cells)) then
+            match List.head kinds with
+            | evaluationStackCellType.I
+            | evaluationStackCellType.Ref -> x.PrependInstr(OpCodes.Conv_I, NoArg, &instr)
+            | _ -> ()
+            let index = FusedMem.index (List.rev kinds)
+            x.PrependProbe(fusedMemProbes.[index], [], x.fusedMemTokens.[index], &instr) |> ignore
+        else
+            let kinds = Array.ofList kinds
+            for order = 0 to arity - 1 do
+                x.PrependMemForType(kinds.[order], arity - order - 1, order, &instr)
+
     member x.PlaceProbes() =
         let instructions = x.rewriter.CopyInstructions()
         assert(not <| Array.isEmpty instructions)
         let mutable atLeastOneReturnFound = false
         let mutable hasPrefix = false
         let mutable prefix : ilInstr byref = &instructions.[0]
-        x.PlaceEnterProbe(&instructions.[0]) |> ignore
+        x.PlaceEnterProbe instructions.[0]
         for i in 0 .. instructions.Length - 1 do
             let instr = &instructions.[i]
             if not hasPrefix then prefix <- instr
@@ -484,30 +507,30 @@ type Instrumenter(communicator : Communicator, entryPoint : MethodBase, probes :
                         | Some (evaluationStackCellType.I2 :: evaluationStackCellType.I4 :: _)
                         | Some (evaluationStackCellType.I4 :: evaluationStackCellType.I1 :: _)
                         | Some (evaluationStackCellType.I4 :: evaluationStackCellType.I2 :: _) ->
-                            x.PrependProbe(probes.mem2_4, [], x.tokens.void_i4_i4_sig, &prependTarget) |> ignore
+                            x.PrependMemMany([evaluationStackCellType.I4; evaluationStackCellType.I4], instr, &prependTarget)
                             (if isUnchecked then probes.execBinOp_4 else probes.execBinOp_4_ovf), x.tokens.void_u2_i4_i4_offset_sig,
                                 probes.unmem_4, x.tokens.i4_i1_sig, probes.unmem_4, x.tokens.i4_i1_sig
                         | Some (evaluationStackCellType.I4 :: evaluationStackCellType.I8 :: _) ->
-                            x.PrependProbe(probes.mem2_8_4, [], x.tokens.void_i8_i4_sig, &prependTarget) |> ignore
+                            x.PrependMemMany([evaluationStackCellType.I4; evaluationStackCellType.I8], instr, &prependTarget)
                             (if isUnchecked then probes.execBinOp_8_4 else probes.execBinOp_8_4_ovf), x.tokens.void_u2_i8_i4_offset_sig,
                                 probes.unmem_8, x.tokens.i8_i1_sig, probes.unmem_4, x.tokens.i4_i1_sig
                         | Some (evaluationStackCellType.I8 :: evaluationStackCellType.I8 :: _) ->
-                            x.PrependProbe(probes.mem2_8, [], x.tokens.void_i8_i8_sig, &prependTarget) |> ignore
+                            x.PrependMemMany([evaluationStackCellType.I8; evaluationStackCellType.I8], instr, &prependTarget)
                             (if isUnchecked then probes.execBinOp_8 else probes.execBinOp_8_ovf), x.tokens.void_u2_i8_i8_offset_sig,
                                 probes.unmem_8, x.tokens.i8_i1_sig, probes.unmem_8, x.tokens.i8_i1_sig
                         | Some (evaluationStackCellType.R4 :: evaluationStackCellType.R4 :: _) ->
-                            x.PrependProbe(probes.mem2_f4, [], x.tokens.void_r4_r4_sig, &prependTarget) |> ignore
+                            x.PrependMemMany([evaluationStackCellType.R4; evaluationStackCellType.R4], instr, &prependTarget)
                             (if isUnchecked then probes.execBinOp_f4 else probes.execBinOp_f4_ovf), x.tokens.void_u2_r4_r4_offset_sig,
                                 probes.unmem_f4, x.tokens.r4_i1_sig, probes.unmem_f4, x.tokens.r4_i1_sig
                         | Some (evaluationStackCellType.R8 :: evaluationStackCellType.R8 :: _) ->
-                            x.PrependProbe(probes.mem2_f8, [], x.tokens.void_r8_r8_sig, &prependTarget) |> ignore
+                            x.PrependMemMany([evaluationStackCellType.R8; evaluationStackCellType.R8], instr, &prependTarget)
                             (if isUnchecked then probes.execBinOp_f8 else probes.execBinOp_f8_ovf), x.tokens.void_u2_r8_r8_offset_sig,
                                 probes.unmem_f8, x.tokens.r8_i1_sig, probes.unmem_f8, x.tokens.r8_i1_sig
                         | Some (evaluationStackCellType.I :: evaluationStackCellType.I :: _)
                         | Some (evaluationStackCellType.I :: evaluationStackCellType.Ref :: _)
                         | Some (evaluationStackCellType.Ref :: evaluationStackCellType.I :: _)
                         | Some (evaluationStackCellType.Ref :: evaluationStackCellType.Ref :: _) ->
-                            x.PrependMem2_p &prependTarget
+                            x.PrependMem2_p(instr, &prependTarget)
                             (if isUnchecked then probes.execBinOp_p else probes.execBinOp_p_ovf), x.tokens.void_u2_i_i_offset_sig,
                                 probes.unmem_p, x.tokens.i_i1_sig, probes.unmem_p, x.tokens.i_i1_sig
                         | Some (evaluationStackCellType.I1 :: evaluationStackCellType.I :: _)
@@ -516,7 +539,7 @@ type Instrumenter(communicator : Communicator, entryPoint : MethodBase, probes :
                         | Some (evaluationStackCellType.I1 :: evaluationStackCellType.Ref :: _)
                         | Some (evaluationStackCellType.I2 :: evaluationStackCellType.Ref :: _)
                         | Some (evaluationStackCellType.I4 :: evaluationStackCellType.Ref :: _) ->
-                            x.PrependMem2_p_4 &prependTarget
+                            x.PrependMem2_p_4(instr, &prependTarget)
                             (if isUnchecked then probes.execBinOp_p_4 else probes.execBinOp_p_4_ovf), x.tokens.void_u2_i_i4_offset_sig,
                                 probes.unmem_p, x.tokens.i_i1_sig, probes.unmem_4, x.tokens.i4_i1_sig
                         | Some (evaluationStackCellType.I :: evaluationStackCellType.I1 :: _)
@@ -525,7 +548,7 @@ type Instrumenter(communicator : Communicator, entryPoint : MethodBase, probes :
                         | Some (evaluationStackCellType.Ref :: evaluationStackCellType.I1 :: _)
                         | Some (evaluationStackCellType.Ref :: evaluationStackCellType.I2 :: _)
                         | Some (evaluationStackCellType.Ref :: evaluationStackCellType.I4 :: _) ->
-                            x.PrependMem2_4_p &prependTarget
+                            x.PrependMem2_4_p(instr, &prependTarget)
                             (if isUnchecked then probes.execBinOp_4_p else probes.execBinOp_4_p_ovf), x.tokens.void_u2_i4_i_offset_sig,
                                 probes.unmem_4, x.tokens.i4_i1_sig, probes.unmem_p, x.tokens.i_i1_sig
                         | Some (x :: y :: _) -> internalfailf "Unexpected binop ([%O]%O) evaluation stack types: %O, %O" i opcodeValue x y
@@ -627,14 +650,14 @@ type Instrumenter(communicator : Communicator, entryPoint : MethodBase, probes :
                             | Some (evaluationStackCellType.I :: evaluationStackCellType.I :: _)
                             | Some (evaluationStackCellType.I :: evaluationStackCellType.Ref :: _) -> ()
                             | _ -> internalfail "Stack validation failed"
-                            x.PrependMem2_p &prependTarget
+                            x.PrependMem2_p(instr, &prependTarget)
                             probes.execStind_ref, x.tokens.void_i_i_offset_sig, probes.unmem_p, x.tokens.i_i1_sig
                         | OpCodeValues.Stind_Ref ->
                             match instr.stackState with
                             | Some (evaluationStackCellType.Ref :: evaluationStackCellType.I :: _)
                             | Some (evaluationStackCellType.Ref :: evaluationStackCellType.Ref :: _) -> ()
                             | _ -> internalfail "Stack validation failed"
-                            x.PrependMem2_p &prependTarget
+                            x.PrependMem2_p(instr, &prependTarget)
                             probes.execStind_ref, x.tokens.void_i_i_offset_sig, probes.unmem_p, x.tokens.i_i1_sig
                         | OpCodeValues.Stind_I1 ->
                             match instr.stackState with
@@ -645,7 +668,7 @@ type Instrumenter(communicator : Communicator, entryPoint : MethodBase, probes :
                             | Some (evaluationStackCellType.I4 :: evaluationStackCellType.I :: _)
                             | Some (evaluationStackCellType.I4 :: evaluationStackCellType.Ref :: _) -> ()
                             | _ -> internalfail "Stack validation failed"
-                            x.PrependMem2_p_1 &prependTarget
+                            x.PrependMem2_p_1(instr, &prependTarget)
                             probes.execStind_I1, x.tokens.void_i_i1_offset_sig, probes.unmem_1, x.tokens.i1_i1_sig
                         | OpCodeValues.Stind_I2 ->
                             match instr.stackState with
@@ -654,35 +677,35 @@ type Instrumenter(communicator : Communicator, entryPoint : MethodBase, probes :
                             | Some (evaluationStackCellType.I4 :: evaluationStackCellType.I :: _)
                             | Some (evaluationStackCellType.I4 :: evaluationStackCellType.Ref :: _) -> ()
                             | _ -> internalfail "Stack validation failed"
-                            x.PrependMem2_p_2 &prependTarget
+                            x.PrependMem2_p_2(instr, &prependTarget)
                             probes.execStind_I2, x.tokens.void_i_i2_offset_sig, probes.unmem_2, x.tokens.i2_i1_sig
                         | OpCodeValues.Stind_I4 ->
                             match instr.stackState with
                             | Some (evaluationStackCellType.I4 :: evaluationStackCellType.I :: _)
                             | Some (evaluationStackCellType.I4 :: evaluationStackCellType.Ref :: _) -> ()
                             | _ -> internalfail "Stack validation failed"
-                            x.PrependMem2_p_4 &prependTarget
+                            x.PrependMem2_p_4(instr, &prependTarget)
                             probes.execStind_I4, x.tokens.void_i_i4_offset_sig, probes.unmem_4, x.tokens.i4_i1_sig
                         | OpCodeValues.Stind_I8 ->
                             match instr.stackState with
                             | Some (evaluationStackCellType.I8 :: evaluationStackCellType.I :: _)
                             | Some (evaluationStackCellType.I8 :: evaluationStackCellType.Ref :: _) -> ()
                             | _ -> internalfail "Stack validation failed"
-                            x.PrependMem2_p_8 &prependTarget
+                            x.PrependMem2_p_8(instr, &prependTarget)
                             probes.execStind_I8, x.tokens.void_i_i8_offset_sig, probes.unmem_8, x.tokens.i8_i1_sig
                         | OpCodeValues.Stind_R4 ->
                             match instr.stackState with
                             | Some (evaluationStackCellType.R4 :: evaluationStackCellType.I :: _)
                             | Some (evaluationStackCellType.R4 :: evaluationStackCellType.Ref :: _) -> ()
                             | _ -> internalfail "Stack validation failed"
-                            x.PrependMem2_p_f4 &prependTarget
+                            x.PrependMem2_p_f4(instr, &prependTarget)
                             probes.execStind_R4, x.tokens.void_i_r4_offset_sig, probes.unmem_f4, x.tokens.r4_i1_sig
                         | OpCodeValues.Stind_R8 ->
                             match instr.stackState with
                             | Some (evaluationStackCellType.R8 :: evaluationStackCellType.I :: _)
                             | Some (evaluationStackCellType.R8 :: evaluationStackCellType.Ref :: _) -> ()
                             | _ -> internalfail "Stack validation failed"
-                            x.PrependMem2_p_f8 &prependTarget
+                            x.PrependMem2_p_f8(instr, &prependTarget)
                             probes.execStind_R8, x.tokens.void_i_r8_offset_sig, probes.unmem_f8, x.tokens.r8_i1_sig
                         | _ -> __unreachable__()
 
@@ -723,7 +746,7 @@ type Instrumenter(communicator : Communicator, entryPoint : MethodBase, probes :
                     // calli unmem 1
                     // calli exec
                     // A: cpobj
-                    x.PrependMem2_p &prependTarget
+                    x.PrependMem2_p(instr, &prependTarget)
                     x.PrependProbe(probes.unmem_p, [(OpCodes.Ldc_I4, Arg32 0)], x.tokens.i_i1_sig, &prependTarget) |> ignore
                     x.PrependProbe(probes.unmem_p, [(OpCodes.Ldc_I4, Arg32 1)], x.tokens.i_i1_sig, &prependTarget) |> ignore
                     x.PrependProbe(probes.unmem_p, [(OpCodes.Ldc_I4, Arg32 0)], x.tokens.i_i1_sig, &prependTarget) |> ignore
@@ -802,29 +825,29 @@ type Instrumenter(communicator : Communicator, entryPoint : MethodBase, probes :
                         | Some (evaluationStackCellType.I1 :: evaluationStackCellType.Ref :: _)
                         | Some (evaluationStackCellType.I2 :: evaluationStackCellType.Ref :: _)
                         | Some (evaluationStackCellType.I4 :: evaluationStackCellType.Ref :: _) ->
-                            x.PrependMem2_p_4 &prependTarget
+                            x.PrependMem2_p_4(instr, &prependTarget)
                             probes.stfld_4, x.tokens.void_token_i_i4_offset_sig, probes.unmem_4, x.tokens.i4_i1_sig
                         | Some (evaluationStackCellType.I8 :: evaluationStackCellType.I :: _)
                         | Some (evaluationStackCellType.I8 :: evaluationStackCellType.Ref :: _) ->
-                            x.PrependMem2_p_8 &prependTarget
+                            x.PrependMem2_p_8(instr, &prependTarget)
                             probes.stfld_8, x.tokens.void_token_i_i8_offset_sig, probes.unmem_8, x.tokens.i8_i1_sig
                         | Some (evaluationStackCellType.R4 :: evaluationStackCellType.I :: _)
                         | Some (evaluationStackCellType.R4 :: evaluationStackCellType.Ref :: _) ->
-                            x.PrependMem2_p_f4 &prependTarget
+                            x.PrependMem2_p_f4(instr, &prependTarget)
                             probes.stfld_f4, x.tokens.void_token_i_r4_offset_sig, probes.unmem_f4, x.tokens.r4_i1_sig
                         | Some (evaluationStackCellType.R8 :: evaluationStackCellType.I :: _)
                         | Some (evaluationStackCellType.R8 :: evaluationStackCellType.Ref :: _) ->
-                            x.PrependMem2_p_f8 &prependTarget
+                            x.PrependMem2_p_f8(instr, &prependTarget)
                             probes.stfld_f8, x.tokens.void_token_i_r8_offset_sig, probes.unmem_f8, x.tokens.r8_i1_sig
                         | Some (evaluationStackCellType.I :: evaluationStackCellType.I :: _)
                         | Some (evaluationStackCellType.I :: evaluationStackCellType.Ref :: _)
                         | Some (evaluationStackCellType.Ref :: evaluationStackCellType.I :: _)
                         | Some (evaluationStackCellType.Ref :: evaluationStackCellType.Ref :: _) ->
-                            x.PrependMem2_p &prependTarget
+                            x.PrependMem2_p(instr, &prependTarget)
                             probes.stfld_p, x.tokens.void_token_i_i_offset_sig, probes.unmem_p, x.tokens.i_i1_sig
                         | Some (evaluationStackCellType.Struct :: evaluationStackCellType.I :: _)
                         | Some (evaluationStackCellType.Struct :: evaluationStackCellType.Ref :: _) ->
-                            x.PrependMem2_p &prependTarget
+                            x.PrependMem2_p(instr, &prependTarget)
                             probes.stfld_struct, x.tokens.void_token_i_i_offset_sig, probes.unmem_p, x.tokens.i_i1_sig
                         | _ -> __unreachable__()
 
@@ -884,7 +907,7 @@ type Instrumenter(communicator : Communicator, entryPoint : MethodBase, probes :
                     // calli unmem 1
                     // calli exec
                     // A: ldelem(a)
-                    x.PrependMem2_p &prependTarget
+                    x.PrependMem2_p(instr, &prependTarget)
                     x.PrependProbe(probes.unmem_p, [(OpCodes.Ldc_I4, Arg32 0)], x.tokens.i_i1_sig, &prependTarget) |> ignore
                     x.PrependProbe(probes.unmem_p, [(OpCodes.Ldc_I4, Arg32 1)], x.tokens.i_i1_sig, &prependTarget) |> ignore
                     x.PrependProbe(probes.unmem_p, [(OpCodes.Ldc_I4, Arg32 0)], x.tokens.i_i1_sig, &prependTarget) |> ignore
@@ -1018,7 +1041,7 @@ type Instrumenter(communicator : Communicator, entryPoint : MethodBase, probes :
                     // calli unmem 2
                     // calli exec
                     // A: cpblk
-                    x.PrependMem3_p &prependTarget
+                    x.PrependMem3_p(instr, &prependTarget)
                     x.PrependProbe(probes.unmem_p, [(OpCodes.Ldc_I4, Arg32 0)], x.tokens.i_i1_sig, &prependTarget) |> ignore
                     x.PrependProbe(probes.unmem_p, [(OpCodes.Ldc_I4, Arg32 1)], x.tokens.i_i1_sig, &prependTarget) |> ignore
                     x.PrependProbe(probes.unmem_p, [(OpCodes.Ldc_I4, Arg32 2)], x.tokens.i_i1_sig, &prependTarget) |> ignore
@@ -1044,7 +1067,7 @@ type Instrumenter(communicator : Communicator, entryPoint : MethodBase, probes :
                     // calli unmem 2
                     // calli exec
                     // A: initblk
-                    x.PrependMem3_p_i1_p &prependTarget
+                    x.PrependMem3_p_i1_p(instr, &prependTarget)
                     x.PrependProbe(probes.unmem_p, [(OpCodes.Ldc_I4, Arg32 0)], x.tokens.i_i1_sig, &prependTarget) |> ignore
                     x.PrependProbe(probes.unmem_1, [(OpCodes.Ldc_I4, Arg32 1)], x.tokens.i1_i1_sig, &prependTarget) |> ignore
                     x.PrependProbe(probes.unmem_p, [(OpCodes.Ldc_I4, Arg32 2)], x.tokens.i_i1_sig, &prependTarget) |> ignore
@@ -1109,10 +1132,10 @@ type Instrumenter(communicator : Communicator, entryPoint : MethodBase, probes :
                         let unmems = List<uint64 * uint32>()
                         match instr.stackState with
                         | Some list ->
-                            let types = List.take argsCount list |> Array.ofList
-                            for i = 0 to argsCount - 1 do
-                                let t = types.[i]
-                                unmems.Add(x.PrependMemUnmemForType(t, argsCount - i - 1, i, &prependTarget))
+                            let types = List.take argsCount list
+                            x.PrependMemMany(types, instr, &prependTarget)
+                            for t in types do
+                                unmems.Add(x.UnmemForType t)
                         | None -> internalfail "unexpected stack state"
                         x.PrependProbe(probes.call, [(OpCodes.Ldc_I4, Arg32 argsCount)], x.tokens.bool_u2_sig, &prependTarget) |> ignore
                         let br_true = x.PrependBranch(OpCodes.Brtrue_S, &prependTarget)
@@ -1184,6 +1207,7 @@ type Instrumenter(communicator : Communicator, entryPoint : MethodBase, probes :
     member x.Instrument(body : rawMethodBody) =
         assert(x.rewriter = null)
         x.tokens <- body.tokens
+        x.fusedMemTokens <- body.fusedMemTokens
         // TODO: call Application.getMethod and take ILRewriter there!
         x.rewriter <- ILRewriter(body)
         x.m <- x.rewriter.Method
@@ -0,0 +1,193 @@
+namespace VSharp.Concolic
+
+#nowarn "9"
+
+open System
+open System.IO
+open System.IO.MemoryMappedFiles
+open System.Runtime.InteropServices
+open System.Threading
+open Microsoft.FSharp.NativeInterop
+
+// NOTE: layout of the shared region is defined by the profiler (see communication/sharedMemoryChannel.h):
+//       header (magic, layout version, capacity of each ring, 'closed' flag), controls of two rings, data of two rings.
+//       Ring 0 is written by the profiler, ring 1 is written by SILI
+module private SharedMemoryLayout =
+    let magic = 0x4D485356u
+    let layoutVersion = 1u
+    let capacityOffset = 8
+    let closedOffset = 12
+    let controlsOffset = 64
+    let controlSize = 128
+    let headerSize = 512
+    let headOffset = 0
+    let writerWaitsOffset = 4
+    let tailOffset = 64
+    let readerWaitsOffset = 68
+
+module private Futex =
+    [<DllImport("libc", SetLastError = true)>]
+    extern int64 syscall(int64 number, nativeint address, int operation, int value, nativeint timeout, nativeint address2, int value3)
+
+    let private futexWait = 0
+    let private futexWake = 1
+
+    // NOTE: number of futex syscall differs between architectures, shared memory is not offered on the unknown ones
+    let syscallNumber =
+        match RuntimeInformation.ProcessArchitecture with
+        | Architecture.X64 -> Some 202L
+        | Architecture.Arm64 -> Some 98L
+        | _ -> None
+
+    let private sysFutex =
+        match syscallNumber with
+        | Some number -> number
+        | None -> raise <| PlatformNotSupportedException(sprintf "Shared memory transport is not supported on %O" RuntimeInformation.ProcessArchitecture)
+
+    // NOTE: sleeping waiter wakes up periodically to check whether the channel was closed
+    let private timeout =
+        let timespec = Marshal.AllocHGlobal(16)
+        Marshal.WriteInt64(timespec, 0L)
+        Marshal.WriteInt64(timespec, 8, 100L * 1000L * 1000L)
+        timespec
+
+    let wait (address : nativeint) (value : int) =
+        syscall(sysFutex, address, futexWait, value, timeout, IntPtr.Zero, 0) |> ignore
+
+    let wake (address : nativeint) =
+        syscall(sysFutex, address, futexWake, 1, IntPtr.Zero, IntPtr.Zero, 0) |> ignore
+
+// NOTE: aligned 32-bit accesses are atomic, full fences give the ordering of the sequentially consistent atomics of the profiler
+module private Atomic =
+    let load (address : nativeint) =
+        let value = Marshal.ReadInt32(address)
+        Thread.MemoryBarrier()
+        value
+
+    let store (address : nativeint) (value : int) =
+        Thread.MemoryBarrier()
+        Marshal.WriteInt32(address, value)
+        Thread.MemoryBarrier()
+
+// Single-producer single-consumer byte ring, mirrors 'Ring' of the profiler
+type private SharedRing(control : nativeint, data : nativeint, capacity : int, closed : nativeint) =
+    let head = control + nativeint SharedMemoryLayout.headOffset
+    let writerWaits = control + nativeint SharedMemoryLayout.writerWaitsOffset
+    let tail = control + nativeint SharedMemoryLayout.tailOffset
+    let readerWaits = control + nativeint SharedMemoryLayout.readerWaitsOffset
+    let spinIterations = 2000
+
+    // Waits until 'word' differs from 'value'. Returns false if the channel was closed
+    let wait word waits value =
+        let mutable spins = 0
+        while spins < spinIterations && Atomic.load word = value do
+            Thread.SpinWait(1)
+            spins <- spins + 1
+        let mutable isClosed = false
+        while not isClosed && Atomic.load word = value do
+            if Atomic.load closed <> 0 then isClosed <- true
+            else
+                Atomic.store waits 1
+                if Atomic.load word = value then Futex.wait word value
+                Marshal.WriteInt32(waits, 0)
+        not isClosed
+
+    let wake word waits =
+        if Atomic.load waits <> 0 then Futex.wake word
+
+    // NOTE: head and tail are amounts of bytes modulo 2^32, capacity is a power of two
+    let used (h : int) (t : int) = int (uint32 h - uint32 t)
+    let position (counter : int) = nativeint (counter &&& (capacity - 1))
+
+    member x.Read(buffer : byte[], offset : int, count : int) =
+        let t = Marshal.ReadInt32(tail)
+        if Atomic.load head = t && not (wait head readerWaits t) then 0
+        else
+            let h = Atomic.load head
+            let chunk = min count (used h t)
+            let start = position t
+            let firstPart = min chunk (capacity - int start)
+            Marshal.Copy(data + start, buffer, offset, firstPart)
+            Marshal.Copy(data, buffer, offset + firstPart, chunk - firstPart)
+            Atomic.store tail (t + chunk)
+            wake tail writerWaits
+            chunk
+
+    member x.Write(buffer : byte[], offset : int, count : int) =
+        let mutable h = Marshal.ReadInt32(head)
+        let mutable offset = offset
+        let mutable left = count
+        let mutable isClosed = false
+        while not isClosed && left > 0 do
+            let t = Atomic.load tail
+            let free = capacity - used h t
+            if free = 0 then
+                // NOTE: publishing what is written so far, so that the reader could free the space
+                Atomic.store head h
+                wake head readerWaits
+                isClosed <- not (wait tail writerWaits t)
+            else
+                let chunk = min left free
+                let start = position h
+                let firstPart = min chunk (capacity - int start)
+                Marshal.Copy(buffer, offset, data + start, firstPart)
+                Marshal.Copy(buffer, offset + firstPart, data, chunk - firstPart)
+                h <- h + chunk
+                offset <- offset + chunk
+                left <- left - chunk
+        Atomic.store head h
+        wake head readerWaits
+        if isClosed then raise <| IOException "Communication with CLR: shared memory channel is closed"
+
+// Stream over the shared region, created by the profiler: the region is mapped via '/proc/<pid>/fd/<fd>'
+type SharedMemoryStream(pid : uint32, fd : uint32, capacity : uint32) =
+    inherit Stream()
+
+    let path = sprintf "/proc/%d/fd/%d" pid fd
+    let size = int64 SharedMemoryLayout.headerSize + 2L * int64 capacity
+    let file = MemoryMappedFile.CreateFromFile(path, FileMode.Open, null, size, MemoryMappedFileAccess.ReadWrite)
+    let view = file.CreateViewAccessor(0L, size, MemoryMappedFileAccess.ReadWrite)
+    let region =
+        let mutable pointer = NativePtr.nullPtr<byte>
+        view.SafeMemoryMappedViewHandle.AcquirePointer(&pointer)
+        NativePtr.toNativeInt pointer + nativeint view.PointerOffset
+
+    do
+        let actualMagic = uint32 (Marshal.ReadInt32(region))
+        let actualVersion = uint32 (Marshal.ReadInt32(region, 4))
+        let actualCapacity = uint32 (Marshal.ReadInt32(region, SharedMemoryLayout.capacityOffset))
+        if actualMagic <> SharedMemoryLayout.magic || actualVersion <> SharedMemoryLayout.layoutVersion || actualCapacity <> capacity then
+            raise <| IOException(sprintf "Communication with CLR: unexpected shared memory header (magic = %x, layout version = %d, capacity = %d)" actualMagic actualVersion actualCapacity)
+
+    let closed = region + nativeint SharedMemoryLayout.closedOffset
+    let ring k =
+        let control = region + nativeint (SharedMemoryLayout.controlsOffset + SharedMemoryLayout.controlSize * k)
+        let data = region + nativeint SharedMemoryLayout.headerSize + nativeint (int64 capacity * int64 k)
+        SharedRing(control, data, int capacity, closed)
+    let input = ring 0
+    let output = ring 1
+    let mutable disposed = false
+
+    // Memfd of the profiler is mapped through procfs and rings wait on futexes, so the transport works on Linux only
+    static member IsSupported =
+        RuntimeInformation.IsOSPlatform(OSPlatform.Linux) && Option.isSome Futex.syscallNumber
+
+    override x.CanRead = true
+    override x.CanWrite = true
+    override x.CanSeek = false
+    override x.Length = raise <| NotSupportedException()
+    override x.Position with get() = raise <| NotSupportedException() and set _ = raise <| NotSupportedException()
+    override x.Seek(_, _) = raise <| NotSupportedException()
+    override x.SetLength _ = raise <| NotSupportedException()
+    override x.Flush() = ()
+    override x.Read(buffer, offset, count) = input.Read(buffer, offset, count)
+    override x.Write(buffer, offset, count) = output.Write(buffer, offset, count)
+
+    override x.Dispose(disposing) =
+        if not disposed then
+            disposed <- true
+            Atomic.store closed 1
+            view.SafeMemoryMappedViewHandle.ReleasePointer()
+            view.Dispose()
+            file.Dispose()
+        base.Dispose(disposing)